@@ -0,0 +1,469 @@
+#include "bench.hpp"
+#include "winlua_modules.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#define bench_mkdir(path) _mkdir(path)
+#define bench_dup _dup
+#define bench_dup2 _dup2
+#define bench_close _close
+#define BENCH_NULL_DEVICE "NUL"
+#define BENCH_SEP "\\"
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define bench_mkdir(path) mkdir(path, 0755)
+#define bench_dup dup
+#define bench_dup2 dup2
+#define bench_close close
+#define BENCH_NULL_DEVICE "/dev/null"
+#define BENCH_SEP "/"
+#endif
+
+/* ------------------------------------------------------------
+WinLua Benchmark Helpers
+------------------------------------------------------------ */
+
+/*
+Libraries of the benchmark states; also used for threads.start
+workers, in place of the one in main.cpp.
+*/
+void winlua_setup_env(lua_State *L)
+{
+	luaL_openlibs(L);
+	luaL_requiref(L, "fs", luaopen_fs, 1);
+	luaL_requiref(L, "serialize", luaopen_serialize, 1);
+	luaL_requiref(L, "async", luaopen_async, 1);
+	luaL_requiref(L, "threads", luaopen_threads, 1);
+	luaL_requiref(L, "profiler", luaopen_profiler, 1);
+	lua_pop(L, 5);
+	/* the stock os library, with the process and environment functions of winos */
+	lua_getglobal(L, "os");
+	lua_pushcfunction(L, winlua_os_spawn);
+	lua_setfield(L, -2, "spawn");
+	lua_pushcfunction(L, winlua_os_run_all);
+	lua_setfield(L, -2, "run_all");
+	lua_pushcfunction(L, winlua_os_environ);
+	lua_setfield(L, -2, "environ");
+	lua_pushcfunction(L, winlua_os_environ_block);
+	lua_setfield(L, -2, "environ_block");
+	lua_pop(L, 1);
+	/* the portable part of the registry module */
+	lua_createtable(L, 0, 3);
+	lua_pushcfunction(L, winlua_registry_load_hive);
+	lua_setfield(L, -2, "load_hive");
+	lua_pushcfunction(L, winlua_registry_parse_reg);
+	lua_setfield(L, -2, "parse_reg");
+	lua_pushcfunction(L, winlua_registry_reg_writer);
+	lua_setfield(L, -2, "reg_writer");
+	lua_setglobal(L, "registry");
+	winlua_open_print(L);
+}
+
+lua_State *bench_newstate(bool pooled)
+{
+	lua_State *L = winlua_newstate(pooled);
+	if (L == NULL)
+	{
+		fprintf(stderr, "winlua-bench: could not allocate Lua state\n");
+		exit(1);
+	}
+	winlua_setup_env(L);
+	return L;
+}
+
+void bench_dostring(lua_State *L, const char *code)
+{
+	if (luaL_dostring(L, code) != LUA_OK)
+	{
+		fprintf(stderr, "winlua-bench: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+}
+
+void bench_call(lua_State *L, const char *name)
+{
+	lua_getglobal(L, name);
+	if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+	{
+		fprintf(stderr, "winlua-bench: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+}
+
+static std::string tree_file(const std::string& dir, int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), BENCH_SEP "file%05d.txt", i);
+	return dir + name;
+}
+
+std::string bench_make_tree(int count)
+{
+	char dir[64];
+	snprintf(dir, sizeof(dir), "winlua-bench-%d", static_cast<int>(rand()));
+	if (bench_mkdir(dir) != 0)
+	{
+		fprintf(stderr, "winlua-bench: could not create '%s'\n", dir);
+		exit(1);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		FILE *f = fopen(tree_file(dir, i).c_str(), "wb");
+		if (f == NULL)
+		{
+			fprintf(stderr, "winlua-bench: could not create files in '%s'\n", dir);
+			exit(1);
+		}
+		fprintf(f, "%d\n", i);
+		fclose(f);
+	}
+	return dir;
+}
+
+void bench_remove_tree(const std::string& dir, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		remove(tree_file(dir, i).c_str());
+	}
+#ifdef _WIN32
+	_rmdir(dir.c_str());
+#else
+	rmdir(dir.c_str());
+#endif
+}
+
+static std::string tree_subdir(const std::string& dir, int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), BENCH_SEP "dir%03d", i);
+	return dir + name;
+}
+
+static void fill_nested_tree(const std::string& dir, int fanout, int depth, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		FILE *f = fopen(tree_file(dir, i).c_str(), "wb");
+		if (f == NULL)
+		{
+			fprintf(stderr, "winlua-bench: could not create files in '%s'\n", dir.c_str());
+			exit(1);
+		}
+		fprintf(f, "%d\n", i);
+		fclose(f);
+	}
+	for (int i = 0; depth > 0 && i < fanout; i++)
+	{
+		std::string sub = tree_subdir(dir, i);
+		if (bench_mkdir(sub.c_str()) != 0)
+		{
+			fprintf(stderr, "winlua-bench: could not create '%s'\n", sub.c_str());
+			exit(1);
+		}
+		fill_nested_tree(sub, fanout, depth - 1, count);
+	}
+}
+
+std::string bench_make_nested_tree(int fanout, int depth, int count)
+{
+	std::string dir = bench_make_tree(0);
+	fill_nested_tree(dir, fanout, depth, count);
+	return dir;
+}
+
+void bench_remove_nested_tree(const std::string& dir, int fanout, int depth, int count)
+{
+	for (int i = 0; depth > 0 && i < fanout; i++)
+	{
+		bench_remove_nested_tree(tree_subdir(dir, i), fanout, depth - 1, count);
+	}
+	bench_remove_tree(dir, count);
+}
+
+std::string bench_make_log(size_t mib)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "winlua-bench-%d.log", static_cast<int>(rand()));
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "winlua-bench: could not create '%s'\n", path);
+		exit(1);
+	}
+
+	std::vector<char> buffer(1 << 20);
+	size_t total = mib << 20, written = 0, used = 0;
+	for (unsigned long line = 0; written + used < total; line++)
+	{
+		if (buffer.size() - used < 64)
+		{
+			fwrite(&buffer[0], 1, used, f);
+			written += used;
+			used = 0;
+		}
+		used += snprintf(&buffer[used], 64, "%08lu %s request served in 12 ms\n", line, (line % 100 == 99) ? "ERROR" : "INFO ");
+	}
+	bool ok = fwrite(&buffer[0], 1, used, f) == used;
+	if (fclose(f) != 0 || !ok)
+	{
+		fprintf(stderr, "winlua-bench: could not write '%s'\n", path);
+		exit(1);
+	}
+	return path;
+}
+
+void bench_remove_log(const std::string& path)
+{
+	remove(path.c_str());
+}
+
+bool bench_drop_caches()
+{
+#ifdef __linux__
+	/* needs root; 3 drops the page cache as well as dentries and inodes */
+	sync();
+	FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+	if (f == NULL)
+	{
+		return false;
+	}
+	bool ok = fputs("3\n", f) >= 0;
+	return (fclose(f) == 0) && ok;
+#else
+	return false;
+#endif
+}
+
+int bench_silence_stdout()
+{
+	fflush(stdout);
+	int saved = bench_dup(1);
+	FILE *null = freopen(BENCH_NULL_DEVICE, "w", stdout);
+	(void)null;
+#ifdef _WIN32
+	/* console output goes through the standard handle, not the CRT */
+	SetStdHandle(STD_OUTPUT_HANDLE, reinterpret_cast<HANDLE>(_get_osfhandle(1)));
+#endif
+	return saved;
+}
+
+void bench_restore_stdout(int saved)
+{
+	fflush(stdout);
+	bench_dup2(saved, 1);
+	bench_close(saved);
+#ifdef _WIN32
+	SetStdHandle(STD_OUTPUT_HANDLE, reinterpret_cast<HANDLE>(_get_osfhandle(1)));
+#endif
+}
+
+/* ------------------------------------------------------------
+Benchmark runner
+------------------------------------------------------------ */
+
+struct BenchResult
+{
+	const char *name;
+	long long ops;
+	int samples;
+	double median, p99, mean, min; /* nanoseconds per run */
+	double allocs, gc; /* Lua allocations and collection nanoseconds per run */
+};
+
+/* counts new blocks and growing reallocations, then defers to the state's allocator */
+struct BenchAllocCounter
+{
+	lua_Alloc allocf;
+	void *ud;
+	long long count;
+};
+
+static void *counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	BenchAllocCounter *counter = static_cast<BenchAllocCounter*>(ud);
+	if (nsize > 0 && (ptr == NULL || nsize > osize))
+	{
+		counter->count++;
+	}
+	return counter->allocf(counter->ud, ptr, osize, nsize);
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	/* nearest rank */
+	size_t rank = static_cast<size_t>(p * sorted.size() + 0.999999);
+	if (rank < 1) { rank = 1; }
+	if (rank > sorted.size()) { rank = sorted.size(); }
+	return sorted[rank - 1];
+}
+
+static BenchResult run_case(const BenchCase& c, int warmup, int samples)
+{
+	typedef std::chrono::steady_clock clock;
+
+	BenchState s;
+	s.L = NULL;
+	s.ops = 1;
+	s.data = NULL;
+	s.gc_ns = 0;
+	if (c.setup) { c.setup(s); }
+
+	for (int i = 0; i < warmup; i++)
+	{
+		if (c.prepare) { c.prepare(s); }
+		c.run(s);
+	}
+	s.gc_ns = 0;
+
+	/* the state must get its own allocator back before it is closed */
+	BenchAllocCounter counter;
+	counter.count = 0;
+	if (s.L)
+	{
+		counter.allocf = lua_getallocf(s.L, &counter.ud);
+		lua_setallocf(s.L, counting_alloc, &counter);
+	}
+
+	std::vector<double> times;
+	times.reserve(samples);
+	for (int i = 0; i < samples; i++)
+	{
+		if (c.prepare) { c.prepare(s); }
+		clock::time_point start = clock::now();
+		c.run(s);
+		clock::time_point end = clock::now();
+		times.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+	}
+
+	if (s.L) { lua_setallocf(s.L, counter.allocf, counter.ud); }
+	if (c.teardown) { c.teardown(s); }
+	if (s.L) { winlua_closestate(s.L); }
+
+	BenchResult r;
+	r.name = c.name;
+	r.ops = s.ops;
+	r.samples = samples;
+	r.allocs = static_cast<double>(counter.count) / samples;
+	r.gc = s.gc_ns / samples;
+	r.mean = 0;
+	for (size_t i = 0; i < times.size(); i++) { r.mean += times[i]; }
+	r.mean /= times.size();
+	std::sort(times.begin(), times.end());
+	r.min = times.front();
+	r.median = percentile(times, 0.5);
+	r.p99 = percentile(times, 0.99);
+	return r;
+}
+
+static bool write_json(const char *path, const std::vector<BenchResult>& results, int warmup)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+	{
+		return false;
+	}
+
+	fprintf(f, "{\n  \"suite\": \"winlua-bench\",\n  \"lua\": \"%s\",\n  \"warmup\": %d,\n  \"cases\": [\n", LUA_RELEASE, warmup);
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		fprintf(f, "    {\"name\": \"%s\", \"samples\": %d, \"ops\": %lld, \"median_ns\": %.0f, \"p99_ns\": %.0f, \"mean_ns\": %.0f, \"min_ns\": %.0f, \"ops_per_sec\": %.1f, \"allocs_per_run\": %.0f, \"gc_ns_per_run\": %.0f}%s\n",
+			r.name, r.samples, r.ops, r.median, r.p99, r.mean, r.min, r.ops / (r.median / 1e9), r.allocs, r.gc,
+			(i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	return fclose(f) == 0;
+}
+
+/*
+Run the self-checks matching the filters; the exit status is 1 if any failed.
+*/
+static int run_checks(const std::vector<const char*>& filters)
+{
+	int failed = 0;
+	for (const BenchCheck *c = bench_checks; c->name; c++)
+	{
+		bool selected = filters.empty();
+		for (size_t i = 0; i < filters.size() && !selected; i++)
+		{
+			selected = strstr(c->name, filters[i]) != NULL;
+		}
+		if (!selected) { continue; }
+
+		bool ok = c->run();
+		printf("%-32s %s\n", c->name, ok ? "ok" : "FAILED");
+		fflush(stdout);
+		failed += ok ? 0 : 1;
+	}
+	return (failed > 0) ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--json file] [--samples n] [--warmup n] [--list] [--check] [filter...]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *json = NULL;
+	int samples = 25, warmup = 3;
+	bool check = false;
+	std::vector<const char*> filters;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) { json = argv[++i]; }
+		else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) { samples = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) { warmup = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--check") == 0) { check = true; }
+		else if (strcmp(argv[i], "--list") == 0)
+		{
+			for (const BenchCase *c = bench_cases; c->name; c++) { printf("%s\n", c->name); }
+			return 0;
+		}
+		else if (argv[i][0] == '-') { usage(argv[0]); }
+		else { filters.push_back(argv[i]); }
+	}
+	if (samples < 1) { usage(argv[0]); }
+	srand(static_cast<unsigned>(time(NULL))); /* scratch directory names */
+	if (check)
+	{
+		return run_checks(filters);
+	}
+
+	std::vector<BenchResult> results;
+	printf("%-32s %14s %14s %16s %14s %12s\n", "case", "median (us)", "p99 (us)", "ops/s", "allocs/run", "gc (us)");
+	for (const BenchCase *c = bench_cases; c->name; c++)
+	{
+		bool selected = filters.empty();
+		for (size_t i = 0; i < filters.size() && !selected; i++)
+		{
+			selected = strstr(c->name, filters[i]) != NULL;
+		}
+		if (!selected) { continue; }
+
+		BenchResult r = run_case(*c, warmup, samples);
+		printf("%-32s %14.1f %14.1f %16.0f %14.0f %12.1f\n", r.name, r.median / 1e3, r.p99 / 1e3, r.ops / (r.median / 1e9), r.allocs, r.gc / 1e3);
+		fflush(stdout);
+		results.push_back(r);
+	}
+
+	if (json != NULL && !write_json(json, results, warmup))
+	{
+		fprintf(stderr, "winlua-bench: could not write '%s'\n", json);
+		return 1;
+	}
+	return 0;
+}
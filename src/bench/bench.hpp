@@ -0,0 +1,88 @@
+#ifndef WINLUA_BENCH_HPP_INCLUDED
+#define WINLUA_BENCH_HPP_INCLUDED
+
+#include "winlua.hpp"
+#include <string>
+
+/* ------------------------------------------------------------
+WinLua Benchmark Cases
+
+A case prepares its state in 'setup', then 'run' is timed once
+per sample and must perform 'ops' operations each time; 'prepare',
+when set, runs untimed before every run. Lua
+allocations made by 'L' during the timed runs are counted; a case
+that collects garbage itself can add the time spent to 'gc_ns'.
+------------------------------------------------------------ */
+struct BenchState
+{
+	lua_State *L;
+	long long ops;
+	std::string dir; /* scratch directory for file system cases */
+	void *data;
+	double gc_ns; /* collection time over all timed runs */
+};
+
+typedef void (*BenchFunction)(BenchState& s);
+
+struct BenchCase
+{
+	const char *name;
+	BenchFunction setup;
+	BenchFunction run;
+	BenchFunction teardown;
+	BenchFunction prepare;
+};
+
+/* all cases, terminated by a NULL name */
+extern const BenchCase bench_cases[];
+
+/*
+Self-checks run by --check instead of the cases; 'run' prints what
+went wrong and returns false on failure.
+*/
+struct BenchCheck
+{
+	const char *name;
+	bool (*run)();
+};
+
+extern const BenchCheck bench_checks[];
+
+/* ------------------------------------------------------------
+WinLua Benchmark Helpers
+------------------------------------------------------------ */
+
+/* new state with the standard libraries and the WinLua modules used by the cases */
+lua_State *bench_newstate(bool pooled);
+
+/* run a chunk, aborting the benchmark with a message on errors */
+void bench_dostring(lua_State *L, const char *code);
+
+/* call the global function 'name' without arguments */
+void bench_call(lua_State *L, const char *name);
+
+/* create and remove a scratch directory holding 'count' small files */
+std::string bench_make_tree(int count);
+void bench_remove_tree(const std::string& dir, int count);
+
+/* nested tree: 'fanout' subdirectories per level down to 'depth', 'count' files in each directory */
+std::string bench_make_nested_tree(int fanout, int depth, int count);
+void bench_remove_nested_tree(const std::string& dir, int fanout, int depth, int count);
+
+/* create and remove a log-like file of about 'mib' MiB in which every 100th line holds "ERROR" */
+std::string bench_make_log(size_t mib);
+void bench_remove_log(const std::string& path);
+
+/* evict file data and metadata from the OS caches; false where that is not possible */
+bool bench_drop_caches();
+
+/* point stdout at the null device while printing benchmarks run */
+int bench_silence_stdout();
+void bench_restore_stdout(int saved);
+
+/* ------------------------------------------------------------
+Platform modules (the real ones on Windows, stand-ins elsewhere)
+------------------------------------------------------------ */
+int luaopen_fs(lua_State *L);
+
+#endif
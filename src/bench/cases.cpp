@@ -0,0 +1,1917 @@
+#include "bench.hpp"
+#include "winlua_modules.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* ------------------------------------------------------------
+UTF-8 <-> UTF-16 conversion
+------------------------------------------------------------ */
+#define BENCH_CONVERSIONS 10000
+
+static const char bench_path[] = "C:\\Users\\winlua\\AppData\\Local\\winlua\\cache\\0123456789abcdef.luac";
+
+static void utf8_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_CONVERSIONS;
+}
+
+static void utf8_to_wstring_run(BenchState& s)
+{
+	for (int i = 0; i < BENCH_CONVERSIONS; i++)
+	{
+		utf8_to_wstring(s.L, bench_path);
+		lua_pop(s.L, 1);
+	}
+}
+
+static void wstring_to_utf8_setup(BenchState& s)
+{
+	utf8_setup(s);
+	/* keep one converted path alive as the input */
+	s.data = utf8_to_wstring(s.L, bench_path);
+	lua_setfield(s.L, LUA_REGISTRYINDEX, "bench.wpath");
+}
+
+static void wstring_to_utf8_run(BenchState& s)
+{
+	for (int i = 0; i < BENCH_CONVERSIONS; i++)
+	{
+		wstring_to_utf8(s.L, static_cast<wchar_t*>(s.data));
+		lua_pop(s.L, 1);
+	}
+}
+
+/* ------------------------------------------------------------
+Temporary wide strings: GC'd userdata vs. the scratch arena
+
+A Lua loop hands 1000 distinct paths to a C function 1M times, in
+batches with the collector stopped; the full collection after each
+batch is timed so that the garbage the userdata leave is visible.
+------------------------------------------------------------ */
+#define BENCH_PATH_CALLS 1000000
+#define BENCH_PATH_BATCH 10000
+
+static volatile uint16_t path_sink;
+
+/* what utf8_to_wstring does: a userdata per conversion, left to the collector */
+static int path_userdata(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	uint16_t *buff = static_cast<uint16_t*>(lua_newuserdata(L, sizeof(uint16_t) * (len + 1)));
+	buff[winlua_utf8_to_utf16(path, len, buff)] = 0;
+	path_sink = buff[0];
+	return 0;
+}
+
+static int path_scratch(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	WinLuaScratch scratch(L);
+	path_sink = scratch.utf16(path)[0];
+	return 0;
+}
+
+static void path_setup(BenchState& s, lua_CFunction convert)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_PATH_CALLS;
+	lua_register(s.L, "convert", convert);
+	bench_dostring(s.L,
+		"paths = {}\n"
+		"for i = 1, 1000 do paths[i] = string.format('C:\\\\Users\\\\winlua\\\\Documents\\\\file%04d.txt', i) end\n"
+		"function bench() for i = 1, 10000 do convert(paths[i % 1000 + 1]) end end\n"
+		"collectgarbage('stop')");
+}
+
+static void path_userdata_setup(BenchState& s)
+{
+	path_setup(s, path_userdata);
+}
+
+static void path_scratch_setup(BenchState& s)
+{
+	path_setup(s, path_scratch);
+}
+
+static void path_run(BenchState& s)
+{
+	typedef std::chrono::steady_clock clock;
+
+	for (int i = 0; i < BENCH_PATH_CALLS / BENCH_PATH_BATCH; i++)
+	{
+		bench_call(s.L, "bench");
+		clock::time_point start = clock::now();
+		lua_gc(s.L, LUA_GCCOLLECT, 0);
+		lua_gc(s.L, LUA_GCSTOP, 0);
+		s.gc_ns += std::chrono::duration<double, std::nano>(clock::now() - start).count();
+	}
+}
+
+/* ------------------------------------------------------------
+Transcoder throughput on 1 MiB of ASCII-heavy or CJK-heavy text
+------------------------------------------------------------ */
+#define BENCH_TEXT_SIZE (1 << 20)
+
+struct BenchText
+{
+	std::string utf8;
+	std::vector<uint16_t> utf16;
+	std::vector<char> out8;
+	std::vector<uint16_t> out16;
+};
+
+static void text_setup(BenchState& s, const char *sample)
+{
+	BenchText *text = new BenchText;
+	while (text->utf8.size() < BENCH_TEXT_SIZE)
+	{
+		text->utf8.append(sample);
+	}
+	text->utf16.resize(text->utf8.size());
+	text->utf16.resize(winlua_utf8_to_utf16(text->utf8.data(), text->utf8.size(), &text->utf16[0]));
+	text->out8.resize(3 * text->utf16.size());
+	text->out16.resize(text->utf8.size());
+	s.data = text;
+}
+
+/* ops are UTF-16 units, roughly characters */
+static void ascii_text_setup(BenchState& s)
+{
+	text_setup(s, "C:\\Users\\winlua\\Documents\\Projects\\report-2016.txt; PATH=C:\\Windows\\System32;\n");
+	s.ops = static_cast<BenchText*>(s.data)->utf16.size();
+}
+
+static void cjk_text_setup(BenchState& s)
+{
+	text_setup(s, "\xe6\x96\x87\xe5\xad\x97\xe5\x8c\x96\xe3\x81\x91\xe3\x81\xae\xe3\x83\x86\xe3\x82\xb9\xe3\x83\x88 \xed\x95\x9c\xea\xb5\xad\xec\x96\xb4 \xe4\xb8\xad\xe6\x96\x87 ");
+	s.ops = static_cast<BenchText*>(s.data)->utf16.size();
+}
+
+static void text_teardown(BenchState& s)
+{
+	delete static_cast<BenchText*>(s.data);
+}
+
+static void utf8_to_utf16_run(BenchState& s)
+{
+	BenchText *text = static_cast<BenchText*>(s.data);
+	winlua_utf8_to_utf16(text->utf8.data(), text->utf8.size(), &text->out16[0]);
+}
+
+static void utf16_to_utf8_run(BenchState& s)
+{
+	BenchText *text = static_cast<BenchText*>(s.data);
+	winlua_utf16_to_utf8(&text->utf16[0], text->utf16.size(), &text->out8[0]);
+}
+
+/* ------------------------------------------------------------
+print
+------------------------------------------------------------ */
+
+static void print_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = 10000;
+	bench_dostring(s.L, "function bench() for i = 1, 10000 do print('line', i, 3.5) end end");
+}
+
+static void print_lines_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = 1000000;
+	bench_dostring(s.L, "function bench() for i = 1, 1000000 do print(i) end end");
+}
+
+static void print_run(BenchState& s)
+{
+	int saved = bench_silence_stdout();
+	bench_call(s.L, "bench");
+	winlua_flush_output(s.L);
+	bench_restore_stdout(saved);
+}
+
+/* ------------------------------------------------------------
+fs.dir, fs.find and fs.attributes
+------------------------------------------------------------ */
+#define BENCH_TREE_FILES 1000
+
+static void fs_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_TREE_FILES;
+	s.dir = bench_make_tree(BENCH_TREE_FILES);
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "dir");
+	bench_dostring(s.L, code);
+}
+
+static void fs_teardown(BenchState& s)
+{
+	bench_remove_tree(s.dir, BENCH_TREE_FILES);
+}
+
+static void fs_dir_setup(BenchState& s)
+{
+	fs_setup(s, "function bench() local n = 0 for name in fs.dir(dir) do n = n + 1 end end");
+}
+
+static void fs_find_setup(BenchState& s)
+{
+	fs_setup(s, "function bench() local n = 0 for name in fs.find(dir .. '/*.txt') do n = n + 1 end end");
+}
+
+static void fs_attributes_setup(BenchState& s)
+{
+	fs_setup(s,
+		"local names = {} "
+		"for i = 0, 999 do names[#names + 1] = string.format('%s/file%05d.txt', dir, i) end "
+		"function bench() for i = 1, #names do fs.attributes(names[i]) end end");
+}
+
+/* the same listing with mode and size: a second lookup per entry vs. the search data */
+static void fs_dir_attributes_setup(BenchState& s)
+{
+	fs_setup(s,
+		"function bench() local n = 0 for name in fs.dir(dir) do "
+		"local a = fs.attributes(dir .. '/' .. name) if a.mode == 'file' then n = n + a.size end end end");
+}
+
+static void fs_dir_record_setup(BenchState& s)
+{
+	fs_setup(s,
+		"function bench() local n = 0 for name, e in fs.dir(dir, true) do "
+		"if e.mode == 'file' then n = n + e.size end end end");
+}
+
+static void fs_dir_fields_setup(BenchState& s)
+{
+	fs_setup(s,
+		"local fields = {'mode', 'size'} "
+		"function bench() local n = 0 for name, mode, size in fs.dir(dir, fields) do "
+		"if mode == 'file' then n = n + size end end end");
+}
+
+static void fs_dir_mode_setup(BenchState& s)
+{
+	fs_setup(s,
+		"local fields = {'mode'} "
+		"function bench() local n = 0 for name, mode in fs.dir(dir, fields) do "
+		"if mode == 'file' then n = n + 1 end end end");
+}
+
+static void run_bench(BenchState& s)
+{
+	bench_call(s.L, "bench");
+}
+
+/* ------------------------------------------------------------
+fs.attributes_many vs. a Lua loop over fs.attributes, on warm
+caches and, where the OS lets us drop them, on cold ones
+------------------------------------------------------------ */
+#define BENCH_MANY_FILES 10000
+
+static void many_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_MANY_FILES;
+	s.dir = bench_make_tree(BENCH_MANY_FILES);
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "dir");
+	bench_dostring(s.L, "names = {} for i = 0, 9999 do names[#names + 1] = string.format('%s/file%05d.txt', dir, i) end");
+	bench_dostring(s.L, code);
+}
+
+static void many_teardown(BenchState& s)
+{
+	bench_remove_tree(s.dir, BENCH_MANY_FILES);
+}
+
+static void many_batch_setup(BenchState& s)
+{
+	many_setup(s, "function bench() local r, failed = fs.attributes_many(names) assert(failed == 0 and #r.size == #names) end");
+}
+
+static void many_loop_setup(BenchState& s)
+{
+	many_setup(s, "function bench() local n = 0 for i = 1, #names do n = n + fs.attributes(names[i]).size end end");
+}
+
+static void many_cold(BenchState&)
+{
+	static bool warned = false;
+	if (!bench_drop_caches() && !warned)
+	{
+		fprintf(stderr, "winlua-bench: cannot drop OS caches here, cold cases run warm\n");
+		warned = true;
+	}
+}
+
+/* ------------------------------------------------------------
+fs.walk vs. recursing with fs.dir and fs.attributes in Lua
+------------------------------------------------------------ */
+#define BENCH_WALK_FANOUT 8
+#define BENCH_WALK_DEPTH 3
+#define BENCH_WALK_FILES 20
+
+static void walk_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.dir = bench_make_nested_tree(BENCH_WALK_FANOUT, BENCH_WALK_DEPTH, BENCH_WALK_FILES);
+	/* every entry below the root: the files of each directory plus the directories themselves */
+	long long dirs = 1, level = 1;
+	for (int i = 0; i < BENCH_WALK_DEPTH; i++)
+	{
+		level *= BENCH_WALK_FANOUT;
+		dirs += level;
+	}
+	s.ops = dirs * BENCH_WALK_FILES + dirs - 1;
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "dir");
+	lua_pushinteger(s.L, s.ops);
+	lua_setglobal(s.L, "expected");
+	bench_dostring(s.L, code);
+}
+
+static void walk_teardown(BenchState& s)
+{
+	bench_remove_nested_tree(s.dir, BENCH_WALK_FANOUT, BENCH_WALK_DEPTH, BENCH_WALK_FILES);
+}
+
+static const char walk_script[] =
+	"function bench() local n = 0 "
+	"for batch in fs.walk(dir, options) do for i = 1, #batch do local e = batch[i] n = n + (e.size >= 0 and 1 or 0) end end "
+	"assert(n == expected, n) end";
+
+static void walk_parallel_setup(BenchState& s)
+{
+	walk_setup(s, walk_script);
+}
+
+static void walk_single_setup(BenchState& s)
+{
+	walk_setup(s, "options = {threads = 1}");
+	bench_dostring(s.L, walk_script);
+}
+
+static void walk_lua_setup(BenchState& s)
+{
+	walk_setup(s,
+		"local function walk(path, out) "
+		"for name in fs.dir(path) do if name ~= '.' and name ~= '..' then "
+		"local p = path .. '/' .. name local a = fs.attributes(p) "
+		"out[#out + 1] = {path = p, type = a.mode, size = a.size, mtime = a.modification} "
+		"if a.mode == 'directory' then walk(p, out) end end end end "
+		"function bench() local out = {} walk(dir, out) assert(#out == expected, #out) end");
+}
+
+/* ------------------------------------------------------------
+Overlapped reads with the async module vs. sequential io.open
+------------------------------------------------------------ */
+#define BENCH_ASYNC_FILES 256
+
+static void read_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_ASYNC_FILES;
+	s.dir = bench_make_tree(BENCH_ASYNC_FILES);
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "dir");
+	bench_dostring(s.L, "names = {} for i = 0, 255 do names[#names + 1] = string.format('%s/file%05d.txt', dir, i) end");
+	bench_dostring(s.L, code);
+}
+
+static void read_teardown(BenchState& s)
+{
+	bench_remove_tree(s.dir, BENCH_ASYNC_FILES);
+}
+
+static void async_read_setup(BenchState& s)
+{
+	read_setup(s,
+		"function bench() "
+		"  async.run(function() "
+		"    for i = 1, #names do async.task(function() assert(async.read(names[i])) end) end "
+		"  end) "
+		"end");
+}
+
+static void io_read_setup(BenchState& s)
+{
+	read_setup(s,
+		"function bench() "
+		"  for i = 1, #names do local f = assert(io.open(names[i], 'rb')) f:read('a') f:close() end "
+		"end");
+}
+
+/* ------------------------------------------------------------
+Scanning a large file: fs.mmap view vs. io.read in 1 MiB chunks.
+The file is 256 MiB by default; WINLUA_BENCH_MMAP_MB=4096 scans
+a 4 GiB file (one op is one MiB)
+------------------------------------------------------------ */
+#define BENCH_MMAP_MIB 256
+
+static void scan_setup(BenchState& s, const char *code)
+{
+	const char *mib = getenv("WINLUA_BENCH_MMAP_MB");
+	s.ops = (mib != NULL && atoi(mib) > 0) ? atoi(mib) : BENCH_MMAP_MIB;
+	s.L = bench_newstate(false);
+	s.dir = bench_make_log(static_cast<size_t>(s.ops));
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "path");
+	bench_dostring(s.L,
+		"function count(s, n) local i = 1 while true do "
+		"local a, e = s:find('ERROR', i, true) if not a then return n end n, i = n + 1, e + 1 end end "
+		"function check(n) expected = expected or n assert(n == expected and n > 0, n) end");
+	bench_dostring(s.L, code);
+}
+
+static void scan_teardown(BenchState& s)
+{
+	bench_remove_log(s.dir);
+}
+
+static void mmap_scan_setup(BenchState& s)
+{
+	scan_setup(s, "function bench() local v = assert(fs.mmap(path)) local n = count(v, 0) v:close() check(n) end");
+}
+
+static void io_read_scan_setup(BenchState& s)
+{
+	/* the last 4 bytes of a chunk are carried over so a match can straddle two reads */
+	scan_setup(s,
+		"function bench() local f = assert(io.open(path, 'rb')) local n, tail = 0, '' "
+		"while true do local chunk = f:read(1 << 20) if not chunk then break end "
+		"local s = tail .. chunk n = count(s, n) tail = s:sub(-4) end "
+		"f:close() check(n) end");
+}
+
+/* ------------------------------------------------------------
+Hashing throughput; one op is one MiB, so ops/s reads as MiB/s
+------------------------------------------------------------ */
+#define BENCH_HASH_MIB 64
+
+static void hash_setup(BenchState& s, const char *algo)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_HASH_MIB;
+	lua_pushstring(s.L, algo);
+	lua_setglobal(s.L, "algo");
+	bench_dostring(s.L,
+		"local t = {} for i = 1, 65536 do t[i] = string.char((i * 7919) % 251) end "
+		"data = table.concat(t):rep(1024)");
+	bench_dostring(s.L, "function bench() fs.hasher(algo):update(data):digest() end");
+}
+
+static void hash_crc32c_setup(BenchState& s) { hash_setup(s, "crc32c"); }
+static void hash_xxh3_setup(BenchState& s) { hash_setup(s, "xxh3"); }
+static void hash_sha256_setup(BenchState& s) { hash_setup(s, "sha256"); }
+
+/* a whole file through the double-buffered reader */
+static void hash_file_setup(BenchState& s)
+{
+	s.ops = BENCH_MMAP_MIB;
+	s.L = bench_newstate(false);
+	s.dir = bench_make_log(BENCH_MMAP_MIB);
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "path");
+	bench_dostring(s.L, "function bench() assert(fs.hash(path, 'xxh3')) end");
+}
+
+static void hash_many_setup(BenchState& s)
+{
+	many_setup(s, "function bench() local r, failed = fs.hash_many(names, 'sha256') assert(failed == 0) end");
+}
+
+static void hash_loop_setup(BenchState& s)
+{
+	many_setup(s, "function bench() for i = 1, #names do assert(fs.hash(names[i], 'sha256')) end end");
+}
+
+/* ------------------------------------------------------------
+fs.watch: a second thread makes 100k changes (creating and at once
+removing 50k files, so the directory stays small) while Lua drains
+the batches. Delivery latency, from the last change to the batch
+that completes the count, and the events lost are printed at
+teardown
+------------------------------------------------------------ */
+#define BENCH_WATCH_EVENTS 100000
+
+struct BenchWatch
+{
+	std::string dir;
+	std::chrono::steady_clock::time_point finished;
+	std::vector<double> latency;
+	long long dropped, overflows;
+};
+
+static std::string watch_file(const std::string& dir, int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/e%06d", i);
+	return dir + name;
+}
+
+static void watch_generate(BenchWatch *bw)
+{
+	for (int i = 0; i < BENCH_WATCH_EVENTS / 2; i++)
+	{
+		std::string name = watch_file(bw->dir, i);
+		FILE *f = fopen(name.c_str(), "ab");
+		if (f != NULL) { fclose(f); }
+		remove(name.c_str());
+	}
+	bw->finished = std::chrono::steady_clock::now();
+}
+
+static void watch_setup(BenchState& s, int capacity)
+{
+	BenchWatch *bw = new BenchWatch();
+	bw->dropped = bw->overflows = 0;
+	s.data = bw;
+	s.ops = BENCH_WATCH_EVENTS;
+	s.L = bench_newstate(false);
+	s.dir = bw->dir = bench_make_tree(0);
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "dir");
+	lua_pushinteger(s.L, BENCH_WATCH_EVENTS);
+	lua_setglobal(s.L, "expected");
+	lua_pushinteger(s.L, capacity);
+	lua_setglobal(s.L, "capacity");
+	bench_dostring(s.L,
+		"w = assert(fs.watch(dir, {debounce = 5, capacity = capacity})) "
+		"function drain() local seen, dropped, overflows = 0, 0, 0 "
+		"while seen + dropped < expected and overflows == 0 do "
+		"local batch, d = w:next_batch(10000) if not batch then error('fs.watch: ' .. tostring(d)) end "
+		"dropped = dropped + d for i = 1, #batch do local a = batch[i].action "
+		"if a == 'added' or a == 'removed' then seen = seen + 1 elseif a == 'overflow' then overflows = overflows + 1 end end end "
+		"return dropped, overflows end "
+		"function settle() while w:next_batch(50) do end end");
+}
+
+static void watch_large_setup(BenchState& s)
+{
+	watch_setup(s, 2 * BENCH_WATCH_EVENTS);
+}
+
+static void watch_small_setup(BenchState& s)
+{
+	watch_setup(s, 16384);
+}
+
+/* events left over from a run that overflowed must not count for the next one */
+static void watch_settle(BenchState& s)
+{
+	bench_call(s.L, "settle");
+}
+
+static void watch_run(BenchState& s)
+{
+	BenchWatch *bw = static_cast<BenchWatch*>(s.data);
+	std::thread generator(watch_generate, bw);
+	lua_getglobal(s.L, "drain");
+	int status = lua_pcall(s.L, 0, 2, 0);
+	std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+	generator.join();
+	if (status != LUA_OK)
+	{
+		fprintf(stderr, "winlua-bench: %s\n", lua_tostring(s.L, -1));
+		exit(1);
+	}
+	bw->dropped += lua_tointeger(s.L, -2);
+	bw->overflows += lua_tointeger(s.L, -1);
+	lua_pop(s.L, 2);
+	bw->latency.push_back(std::chrono::duration<double, std::milli>(done - bw->finished).count());
+}
+
+static void watch_teardown(BenchState& s)
+{
+	BenchWatch *bw = static_cast<BenchWatch*>(s.data);
+	bench_dostring(s.L, "w:close()");
+	std::sort(bw->latency.begin(), bw->latency.end());
+	fprintf(stderr, "winlua-bench: fs.watch %d events/run: latency median %.2f ms, max %.2f ms; %lld dropped, %lld overflows in %d runs\n",
+		BENCH_WATCH_EVENTS, bw->latency[bw->latency.size() / 2], bw->latency.back(), bw->dropped, bw->overflows,
+		static_cast<int>(bw->latency.size()));
+	bench_remove_tree(bw->dir, 0);
+	delete bw;
+}
+
+/* ------------------------------------------------------------
+fs.copy_tree vs. copying with io.open reads and writes in Lua, on
+the 12k-file tree of the walk cases and on four 64 MiB files. The
+copy is removed again before every run
+------------------------------------------------------------ */
+#define BENCH_COPY_BIG_FILES 4
+#define BENCH_COPY_BIG_MIB 64
+
+static std::string copy_big_file(const std::string& dir, int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/big%d.bin", i);
+	return dir + name;
+}
+
+static void copy_remove_big(const std::string& dir)
+{
+	for (int i = 0; i < BENCH_COPY_BIG_FILES; i++)
+	{
+		remove(copy_big_file(dir, i).c_str());
+	}
+	bench_remove_tree(dir, 0);
+}
+
+static void copy_setup(BenchState& s, const char *code, long long expected)
+{
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "src");
+	lua_pushstring(s.L, (s.dir + "-copy").c_str());
+	lua_setglobal(s.L, "dst");
+	lua_pushinteger(s.L, expected);
+	lua_setglobal(s.L, "expected");
+	bench_dostring(s.L, code);
+}
+
+static const char copy_tree_script[] =
+	"function bench() local n, bytes, errors = fs.copy_tree(src, dst) assert(n == expected and #errors == 0, n) end";
+
+static const char copy_lua_script[] =
+	"local function copy(from, to) fs.mkdir(to) "
+	"for name in fs.dir(from) do if name ~= '.' and name ~= '..' then "
+	"local a, b = from .. '/' .. name, to .. '/' .. name "
+	"if fs.attributes(a).mode == 'directory' then copy(a, b) else "
+	"local i, o = assert(io.open(a, 'rb')), assert(io.open(b, 'wb')) "
+	"while true do local chunk = i:read(1 << 20) if not chunk then break end o:write(chunk) end "
+	"i:close() o:close() n = n + 1 end end end end "
+	"function bench() n = 0 copy(src, dst) assert(n == expected, n) end";
+
+static void copy_small_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.dir = bench_make_nested_tree(BENCH_WALK_FANOUT, BENCH_WALK_DEPTH, BENCH_WALK_FILES);
+	long long dirs = 1, level = 1;
+	for (int i = 0; i < BENCH_WALK_DEPTH; i++)
+	{
+		level *= BENCH_WALK_FANOUT;
+		dirs += level;
+	}
+	s.ops = dirs * BENCH_WALK_FILES;
+	copy_setup(s, code, s.ops);
+}
+
+static void copy_small_tree_setup(BenchState& s) { copy_small_setup(s, copy_tree_script); }
+static void copy_small_lua_setup(BenchState& s) { copy_small_setup(s, copy_lua_script); }
+
+static void copy_small_clean(BenchState& s)
+{
+	bench_remove_nested_tree(s.dir + "-copy", BENCH_WALK_FANOUT, BENCH_WALK_DEPTH, BENCH_WALK_FILES);
+}
+
+static void copy_small_teardown(BenchState& s)
+{
+	copy_small_clean(s);
+	bench_remove_nested_tree(s.dir, BENCH_WALK_FANOUT, BENCH_WALK_DEPTH, BENCH_WALK_FILES);
+}
+
+/* one op is one MiB, so ops/s reads as MiB/s */
+static void copy_big_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_COPY_BIG_FILES * BENCH_COPY_BIG_MIB;
+	s.dir = bench_make_tree(0);
+	std::vector<char> block(1 << 20);
+	for (int i = 0; i < BENCH_COPY_BIG_FILES; i++)
+	{
+		FILE *f = fopen(copy_big_file(s.dir, i).c_str(), "wb");
+		bool ok = f != NULL;
+		for (int mib = 0; ok && mib < BENCH_COPY_BIG_MIB; mib++)
+		{
+			for (size_t k = 0; k < block.size(); k++) { block[k] = static_cast<char>((k * 7919 + mib * 31 + i) % 251); }
+			ok = fwrite(&block[0], 1, block.size(), f) == block.size();
+		}
+		if (f == NULL || fclose(f) != 0 || !ok)
+		{
+			fprintf(stderr, "winlua-bench: could not write '%s'\n", copy_big_file(s.dir, i).c_str());
+			exit(1);
+		}
+	}
+	copy_setup(s, code, BENCH_COPY_BIG_FILES);
+}
+
+static void copy_big_tree_setup(BenchState& s) { copy_big_setup(s, copy_tree_script); }
+static void copy_big_lua_setup(BenchState& s) { copy_big_setup(s, copy_lua_script); }
+
+static void copy_big_clean(BenchState& s)
+{
+	copy_remove_big(s.dir + "-copy");
+}
+
+static void copy_big_teardown(BenchState& s)
+{
+	copy_remove_big(s.dir + "-copy");
+	copy_remove_big(s.dir);
+}
+
+/* ------------------------------------------------------------
+fs.glob vs. recursing with fs.dir and string.match in Lua, on a
+tree of 1111 directories holding 100k files by default
+(WINLUA_BENCH_GLOB_FILES=1000000 for a million). One op is one
+file of the tree
+------------------------------------------------------------ */
+#define BENCH_GLOB_FANOUT 10
+#define BENCH_GLOB_DEPTH 3
+#define BENCH_GLOB_DIRS 1111
+#define BENCH_GLOB_FILES 100000
+
+static int glob_per_dir()
+{
+	const char *files = getenv("WINLUA_BENCH_GLOB_FILES");
+	int total = (files != NULL && atoi(files) > 0) ? atoi(files) : BENCH_GLOB_FILES;
+	return (total + BENCH_GLOB_DIRS - 1) / BENCH_GLOB_DIRS;
+}
+
+static void glob_setup(BenchState& s, const char *pattern, const char *lua_pattern, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.dir = bench_make_nested_tree(BENCH_GLOB_FANOUT, BENCH_GLOB_DEPTH, glob_per_dir());
+	s.ops = static_cast<long long>(BENCH_GLOB_DIRS) * glob_per_dir();
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "dir");
+	lua_pushstring(s.L, pattern);
+	lua_setglobal(s.L, "pattern");
+	lua_pushstring(s.L, lua_pattern);
+	lua_setglobal(s.L, "lua_pattern");
+	bench_dostring(s.L, code);
+}
+
+static void glob_teardown(BenchState& s)
+{
+	bench_remove_nested_tree(s.dir, BENCH_GLOB_FANOUT, BENCH_GLOB_DEPTH, glob_per_dir());
+}
+
+static const char glob_script[] =
+	"function bench() local r = fs.glob(dir .. '/' .. pattern) expected = expected or #r assert(#r == expected and #r > 0) end";
+
+/* the usual emulation: walk everything, match the path below 'dir' */
+static const char glob_lua_script[] =
+	"local function walk(path, rel, out) "
+	"for name, mode in fs.dir(path, {'mode'}) do if name ~= '.' and name ~= '..' then "
+	"local r = rel and rel .. '/' .. name or name "
+	"if r:match(lua_pattern) then out[#out + 1] = path .. '/' .. name end "
+	"if mode == 'directory' then walk(path .. '/' .. name, r, out) end end end end "
+	"function bench() local r = {} walk(dir, nil, r) expected = expected or #r assert(#r == expected and #r > 0) end";
+
+static void glob_suffix_setup(BenchState& s) { glob_setup(s, "**/file*7.txt", "file[^/]*7%.txt$", glob_script); }
+static void glob_suffix_lua_setup(BenchState& s) { glob_setup(s, "**/file*7.txt", "file[^/]*7%.txt$", glob_lua_script); }
+static void glob_prefix_setup(BenchState& s) { glob_setup(s, "dir003/dir005/**/file*7.txt", "^dir003/dir005/.*file[^/]*7%.txt$", glob_script); }
+static void glob_prefix_lua_setup(BenchState& s) { glob_setup(s, "dir003/dir005/**/file*7.txt", "^dir003/dir005/.*file[^/]*7%.txt$", glob_lua_script); }
+
+/* ------------------------------------------------------------
+fs.snapshot and fs.diff on the fs.glob tree, against the full
+rescan a script would otherwise do: fs.dir over every directory,
+compared with the sizes and times kept in a Lua table
+------------------------------------------------------------ */
+static void snapshot_setup(BenchState& s, const char *code)
+{
+	glob_setup(s, "", "", code);
+	lua_pushstring(s.L, (s.dir + ".snap").c_str());
+	lua_setglobal(s.L, "snap");
+	bench_dostring(s.L, "assert(fs.snapshot(dir, snap))");
+}
+
+static void snapshot_teardown(BenchState& s)
+{
+	remove((s.dir + ".snap").c_str());
+	glob_teardown(s);
+}
+
+static const char snapshot_script[] =
+	"function bench() assert(fs.snapshot(dir, snap)) end";
+
+static const char diff_script[] =
+	"function bench() local c = assert(fs.diff(snap, dir)) assert(#c.added + #c.removed + #c.modified == 0) end";
+
+static const char diff_trust_script[] =
+	"function bench() local c = assert(fs.diff(snap, dir, {trust = true})) assert(#c.added + #c.removed + #c.modified == 0) end";
+
+static const char rescan_lua_script[] =
+	"local fields = {'mode', 'size', 'modification'} "
+	"local function scan(path, rel, out) "
+	"for name, mode, size, time in fs.dir(path, fields) do if name ~= '.' and name ~= '..' then "
+	"local r = rel and rel .. '/' .. name or name "
+	"out[r] = mode == 'directory' and -1 or size .. ':' .. time "
+	"if mode == 'directory' then scan(path .. '/' .. name, r, out) end end end end "
+	"local old = {} scan(dir, nil, old) "
+	"function bench() local now, changes = {}, 0 scan(dir, nil, now) "
+	"for k, v in pairs(now) do if old[k] ~= v then changes = changes + 1 end end "
+	"for k in pairs(old) do if now[k] == nil then changes = changes + 1 end end "
+	"assert(changes == 0) end";
+
+static void snapshot_full_setup(BenchState& s) { snapshot_setup(s, snapshot_script); }
+static void snapshot_diff_setup(BenchState& s) { snapshot_setup(s, diff_script); }
+static void snapshot_trust_setup(BenchState& s) { snapshot_setup(s, diff_trust_script); }
+static void snapshot_lua_setup(BenchState& s) { snapshot_setup(s, rescan_lua_script); }
+
+/* ------------------------------------------------------------
+1000 short commands that each print a line: io.popen (a shell
+per command, one at a time) vs os.spawn one at a time vs the
+os.run_all pool. One op is one command
+------------------------------------------------------------ */
+#define BENCH_SPAWN_JOBS 1000
+
+#ifdef _WIN32
+#define BENCH_SPAWN_JOB "{'cmd', '/c', 'echo', 'job' .. i}"
+#else
+#define BENCH_SPAWN_JOB "{'echo', 'job' .. i}"
+#endif
+
+static void spawn_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_SPAWN_JOBS;
+	lua_pushinteger(s.L, BENCH_SPAWN_JOBS);
+	lua_setglobal(s.L, "count");
+	bench_dostring(s.L, code);
+}
+
+static const char spawn_popen_script[] =
+	"function bench() for i = 1, count do "
+	"local f = io.popen('echo job' .. i) local out = f:read('a') f:close() "
+	"assert(out:match('^job' .. i)) end end";
+
+static const char spawn_loop_script[] =
+	"function bench() for i = 1, count do "
+	"local code, out = assert(os.spawn" BENCH_SPAWN_JOB "):wait() "
+	"assert(code == 0 and out:match('^job' .. i)) end end";
+
+static const char spawn_pool_script[] =
+	"local jobs = {} for i = 1, count do jobs[i] = " BENCH_SPAWN_JOB " end "
+	"function bench() local r = os.run_all(jobs) for i = 1, count do "
+	"assert(r[i].code == 0 and r[i].stdout:match('^job' .. i)) end end";
+
+static void spawn_popen_setup(BenchState& s) { spawn_setup(s, spawn_popen_script); }
+static void spawn_loop_setup(BenchState& s) { spawn_setup(s, spawn_loop_script); }
+static void spawn_pool_setup(BenchState& s) { spawn_setup(s, spawn_pool_script); }
+
+/* ------------------------------------------------------------
+Environment lookups: os.getenv per lookup vs one os.environ
+snapshot indexed from Lua, over 32 variables the case sets. One
+op is one lookup
+------------------------------------------------------------ */
+#define BENCH_ENV_VARS 32
+#define BENCH_ENV_LOOKUPS 10000
+
+static void env_setup(BenchState& s, const char *code)
+{
+	for (int i = 0; i < BENCH_ENV_VARS; i++)
+	{
+		char name[32], value[64];
+		snprintf(name, sizeof(name), "WINLUA_BENCH_VAR%d", i);
+		snprintf(value, sizeof(value), "value of variable %d", i);
+#ifdef _WIN32
+		SetEnvironmentVariableA(name, value);
+#else
+		setenv(name, value, 1);
+#endif
+	}
+	s.L = bench_newstate(false);
+	s.ops = BENCH_ENV_LOOKUPS;
+	lua_pushinteger(s.L, BENCH_ENV_LOOKUPS);
+	lua_setglobal(s.L, "count");
+	bench_dostring(s.L, code);
+}
+
+static const char env_getenv_script[] =
+	"local names = {} for i = 1, 32 do names[i] = 'WINLUA_BENCH_VAR' .. (i - 1) end "
+	"function bench() local n = 0 for i = 1, count do "
+	"if os.getenv(names[i % 32 + 1]) then n = n + 1 end end assert(n == count) end";
+
+static const char env_environ_script[] =
+	"local names = {} for i = 1, 32 do names[i] = 'WINLUA_BENCH_VAR' .. (i - 1) end "
+	"function bench() local env, n = os.environ(), 0 for i = 1, count do "
+	"if env[names[i % 32 + 1]] then n = n + 1 end end assert(n == count) end";
+
+static void env_getenv_setup(BenchState& s) { env_setup(s, env_getenv_script); }
+static void env_environ_setup(BenchState& s) { env_setup(s, env_environ_script); }
+
+/* ------------------------------------------------------------
+registry.load_hive on a generated 200 MiB hive: 64 vendors of 64
+products of ~40 items, each item a key with five values of the
+common types. Enumerating visits every key and value (one op is
+one key); the lookups open 10k item paths from the root, walking
+the subkey lists or with the path index. Loading with the index
+is measured on its own. key:read_tree returns all keys and values
+as nested tables, on one thread or with the vendors' subtrees read
+on several, against building the same tables with key methods
+------------------------------------------------------------ */
+#define BENCH_HIVE_MIB 200
+#define BENCH_HIVE_FANOUT 64
+#define BENCH_HIVE_LOOKUPS 10000
+
+struct HiveWriter
+{
+	std::vector<unsigned char> bins;
+	size_t used;
+};
+
+static void hive_put16(HiveWriter& w, size_t at, uint32_t v)
+{
+	w.bins[at] = static_cast<unsigned char>(v);
+	w.bins[at + 1] = static_cast<unsigned char>(v >> 8);
+}
+
+static void hive_put32(HiveWriter& w, size_t at, uint32_t v)
+{
+	hive_put16(w, at, v & 0xffff);
+	hive_put16(w, at + 2, v >> 16);
+}
+
+/* close the current bin with a free cell */
+static void hive_end_bin(HiveWriter& w)
+{
+	if (w.used < w.bins.size())
+	{
+		hive_put32(w, w.used, static_cast<uint32_t>(w.bins.size() - w.used));
+		w.used = w.bins.size();
+	}
+}
+
+/* allocate a cell for 'size' bytes; returns its offset, the data starts 4 bytes later */
+static uint32_t hive_cell(HiveWriter& w, size_t size)
+{
+	size_t total = (size + 4 + 7) & ~static_cast<size_t>(7);
+	if (w.bins.size() - w.used < total)
+	{
+		hive_end_bin(w);
+		size_t start = w.bins.size(), binsize = (total + 32 + 4095) & ~static_cast<size_t>(4095);
+		w.bins.resize(start + binsize);
+		memcpy(&w.bins[start], "hbin", 4);
+		hive_put32(w, start + 4, static_cast<uint32_t>(start));
+		hive_put32(w, start + 8, static_cast<uint32_t>(binsize));
+		w.used = start + 32;
+	}
+	uint32_t offset = static_cast<uint32_t>(w.used);
+	hive_put32(w, offset, static_cast<uint32_t>(-static_cast<int32_t>(total)));
+	w.used += total;
+	return offset;
+}
+
+static uint32_t hive_data(HiveWriter& w, const void *data, size_t len)
+{
+	uint32_t cell = hive_cell(w, len);
+	memcpy(&w.bins[cell + 4], data, len);
+	return cell;
+}
+
+static uint32_t hive_nk(HiveWriter& w, const char *name, uint32_t parent, uint16_t flags)
+{
+	size_t len = strlen(name);
+	uint32_t cell = hive_cell(w, 76 + len), p = cell + 4;
+	memcpy(&w.bins[p], "nk", 2);
+	hive_put16(w, p + 2, flags | 0x20);
+	hive_put32(w, p + 16, parent);
+	hive_put32(w, p + 28, 0xffffffff);
+	hive_put32(w, p + 32, 0xffffffff);
+	hive_put32(w, p + 40, 0xffffffff);
+	hive_put32(w, p + 44, 0xffffffff);
+	hive_put32(w, p + 48, 0xffffffff);
+	hive_put16(w, p + 72, static_cast<uint32_t>(len));
+	memcpy(&w.bins[p + 76], name, len);
+	return cell;
+}
+
+/* a value; data of up to four bytes is stored in the vk cell itself */
+static uint32_t hive_vk(HiveWriter& w, const char *name, uint32_t type, const void *data, size_t len)
+{
+	size_t namelen = strlen(name);
+	uint32_t data_cell = (len > 4) ? hive_data(w, data, len) : 0;
+	uint32_t cell = hive_cell(w, 20 + namelen), p = cell + 4;
+	memcpy(&w.bins[p], "vk", 2);
+	hive_put16(w, p + 2, static_cast<uint32_t>(namelen));
+	if (len > 4)
+	{
+		hive_put32(w, p + 4, static_cast<uint32_t>(len));
+		hive_put32(w, p + 8, data_cell);
+	}
+	else
+	{
+		hive_put32(w, p + 4, static_cast<uint32_t>(len) | 0x80000000u);
+		memcpy(&w.bins[p + 8], data, len);
+	}
+	hive_put32(w, p + 12, type);
+	hive_put16(w, p + 16, 1);
+	memcpy(&w.bins[p + 20], name, namelen);
+	return cell;
+}
+
+/* point 'nk' at its subkeys with an lh list (names hashed as the registry does) */
+static void hive_subkeys(HiveWriter& w, uint32_t nk, const std::vector<uint32_t>& children)
+{
+	uint32_t list = hive_cell(w, 4 + 8 * children.size()), p = list + 4;
+	memcpy(&w.bins[p], "lh", 2);
+	hive_put16(w, p + 2, static_cast<uint32_t>(children.size()));
+	for (size_t i = 0; i < children.size(); i++)
+	{
+		uint32_t child = children[i] + 4, hash = 0;
+		for (uint32_t k = 0, len = w.bins[child + 72]; k < len; k++)
+		{
+			hash = hash * 37 + static_cast<uint32_t>(toupper(w.bins[child + 76 + k]));
+		}
+		hive_put32(w, p + 4 + 8 * static_cast<uint32_t>(i), children[i]);
+		hive_put32(w, p + 8 + 8 * static_cast<uint32_t>(i), hash);
+	}
+	hive_put32(w, nk + 4 + 20, static_cast<uint32_t>(children.size()));
+	hive_put32(w, nk + 4 + 28, list);
+}
+
+static void hive_values(HiveWriter& w, uint32_t nk, const std::vector<uint32_t>& values)
+{
+	uint32_t list = hive_cell(w, 4 * values.size());
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		hive_put32(w, list + 4 + 4 * static_cast<uint32_t>(i), values[i]);
+	}
+	hive_put32(w, nk + 4 + 36, static_cast<uint32_t>(values.size()));
+	hive_put32(w, nk + 4 + 40, list);
+}
+
+static std::vector<unsigned char> hive_wide(const char *text, size_t terminators)
+{
+	std::vector<unsigned char> wide;
+	for (const char *p = text; *p; p++)
+	{
+		wide.push_back(static_cast<unsigned char>(*p));
+		wide.push_back(0);
+	}
+	wide.resize(wide.size() + 2 * terminators, 0);
+	return wide;
+}
+
+static void hive_item(HiveWriter& w, uint32_t nk, int vendor, int product, int item)
+{
+	char text[96];
+	std::vector<uint32_t> values;
+	snprintf(text, sizeof(text), "Item %05d of Product %02d by Vendor %02d", item, product, vendor);
+	std::vector<unsigned char> sz = hive_wide(text, 1);
+	values.push_back(hive_vk(w, "DisplayName", 1, &sz[0], sz.size()));
+	unsigned char version[4] = {static_cast<unsigned char>(item), 0, 1, 0};
+	values.push_back(hive_vk(w, "Version", 4, version, 4));
+	unsigned char blob[768];
+	for (size_t i = 0; i < sizeof(blob); i++) { blob[i] = static_cast<unsigned char>((i * 7919 + item) % 251); }
+	values.push_back(hive_vk(w, "Data", 3, blob, sizeof(blob)));
+	snprintf(text, sizeof(text), "C:\\Vendor%02d\\Product%02d\\bin C:\\Vendor%02d\\Product%02d\\lib", vendor, product, vendor, product);
+	std::vector<unsigned char> multi = hive_wide(text, 2);
+	for (size_t i = 0; i + 1 < multi.size(); i += 2)
+	{
+		if (multi[i] == ' ') { multi[i] = 0; }
+	}
+	values.push_back(hive_vk(w, "Paths", 7, &multi[0], multi.size()));
+	unsigned char stamp[8] = {static_cast<unsigned char>(vendor), static_cast<unsigned char>(product), static_cast<unsigned char>(item), 0, 0, 0, 1, 0};
+	values.push_back(hive_vk(w, "Stamp", 11, stamp, sizeof(stamp)));
+	hive_values(w, nk, values);
+}
+
+static int hive_items_per_product()
+{
+	/* about 1.3 KiB of cells per item */
+	return static_cast<int>((static_cast<size_t>(BENCH_HIVE_MIB) << 20) / 1300 / (BENCH_HIVE_FANOUT * BENCH_HIVE_FANOUT));
+}
+
+static std::string bench_make_hive()
+{
+	HiveWriter w;
+	w.used = 0;
+	char name[32];
+	int items = hive_items_per_product();
+	uint32_t root = hive_nk(w, "ROOT", 0xffffffff, 0x0c);
+	std::vector<uint32_t> vendors;
+	for (int v = 0; v < BENCH_HIVE_FANOUT; v++)
+	{
+		snprintf(name, sizeof(name), "Vendor%02d", v);
+		uint32_t vendor = hive_nk(w, name, root, 0);
+		std::vector<uint32_t> products;
+		for (int p = 0; p < BENCH_HIVE_FANOUT; p++)
+		{
+			snprintf(name, sizeof(name), "Product%02d", p);
+			uint32_t product = hive_nk(w, name, vendor, 0);
+			std::vector<uint32_t> children;
+			for (int i = 0; i < items; i++)
+			{
+				snprintf(name, sizeof(name), "Item%05d", i);
+				children.push_back(hive_nk(w, name, product, 0));
+				hive_item(w, children.back(), v, p, i);
+			}
+			hive_subkeys(w, product, children);
+			products.push_back(product);
+		}
+		hive_subkeys(w, vendor, products);
+		vendors.push_back(vendor);
+	}
+	hive_subkeys(w, root, vendors);
+	hive_end_bin(w);
+
+	unsigned char base[4096] = {0};
+	memcpy(base, "regf", 4);
+	base[4] = base[8] = 1;
+	base[20] = 1;
+	base[24] = 5;
+	base[32] = 1;
+	base[44] = 1;
+	for (int i = 0; i < 4; i++)
+	{
+		base[36 + i] = static_cast<unsigned char>(root >> (8 * i));
+		base[40 + i] = static_cast<unsigned char>(w.bins.size() >> (8 * i));
+	}
+	uint32_t checksum = 0;
+	for (int i = 0; i < 508; i += 4)
+	{
+		checksum ^= static_cast<uint32_t>(base[i]) | (base[i + 1] << 8) | (base[i + 2] << 16) | (static_cast<uint32_t>(base[i + 3]) << 24);
+	}
+	for (int i = 0; i < 4; i++) { base[508 + i] = static_cast<unsigned char>(checksum >> (8 * i)); }
+
+	char path[64];
+	snprintf(path, sizeof(path), "winlua-bench-%d.hiv", static_cast<int>(rand()));
+	FILE *f = fopen(path, "wb");
+	if (f == NULL || fwrite(base, 1, sizeof(base), f) != sizeof(base) || fwrite(&w.bins[0], 1, w.bins.size(), f) != w.bins.size() || fclose(f) != 0)
+	{
+		fprintf(stderr, "winlua-bench: could not write '%s'\n", path);
+		exit(1);
+	}
+	return path;
+}
+
+static void hive_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.dir = bench_make_hive();
+	int items = hive_items_per_product();
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "path");
+	lua_pushinteger(s.L, items);
+	lua_setglobal(s.L, "items");
+	lua_pushinteger(s.L, BENCH_HIVE_LOOKUPS);
+	lua_setglobal(s.L, "count");
+	bench_dostring(s.L, code);
+	lua_getglobal(s.L, "ops");
+	s.ops = lua_tointeger(s.L, -1);
+	lua_pop(s.L, 1);
+}
+
+static void hive_teardown(BenchState& s)
+{
+	/* the hive stays mapped until its keys are collected */
+	winlua_closestate(s.L);
+	s.L = NULL;
+	remove(s.dir.c_str());
+}
+
+static const char hive_enumerate_script[] =
+	"local root = assert(registry.load_hive(path)) "
+	"ops = 1 + 64 + 64 * 64 + 64 * 64 * items "
+	"local function visit(key) local n, bytes = 1, 0 "
+	"for name, data in key:values() do if type(data) == 'string' then bytes = bytes + #data end end "
+	"for name in key:subkeys() do n = n + visit(key:open(name)) end return n end "
+	"function bench() assert(visit(root) == ops) end";
+
+#define BENCH_HIVE_LOOKUP_SCRIPT \
+	"local root = assert(registry.load_hive(path, {index = indexed})) " \
+	"ops = count " \
+	"local paths = {} for i = 1, count do " \
+	"paths[i] = string.format('Vendor%02d\\\\Product%02d\\\\Item%05d', i * 7 % 64, i * 13 % 64, i * 31 % items) end " \
+	"function bench() for i = 1, count do " \
+	"assert(root:open(paths[i]):value('DisplayName')) end end"
+
+#define BENCH_HIVE_READ_TREE_SCRIPT \
+	"local root = assert(registry.load_hive(path)) " \
+	"ops = 1 + 64 + 64 * 64 + 64 * 64 * items " \
+	"function bench() local t = root:read_tree{parallel = parallel} " \
+	"assert(t.keys.Vendor63.keys.Product63.keys.Item00000.values.Version == 0x10000) end"
+
+static const char hive_lua_tree_script[] =
+	"local root = assert(registry.load_hive(path)) "
+	"ops = 1 + 64 + 64 * 64 + 64 * 64 * items "
+	"local function read(key) local node = {values = {}, types = {}, keys = {}} "
+	"for name, data, type in key:values() do node.values[name] = data node.types[name] = type end "
+	"for name in key:subkeys() do node.keys[name] = read(key:open(name)) end return node end "
+	"function bench() local t = read(root) "
+	"assert(t.keys.Vendor63.keys.Product63.keys.Item00000.values.Version == 0x10000) end";
+
+static const char hive_index_script[] =
+	"ops = 1 + 64 + 64 * 64 + 64 * 64 * items "
+	"function bench() local root = assert(registry.load_hive(path, {index = true})) "
+	"assert(root:open('Vendor63\\\\Product63')) end";
+
+static void hive_enumerate_setup(BenchState& s) { hive_setup(s, hive_enumerate_script); }
+static void hive_lookup_setup(BenchState& s) { hive_setup(s, "indexed = false " BENCH_HIVE_LOOKUP_SCRIPT); }
+static void hive_indexed_setup(BenchState& s) { hive_setup(s, "indexed = true " BENCH_HIVE_LOOKUP_SCRIPT); }
+static void hive_index_setup(BenchState& s) { hive_setup(s, hive_index_script); }
+static void hive_lua_tree_setup(BenchState& s) { hive_setup(s, hive_lua_tree_script); }
+static void hive_read_tree_setup(BenchState& s) { hive_setup(s, "parallel = false " BENCH_HIVE_READ_TREE_SCRIPT); }
+static void hive_read_tree_parallel_setup(BenchState& s) { hive_setup(s, "parallel = true " BENCH_HIVE_READ_TREE_SCRIPT); }
+
+/* ------------------------------------------------------------
+registry.parse_reg on a generated 64 MiB export (UTF-8, and the
+same text as UTF-16LE, twice the bytes, the way regedit writes
+it): one key per item, with the value types of the hive cases and
+wrapped hex data. The records are handed to a callback in batches,
+or built into nested tables, against a line-by-line string.match
+parser of the UTF-8 file. The tree is written back with a
+reg_writer. One op is one MiB of the file read or written, so
+ops/s reads as MB/s
+------------------------------------------------------------ */
+#define BENCH_REG_MIB 64
+
+static void reg_hex(std::string& out, const char *prefix, const unsigned char *data, size_t size)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t col = out.size() - out.rfind('\n') - 1;
+	out += prefix;
+	col += strlen(prefix);
+	for (size_t i = 0; i < size; i++)
+	{
+		out += digits[data[i] >> 4];
+		out += digits[data[i] & 15];
+		col += 2;
+		if (i + 1 < size)
+		{
+			out += ',';
+			if (++col > 76)
+			{
+				out += "\\\r\n  ";
+				col = 2;
+			}
+		}
+	}
+	out += "\r\n";
+}
+
+/* ASCII text as the registry stores it: UTF-16LE, each string terminated */
+static void reg_wide(std::vector<unsigned char>& out, const char *s)
+{
+	for (; *s != '\0'; s++)
+	{
+		out.push_back(static_cast<unsigned char>(*s));
+		out.push_back(0);
+	}
+	out.push_back(0);
+	out.push_back(0);
+}
+
+/* the export as UTF-8; 'records' counts key and value lines */
+static std::string bench_make_reg(long long *records)
+{
+	std::string out = "Windows Registry Editor Version 5.00\r\n";
+	char line[256];
+	*records = 0;
+	for (long long i = 0; out.size() < static_cast<size_t>(BENCH_REG_MIB) << 20; i++)
+	{
+		int v = static_cast<int>(i / 4096 % 64), p = static_cast<int>(i / 64 % 64);
+		snprintf(line, sizeof(line), "\r\n[HKEY_LOCAL_MACHINE\\SOFTWARE\\WinLuaBench\\Vendor%02d\\Product%02d\\Item%06lld]\r\n", v, p, i);
+		out += line;
+		snprintf(line, sizeof(line), "\"DisplayName\"=\"Item %lld of \\\"Product %d\\\"\"\r\n\"Version\"=dword:%08x\r\n", i, p, static_cast<unsigned>(i));
+		out += line;
+		snprintf(line, sizeof(line), "\"InstallLocation\"=\"C:\\\\Program Files\\\\Vendor%02d\\\\Product%02d\"\r\n", v, p);
+		out += line;
+
+		unsigned char data[96];
+		for (size_t k = 0; k < sizeof(data); k++) { data[k] = static_cast<unsigned char>(i * 31 + k * 7); }
+		reg_hex(out, "\"Data\"=hex:", data, sizeof(data));
+		std::vector<unsigned char> paths;
+		snprintf(line, sizeof(line), "C:\\Program Files\\Vendor%02d\\bin", v);
+		reg_wide(paths, line);
+		snprintf(line, sizeof(line), "C:\\Program Files\\Vendor%02d\\Product%02d\\lib", v, p);
+		reg_wide(paths, line);
+		paths.push_back(0);
+		paths.push_back(0);
+		reg_hex(out, "\"Paths\"=hex(7):", &paths[0], paths.size());
+		unsigned char stamp[8];
+		for (int k = 0; k < 8; k++) { stamp[k] = static_cast<unsigned char>((i * 1000003) >> (8 * k)); }
+		reg_hex(out, "\"Stamp\"=hex(b):", stamp, sizeof(stamp));
+		*records += 7;
+	}
+	return out;
+}
+
+static void reg_write_file(const std::string& path, const void *data, size_t size, bool bom)
+{
+	static const unsigned char mark[] = {0xff, 0xfe};
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == NULL || (bom && fwrite(mark, 1, 2, f) != 2) || fwrite(data, 1, size, f) != size || fclose(f) != 0)
+	{
+		fprintf(stderr, "winlua-bench: could not write '%s'\n", path.c_str());
+		exit(1);
+	}
+}
+
+static void reg_setup(BenchState& s, bool utf16, const char *code)
+{
+	s.L = bench_newstate(false);
+	char name[64];
+	snprintf(name, sizeof(name), "winlua-bench-%d.reg", static_cast<int>(rand()));
+	s.dir = name;
+
+	long long records;
+	std::string text = bench_make_reg(&records);
+	size_t size = text.size();
+	if (utf16)
+	{
+		std::vector<uint16_t> wide(text.size());
+		size_t units = winlua_utf8_to_utf16(text.data(), text.size(), &wide[0]);
+		size = 2 * units + 2;
+		reg_write_file(s.dir, &wide[0], 2 * units, true);
+	}
+	else
+	{
+		reg_write_file(s.dir, text.data(), text.size(), false);
+	}
+	s.ops = static_cast<long long>(size >> 20);
+
+	lua_pushstring(s.L, s.dir.c_str());
+	lua_setglobal(s.L, "path");
+	lua_pushinteger(s.L, records);
+	lua_setglobal(s.L, "records");
+	bench_dostring(s.L, code);
+}
+
+static void reg_teardown(BenchState& s)
+{
+	winlua_closestate(s.L);
+	s.L = NULL;
+	remove(s.dir.c_str());
+	remove((s.dir + ".out").c_str());
+}
+
+static const char reg_batches_script[] =
+	"function bench() local n = 0 "
+	"assert(registry.parse_reg(path, function(b) n = n + b.n end) == records) "
+	"assert(n == records) end";
+
+static const char reg_tree_script[] =
+	"function bench() local t = assert(registry.parse_reg(path)) "
+	"assert(t.keys.HKEY_LOCAL_MACHINE.keys.SOFTWARE.keys.WinLuaBench.keys.Vendor00.keys.Product00.keys.Item000000.values.Version == 0) end";
+
+static const char reg_write_script[] =
+	"local t = assert(registry.parse_reg(path)) "
+	"function bench() local w = assert(registry.reg_writer(path .. '.out')) w:tree(t) assert(w:close()) end";
+
+/* the parser these replace: string.match over io.lines */
+static const char reg_lua_script[] =
+	"local function byte(h) return string.char(tonumber(h, 16)) end "
+	"local function parse(path, fn) "
+	"local key, pending, n = nil, nil, 0 "
+	"for line in io.lines(path) do line = line:gsub('\\r$', '') "
+	"if pending then line = pending .. line:match('^%s*(.*)$') pending = nil end "
+	"if line:sub(-1) == '\\\\' then pending = line:sub(1, -2) "
+	"else local k = line:match('^%[(.*)%]$') "
+	"if k then key = k n = n + 1 fn(key) "
+	"else local name, data = line:match('^\"(.-[^\\\\])\"=(.*)$') "
+	"if not name then name, data = '', line:match('^@=(.*)$') end "
+	"if data then local value, vtype "
+	"local str = data:match('^\"(.*)\"$') "
+	"if str then value, vtype = str:gsub('\\\\(.)', '%1'), 'REG_SZ' "
+	"elseif data:match('^dword:') then value, vtype = tonumber(data:sub(7), 16), 'REG_DWORD' "
+	"else local t, hex = data:match('^hex%(?(%x*)%)?:(.*)$') "
+	"value, vtype = hex:gsub('(%x%x),?', byte), t end "
+	"n = n + 1 fn(key, name, value, vtype) end end end end "
+	"return n end "
+	"function bench() local n = 0 "
+	"assert(parse(path, function() n = n + 1 end) == records) "
+	"assert(n == records) end";
+
+static void reg_batches_setup(BenchState& s) { reg_setup(s, false, reg_batches_script); }
+static void reg_batches_utf16_setup(BenchState& s) { reg_setup(s, true, reg_batches_script); }
+static void reg_tree_setup(BenchState& s) { reg_setup(s, false, reg_tree_script); }
+static void reg_write_setup(BenchState& s) { reg_setup(s, true, reg_write_script); }
+static void reg_lua_setup(BenchState& s) { reg_setup(s, false, reg_lua_script); }
+
+/* ------------------------------------------------------------
+ltable.c -- insertion and lookup through the C API
+------------------------------------------------------------ */
+#define BENCH_TABLE_SIZE 100000
+
+static void table_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_TABLE_SIZE;
+}
+
+static void table_insert_array_run(BenchState& s)
+{
+	lua_newtable(s.L);
+	for (lua_Integer i = 1; i <= BENCH_TABLE_SIZE; i++)
+	{
+		lua_pushinteger(s.L, i);
+		lua_rawseti(s.L, -2, i);
+	}
+	lua_pop(s.L, 1);
+}
+
+static void table_insert_hash_run(BenchState& s)
+{
+	lua_newtable(s.L);
+	for (lua_Integer i = 1; i <= BENCH_TABLE_SIZE; i++)
+	{
+		lua_pushinteger(s.L, i);
+		lua_rawseti(s.L, -2, i * 7919);
+	}
+	lua_pop(s.L, 1);
+}
+
+static void table_lookup_setup(BenchState& s)
+{
+	table_setup(s);
+	lua_newtable(s.L);
+	for (lua_Integer i = 1; i <= BENCH_TABLE_SIZE; i++)
+	{
+		lua_pushinteger(s.L, i);
+		lua_rawseti(s.L, -2, i * 7919);
+	}
+	lua_setfield(s.L, LUA_REGISTRYINDEX, "bench.table");
+}
+
+static void table_lookup_hash_run(BenchState& s)
+{
+	lua_getfield(s.L, LUA_REGISTRYINDEX, "bench.table");
+	for (lua_Integer i = 1; i <= BENCH_TABLE_SIZE; i++)
+	{
+		lua_rawgeti(s.L, -1, i * 7919);
+		lua_pop(s.L, 1);
+	}
+	lua_pop(s.L, 1);
+}
+
+/* ------------------------------------------------------------
+lstring.c -- interning
+------------------------------------------------------------ */
+#define BENCH_STRINGS 100000
+
+static void string_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = BENCH_STRINGS;
+}
+
+/* every string is new: hash, miss and insert */
+static void string_intern_new_run(BenchState& s)
+{
+	static unsigned counter = 0;
+	char buff[32];
+	for (int i = 0; i < BENCH_STRINGS; i++)
+	{
+		int len = snprintf(buff, sizeof(buff), "key_%u", counter++);
+		lua_pushlstring(s.L, buff, len);
+		lua_pop(s.L, 1);
+	}
+	lua_gc(s.L, LUA_GCCOLLECT, 0);
+}
+
+/* a small working set of strings that stay interned */
+static void string_intern_hit_setup(BenchState& s)
+{
+	string_setup(s);
+	lua_newtable(s.L);
+	for (int i = 0; i < 1000; i++)
+	{
+		lua_pushfstring(s.L, "key_%d", i);
+		lua_rawseti(s.L, -2, i + 1);
+	}
+	lua_setfield(s.L, LUA_REGISTRYINDEX, "bench.strings");
+}
+
+static void string_intern_hit_run(BenchState& s)
+{
+	char buff[32];
+	for (int i = 0; i < BENCH_STRINGS; i++)
+	{
+		int len = snprintf(buff, sizeof(buff), "key_%d", i % 1000);
+		lua_pushlstring(s.L, buff, len);
+		lua_pop(s.L, 1);
+	}
+}
+
+/* ------------------------------------------------------------
+table.sort
+------------------------------------------------------------ */
+
+static void sort_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = 100000;
+	bench_dostring(s.L,
+		"math.randomseed(42) "
+		"local input = {} for i = 1, 100000 do input[i] = math.random(1, 1000000) end "
+		"function bench() local t = table.move(input, 1, #input, 1, {}) table.sort(t) end");
+}
+
+/* ------------------------------------------------------------
+Compiling chunks: luaL_loadfile (source) vs. loading bytecode
+------------------------------------------------------------ */
+#define BENCH_CHUNK_FUNCTIONS 2000
+
+struct BenchChunk
+{
+	std::string path;
+	std::string bytecode;
+};
+
+static int chunk_writer(lua_State *, const void *p, size_t sz, void *ud)
+{
+	static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+	return 0;
+}
+
+static void compile_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = 1;
+
+	BenchChunk *chunk = new BenchChunk;
+	chunk->path = "winlua-bench-chunk.lua";
+	FILE *f = fopen(chunk->path.c_str(), "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "winlua-bench: could not create '%s'\n", chunk->path.c_str());
+		exit(1);
+	}
+	fprintf(f, "local M = {}\n");
+	for (int i = 0; i < BENCH_CHUNK_FUNCTIONS; i++)
+	{
+		fprintf(f,
+			"function M.f%d(t, n)\n"
+			"  local sum = 0\n"
+			"  for i = 1, n do if t[i] and t[i] > %d then sum = sum + t[i] * 2 else sum = sum - 1 end end\n"
+			"  return { name = 'f%d', value = sum, text = string.format('%%d:%%s', sum, 'x') }\n"
+			"end\n", i, i, i);
+	}
+	fprintf(f, "return M\n");
+	fclose(f);
+
+	if (luaL_loadfile(s.L, chunk->path.c_str()) != LUA_OK)
+	{
+		fprintf(stderr, "winlua-bench: %s\n", lua_tostring(s.L, -1));
+		exit(1);
+	}
+	lua_dump(s.L, chunk_writer, &chunk->bytecode, 0);
+	lua_pop(s.L, 1);
+	s.data = chunk;
+}
+
+static void compile_teardown(BenchState& s)
+{
+	BenchChunk *chunk = static_cast<BenchChunk*>(s.data);
+	remove(chunk->path.c_str());
+	delete chunk;
+}
+
+static void compile_source_run(BenchState& s)
+{
+	BenchChunk *chunk = static_cast<BenchChunk*>(s.data);
+	luaL_loadfile(s.L, chunk->path.c_str());
+	lua_pop(s.L, 1);
+}
+
+static void compile_bytecode_run(BenchState& s)
+{
+	BenchChunk *chunk = static_cast<BenchChunk*>(s.data);
+	luaL_loadbufferx(s.L, chunk->bytecode.data(), chunk->bytecode.size(), "=bench", "b");
+	lua_pop(s.L, 1);
+}
+
+/* ------------------------------------------------------------
+Chunk cache: winlua_loadfile on the chunk above, cold (the cache
+is emptied before each run, so the chunk is compiled, dumped and
+stored) vs. warm (loaded from the cache file), against
+luaL_loadfile in compile/source
+------------------------------------------------------------ */
+#define BENCH_CACHE_DIR "winlua-bench-cache"
+
+static void cache_setup(BenchState& s)
+{
+#ifdef _WIN32
+	SetEnvironmentVariableA("WINLUA_CACHEDIR", BENCH_CACHE_DIR);
+	SetEnvironmentVariableA("WINLUA_NOCACHE", NULL);
+#else
+	setenv("WINLUA_CACHEDIR", BENCH_CACHE_DIR, 1);
+	unsetenv("WINLUA_NOCACHE");
+#endif
+	compile_setup(s);
+	lua_pushstring(s.L, BENCH_CACHE_DIR);
+	lua_setglobal(s.L, "cache");
+	bench_dostring(s.L,
+		"fs.mkdir(cache) "
+		"function empty() for name in fs.dir(cache) do "
+		"if name:match('%.luac$') then assert(os.remove(cache .. '/' .. name)) end end end");
+}
+
+static void cache_load_run(BenchState& s)
+{
+	BenchChunk *chunk = static_cast<BenchChunk*>(s.data);
+	if (winlua_loadfile(s.L, chunk->path.c_str()) != LUA_OK)
+	{
+		fprintf(stderr, "winlua-bench: %s\n", lua_tostring(s.L, -1));
+		exit(1);
+	}
+	lua_pop(s.L, 1);
+}
+
+static void cache_warm_setup(BenchState& s)
+{
+	cache_setup(s);
+	cache_load_run(s); /* fills the cache */
+}
+
+static void cache_empty(BenchState& s)
+{
+	bench_call(s.L, "empty");
+}
+
+static void cache_teardown(BenchState& s)
+{
+	cache_empty(s);
+	compile_teardown(s);
+	bench_remove_tree(BENCH_CACHE_DIR, 0);
+}
+
+/* ------------------------------------------------------------
+Allocator: GC-heavy script with realloc vs. the pool allocator
+------------------------------------------------------------ */
+static const char alloc_script[] =
+	"function bench() "
+	"  local keep = {} "
+	"  for i = 1, 200000 do "
+	"    local t = { i, tostring(i), { x = i, y = i * 2 } } "
+	"    if i % 16 == 0 then keep[#keep + 1] = t end "
+	"  end "
+	"end";
+
+static void alloc_realloc_setup(BenchState& s)
+{
+	s.L = bench_newstate(false);
+	s.ops = 200000;
+	bench_dostring(s.L, alloc_script);
+}
+
+static void alloc_pool_setup(BenchState& s)
+{
+	s.L = bench_newstate(true);
+	s.ops = 200000;
+	bench_dostring(s.L, alloc_script);
+}
+
+/* ------------------------------------------------------------
+Serializer vs. string.format + load
+------------------------------------------------------------ */
+static const char serialize_data[] =
+	"rows = {} "
+	"for i = 1, 20000 do rows[i] = { name = 'file' .. i, size = i * 10, dir = (i % 7 == 0), tags = { 'a', 'b' } } end "
+	"encoded = serialize.encode(rows) "
+	"local function dump(v, out) "
+	"  local t = type(v) "
+	"  if t == 'table' then "
+	"    out[#out + 1] = '{' "
+	"    for k, x in pairs(v) do "
+	"      out[#out + 1] = '[' dump(k, out) out[#out + 1] = ']=' dump(x, out) out[#out + 1] = ',' "
+	"    end "
+	"    out[#out + 1] = '}' "
+	"  elseif t == 'string' then out[#out + 1] = string.format('%q', v) "
+	"  else out[#out + 1] = tostring(v) end "
+	"end "
+	"function tosource(v) local out = { 'return ' } dump(v, out) return table.concat(out) end "
+	"source = tosource(rows) ";
+
+static void serialize_setup(BenchState& s, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = 20000;
+	bench_dostring(s.L, serialize_data);
+	bench_dostring(s.L, code);
+}
+
+static void serialize_encode_setup(BenchState& s)
+{
+	serialize_setup(s, "function bench() serialize.encode(rows) end");
+}
+
+static void serialize_decode_setup(BenchState& s)
+{
+	serialize_setup(s, "function bench() serialize.decode(encoded) end");
+}
+
+static void serialize_format_setup(BenchState& s)
+{
+	serialize_setup(s, "function bench() tosource(rows) end");
+}
+
+static void serialize_load_setup(BenchState& s)
+{
+	serialize_setup(s, "function bench() load(source)() end");
+}
+
+/* ------------------------------------------------------------
+Channels: 'workers' workers (0 for threads.cpucount) streaming
+numbers or small tables to the main state, and a ping-pong round
+trip. One op is one message (one round trip for ping-pong), so
+ops/s is messages per second
+------------------------------------------------------------ */
+static const char channel_script[] =
+	"local req, rep = threads.channel(), threads.channel() "
+	"local n = workers > 0 and workers or threads.cpucount "
+	"pool = threads.start(n, function(id, req, rep, payload) "
+	"  while true do "
+	"    local n = req:receive() "
+	"    if n == 0 then return end "
+	"    if n < 0 then rep:send(n) "
+	"    elseif payload then for i = 1, n do rep:send({ i, 'file' .. i, true }) end "
+	"    else for i = 1, n do rep:send(i) end end "
+	"  end "
+	"end, req, rep, payload) "
+	"function stream() "
+	"  req:send(count // n + count % n) for w = 2, n do req:send(count // n) end "
+	"  for i = 1, count do rep:receive() end "
+	"end "
+	"function pingpong() for i = 1, count do req:send(-i) assert(rep:receive() == -i) end end "
+	"function stop() for w = 1, n do req:send(0) end assert(pool:join()) end ";
+
+static void channel_setup(BenchState& s, int workers, int count, bool tables, const char *code)
+{
+	s.L = bench_newstate(false);
+	s.ops = count;
+	lua_pushinteger(s.L, count);
+	lua_setglobal(s.L, "count");
+	lua_pushinteger(s.L, workers);
+	lua_setglobal(s.L, "workers");
+	lua_pushboolean(s.L, tables);
+	lua_setglobal(s.L, "payload");
+	bench_dostring(s.L, channel_script);
+	bench_dostring(s.L, code);
+}
+
+static void channel_stream_setup(BenchState& s)
+{
+	channel_setup(s, 1, 100000, false, "bench = stream");
+}
+
+static void channel_tables_setup(BenchState& s)
+{
+	channel_setup(s, 1, 100000, true, "bench = stream");
+}
+
+static void channel_pingpong_setup(BenchState& s)
+{
+	channel_setup(s, 1, 20000, false, "bench = pingpong");
+}
+
+static void channel_stream2_setup(BenchState& s)
+{
+	channel_setup(s, 2, 100000, false, "bench = stream");
+}
+
+static void channel_stream4_setup(BenchState& s)
+{
+	channel_setup(s, 4, 100000, false, "bench = stream");
+}
+
+static void channel_streamcpu_setup(BenchState& s)
+{
+	channel_setup(s, 0, 100000, false, "bench = stream");
+}
+
+static void channel_teardown(BenchState& s)
+{
+	bench_call(s.L, "stop");
+}
+
+/* ------------------------------------------------------------
+Profiler overhead: the same call-heavy script without and with
+profiler.start() sampling at 1 kHz. One op is one call of 'work'
+------------------------------------------------------------ */
+static const char profiler_script[] =
+	"local function work(i) "
+	"  local t = { i, i * 2, tostring(i) } "
+	"  return #t[3] + t[2] % 7 "
+	"end "
+	"function bench() local sum = 0 for i = 1, count do sum = sum + work(i) end return sum end ";
+
+static void profiler_setup(BenchState& s, bool sampling)
+{
+	s.L = bench_newstate(false);
+	s.ops = 200000;
+	lua_pushinteger(s.L, s.ops);
+	lua_setglobal(s.L, "count");
+	bench_dostring(s.L, profiler_script);
+	if (sampling)
+	{
+		bench_dostring(s.L, "profiler.start(1)");
+	}
+}
+
+static void profiler_off_setup(BenchState& s) { profiler_setup(s, false); }
+static void profiler_on_setup(BenchState& s) { profiler_setup(s, true); }
+
+static void profiler_teardown(BenchState& s)
+{
+	bench_dostring(s.L, "pcall(profiler.stop)");
+}
+
+/* ------------------------------------------------------------
+Case table
+------------------------------------------------------------ */
+
+const BenchCase bench_cases[] = {
+	{"utf8_to_wstring/path", utf8_setup, utf8_to_wstring_run, NULL, NULL},
+	{"wstring_to_utf8/path", wstring_to_utf8_setup, wstring_to_utf8_run, NULL, NULL},
+	{"path/userdata-1M", path_userdata_setup, path_run, NULL, NULL},
+	{"path/scratch-1M", path_scratch_setup, path_run, NULL, NULL},
+	{"utf8->utf16/ascii-1MiB", ascii_text_setup, utf8_to_utf16_run, text_teardown, NULL},
+	{"utf8->utf16/cjk-1MiB", cjk_text_setup, utf8_to_utf16_run, text_teardown, NULL},
+	{"utf16->utf8/ascii-1MiB", ascii_text_setup, utf16_to_utf8_run, text_teardown, NULL},
+	{"utf16->utf8/cjk-1MiB", cjk_text_setup, utf16_to_utf8_run, text_teardown, NULL},
+	{"print/3-args", print_setup, print_run, NULL, NULL},
+	{"print/1M-lines", print_lines_setup, print_run, NULL, NULL},
+	{"fs.dir/1000", fs_dir_setup, run_bench, fs_teardown, NULL},
+	{"fs.find/1000", fs_find_setup, run_bench, fs_teardown, NULL},
+	{"fs.attributes/1000", fs_attributes_setup, run_bench, fs_teardown, NULL},
+	{"fs.dir+attributes/1000", fs_dir_attributes_setup, run_bench, fs_teardown, NULL},
+	{"fs.dir-record/1000", fs_dir_record_setup, run_bench, fs_teardown, NULL},
+	{"fs.dir-fields/1000", fs_dir_fields_setup, run_bench, fs_teardown, NULL},
+	{"fs.dir-mode/1000", fs_dir_mode_setup, run_bench, fs_teardown, NULL},
+	{"fs.attributes_many/10k-warm", many_batch_setup, run_bench, many_teardown, NULL},
+	{"fs.attributes-loop/10k-warm", many_loop_setup, run_bench, many_teardown, NULL},
+	{"fs.attributes_many/10k-cold", many_batch_setup, run_bench, many_teardown, many_cold},
+	{"fs.attributes-loop/10k-cold", many_loop_setup, run_bench, many_teardown, many_cold},
+	{"fs.walk/12k-tree", walk_parallel_setup, run_bench, walk_teardown, NULL},
+	{"fs.walk/12k-tree-1-thread", walk_single_setup, run_bench, walk_teardown, NULL},
+	{"fs.dir-recursive/12k-tree", walk_lua_setup, run_bench, walk_teardown, NULL},
+	{"async.read/256-files", async_read_setup, run_bench, read_teardown, NULL},
+	{"io.read/256-files", io_read_setup, run_bench, read_teardown, NULL},
+	{"fs.mmap/scan", mmap_scan_setup, run_bench, scan_teardown, NULL},
+	{"io.read/scan", io_read_scan_setup, run_bench, scan_teardown, NULL},
+	{"hash/crc32c-64MiB", hash_crc32c_setup, run_bench, NULL, NULL},
+	{"hash/xxh3-64MiB", hash_xxh3_setup, run_bench, NULL, NULL},
+	{"hash/sha256-64MiB", hash_sha256_setup, run_bench, NULL, NULL},
+	{"fs.hash/xxh3-256MiB-file", hash_file_setup, run_bench, scan_teardown, NULL},
+	{"fs.hash_many/10k-files", hash_many_setup, run_bench, many_teardown, NULL},
+	{"fs.hash-loop/10k-files", hash_loop_setup, run_bench, many_teardown, NULL},
+	{"fs.watch/100k-events", watch_large_setup, watch_run, watch_teardown, watch_settle},
+	{"fs.watch/100k-events-16k-ring", watch_small_setup, watch_run, watch_teardown, watch_settle},
+	{"fs.copy_tree/12k-small-files", copy_small_tree_setup, run_bench, copy_small_teardown, copy_small_clean},
+	{"io-copy/12k-small-files", copy_small_lua_setup, run_bench, copy_small_teardown, copy_small_clean},
+	{"fs.copy_tree/4x64MiB", copy_big_tree_setup, run_bench, copy_big_teardown, copy_big_clean},
+	{"io-copy/4x64MiB", copy_big_lua_setup, run_bench, copy_big_teardown, copy_big_clean},
+	{"fs.glob/**-suffix", glob_suffix_setup, run_bench, glob_teardown, NULL},
+	{"lua-glob/**-suffix", glob_suffix_lua_setup, run_bench, glob_teardown, NULL},
+	{"fs.glob/literal-prefix", glob_prefix_setup, run_bench, glob_teardown, NULL},
+	{"lua-glob/literal-prefix", glob_prefix_lua_setup, run_bench, glob_teardown, NULL},
+	{"fs.snapshot/100k-files", snapshot_full_setup, run_bench, snapshot_teardown, NULL},
+	{"fs.diff/100k-unchanged", snapshot_diff_setup, run_bench, snapshot_teardown, NULL},
+	{"fs.diff/100k-unchanged-trust", snapshot_trust_setup, run_bench, snapshot_teardown, NULL},
+	{"lua-rescan/100k-unchanged", snapshot_lua_setup, run_bench, snapshot_teardown, NULL},
+	{"io.popen/1000-commands", spawn_popen_setup, run_bench, NULL, NULL},
+	{"os.spawn/1000-commands", spawn_loop_setup, run_bench, NULL, NULL},
+	{"os.run_all/1000-commands", spawn_pool_setup, run_bench, NULL, NULL},
+	{"os.getenv/10k-lookups", env_getenv_setup, run_bench, NULL, NULL},
+	{"os.environ/10k-lookups", env_environ_setup, run_bench, NULL, NULL},
+	{"registry.load_hive/enumerate-200MB", hive_enumerate_setup, run_bench, hive_teardown, NULL},
+	{"registry.load_hive/index-200MB", hive_index_setup, run_bench, hive_teardown, NULL},
+	{"key:read_tree/200MB-hive", hive_read_tree_setup, run_bench, hive_teardown, NULL},
+	{"key:read_tree/200MB-hive-parallel", hive_read_tree_parallel_setup, run_bench, hive_teardown, NULL},
+	{"lua-tree/200MB-hive", hive_lua_tree_setup, run_bench, hive_teardown, NULL},
+	{"hive:open/10k-paths", hive_lookup_setup, run_bench, hive_teardown, NULL},
+	{"hive:open/10k-paths-indexed", hive_indexed_setup, run_bench, hive_teardown, NULL},
+	{"registry.parse_reg/64MB-utf8", reg_batches_setup, run_bench, reg_teardown, NULL},
+	{"registry.parse_reg/64MB-utf16", reg_batches_utf16_setup, run_bench, reg_teardown, NULL},
+	{"registry.parse_reg/64MB-utf8-tree", reg_tree_setup, run_bench, reg_teardown, NULL},
+	{"lua-reg-parse/64MB-utf8", reg_lua_setup, run_bench, reg_teardown, NULL},
+	{"reg_writer:tree/64MB-utf16", reg_write_setup, run_bench, reg_teardown, NULL},
+	{"ltable/insert-array", table_setup, table_insert_array_run, NULL, NULL},
+	{"ltable/insert-hash", table_setup, table_insert_hash_run, NULL, NULL},
+	{"ltable/lookup-hash", table_lookup_setup, table_lookup_hash_run, NULL, NULL},
+	{"lstring/intern-new", string_setup, string_intern_new_run, NULL, NULL},
+	{"lstring/intern-hit", string_intern_hit_setup, string_intern_hit_run, NULL, NULL},
+	{"table.sort/100k", sort_setup, run_bench, NULL, NULL},
+	{"compile/source", compile_setup, compile_source_run, compile_teardown, NULL},
+	{"compile/bytecode", compile_setup, compile_bytecode_run, compile_teardown, NULL},
+	{"winlua_loadfile/cold-cache", cache_setup, cache_load_run, cache_teardown, cache_empty},
+	{"winlua_loadfile/warm-cache", cache_warm_setup, cache_load_run, cache_teardown, NULL},
+	{"alloc/realloc-gc", alloc_realloc_setup, run_bench, NULL, NULL},
+	{"alloc/pool-gc", alloc_pool_setup, run_bench, NULL, NULL},
+	{"serialize/encode", serialize_encode_setup, run_bench, NULL, NULL},
+	{"serialize/decode", serialize_decode_setup, run_bench, NULL, NULL},
+	{"serialize/format-baseline", serialize_format_setup, run_bench, NULL, NULL},
+	{"serialize/load-baseline", serialize_load_setup, run_bench, NULL, NULL},
+	{"threads/channel-stream", channel_stream_setup, run_bench, channel_teardown, NULL},
+	{"threads/channel-stream-2w", channel_stream2_setup, run_bench, channel_teardown, NULL},
+	{"threads/channel-stream-4w", channel_stream4_setup, run_bench, channel_teardown, NULL},
+	{"threads/channel-stream-cpuw", channel_streamcpu_setup, run_bench, channel_teardown, NULL},
+	{"threads/channel-tables", channel_tables_setup, run_bench, channel_teardown, NULL},
+	{"threads/channel-pingpong", channel_pingpong_setup, run_bench, channel_teardown, NULL},
+	{"profiler/off", profiler_off_setup, run_bench, profiler_teardown, NULL},
+	{"profiler/1kHz", profiler_on_setup, run_bench, profiler_teardown, NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
@@ -0,0 +1,397 @@
+#include "bench.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+/* ------------------------------------------------------------
+WinLua Self-checks
+
+Correctness checks that need the same build as the benchmarks,
+run with 'winlua-bench --check'. Each prints what went wrong and
+returns false on failure.
+------------------------------------------------------------ */
+
+/* xorshift64*, so every run checks the same inputs */
+struct CheckRandom
+{
+	unsigned long long state;
+
+	explicit CheckRandom(unsigned long long seed) : state(seed) {}
+
+	unsigned next(unsigned n)
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return static_cast<unsigned>((state * 2685821657736338717ULL) >> 33) % n;
+	}
+};
+
+/* ------------------------------------------------------------
+Transcoder: 40k random valid, corrupted and truncated inputs
+against a table-driven reference decoder (and the Win32
+converters on Windows), at every alignment of a vector block
+------------------------------------------------------------ */
+#define CHECK_UTF_INPUTS 40000
+#define CHECK_UTF_REPLACEMENT 0xFFFD
+
+/* valid second-byte range per lead byte (Unicode table 3-7); later bytes are 80..BF */
+static bool ref_lead(unsigned char c, int& need, unsigned char& lo, unsigned char& hi)
+{
+	lo = 0x80; hi = 0xBF;
+	if (c >= 0xC2 && c <= 0xDF) { need = 1; }
+	else if (c == 0xE0) { need = 2; lo = 0xA0; }
+	else if (c == 0xED) { need = 2; hi = 0x9F; }
+	else if (c >= 0xE1 && c <= 0xEF) { need = 2; }
+	else if (c == 0xF0) { need = 3; lo = 0x90; }
+	else if (c == 0xF4) { need = 3; hi = 0x8F; }
+	else if (c >= 0xF1 && c <= 0xF3) { need = 3; }
+	else { return false; }
+	return true;
+}
+
+static void ref_utf8_to_utf16(const std::string& in, std::vector<uint16_t>& out)
+{
+	out.clear();
+	size_t i = 0;
+	while (i < in.size())
+	{
+		unsigned char c = static_cast<unsigned char>(in[i]);
+		int need;
+		unsigned char lo, hi;
+		if (c < 0x80) { out.push_back(c); i++; continue; }
+		if (!ref_lead(c, need, lo, hi)) { out.push_back(CHECK_UTF_REPLACEMENT); i++; continue; }
+
+		/* a maximal subpart of a broken sequence is replaced as a whole */
+		int got = 0;
+		while (got < need && i + 1 + got < in.size())
+		{
+			unsigned char cc = static_cast<unsigned char>(in[i + 1 + got]);
+			if (got == 0 ? (cc < lo || cc > hi) : (cc < 0x80 || cc > 0xBF)) { break; }
+			got++;
+		}
+		if (got < need)
+		{
+			out.push_back(CHECK_UTF_REPLACEMENT);
+			i += 1 + got;
+			continue;
+		}
+
+		unsigned cp = c & (0x7F >> (need + 1));
+		for (int k = 1; k <= need; k++)
+		{
+			cp = (cp << 6) | (static_cast<unsigned char>(in[i + k]) & 0x3F);
+		}
+		i += 1 + need;
+		if (cp >= 0x10000)
+		{
+			out.push_back(static_cast<uint16_t>(0xD800 + ((cp - 0x10000) >> 10)));
+			out.push_back(static_cast<uint16_t>(0xDC00 + ((cp - 0x10000) & 0x3FF)));
+		}
+		else
+		{
+			out.push_back(static_cast<uint16_t>(cp));
+		}
+	}
+}
+
+static void ref_append_utf8(std::string& out, unsigned cp)
+{
+	if (cp < 0x80) { out += static_cast<char>(cp); }
+	else if (cp < 0x800)
+	{
+		out += static_cast<char>(0xC0 | (cp >> 6));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	else if (cp < 0x10000)
+	{
+		out += static_cast<char>(0xE0 | (cp >> 12));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	else
+	{
+		out += static_cast<char>(0xF0 | (cp >> 18));
+		out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+}
+
+static void ref_utf16_to_utf8(const std::vector<uint16_t>& in, std::string& out)
+{
+	out.clear();
+	for (size_t i = 0; i < in.size(); i++)
+	{
+		unsigned c = in[i];
+		if (c >= 0xD800 && c <= 0xDBFF && i + 1 < in.size() && in[i + 1] >= 0xDC00 && in[i + 1] <= 0xDFFF)
+		{
+			ref_append_utf8(out, 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00));
+		}
+		else
+		{
+			ref_append_utf8(out, (c >= 0xD800 && c <= 0xDFFF) ? CHECK_UTF_REPLACEMENT : c);
+		}
+	}
+}
+
+/* mostly ASCII runs of every length around the vector widths, mixed with 2-, 3- and 4-byte characters */
+static void random_utf8(CheckRandom& rng, std::string& s)
+{
+	s.clear();
+	size_t target = rng.next(300);
+	while (s.size() < target)
+	{
+		switch (rng.next(5))
+		{
+		case 0:
+		case 1:
+			for (unsigned n = rng.next(70); n > 0; n--) { s += static_cast<char>(0x20 + rng.next(0x5F)); }
+			break;
+		case 2:
+			ref_append_utf8(s, 0x80 + rng.next(0x800 - 0x80));
+			break;
+		case 3:
+		{
+			unsigned cp = 0x800 + rng.next(0x10000 - 0x800);
+			ref_append_utf8(s, (cp >= 0xD800 && cp <= 0xDFFF) ? 0x4E2D : cp);
+			break;
+		}
+		default:
+			ref_append_utf8(s, 0x10000 + rng.next(0x110000 - 0x10000));
+			break;
+		}
+	}
+}
+
+static void corrupt_utf8(CheckRandom& rng, std::string& s)
+{
+	static const unsigned char special[] = { 0x80, 0xBF, 0xC0, 0xC1, 0xC2, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xFF, 0xA0, 0x9F, 0x8F, 0x90 };
+	for (unsigned n = 1 + rng.next(4); n > 0 && !s.empty(); n--)
+	{
+		size_t at = rng.next(static_cast<unsigned>(s.size()));
+		switch (rng.next(4))
+		{
+		case 0: s[at] = static_cast<char>(rng.next(256)); break;
+		case 1: s.insert(at, 1, static_cast<char>(special[rng.next(sizeof(special))])); break;
+		case 2: s.erase(at, 1); break;
+		default: s.resize(at); break; /* truncated in the middle of a sequence */
+		}
+	}
+}
+
+static void corrupt_utf16(CheckRandom& rng, std::vector<uint16_t>& w)
+{
+	for (unsigned n = 1 + rng.next(3); n > 0 && !w.empty(); n--)
+	{
+		size_t at = rng.next(static_cast<unsigned>(w.size()));
+		switch (rng.next(3))
+		{
+		case 0: w[at] = static_cast<uint16_t>(0xD800 + rng.next(0x800)); break; /* lone or swapped surrogate */
+		case 1: w[at] = static_cast<uint16_t>(rng.next(0x10000)); break;
+		default: w.resize(at); break;
+		}
+	}
+}
+
+static bool utf_report(int input, const char *what, size_t offset)
+{
+	fprintf(stderr, "utf: input %d (offset %u): %s differs from the reference\n", input, static_cast<unsigned>(offset), what);
+	return false;
+}
+
+static bool check_utf()
+{
+	CheckRandom rng(0x57696E4C7561ULL);
+	std::string in, ref8, buff8;
+	std::vector<uint16_t> in16, ref16, buff16;
+
+	for (int n = 0; n < CHECK_UTF_INPUTS; n++)
+	{
+		random_utf8(rng, in);
+		bool valid = (n % 4 == 0);
+		if (!valid) { corrupt_utf8(rng, in); }
+		size_t offset = static_cast<size_t>(n % 32);
+
+		/* UTF-8 -> UTF-16 at an arbitrary alignment */
+		buff8.assign(offset, 'x');
+		buff8 += in;
+		buff16.assign(in.size() + 1, 0);
+		size_t units = winlua_utf8_to_utf16(buff8.data() + offset, in.size(), &buff16[0]);
+		ref_utf8_to_utf16(in, ref16);
+		if (units != ref16.size() || (units > 0 && memcmp(&buff16[0], &ref16[0], units * sizeof(uint16_t)) != 0))
+		{
+			return utf_report(n, "utf8->utf16", offset);
+		}
+#ifdef _WIN32
+		int wlen = MultiByteToWideChar(CP_UTF8, 0, in.data(), static_cast<int>(in.size()), NULL, 0);
+		std::vector<wchar_t> win(wlen + 1);
+		MultiByteToWideChar(CP_UTF8, 0, in.data(), static_cast<int>(in.size()), &win[0], wlen);
+		if (static_cast<size_t>(wlen) != units || (units > 0 && memcmp(&win[0], &buff16[0], units * sizeof(uint16_t)) != 0))
+		{
+			return utf_report(n, "utf8->utf16 (MultiByteToWideChar)", offset);
+		}
+#endif
+
+		/* UTF-16 -> UTF-8, from the converted text and from a corrupted copy */
+		in16.assign(buff16.begin(), buff16.begin() + units);
+		if (n % 3 == 0) { corrupt_utf16(rng, in16); }
+		buff16.assign(offset, 0x41);
+		buff16.insert(buff16.end(), in16.begin(), in16.end());
+		buff8.assign(in16.size() * 3 + 1, 0);
+		size_t bytes = winlua_utf16_to_utf8(buff16.data() + offset, in16.size(), &buff8[0]);
+		ref_utf16_to_utf8(in16, ref8);
+		if (bytes != ref8.size() || ref8.compare(0, bytes, buff8, 0, bytes) != 0)
+		{
+			return utf_report(n, "utf16->utf8", offset);
+		}
+#ifdef _WIN32
+		int mlen = WideCharToMultiByte(CP_UTF8, 0, reinterpret_cast<const wchar_t*>(in16.data()), static_cast<int>(in16.size()), NULL, 0, NULL, NULL);
+		std::string win8(mlen, '\0');
+		WideCharToMultiByte(CP_UTF8, 0, reinterpret_cast<const wchar_t*>(in16.data()), static_cast<int>(in16.size()), &win8[0], mlen, NULL, NULL);
+		if (win8 != ref8)
+		{
+			return utf_report(n, "utf16->utf8 (WideCharToMultiByte)", offset);
+		}
+#endif
+
+		/* valid text survives the round trip unchanged */
+		if (valid && n % 3 != 0 && ref8 != in)
+		{
+			return utf_report(n, "round trip", offset);
+		}
+	}
+	return true;
+}
+
+/* ------------------------------------------------------------
+fs.watch: 100k changes (50k files created and removed at once).
+With a ring that holds them all, every change must arrive, in
+order. With a 16k ring filled before it is drained, the changes
+must arrive in order with only later ones missing, the missing ones
+must match the dropped count, and the next change must still arrive
+------------------------------------------------------------ */
+#define CHECK_WATCH_EVENTS 100000
+#define CHECK_WATCH_SMALL 16384
+#define CHECK_WATCH_ATTEMPTS 3 /* a system queue overflow makes a run inconclusive */
+
+static void watch_generate(const std::string *dir)
+{
+	for (int i = 0; i < CHECK_WATCH_EVENTS / 2; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/e%06d", i);
+		std::string path = *dir + name;
+		FILE *f = fopen(path.c_str(), "ab");
+		if (f != NULL) { fclose(f); }
+		remove(path.c_str());
+	}
+}
+
+/* 1 when the run passed, 0 when it failed, -1 when the system queue overflowed */
+static int watch_attempt(const char *what, int capacity, bool concurrent)
+{
+	lua_State *L = bench_newstate(false);
+	std::string dir = bench_make_tree(0);
+	lua_pushstring(L, dir.c_str());
+	lua_setglobal(L, "dir");
+	lua_pushinteger(L, CHECK_WATCH_EVENTS);
+	lua_setglobal(L, "expected");
+	lua_pushinteger(L, capacity);
+	lua_setglobal(L, "capacity");
+	bench_dostring(L,
+		"w = assert(fs.watch(dir, {debounce = 5, capacity = capacity})) "
+		"local function event(k) return (k % 2 == 0) and 'added' or 'removed', string.format('e%06d', k // 2) end "
+		"function drain() local n, dropped, missing, k = 0, 0, 0, 0 "
+		"while n + dropped < expected do "
+		"local batch, d = w:next_batch(5000) "
+		"if not batch then return 'fail', string.format('%d events arrived and %d were dropped, then: %s', n, dropped, tostring(d)) end "
+		"dropped = dropped + d "
+		"for i = 1, #batch do local e = batch[i] "
+		"if e.action == 'overflow' then return 'overflow' end "
+		"n = n + 1 "
+		"while k < expected do local action, path = event(k) if e.action == action and e.path == path then break end "
+		"if k < capacity then return 'fail', string.format('change %d (%s %s) was lost while the ring had room', k, action, path) end "
+		"k, missing = k + 1, missing + 1 end "
+		"if k == expected then return 'fail', string.format('event %d (%s %s) was not made or is out of order', n, e.action, e.path) end "
+		"k = k + 1 end end "
+		"missing = missing + expected - k "
+		"if missing ~= dropped then return 'fail', string.format('%d events arrived, %d are missing but %d were reported dropped', n, missing, dropped) end "
+		"return 'ok', dropped end "
+		"function again() local f = assert(io.open(dir .. '/after', 'w')) f:close() "
+		"local batch, d = w:next_batch(5000) os.remove(dir .. '/after') "
+		"return batch ~= nil and d == 0 and #batch == 1 and batch[1].action == 'added' and batch[1].path == 'after' end");
+
+	/* either drained while the changes are made, or only once all are made so the ring fills up */
+	std::thread generator;
+	if (concurrent) { generator = std::thread(watch_generate, &dir); }
+	else { watch_generate(&dir); }
+	lua_getglobal(L, "drain");
+	int status = lua_pcall(L, 0, 2, 0);
+	if (generator.joinable()) { generator.join(); }
+
+	int result = 0;
+	const char *outcome = (status == LUA_OK) ? lua_tostring(L, -2) : NULL;
+	if (outcome == NULL)
+	{
+		fprintf(stderr, "watch: %s: %s\n", what, lua_tostring(L, -1));
+	}
+	else if (strcmp(outcome, "overflow") == 0)
+	{
+		result = -1;
+	}
+	else if (strcmp(outcome, "ok") != 0)
+	{
+		fprintf(stderr, "watch: %s: %s\n", what, lua_tostring(L, -1));
+	}
+	else if (concurrent != (lua_tointeger(L, -1) == 0))
+	{
+		fprintf(stderr, "watch: %s: %d changes dropped with a %d-event ring\n", what, static_cast<int>(lua_tointeger(L, -1)), capacity);
+	}
+	else
+	{
+		lua_getglobal(L, "again");
+		result = (lua_pcall(L, 0, 1, 0) == LUA_OK && lua_toboolean(L, -1)) ? 1 : 0;
+		if (result == 0)
+		{
+			fprintf(stderr, "watch: %s: the next change did not arrive after draining\n", what);
+		}
+	}
+	lua_close(L);
+	bench_remove_tree(dir, 0);
+	return result;
+}
+
+static bool check_watch_mode(const char *what, int capacity, bool concurrent)
+{
+	for (int attempt = 0; attempt < CHECK_WATCH_ATTEMPTS; attempt++)
+	{
+		int result = watch_attempt(what, capacity, concurrent);
+		if (result >= 0)
+		{
+			return result == 1;
+		}
+		fprintf(stderr, "watch: %s: the system change queue overflowed, trying again\n", what);
+	}
+	fprintf(stderr, "watch: %s: the system change queue overflowed on every attempt\n", what);
+	return false;
+}
+
+static bool check_watch()
+{
+	return check_watch_mode("delivery", 2 * CHECK_WATCH_EVENTS, true) &&
+		check_watch_mode("drops", CHECK_WATCH_SMALL, false);
+}
+
+/* ------------------------------------------------------------
+Check table
+------------------------------------------------------------ */
+
+const BenchCheck bench_checks[] = {
+	{"utf/transcoder-40k", check_utf},
+	{"fs.watch/100k-events", check_watch},
+	{NULL, NULL}
+};
@@ -0,0 +1,317 @@
+#include "bench.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include <string>
+
+/* ------------------------------------------------------------
+Stand-ins for the Windows-only pieces the benchmark cases use,
+so the suite also builds and runs on POSIX systems. They follow
+the calling conventions of the real functions (results are left
+on the Lua stack) but use the C runtime instead of Win32 calls.
+------------------------------------------------------------ */
+
+const char *wstring_to_utf8(lua_State *L, wchar_t *inputs)
+{
+	size_t needed = wcstombs(NULL, inputs, 0);
+	if (needed == static_cast<size_t>(-1) || needed == 0)
+	{
+		lua_pushstring(L, "");
+	}
+	else
+	{
+		char *buff = static_cast<char*>(lua_newuserdata(L, sizeof(char) * (needed+1)));
+		wcstombs(buff, inputs, needed+1);
+		lua_pushstring(L, buff);
+		lua_remove(L, -2);
+	}
+	return lua_tostring(L, -1);
+}
+
+wchar_t *utf8_to_wstring(lua_State *L, const char *inputs)
+{
+	size_t needed = mbstowcs(NULL, inputs, 0);
+	if (needed == static_cast<size_t>(-1))
+	{
+		needed = 0;
+	}
+	wchar_t *buff = static_cast<wchar_t*>(lua_newuserdata(L, sizeof(wchar_t) * (needed+1)));
+	if (needed == 0)
+	{
+		buff[0] = L'\0';
+	}
+	else
+	{
+		mbstowcs(buff, inputs, needed+1);
+	}
+	return buff;
+}
+
+/* ------------------------------------------------------------
+fs stand-in: dir, find, attributes and mkdir (walk, attributes_many, mmap, hashing, watch, copies, glob and snapshots are the real ones)
+
+Entry fields come from d_type where they can; size and times need
+one fstatat relative to the open directory, done only when asked for.
+------------------------------------------------------------ */
+#define BENCH_DIR_META "WinLuaBenchDir"
+#define BENCH_DIR_MAXFIELDS 8
+
+enum BenchDirField
+{
+	FIELD_MODE,
+	FIELD_SIZE,
+	FIELD_MODIFICATION,
+	FIELD_ACCESS,
+	FIELD_CREATION
+};
+
+static const char *const dirfield_names[] = {"mode", "size", "modification", "access", "creation", NULL};
+
+struct BenchDir
+{
+	DIR *handle;
+	char pattern[256];
+	bool record;
+	int nfields;
+	unsigned char fields[BENCH_DIR_MAXFIELDS];
+};
+
+static int benchdir__gc(lua_State *L)
+{
+	BenchDir *udata = static_cast<BenchDir*>(luaL_checkudata(L, 1, BENCH_DIR_META));
+	if (udata->handle != NULL)
+	{
+		closedir(udata->handle);
+		udata->handle = NULL;
+	}
+	return 0;
+}
+
+struct BenchDirEntry
+{
+	BenchDir *dir;
+	struct dirent *entry;
+	struct stat st;
+	bool statted;
+};
+
+static void entry_stat(BenchDirEntry& e)
+{
+	if (!e.statted)
+	{
+		e.statted = true;
+		if (fstatat(dirfd(e.dir->handle), e.entry->d_name, &e.st, 0) != 0)
+		{
+			memset(&e.st, 0, sizeof(e.st));
+		}
+	}
+}
+
+static void push_dirfield(lua_State *L, BenchDirEntry& e, int field)
+{
+	switch (field)
+	{
+		case FIELD_MODE:
+			if (e.entry->d_type == DT_UNKNOWN || e.entry->d_type == DT_LNK)
+			{
+				entry_stat(e);
+				lua_pushstring(L, S_ISDIR(e.st.st_mode) ? "directory" : "file");
+			}
+			else
+			{
+				lua_pushstring(L, e.entry->d_type == DT_DIR ? "directory" : "file");
+			}
+			break;
+		case FIELD_SIZE:
+			entry_stat(e);
+			lua_pushinteger(L, e.st.st_size);
+			break;
+		case FIELD_MODIFICATION:
+			entry_stat(e);
+			lua_pushinteger(L, e.st.st_mtime);
+			break;
+		case FIELD_ACCESS:
+			entry_stat(e);
+			lua_pushinteger(L, e.st.st_atime);
+			break;
+		case FIELD_CREATION:
+			entry_stat(e);
+			lua_pushinteger(L, e.st.st_ctime);
+			break;
+	}
+}
+
+static int benchdir_next(lua_State *L)
+{
+	BenchDir *udata = static_cast<BenchDir*>(luaL_checkudata(L, lua_upvalueindex(1), BENCH_DIR_META));
+	if (udata->handle == NULL) { return 0; }
+
+	struct dirent *entry;
+	while ((entry = readdir(udata->handle)) != NULL)
+	{
+		if (udata->pattern[0] == '\0' || fnmatch(udata->pattern, entry->d_name, 0) == 0)
+		{
+			lua_pushstring(L, entry->d_name);
+
+			BenchDirEntry e;
+			e.dir = udata;
+			e.entry = entry;
+			e.statted = false;
+			int nresults = 1;
+			if (udata->record)
+			{
+				lua_pushvalue(L, lua_upvalueindex(2));
+				for (int i = FIELD_MODE; dirfield_names[i] != NULL; i++)
+				{
+					push_dirfield(L, e, i);
+					lua_setfield(L, -2, dirfield_names[i]);
+				}
+				nresults++;
+			}
+			for (int i = 0; i < udata->nfields; i++)
+			{
+				push_dirfield(L, e, udata->fields[i]);
+				nresults++;
+			}
+			return nresults;
+		}
+	}
+
+	closedir(udata->handle);
+	udata->handle = NULL;
+	return 0;
+}
+
+static int open_dir(lua_State *L, const std::string& directory, const char *pattern)
+{
+	BenchDir *udata = static_cast<BenchDir*>(lua_newuserdata(L, sizeof(BenchDir)));
+	udata->handle = NULL;
+	udata->record = lua_toboolean(L, 2) && !lua_istable(L, 2);
+	udata->nfields = 0;
+	luaL_setmetatable(L, BENCH_DIR_META);
+	snprintf(udata->pattern, sizeof(udata->pattern), "%s", pattern);
+
+	if (lua_istable(L, 2))
+	{
+		for (lua_Integer i = 1; lua_rawgeti(L, 2, i) != LUA_TNIL; i++)
+		{
+			luaL_argcheck(L, udata->nfields < BENCH_DIR_MAXFIELDS, 2, "too many fields");
+			const char *name = lua_tostring(L, -1);
+			int field = 0;
+			while (dirfield_names[field] != NULL && (name == NULL || strcmp(dirfield_names[field], name) != 0)) { field++; }
+			if (dirfield_names[field] == NULL)
+			{
+				return luaL_error(L, "invalid field '%s'", name ? name : luaL_typename(L, -1));
+			}
+			udata->fields[udata->nfields++] = static_cast<unsigned char>(field);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	udata->handle = opendir(directory.c_str());
+	if (udata->handle == NULL)
+	{
+		return luaL_error(L, "could not start search for '%s'", directory.c_str());
+	}
+
+	if (udata->record)
+	{
+		lua_createtable(L, 0, 5);
+		lua_pushcclosure(L, benchdir_next, 2);
+	}
+	else
+	{
+		lua_pushcclosure(L, benchdir_next, 1);
+	}
+	return 1;
+}
+
+static int fs_dir(lua_State *L)
+{
+	return open_dir(L, luaL_checkstring(L, 1), "");
+}
+
+static int fs_find(lua_State *L)
+{
+	std::string filespec = luaL_checkstring(L, 1);
+	size_t sep = filespec.find_last_of('/');
+	if (sep == std::string::npos)
+	{
+		return open_dir(L, ".", filespec.c_str());
+	}
+	return open_dir(L, filespec.substr(0, sep), filespec.c_str() + sep + 1);
+}
+
+static int fs_attributes(lua_State *L)
+{
+	const char *filepath = luaL_checkstring(L, 1);
+
+	struct stat st;
+	if (stat(filepath, &st) != 0)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, st.st_ctime);
+	lua_setfield(L, -2, "creation");
+	lua_pushinteger(L, st.st_atime);
+	lua_setfield(L, -2, "access");
+	lua_pushinteger(L, st.st_mtime);
+	lua_setfield(L, -2, "modification");
+	lua_pushstring(L, S_ISDIR(st.st_mode) ? "directory" : "file");
+	lua_setfield(L, -2, "mode");
+	lua_pushinteger(L, st.st_size);
+	lua_setfield(L, -2, "size");
+	return 1;
+}
+
+static int fs_mkdir(lua_State *L)
+{
+	const char *filepath = luaL_checkstring(L, 1);
+	if (mkdir(filepath, 0777) != 0)
+	{
+		return luaL_error(L, "could not create directory '%s' (%d)", filepath, errno);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static const luaL_Reg library_methods[] = {
+	{"attributes", fs_attributes},
+	{"dir", fs_dir},
+	{"find", fs_find},
+	{"mkdir", fs_mkdir},
+	{"walk", winlua_fs_walk},
+	{"attributes_many", winlua_fs_attributes_many},
+	{"mmap", winlua_fs_mmap},
+	{"hash", winlua_fs_hash},
+	{"hash_many", winlua_fs_hash_many},
+	{"hasher", winlua_fs_hasher},
+	{"watch", winlua_fs_watch},
+	{"copy", winlua_fs_copy},
+	{"copy_tree", winlua_fs_copy_tree},
+	{"glob", winlua_fs_glob},
+	{"snapshot", winlua_fs_snapshot},
+	{"diff", winlua_fs_diff},
+	{NULL, NULL}
+};
+
+int luaopen_fs(lua_State *L)
+{
+	luaL_newmetatable(L, BENCH_DIR_META);
+	lua_pushcfunction(L, benchdir__gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, library_methods);
+	return 1;
+}
@@ -0,0 +1,350 @@
+#include "winlua.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+/* ------------------------------------------------------------
+WinLua Pool Allocator
+
+Small blocks (TString headers, Table/Node arrays, CallInfo,
+closures, ...) are served from per-size-class free lists carved
+out of 64k pages. Blocks above the largest class go to the system
+allocator. Lua always passes the original block size on free and
+realloc, so no per-block header is needed.
+
+Lua assumes a shrinking realloc cannot fail. When a shrink into a
+pooled class cannot get a new block, the old block is kept: a pooled
+block simply moves to the smaller class, a large block is remembered
+as 'adopted' so it is still handed back to the system allocator.
+------------------------------------------------------------ */
+
+#define WINLUA_POOL_PAGESIZE (64 * 1024)
+#define WINLUA_POOL_NCLASSES 10
+#define WINLUA_POOL_NADOPTED 16
+
+static const size_t pool_class_sizes[WINLUA_POOL_NCLASSES] = {
+	16, 32, 48, 64, 80, 96, 128, 192, 256, 512
+};
+
+struct WinLuaPoolBlock
+{
+	WinLuaPoolBlock *next;
+};
+
+struct WinLuaPoolAllocator
+{
+	WinLuaPoolBlock *freelist[WINLUA_POOL_NCLASSES];
+	WinLuaPoolBlock *pages; /* all pages, linked through their first block */
+	char *bump;
+	size_t bumpleft;
+	/* statistics */
+	size_t live, peak;
+	size_t classlive[WINLUA_POOL_NCLASSES];
+	size_t classtotal[WINLUA_POOL_NCLASSES];
+	size_t largelive, largetotal;
+	size_t pagecount;
+	/* large blocks that Lua now sizes as pooled ones */
+	void *adopted[WINLUA_POOL_NADOPTED];
+	int nadopted;
+};
+
+static int pool_class(size_t size)
+{
+	if (size <= 64) { return (size == 0) ? 0 : static_cast<int>((size + 15) / 16) - 1; }
+	for (int i = 4; i < WINLUA_POOL_NCLASSES; i++)
+	{
+		if (size <= pool_class_sizes[i]) { return i; }
+	}
+	return -1;
+}
+
+static void *pool_take(WinLuaPoolAllocator *pool, int cls)
+{
+	WinLuaPoolBlock *block = pool->freelist[cls];
+	if (block != NULL)
+	{
+		pool->freelist[cls] = block->next;
+	}
+	else
+	{
+		size_t size = pool_class_sizes[cls];
+		if (pool->bumpleft < size)
+		{
+			/* the remainder of the old page is given to the smaller free lists */
+			for (int i = cls - 1; i >= 0 && pool->bumpleft >= pool_class_sizes[0]; i--)
+			{
+				while (pool->bumpleft >= pool_class_sizes[i])
+				{
+					WinLuaPoolBlock *rest = reinterpret_cast<WinLuaPoolBlock*>(pool->bump);
+					rest->next = pool->freelist[i];
+					pool->freelist[i] = rest;
+					pool->bump += pool_class_sizes[i];
+					pool->bumpleft -= pool_class_sizes[i];
+				}
+			}
+
+			char *page = static_cast<char*>(malloc(WINLUA_POOL_PAGESIZE));
+			if (page == NULL)
+			{
+				return NULL;
+			}
+			WinLuaPoolBlock *link = reinterpret_cast<WinLuaPoolBlock*>(page);
+			link->next = pool->pages;
+			pool->pages = link;
+			pool->pagecount++;
+			pool->bump = page + pool_class_sizes[0];
+			pool->bumpleft = WINLUA_POOL_PAGESIZE - pool_class_sizes[0];
+		}
+		block = reinterpret_cast<WinLuaPoolBlock*>(pool->bump);
+		pool->bump += size;
+		pool->bumpleft -= size;
+	}
+
+	pool->classlive[cls]++;
+	pool->classtotal[cls]++;
+	return block;
+}
+
+static void pool_give(WinLuaPoolAllocator *pool, int cls, void *ptr)
+{
+	WinLuaPoolBlock *block = static_cast<WinLuaPoolBlock*>(ptr);
+	block->next = pool->freelist[cls];
+	pool->freelist[cls] = block;
+	pool->classlive[cls]--;
+}
+
+static int pool_find_adopted(WinLuaPoolAllocator *pool, void *ptr)
+{
+	for (int i = 0; i < pool->nadopted; i++)
+	{
+		if (pool->adopted[i] == ptr) { return i; }
+	}
+	return -1;
+}
+
+static void pool_drop_adopted(WinLuaPoolAllocator *pool, int idx)
+{
+	pool->adopted[idx] = pool->adopted[--pool->nadopted];
+}
+
+/*
+Keep 'ptr' (of class 'ocls', or large) for a shrink to class 'ncls'
+after pool_take failed. Returns NULL when a large block cannot be adopted.
+*/
+static void *pool_keep(WinLuaPoolAllocator *pool, void *ptr, int ocls, int ncls, bool adopted)
+{
+	if (ocls >= 0)
+	{
+		pool->classlive[ocls]--;
+		pool->classlive[ncls]++;
+	}
+	else if (!adopted)
+	{
+		if (pool->nadopted == WINLUA_POOL_NADOPTED) { return NULL; }
+		pool->adopted[pool->nadopted++] = ptr;
+	}
+	return ptr;
+}
+
+static void *pool_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	WinLuaPoolAllocator *pool = static_cast<WinLuaPoolAllocator*>(ud);
+	/* when ptr is NULL, osize encodes the object type, not a size */
+	if (ptr == NULL) { osize = 0; }
+
+	int ocls = (ptr != NULL) ? pool_class(osize) : -1;
+	int adopted = -1;
+	if (ocls >= 0 && pool->nadopted > 0)
+	{
+		adopted = pool_find_adopted(pool, ptr);
+		if (adopted >= 0) { ocls = -1; }
+	}
+
+	if (nsize == 0)
+	{
+		if (ptr != NULL)
+		{
+			if (ocls >= 0) { pool_give(pool, ocls, ptr); }
+			else { free(ptr); pool->largelive--; }
+			if (adopted >= 0) { pool_drop_adopted(pool, adopted); }
+			pool->live -= osize;
+		}
+		return NULL;
+	}
+
+	int ncls = pool_class(nsize);
+	void *block;
+
+	if (ptr != NULL && ocls == ncls)
+	{
+		/* same class (or both large) -- resize in place */
+		if (ncls >= 0)
+		{
+			block = ptr;
+		}
+		else
+		{
+			block = realloc(ptr, nsize);
+			if (block == NULL) { return NULL; }
+			if (adopted >= 0) { pool_drop_adopted(pool, adopted); }
+		}
+	}
+	else
+	{
+		if (ncls >= 0)
+		{
+			block = pool_take(pool, ncls);
+		}
+		else
+		{
+			block = malloc(nsize);
+			if (block != NULL) { pool->largelive++; pool->largetotal++; }
+		}
+		if (block == NULL)
+		{
+			if (ptr == NULL || nsize > osize || ncls < 0) { return NULL; }
+			block = pool_keep(pool, ptr, ocls, ncls, adopted >= 0);
+			if (block == NULL) { return NULL; }
+			pool->live = pool->live - osize + nsize;
+			return block;
+		}
+
+		if (ptr != NULL)
+		{
+			memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+			if (ocls >= 0) { pool_give(pool, ocls, ptr); }
+			else { free(ptr); pool->largelive--; }
+			if (adopted >= 0) { pool_drop_adopted(pool, adopted); }
+		}
+	}
+
+	pool->live = pool->live - osize + nsize;
+	if (pool->live > pool->peak) { pool->peak = pool->live; }
+	return block;
+}
+
+static int pool_panic(lua_State *L)
+{
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	fflush(stderr);
+	return 0;
+}
+
+/* ------------------------------------------------------------
+WinLua State functions
+------------------------------------------------------------ */
+
+/*
+Create a new Lua state, using the pool allocator if requested.
+*/
+lua_State *winlua_newstate(bool pooled)
+{
+	if (!pooled)
+	{
+		return luaL_newstate();
+	}
+
+	WinLuaPoolAllocator *pool = static_cast<WinLuaPoolAllocator*>(calloc(1, sizeof(WinLuaPoolAllocator)));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+
+	lua_State *L = lua_newstate(pool_alloc, pool);
+	if (L == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	lua_atpanic(L, pool_panic);
+	return L;
+}
+
+void winlua_closestate(lua_State *L)
+{
+	void *ud;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	lua_close(L);
+
+	if (allocf == pool_alloc)
+	{
+		WinLuaPoolAllocator *pool = static_cast<WinLuaPoolAllocator*>(ud);
+		WinLuaPoolBlock *page = pool->pages;
+		while (page != NULL)
+		{
+			WinLuaPoolBlock *next = page->next;
+			free(page);
+			page = next;
+		}
+		free(pool);
+	}
+}
+
+bool winlua_state_pooled(lua_State *L)
+{
+	void *ud;
+	return lua_getallocf(L, &ud) == pool_alloc;
+}
+
+/* ------------------------------------------------------------
+WinLua Allocator module
+------------------------------------------------------------ */
+
+static int allocator_stats(lua_State *L)
+{
+	void *ud;
+	lua_getallocf(L, &ud);
+
+	if (!winlua_state_pooled(L))
+	{
+		lua_createtable(L, 0, 2);
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "pooled");
+		lua_pushinteger(L, static_cast<lua_Integer>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0));
+		lua_setfield(L, -2, "live");
+		return 1;
+	}
+
+	WinLuaPoolAllocator *pool = static_cast<WinLuaPoolAllocator*>(ud);
+	lua_createtable(L, 0, 6);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "pooled");
+	lua_pushinteger(L, static_cast<lua_Integer>(pool->live));
+	lua_setfield(L, -2, "live");
+	lua_pushinteger(L, static_cast<lua_Integer>(pool->peak));
+	lua_setfield(L, -2, "peak");
+	lua_pushinteger(L, static_cast<lua_Integer>(pool->pagecount));
+	lua_setfield(L, -2, "pages");
+
+	lua_createtable(L, WINLUA_POOL_NCLASSES, 0);
+	for (int i = 0; i < WINLUA_POOL_NCLASSES; i++)
+	{
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, static_cast<lua_Integer>(pool_class_sizes[i]));
+		lua_setfield(L, -2, "size");
+		lua_pushinteger(L, static_cast<lua_Integer>(pool->classlive[i]));
+		lua_setfield(L, -2, "live");
+		lua_pushinteger(L, static_cast<lua_Integer>(pool->classtotal[i]));
+		lua_setfield(L, -2, "total");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "classes");
+
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, static_cast<lua_Integer>(pool->largelive));
+	lua_setfield(L, -2, "live");
+	lua_pushinteger(L, static_cast<lua_Integer>(pool->largetotal));
+	lua_setfield(L, -2, "total");
+	lua_setfield(L, -2, "large");
+	return 1;
+}
+
+static const luaL_Reg library_methods[] = {
+	{"stats", allocator_stats},
+	{NULL, NULL}
+};
+
+int luaopen_allocator(lua_State *L)
+{
+	luaL_newlib(L, library_methods);
+	return 1;
+}
@@ -0,0 +1,995 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+extern char **environ;
+#endif
+
+/* ------------------------------------------------------------
+WinLua Async Event Loop
+
+async.run drives a set of tasks (coroutines). An async operation
+started by a task (read, write, sleep, spawn) yields the task
+until the operation completes; the loop then pushes the results on
+the task's stack and resumes it. Many operations can be in flight
+from a single thread at once.
+
+The reactor waits on an I/O completion port on Windows: files are
+opened for overlapped I/O and process exits are posted to the
+port by a wait callback. On Linux it waits on epoll, with process
+exits signalled through pidfds. Regular files are always ready
+for epoll, so reads and writes are handed to a few offload threads
+that signal completions through an eventfd. Timers are kept in a
+map and bound the wait timeout.
+------------------------------------------------------------ */
+#define WINLUA_ASYNC_META "WinLuaAsync"
+#define WINLUA_ASYNC_CHUNK 0x40000000 /* largest single read or write */
+#define WINLUA_ASYNC_EVENTS 64
+#define WINLUA_ASYNC_THREADS 4 /* offload threads for file I/O off Windows */
+
+static const char async_key = 'a';
+
+enum AsyncOpKind
+{
+	ASYNC_READ,
+	ASYNC_WRITE,
+	ASYNC_PROCESS
+};
+
+struct AsyncOp
+{
+#ifdef _WIN32
+	OVERLAPPED ov; /* completions hand back this pointer */
+	HANDLE handle;
+	HANDLE wait;   /* process exit wait registration */
+	HANDLE port;
+#else
+	int fd;        /* pidfd for processes */
+	pid_t pid;
+#endif
+	AsyncOpKind kind;
+	const char *what; /* step named in the error message */
+	lua_State *task;
+	std::string path;
+	std::string data;
+	unsigned long long offset;
+#ifndef _WIN32
+	int err;       /* set by the offload thread */
+	bool running;  /* the offload thread is working on it */
+#endif
+};
+
+#ifndef _WIN32
+/* file operations queued for and completed by the offload threads */
+struct AsyncOffload
+{
+	std::mutex lock;
+	std::condition_variable work;
+	std::condition_variable done;
+	std::deque<AsyncOp*> jobs;
+	std::vector<AsyncOp*> finished;
+	std::vector<std::thread> threads;
+	int idle;
+	bool stop;
+};
+#endif
+
+typedef std::pair<lua_State*, int> AsyncResume; /* task and number of values pushed on its stack */
+
+struct WinLuaAsync
+{
+#ifdef _WIN32
+	HANDLE port;
+#else
+	int epfd;
+	int efd; /* offload completions */
+	AsyncOffload *offload;
+#endif
+	std::set<AsyncOp*> *ops;
+	std::deque<AsyncResume> *ready;
+	std::multimap<unsigned long long, lua_State*> *timers;
+	int tasks;
+	bool running;
+	bool waiting; /* set when the resumed task yielded for an operation */
+};
+
+static unsigned long long now_ms()
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<unsigned long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*
+Push the reactor of this state (creating it on first use) and return it.
+*/
+static WinLuaAsync *get_reactor(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &async_key);
+	WinLuaAsync *r = static_cast<WinLuaAsync*>(lua_touserdata(L, -1));
+	if (r != NULL)
+	{
+		return r;
+	}
+	lua_pop(L, 1);
+
+	r = static_cast<WinLuaAsync*>(lua_newuserdata(L, sizeof(WinLuaAsync)));
+#ifdef _WIN32
+	r->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (r->port == NULL)
+	{
+		luaL_error(L, "could not create I/O completion port (%d)", GetLastError());
+	}
+#else
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0)
+	{
+		luaL_error(L, "could not create epoll instance (%d)", errno);
+	}
+	r->offload = NULL;
+	r->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (r->efd < 0 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->efd, &ev) != 0)
+	{
+		int err = errno;
+		if (r->efd >= 0) { close(r->efd); }
+		close(r->epfd);
+		luaL_error(L, "could not create eventfd (%d)", err);
+	}
+#endif
+	r->ops = new std::set<AsyncOp*>();
+	r->ready = new std::deque<AsyncResume>();
+	r->timers = new std::multimap<unsigned long long, lua_State*>();
+	r->tasks = 0;
+	r->running = false;
+	r->waiting = false;
+	luaL_setmetatable(L, WINLUA_ASYNC_META);
+
+	/* the uservalue anchors the task threads */
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &async_key);
+	return r;
+}
+
+/* ------------------------------------------------------------
+Operations
+------------------------------------------------------------ */
+
+static AsyncOp *op_create(lua_State *L, AsyncOpKind kind, const char *path)
+{
+	AsyncOp *op = new AsyncOp;
+#ifdef _WIN32
+	memset(&op->ov, 0, sizeof(op->ov));
+	op->handle = INVALID_HANDLE_VALUE;
+	op->wait = NULL;
+	op->port = NULL;
+#else
+	op->fd = -1;
+	op->pid = 0;
+	op->err = 0;
+	op->running = false;
+#endif
+	op->kind = kind;
+	op->what = (kind == ASYNC_READ) ? "read" : (kind == ASYNC_WRITE) ? "write" : "run";
+	op->task = L;
+	op->path = path;
+	op->offset = 0;
+	return op;
+}
+
+static void op_destroy(WinLuaAsync *r, AsyncOp *op)
+{
+#ifdef _WIN32
+	if (op->handle != INVALID_HANDLE_VALUE) { CloseHandle(op->handle); }
+#else
+	if (op->fd >= 0) { close(op->fd); }
+#endif
+	r->ops->erase(op);
+	delete op;
+}
+
+/*
+Push the results of a finished operation on its task and queue the task.
+*/
+static void op_finish(WinLuaAsync *r, AsyncOp *op, bool ok, unsigned long err)
+{
+	lua_State *T = op->task;
+	int nresults = 1;
+	if (!ok)
+	{
+		lua_pushnil(T);
+		lua_pushfstring(T, "could not %s '%s' (%d)", op->what, op->path.c_str(), static_cast<int>(err));
+		lua_pushinteger(T, static_cast<lua_Integer>(err));
+		nresults = 3;
+	}
+	else if (op->kind == ASYNC_READ)
+	{
+		lua_pushlstring(T, op->data.data(), static_cast<size_t>(op->offset));
+	}
+	else if (op->kind == ASYNC_WRITE)
+	{
+		lua_pushboolean(T, 1);
+	}
+	else
+	{
+		lua_pushinteger(T, static_cast<lua_Integer>(err)); /* exit code */
+	}
+	r->ready->push_back(AsyncResume(T, nresults));
+	op_destroy(r, op);
+}
+
+/*
+Yield the calling task until its operation completes.
+*/
+static int op_wait(lua_State *L, WinLuaAsync *r, AsyncOp *op)
+{
+	r->ops->insert(op);
+	r->waiting = true;
+	return lua_yield(L, 0);
+}
+
+/*
+Async operations must be called from a task of a running loop.
+*/
+static WinLuaAsync *check_task(lua_State *L, const char *fname)
+{
+	WinLuaAsync *r = get_reactor(L);
+	lua_getuservalue(L, -1);
+	bool istask = lua_rawgetp(L, -1, L) != LUA_TNIL;
+	lua_pop(L, 3);
+	if (!r->running || !istask)
+	{
+		luaL_error(L, "async.%s must be called from a task inside async.run", fname);
+	}
+	return r;
+}
+
+#ifdef _WIN32
+
+static bool op_issue(AsyncOp *op)
+{
+	size_t remaining = op->data.size() - static_cast<size_t>(op->offset);
+	DWORD n = (remaining > WINLUA_ASYNC_CHUNK) ? WINLUA_ASYNC_CHUNK : static_cast<DWORD>(remaining);
+	op->ov.Offset = static_cast<DWORD>(op->offset);
+	op->ov.OffsetHigh = static_cast<DWORD>(op->offset >> 32);
+
+	BOOL ret = (op->kind == ASYNC_READ)
+		? ReadFile(op->handle, &op->data[static_cast<size_t>(op->offset)], n, NULL, &op->ov)
+		: WriteFile(op->handle, op->data.data() + op->offset, n, NULL, &op->ov);
+	/* a synchronous success still posts a completion packet */
+	return ret != 0 || GetLastError() == ERROR_IO_PENDING;
+}
+
+static HANDLE open_overlapped(lua_State *L, WinLuaAsync *r, const char *path, bool write)
+{
+	WinLuaScratch scratch(L);
+	wchar_t *pathW = scratch.wstring(path);
+	HANDLE handle = write
+		? CreateFileW(pathW, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL)
+		: CreateFileW(pathW, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle != INVALID_HANDLE_VALUE && CreateIoCompletionPort(handle, r->port, 0, 0) == NULL)
+	{
+		DWORD err = GetLastError();
+		CloseHandle(handle);
+		SetLastError(err);
+		return INVALID_HANDLE_VALUE;
+	}
+	return handle;
+}
+
+static int push_error(lua_State *L, const char *what, const char *path, DWORD err)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "could not %s '%s' (%d)", what, path, err);
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+static int start_transfer(lua_State *L, WinLuaAsync *r, AsyncOp *op)
+{
+	if (!op_issue(op))
+	{
+		DWORD err = GetLastError();
+		const char *what = (op->kind == ASYNC_READ) ? "read" : "write";
+		op_destroy(r, op);
+		return push_error(L, what, lua_tostring(L, 1), err);
+	}
+	return op_wait(L, r, op);
+}
+
+static int async_read(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	WinLuaAsync *r = check_task(L, "read");
+
+	HANDLE handle = open_overlapped(L, r, path, false);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		return push_error(L, "open", path, GetLastError());
+	}
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(handle, &size) == 0)
+	{
+		DWORD err = GetLastError();
+		CloseHandle(handle);
+		return push_error(L, "read", path, err);
+	}
+	if (size.QuadPart == 0)
+	{
+		CloseHandle(handle);
+		lua_pushliteral(L, "");
+		return 1;
+	}
+
+	AsyncOp *op = op_create(L, ASYNC_READ, path);
+	op->handle = handle;
+	op->data.resize(static_cast<size_t>(size.QuadPart));
+	return start_transfer(L, r, op);
+}
+
+static int async_write(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	WinLuaAsync *r = check_task(L, "write");
+
+	HANDLE handle = open_overlapped(L, r, path, true);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		return push_error(L, "open", path, GetLastError());
+	}
+	if (len == 0)
+	{
+		CloseHandle(handle);
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	AsyncOp *op = op_create(L, ASYNC_WRITE, path);
+	op->handle = handle;
+	op->data.assign(data, len);
+	return start_transfer(L, r, op);
+}
+
+static void CALLBACK process_exited(PVOID param, BOOLEAN)
+{
+	AsyncOp *op = static_cast<AsyncOp*>(param);
+	PostQueuedCompletionStatus(op->port, 0, 0, &op->ov);
+}
+
+static int async_spawn(lua_State *L)
+{
+	const char *cmdline = luaL_checkstring(L, 1);
+	WinLuaAsync *r = check_task(L, "spawn");
+
+	PROCESS_INFORMATION pi;
+	BOOL ret;
+	{
+		/* closed before op_wait yields; CreateProcessW may modify the command line buffer */
+		WinLuaScratch scratch(L);
+		wchar_t *cmdlineW = scratch.wstring(cmdline);
+		STARTUPINFOW si;
+		memset(&si, 0, sizeof(si));
+		si.cb = sizeof(si);
+		ret = CreateProcessW(NULL, cmdlineW, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+	}
+	if (ret == 0)
+	{
+		return push_error(L, "run", cmdline, GetLastError());
+	}
+	CloseHandle(pi.hThread);
+
+	AsyncOp *op = op_create(L, ASYNC_PROCESS, cmdline);
+	op->handle = pi.hProcess;
+	op->port = r->port;
+	if (RegisterWaitForSingleObject(&op->wait, pi.hProcess, process_exited, op, INFINITE, WT_EXECUTEONLYONCE) == 0)
+	{
+		/* fall back to waiting synchronously */
+		DWORD code = 0;
+		WaitForSingleObject(pi.hProcess, INFINITE);
+		GetExitCodeProcess(pi.hProcess, &code);
+		op_destroy(r, op);
+		lua_pushinteger(L, code);
+		return 1;
+	}
+	return op_wait(L, r, op);
+}
+
+static void complete(WinLuaAsync *r, AsyncOp *op)
+{
+	if (op->kind == ASYNC_PROCESS)
+	{
+		DWORD code = 0;
+		UnregisterWaitEx(op->wait, NULL);
+		GetExitCodeProcess(op->handle, &code);
+		op_finish(r, op, true, code);
+		return;
+	}
+
+	DWORD bytes = 0;
+	if (GetOverlappedResult(op->handle, &op->ov, &bytes, FALSE) == 0)
+	{
+		DWORD err = GetLastError();
+		if (err != ERROR_HANDLE_EOF)
+		{
+			op_finish(r, op, false, err);
+			return;
+		}
+		bytes = 0;
+	}
+
+	/* continue until the whole buffer is transferred or the file ends */
+	op->offset += bytes;
+	if (bytes > 0 && op->offset < op->data.size())
+	{
+		if (!op_issue(op))
+		{
+			op_finish(r, op, false, GetLastError());
+		}
+		return;
+	}
+	op_finish(r, op, op->kind == ASYNC_READ || op->offset == op->data.size(), ERROR_WRITE_FAULT);
+}
+
+static void reactor_poll(WinLuaAsync *r, unsigned long long timeout)
+{
+	OVERLAPPED_ENTRY entries[WINLUA_ASYNC_EVENTS];
+	ULONG count = 0;
+	DWORD wait = (timeout == ~0ULL) ? INFINITE : static_cast<DWORD>(timeout);
+	if (GetQueuedCompletionStatusEx(r->port, entries, WINLUA_ASYNC_EVENTS, &count, wait, FALSE) == 0)
+	{
+		return; /* timeout */
+	}
+	for (ULONG i = 0; i < count; i++)
+	{
+		complete(r, reinterpret_cast<AsyncOp*>(entries[i].lpOverlapped));
+	}
+}
+
+static void reactor_cancel(WinLuaAsync *, AsyncOp *op)
+{
+	DWORD bytes;
+	if (op->kind == ASYNC_PROCESS)
+	{
+		UnregisterWaitEx(op->wait, INVALID_HANDLE_VALUE); /* waits for a running callback */
+	}
+	else if (CancelIoEx(op->handle, &op->ov) != 0 || GetLastError() != ERROR_NOT_FOUND)
+	{
+		/* the buffer must stay alive until the cancellation has completed */
+		GetOverlappedResult(op->handle, &op->ov, &bytes, TRUE);
+	}
+}
+
+static void reactor_close(WinLuaAsync *r)
+{
+	CloseHandle(r->port);
+}
+
+#else
+
+static int push_error(lua_State *L, const char *what, const char *path, int err)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "could not %s '%s' (%d)", what, path, err);
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+/*
+Run a file operation on an offload thread: open, then read the
+whole file or write all of 'data'. Only the fields of 'op' are
+touched, never the Lua state.
+*/
+static void offload_run(AsyncOp *op)
+{
+	int fd = (op->kind == ASYNC_READ)
+		? open(op->path.c_str(), O_RDONLY | O_CLOEXEC)
+		: open(op->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+	{
+		op->what = "open";
+		op->err = errno;
+		return;
+	}
+
+	if (op->kind == ASYNC_READ)
+	{
+		/* one spare byte lets the final read see the end without growing the buffer */
+		struct stat st;
+		op->data.resize((fstat(fd, &st) == 0 && st.st_size > 0) ? static_cast<size_t>(st.st_size) + 1 : LUAL_BUFFERSIZE);
+		for (;;)
+		{
+			if (op->offset == op->data.size())
+			{
+				op->data.resize(op->data.size() * 2);
+			}
+			ssize_t n = read(fd, &op->data[static_cast<size_t>(op->offset)], op->data.size() - static_cast<size_t>(op->offset));
+			if (n < 0)
+			{
+				op->err = errno;
+				break;
+			}
+			if (n == 0) { break; }
+			op->offset += static_cast<size_t>(n);
+		}
+	}
+	else
+	{
+		while (op->offset < op->data.size())
+		{
+			size_t len = op->data.size() - static_cast<size_t>(op->offset);
+			ssize_t n = write(fd, op->data.data() + op->offset, (len > WINLUA_ASYNC_CHUNK) ? WINLUA_ASYNC_CHUNK : len);
+			if (n <= 0)
+			{
+				op->err = (n < 0) ? errno : EIO;
+				break;
+			}
+			op->offset += static_cast<size_t>(n);
+		}
+	}
+	close(fd);
+}
+
+static void offload_thread(AsyncOffload *q, int efd)
+{
+	std::unique_lock<std::mutex> lock(q->lock);
+	for (;;)
+	{
+		q->idle++;
+		q->work.wait(lock, [q] { return q->stop || !q->jobs.empty(); });
+		q->idle--;
+		if (q->stop)
+		{
+			return;
+		}
+
+		AsyncOp *op = q->jobs.front();
+		q->jobs.pop_front();
+		op->running = true;
+		lock.unlock();
+		offload_run(op);
+		lock.lock();
+		op->running = false;
+		q->finished.push_back(op);
+		q->done.notify_all();
+
+		uint64_t one = 1;
+		ssize_t n = write(efd, &one, sizeof(one)); /* only fails while the counter is saturated */
+		(void)n;
+	}
+}
+
+/*
+Queue 'op' for the offload threads, starting one if none is idle.
+Returns false if no thread could be started at all.
+*/
+static bool offload_submit(WinLuaAsync *r, AsyncOp *op)
+{
+	if (r->offload == NULL)
+	{
+		r->offload = new AsyncOffload;
+		r->offload->idle = 0;
+		r->offload->stop = false;
+	}
+
+	AsyncOffload *q = r->offload;
+	std::lock_guard<std::mutex> lock(q->lock);
+	if (q->idle <= static_cast<int>(q->jobs.size()) && q->threads.size() < WINLUA_ASYNC_THREADS)
+	{
+		try
+		{
+			q->threads.push_back(std::thread(offload_thread, q, r->efd));
+		}
+		catch (...)
+		{
+			if (q->threads.empty())
+			{
+				return false;
+			}
+		}
+	}
+	q->jobs.push_back(op);
+	q->work.notify_one();
+	return true;
+}
+
+static int start_transfer(lua_State *L, WinLuaAsync *r, AsyncOp *op)
+{
+	if (!offload_submit(r, op))
+	{
+		/* no offload thread: do the work here and resume with the result */
+		offload_run(op);
+		op_finish(r, op, op->err == 0, static_cast<unsigned long>(op->err));
+		r->waiting = true;
+		return lua_yield(L, 0);
+	}
+	return op_wait(L, r, op);
+}
+
+static int async_read(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	WinLuaAsync *r = check_task(L, "read");
+
+	AsyncOp *op = op_create(L, ASYNC_READ, path);
+	return start_transfer(L, r, op);
+}
+
+static int async_write(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	WinLuaAsync *r = check_task(L, "write");
+
+	AsyncOp *op = op_create(L, ASYNC_WRITE, path);
+	op->data.assign(data, len);
+	return start_transfer(L, r, op);
+}
+
+static lua_Integer exit_code(int status)
+{
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static int async_spawn(lua_State *L)
+{
+	const char *cmdline = luaL_checkstring(L, 1);
+	WinLuaAsync *r = check_task(L, "spawn");
+
+	pid_t pid;
+	char *argv[] = {const_cast<char*>("sh"), const_cast<char*>("-c"), const_cast<char*>(cmdline), NULL};
+	int err = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ);
+	if (err != 0)
+	{
+		return push_error(L, "run", cmdline, err);
+	}
+
+	int status = 0;
+	int fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+	if (fd < 0)
+	{
+		/* kernels without pidfds wait synchronously */
+		waitpid(pid, &status, 0);
+		lua_pushinteger(L, exit_code(status));
+		return 1;
+	}
+
+	AsyncOp *op = op_create(L, ASYNC_PROCESS, cmdline);
+	op->fd = fd;
+	op->pid = pid;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = op;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		waitpid(pid, &status, 0);
+		op_destroy(r, op);
+		lua_pushinteger(L, exit_code(status));
+		return 1;
+	}
+	return op_wait(L, r, op);
+}
+
+static void reactor_poll(WinLuaAsync *r, unsigned long long timeout)
+{
+	struct epoll_event events[WINLUA_ASYNC_EVENTS];
+	int wait = (timeout == ~0ULL) ? -1 : static_cast<int>(timeout);
+	int count = epoll_wait(r->epfd, events, WINLUA_ASYNC_EVENTS, wait);
+	for (int i = 0; i < count; i++)
+	{
+		AsyncOp *op = static_cast<AsyncOp*>(events[i].data.ptr);
+		if (op == NULL)
+		{
+			/* offload completions */
+			uint64_t n;
+			std::vector<AsyncOp*> finished;
+			if (read(r->efd, &n, sizeof(n)) < 0) { continue; }
+			{
+				std::lock_guard<std::mutex> lock(r->offload->lock);
+				finished.swap(r->offload->finished);
+			}
+			for (size_t j = 0; j < finished.size(); j++)
+			{
+				op_finish(r, finished[j], finished[j]->err == 0, static_cast<unsigned long>(finished[j]->err));
+			}
+			continue;
+		}
+
+		int status = 0;
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, op->fd, NULL);
+		waitpid(op->pid, &status, 0);
+		op_finish(r, op, true, static_cast<unsigned long>(exit_code(status)));
+	}
+}
+
+static void reactor_cancel(WinLuaAsync *r, AsyncOp *op)
+{
+	if (op->kind == ASYNC_PROCESS)
+	{
+		int status;
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, op->fd, NULL);
+		waitpid(op->pid, &status, WNOHANG);
+		return;
+	}
+
+	/* the offload threads must be done with 'op' before it is destroyed */
+	AsyncOffload *q = r->offload;
+	std::unique_lock<std::mutex> lock(q->lock);
+	std::deque<AsyncOp*>::iterator queued = std::find(q->jobs.begin(), q->jobs.end(), op);
+	if (queued != q->jobs.end())
+	{
+		q->jobs.erase(queued);
+		return;
+	}
+	q->done.wait(lock, [op] { return !op->running; });
+	q->finished.erase(std::remove(q->finished.begin(), q->finished.end(), op), q->finished.end());
+}
+
+static void reactor_close(WinLuaAsync *r)
+{
+	if (r->offload != NULL)
+	{
+		{
+			std::lock_guard<std::mutex> lock(r->offload->lock);
+			r->offload->stop = true;
+		}
+		r->offload->work.notify_all();
+		for (size_t i = 0; i < r->offload->threads.size(); i++)
+		{
+			r->offload->threads[i].join();
+		}
+		delete r->offload;
+		r->offload = NULL;
+	}
+	close(r->efd);
+	close(r->epfd);
+}
+
+#endif
+
+/* ------------------------------------------------------------
+Tasks and the loop
+------------------------------------------------------------ */
+
+/*
+Start a task running the function at 'idx' with the values above it as arguments.
+*/
+static void task_create(lua_State *L, WinLuaAsync *r, int idx)
+{
+	int nargs = lua_gettop(L) - idx;
+	lua_State *T = lua_newthread(L);
+	lua_rotate(L, idx, 1);          /* thread below the function and arguments */
+	lua_xmove(L, T, nargs + 1);
+
+	get_reactor(L);
+	lua_getuservalue(L, -1);
+	lua_pushvalue(L, idx);
+	lua_rawsetp(L, -2, T);
+	lua_pop(L, 2);
+
+	r->tasks++;
+	r->ready->push_back(AsyncResume(T, nargs));
+}
+
+static void task_remove(lua_State *L, lua_State *T)
+{
+	get_reactor(L);
+	lua_getuservalue(L, -1);
+	lua_pushnil(L);
+	lua_rawsetp(L, -2, T);
+	lua_pop(L, 2);
+}
+
+static int async_task(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	WinLuaAsync *r = get_reactor(L);
+	lua_pop(L, 1);
+	task_create(L, r, 1);
+	return 1; /* the task thread */
+}
+
+static int async_sleep(lua_State *L)
+{
+	lua_Number ms = luaL_checknumber(L, 1);
+	luaL_argcheck(L, ms >= 0, 1, "negative duration");
+	WinLuaAsync *r = check_task(L, "sleep");
+	r->timers->insert(std::make_pair(now_ms() + static_cast<unsigned long long>(ms), L));
+	r->waiting = true;
+	return lua_yield(L, 0);
+}
+
+/*
+Cancel every operation and forget all tasks, after a task failed or
+when no task can make progress, so the next async.run starts clean.
+*/
+static void reactor_reset(lua_State *L, WinLuaAsync *r)
+{
+	while (!r->ops->empty())
+	{
+		AsyncOp *op = *r->ops->begin();
+		reactor_cancel(r, op);
+		op_destroy(r, op);
+	}
+	r->ready->clear();
+	r->timers->clear();
+	r->tasks = 0;
+	r->running = false;
+
+	get_reactor(L);
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+	lua_pop(L, 1);
+}
+
+/*
+async.run([fn, ...]) -- run tasks until all of them have finished
+*/
+static int async_run(lua_State *L)
+{
+	WinLuaAsync *r = get_reactor(L);
+	lua_pop(L, 1);
+	if (r->running)
+	{
+		return luaL_error(L, "async loop already running");
+	}
+	if (!lua_isnoneornil(L, 1))
+	{
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+		task_create(L, r, 1);
+		lua_pop(L, 1);
+	}
+
+	r->running = true;
+	while (r->tasks > 0)
+	{
+		/* resume everything that is ready; tasks queued meanwhile wait for the next round */
+		for (size_t n = r->ready->size(); n > 0; n--)
+		{
+			AsyncResume next = r->ready->front();
+			r->ready->pop_front();
+
+			lua_State *T = next.first;
+			r->waiting = false;
+			int status = lua_resume(T, L, next.second);
+			if (status == LUA_YIELD)
+			{
+				if (!r->waiting)
+				{
+					/* plain coroutine.yield: give the other tasks a turn */
+					lua_settop(T, 0);
+					r->ready->push_back(AsyncResume(T, 0));
+				}
+				continue;
+			}
+
+			r->tasks--;
+			if (status != LUA_OK)
+			{
+				const char *msg = lua_tostring(T, -1);
+				luaL_traceback(L, T, msg ? msg : "(error object is not a string)", 0);
+				reactor_reset(L, r);
+				return lua_error(L);
+			}
+			task_remove(L, T);
+		}
+
+		if (!r->ready->empty() || r->tasks == 0)
+		{
+			continue;
+		}
+		if (r->ops->empty() && r->timers->empty())
+		{
+			/* nothing left that could wake the remaining tasks */
+			int waiting = r->tasks;
+			reactor_reset(L, r);
+			return luaL_error(L, "deadlock: %d tasks waiting", waiting);
+		}
+
+		unsigned long long timeout = ~0ULL;
+		if (!r->timers->empty())
+		{
+			unsigned long long now = now_ms(), due = r->timers->begin()->first;
+			timeout = (due > now) ? due - now : 0;
+		}
+		if (!r->ops->empty() || timeout > 0)
+		{
+			reactor_poll(r, timeout);
+		}
+
+		unsigned long long now = now_ms();
+		while (!r->timers->empty() && r->timers->begin()->first <= now)
+		{
+			r->ready->push_back(AsyncResume(r->timers->begin()->second, 0));
+			r->timers->erase(r->timers->begin());
+		}
+	}
+	r->running = false;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* ------------------------------------------------------------
+Reactor userdata
+------------------------------------------------------------ */
+
+static int async__gc(lua_State *L)
+{
+	WinLuaAsync *r = static_cast<WinLuaAsync*>(luaL_checkudata(L, 1, WINLUA_ASYNC_META));
+	if (r->ops != NULL)
+	{
+		while (!r->ops->empty())
+		{
+			AsyncOp *op = *r->ops->begin();
+			reactor_cancel(r, op);
+			op_destroy(r, op);
+		}
+		reactor_close(r);
+		delete r->ops;
+		delete r->ready;
+		delete r->timers;
+		r->ops = NULL;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------
+WinLua Async module
+------------------------------------------------------------ */
+
+static const luaL_Reg library_methods[] = {
+	{"run", async_run},
+	{"task", async_task},
+	{"sleep", async_sleep},
+	{"read", async_read},
+	{"write", async_write},
+	{"spawn", async_spawn},
+	{NULL, NULL}
+};
+
+int luaopen_async(lua_State *L)
+{
+	luaL_newmetatable(L, WINLUA_ASYNC_META);
+	lua_pushcfunction(L, async__gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, library_methods);
+	return 1;
+}
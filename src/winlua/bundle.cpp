@@ -0,0 +1,525 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* ------------------------------------------------------------
+WinLua Bundle
+
+A bundle is an indexed archive of Lua chunks (source or bytecode),
+either appended to the executable or stored next to it as
+<name>.bundle. Layout, from the start of the bundle:
+
+	chunk data ...
+	index: WinLuaBundleEntry[count], sorted by module name
+	names: module names referenced by the index entries
+	trailer: WinLuaBundleTrailer
+
+The trailer sits at the very end of the file, so a bundle can be
+found behind an executable without knowing the executable size.
+------------------------------------------------------------ */
+
+#define WINLUA_BUNDLE_MAGIC "WLBUNDLE"
+#define WINLUA_BUNDLE_VERSION 1
+#define WINLUA_BUNDLE_BUILD_META "WinLuaBundleBuild"
+
+/* the entry has been precompiled to bytecode */
+#define WINLUA_BUNDLE_BINARY 0x1
+
+struct WinLuaBundleEntry
+{
+	DWORD nameoffset; /* offset of the name in the names area */
+	DWORD namelen;
+	DWORD flags;
+	DWORD reserved;
+	ULONGLONG offset; /* offset of the chunk from the start of the bundle */
+	ULONGLONG size;
+};
+
+struct WinLuaBundleTrailer
+{
+	char magic[8];
+	DWORD version;
+	DWORD count;
+	ULONGLONG indexoffset; /* offset of the index from the start of the bundle */
+	ULONGLONG bundlesize; /* size of the bundle including this trailer */
+};
+
+struct WinLuaBundle
+{
+	HANDLE file;
+	HANDLE mapping;
+	const char *view;
+	const char *base;
+	ULONGLONG size;
+	const WinLuaBundleEntry *entries;
+	const char *names;
+	DWORD count;
+};
+
+/* the bundle is mapped once per process and shared by all Lua states */
+static WinLuaBundle bundle_image = { INVALID_HANDLE_VALUE, NULL, NULL, NULL, 0, NULL, NULL, 0 };
+
+/* ------------------------------------------------------------
+Bundle mapping functions
+------------------------------------------------------------ */
+
+static bool bundle_map(const wchar_t *filename)
+{
+	HANDLE file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER filesize;
+	if (GetFileSizeEx(file, &filesize) == 0 || static_cast<ULONGLONG>(filesize.QuadPart) < sizeof(WinLuaBundleTrailer))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	const char *view = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : NULL;
+	if (view == NULL)
+	{
+		if (mapping) { CloseHandle(mapping); }
+		CloseHandle(file);
+		return false;
+	}
+
+	ULONGLONG total = filesize.QuadPart;
+	WinLuaBundleTrailer trailer;
+	memcpy(&trailer, view + total - sizeof(trailer), sizeof(trailer));
+
+	/*
+	Validate the trailer and every index entry before trusting any
+	offset in them. Each check subtracts from a size already known to
+	be in range, so a crafted offset cannot wrap the sum around.
+	*/
+	ULONGLONG indexsize = static_cast<ULONGLONG>(trailer.count) * sizeof(WinLuaBundleEntry);
+	ULONGLONG bodysize = trailer.bundlesize - sizeof(trailer);
+	bool ok = memcmp(trailer.magic, WINLUA_BUNDLE_MAGIC, sizeof(trailer.magic)) == 0
+		&& trailer.version == WINLUA_BUNDLE_VERSION
+		&& trailer.bundlesize >= sizeof(trailer)
+		&& trailer.bundlesize <= total
+		&& trailer.indexoffset <= bodysize
+		&& indexsize <= bodysize - trailer.indexoffset;
+
+	const char *base = ok ? view + (total - trailer.bundlesize) : NULL;
+	const WinLuaBundleEntry *entries = ok ? reinterpret_cast<const WinLuaBundleEntry*>(base + trailer.indexoffset) : NULL;
+	ULONGLONG namessize = ok ? bodysize - trailer.indexoffset - indexsize : 0;
+	for (DWORD i = 0; ok && i < trailer.count; i++)
+	{
+		WinLuaBundleEntry entry;
+		memcpy(&entry, &entries[i], sizeof(entry));
+		ok = entry.nameoffset <= namessize
+			&& entry.namelen <= namessize - entry.nameoffset
+			&& entry.offset <= trailer.indexoffset
+			&& entry.size <= trailer.indexoffset - entry.offset;
+	}
+
+	if (!ok)
+	{
+		UnmapViewOfFile(view);
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	bundle_image.file = file;
+	bundle_image.mapping = mapping;
+	bundle_image.view = view;
+	bundle_image.base = base;
+	bundle_image.size = trailer.bundlesize;
+	bundle_image.entries = entries;
+	bundle_image.names = base + trailer.indexoffset + indexsize;
+	bundle_image.count = trailer.count;
+	return true;
+}
+
+static const WinLuaBundleEntry *bundle_find(const char *name, size_t namelen)
+{
+	size_t lo = 0, hi = bundle_image.count;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		const WinLuaBundleEntry *entry = &bundle_image.entries[mid];
+		int cmp = memcmp(name, bundle_image.names + entry->nameoffset, std::min<size_t>(namelen, entry->namelen));
+		if (cmp == 0)
+		{
+			cmp = (namelen < entry->namelen) ? -1 : (namelen > entry->namelen) ? 1 : 0;
+		}
+
+		if (cmp == 0) { return entry; }
+		if (cmp < 0) { hi = mid; }
+		else { lo = mid + 1; }
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------
+WinLua Bundle functions
+------------------------------------------------------------ */
+
+/*
+Map the bundle appended to the running executable, or the
+sidecar bundle next to it. Returns false if there is none.
+*/
+bool winlua_bundle_open()
+{
+	wchar_t filename[MAX_PATH + 8];
+	DWORD len = GetModuleFileNameW(NULL, filename, MAX_PATH);
+	if (len == 0 || len >= MAX_PATH)
+	{
+		return false;
+	}
+
+	if (bundle_map(filename))
+	{
+		return true;
+	}
+
+	/* winlua.exe -> winlua.bundle */
+	if (len > 4 && _wcsicmp(filename + len - 4, L".exe") == 0)
+	{
+		len -= 4;
+	}
+	wcscpy(filename + len, L".bundle");
+	return bundle_map(filename);
+}
+
+void winlua_bundle_close()
+{
+	if (bundle_image.view == NULL)
+	{
+		return;
+	}
+
+	UnmapViewOfFile(bundle_image.view);
+	CloseHandle(bundle_image.mapping);
+	CloseHandle(bundle_image.file);
+	bundle_image.view = NULL;
+	bundle_image.count = 0;
+}
+
+bool winlua_bundle_contains(const char *name)
+{
+	return bundle_find(name, strlen(name)) != NULL;
+}
+
+struct WinLuaBundleReader
+{
+	const char *data;
+	size_t size;
+};
+
+/* hands the whole mapped chunk to the parser in one piece */
+static const char *bundle_reader(lua_State *L, void *ud, size_t *size)
+{
+	WinLuaBundleReader *reader = static_cast<WinLuaBundleReader*>(ud);
+	*size = reader->size;
+	reader->size = 0;
+	return (*size > 0) ? reader->data : NULL;
+}
+
+int winlua_bundle_load(lua_State *L, const char *name)
+{
+	const WinLuaBundleEntry *entry = bundle_find(name, strlen(name));
+	if (entry == NULL)
+	{
+		lua_pushfstring(L, "module '%s' not found in bundle", name);
+		return LUA_ERRFILE;
+	}
+
+	WinLuaBundleReader reader = { bundle_image.base + entry->offset, static_cast<size_t>(entry->size) };
+	lua_pushfstring(L, "@bundle:%s", name);
+	int status = lua_load(L, bundle_reader, &reader, lua_tostring(L, -1), (entry->flags & WINLUA_BUNDLE_BINARY) ? "b" : "t");
+	lua_remove(L, -2); // pop chunk name
+	return status;
+}
+
+/*
+Searcher for modules stored in the bundle. Module names are
+looked up verbatim, so 'a.b' must be stored as 'a.b'.
+*/
+static int bundle_searcher(lua_State *L)
+{
+	size_t namelen;
+	const char *name = luaL_checklstring(L, 1, &namelen);
+
+	if (bundle_find(name, namelen) == NULL)
+	{
+		lua_pushfstring(L, "\n\tno module '%s' in bundle", name);
+		return 1;
+	}
+
+	if (winlua_bundle_load(L, name) != LUA_OK)
+	{
+		return luaL_error(L, "error loading module '%s' from bundle:\n\t%s", name, lua_tostring(L, -1));
+	}
+
+	lua_pushliteral(L, "bundle");
+	return 2;
+}
+
+void winlua_install_bundle_searcher(lua_State *L)
+{
+	if (bundle_image.view == NULL)
+	{
+		return;
+	}
+
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "searchers");
+
+	/* insert after the preload searcher, ahead of the file searchers */
+	for (lua_Integer i = luaL_len(L, -1); i >= 2; i--)
+	{
+		lua_rawgeti(L, -1, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushcfunction(L, bundle_searcher);
+	lua_rawseti(L, -2, 2);
+	lua_pop(L, 2); // pop searchers and package table
+}
+
+/* ------------------------------------------------------------
+Bundle module functions
+------------------------------------------------------------ */
+
+static int bundle_list(lua_State *L)
+{
+	lua_createtable(L, bundle_image.count, 0);
+	for (DWORD i = 0; i < bundle_image.count; i++)
+	{
+		const WinLuaBundleEntry *entry = &bundle_image.entries[i];
+		lua_pushlstring(L, bundle_image.names + entry->nameoffset, entry->namelen);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+struct WinLuaBundleItem
+{
+	std::string name;
+	std::string data;
+	DWORD flags;
+};
+
+/* everything bundle_build collects; boxed so a Lua error frees it */
+struct WinLuaBundleBuild
+{
+	std::vector<WinLuaBundleItem> items;
+	std::string stubdata;
+	std::vector<WinLuaBundleEntry> entries;
+	std::string names;
+};
+
+static int bundle_build__gc(lua_State *L)
+{
+	WinLuaBundleBuild **box = static_cast<WinLuaBundleBuild**>(luaL_checkudata(L, 1, WINLUA_BUNDLE_BUILD_META));
+	delete *box;
+	*box = NULL;
+	return 0;
+}
+
+static bool bundle_item_less(const WinLuaBundleItem& a, const WinLuaBundleItem& b)
+{
+	return a.name < b.name;
+}
+
+static int bundle_dump_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+	return 0;
+}
+
+static bool bundle_read_file(const wchar_t *filename, std::string& data)
+{
+	HANDLE file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	bool ok = GetFileSizeEx(file, &size) != 0;
+	if (ok)
+	{
+		DWORD read = 0;
+		data.resize(static_cast<size_t>(size.QuadPart));
+		ok = data.empty() || (ReadFile(file, &data[0], static_cast<DWORD>(data.size()), &read, NULL) != 0 && read == data.size());
+	}
+	CloseHandle(file);
+	return ok;
+}
+
+static bool bundle_write(HANDLE file, const void *data, size_t size)
+{
+	DWORD written = 0;
+	return WriteFile(file, data, static_cast<DWORD>(size), &written, NULL) != 0 && written == size;
+}
+
+/*
+bundle.build(output, modules [, options])
+
+modules maps module names to Lua files; the entry point is the module
+named 'main'. Options:
+	stub -> executable to prepend (produces a single-file application)
+	compile -> store precompiled bytecode instead of source
+	strip -> strip debug information from the bytecode
+*/
+static int bundle_build(lua_State *L)
+{
+	const char *output = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	const char *stub = NULL;
+	bool compile = false, strip = false;
+	WinLuaScratch scratch(L);
+
+	if (lua_istable(L, 3))
+	{
+		lua_getfield(L, 3, "stub");
+		stub = lua_tostring(L, -1);
+		lua_getfield(L, 3, "compile");
+		compile = lua_toboolean(L, -1) != 0;
+		lua_getfield(L, 3, "strip");
+		strip = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 2); // keep stub name on the stack
+	}
+
+	/* the box goes on the stack first so a failed read or compile still frees what was collected */
+	WinLuaBundleBuild **box = static_cast<WinLuaBundleBuild**>(lua_newuserdata(L, sizeof(WinLuaBundleBuild*)));
+	*box = NULL;
+	if (luaL_newmetatable(L, WINLUA_BUNDLE_BUILD_META))
+	{
+		lua_pushcfunction(L, bundle_build__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	*box = new WinLuaBundleBuild;
+	std::vector<WinLuaBundleItem>& items = (*box)->items;
+
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0)
+	{
+		/* luaL_checkstring would convert a number key in place and confuse lua_next */
+		if (lua_type(L, -2) != LUA_TSTRING)
+		{
+			return luaL_error(L, "module name must be a string, got %s", luaL_typename(L, -2));
+		}
+		items.push_back(WinLuaBundleItem());
+		WinLuaBundleItem& item = items.back();
+		item.name = lua_tostring(L, -2);
+		const char *filename = luaL_checkstring(L, -1);
+		item.flags = 0;
+
+		if (compile)
+		{
+			if (luaL_loadfile(L, filename) != LUA_OK)
+			{
+				return lua_error(L);
+			}
+			lua_dump(L, bundle_dump_writer, &item.data, strip ? 1 : 0);
+			lua_pop(L, 1); // pop compiled function
+			item.flags |= WINLUA_BUNDLE_BINARY;
+		}
+		else
+		{
+			wchar_t *filenameW = scratch.wstring(filename);
+			if (!bundle_read_file(filenameW, item.data))
+			{
+				return luaL_error(L, "could not read '%s' (%d)", filename, GetLastError());
+			}
+		}
+
+		lua_pop(L, 1); // pop value, keep key for next iteration
+	}
+	std::sort(items.begin(), items.end(), bundle_item_less);
+
+	std::string& stubdata = (*box)->stubdata;
+	if (stub != NULL)
+	{
+		wchar_t *stubW = scratch.wstring(stub);
+		if (!bundle_read_file(stubW, stubdata))
+		{
+			return luaL_error(L, "could not read stub '%s' (%d)", stub, GetLastError());
+		}
+	}
+
+	/* lay out chunk data, index and names */
+	std::vector<WinLuaBundleEntry>& entries = (*box)->entries;
+	std::string& names = (*box)->names;
+	entries.resize(items.size());
+	ULONGLONG offset = 0;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		WinLuaBundleEntry& entry = entries[i];
+		memset(&entry, 0, sizeof(entry));
+		entry.nameoffset = static_cast<DWORD>(names.size());
+		entry.namelen = static_cast<DWORD>(items[i].name.size());
+		entry.flags = items[i].flags;
+		entry.offset = offset;
+		entry.size = items[i].data.size();
+		names += items[i].name;
+		offset += items[i].data.size();
+	}
+
+	WinLuaBundleTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	memcpy(trailer.magic, WINLUA_BUNDLE_MAGIC, sizeof(trailer.magic));
+	trailer.version = WINLUA_BUNDLE_VERSION;
+	trailer.count = static_cast<DWORD>(entries.size());
+	trailer.indexoffset = offset;
+	trailer.bundlesize = offset + entries.size() * sizeof(WinLuaBundleEntry) + names.size() + sizeof(trailer);
+
+	wchar_t *outputW = scratch.wstring(output);
+	HANDLE file = CreateFileW(outputW, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return luaL_error(L, "could not create bundle '%s' (%d)", output, GetLastError());
+	}
+
+	bool ok = bundle_write(file, stubdata.data(), stubdata.size());
+	for (size_t i = 0; ok && i < items.size(); i++)
+	{
+		ok = bundle_write(file, items[i].data.data(), items[i].data.size());
+	}
+	ok = ok && (entries.empty() || bundle_write(file, &entries[0], entries.size() * sizeof(WinLuaBundleEntry)))
+		&& bundle_write(file, names.data(), names.size())
+		&& bundle_write(file, &trailer, sizeof(trailer));
+	DWORD err = GetLastError();
+	CloseHandle(file);
+
+	if (!ok)
+	{
+		return luaL_error(L, "could not write bundle '%s' (%d)", output, err);
+	}
+
+	/* release the collected chunks now rather than at collection */
+	lua_Integer count = static_cast<lua_Integer>(items.size());
+	delete *box;
+	*box = NULL;
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/* ------------------------------------------------------------
+WinLua Bundle module
+------------------------------------------------------------ */
+
+static const luaL_Reg library_methods[] = {
+	{"build", bundle_build},
+	{"list", bundle_list},
+	{NULL, NULL}
+};
+
+int luaopen_bundle(lua_State *L)
+{
+	luaL_newlib(L, library_methods);
+	return 1;
+}
@@ -0,0 +1,487 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ------------------------------------------------------------
+WinLua Chunk Cache
+
+Precompiled chunks are stored in %LOCALAPPDATA%\winlua\cache
+(or %WINLUA_CACHEDIR%), one file per source file. A cache file
+is only used when the source path, size and modification time
+and the interpreter version all match the stored header.
+Set WINLUA_NOCACHE to bypass the cache entirely. Elsewhere (the
+benchmark suite runs it there) the cache lives in $WINLUA_CACHEDIR
+or $XDG_CACHE_HOME/winlua, falling back to ~/.cache/winlua.
+------------------------------------------------------------ */
+
+/* bump when the layout of the cache files changes */
+#define WINLUA_CACHE_VERSION 2
+#define WINLUA_CACHE_MAGIC "WLCHUNK"
+
+#ifdef _WIN32
+#define WINLUA_CACHE_MAXPATH MAX_PATH
+typedef wchar_t CacheChar;
+typedef HANDLE CacheFile;
+#define WINLUA_CACHE_NOFILE INVALID_HANDLE_VALUE
+#else
+#define WINLUA_CACHE_MAXPATH PATH_MAX
+typedef char CacheChar;
+typedef FILE *CacheFile;
+#define WINLUA_CACHE_NOFILE NULL
+#endif
+
+struct WinLuaCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t luaversion;
+	uint32_t pathlen; /* length of the full source path in characters */
+	uint32_t reserved;
+	uint64_t sourcetime;
+	uint64_t sourcesize;
+	uint64_t chunksize;
+};
+
+/* what a cache file must match: the source's full path, size and modification time */
+struct WinLuaCacheSource
+{
+	CacheChar path[WINLUA_CACHE_MAXPATH];
+	uint32_t pathlen;
+	uint64_t time;
+	uint64_t size;
+};
+
+struct WinLuaCacheWriter
+{
+	CacheFile file;
+	uint64_t written;
+	bool failed;
+};
+
+/* ------------------------------------------------------------
+Platform helpers
+------------------------------------------------------------ */
+#ifdef _WIN32
+
+static bool cache_enabled()
+{
+	return GetEnvironmentVariableW(L"WINLUA_NOCACHE", NULL, 0) == 0;
+}
+
+static bool cache_directory(wchar_t *buff, DWORD bufflen)
+{
+	DWORD len = GetEnvironmentVariableW(L"WINLUA_CACHEDIR", buff, bufflen);
+	if (len > 0 && len < bufflen)
+	{
+		CreateDirectoryW(buff, NULL);
+		return true;
+	}
+
+	len = GetEnvironmentVariableW(L"LOCALAPPDATA", buff, bufflen);
+	if (len == 0 || len + 14 >= bufflen)
+	{
+		return false;
+	}
+
+	/* create the directories one level at a time */
+	wcscpy(buff + len, L"\\winlua");
+	CreateDirectoryW(buff, NULL);
+	wcscpy(buff + len + 7, L"\\cache");
+	if (CreateDirectoryW(buff, NULL) == 0 && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		return false;
+	}
+	return true;
+}
+
+static bool cache_source(lua_State *L, const char *filename, WinLuaCacheSource& src)
+{
+	WinLuaScratch scratch(L);
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	DWORD pathlen = GetFullPathNameW(scratch.wstring(filename), MAX_PATH, src.path, NULL);
+	if (pathlen == 0 || pathlen >= MAX_PATH || GetFileAttributesExW(src.path, GetFileExInfoStandard, &info) == 0)
+	{
+		return false;
+	}
+	src.pathlen = pathlen;
+	src.time = (static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+	src.size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	return true;
+}
+
+/* what a path character adds to the file name hash */
+static uint32_t cache_hashunit(wchar_t c)
+{
+	CharLowerBuffW(&c, 1);
+	return static_cast<uint16_t>(c);
+}
+
+static CacheFile cache_open(const CacheChar *path, bool write)
+{
+	if (write)
+	{
+		return CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	}
+	return CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+}
+
+static bool cache_close(CacheFile file)
+{
+	return CloseHandle(file) != 0;
+}
+
+static bool read_exactly(HANDLE file, void *buff, size_t size)
+{
+	DWORD read = 0;
+	return ReadFile(file, buff, static_cast<DWORD>(size), &read, NULL) != 0 && read == size;
+}
+
+static bool write_exactly(HANDLE file, const void *buff, size_t size)
+{
+	DWORD written = 0;
+	return WriteFile(file, buff, static_cast<DWORD>(size), &written, NULL) != 0 && written == size;
+}
+
+static bool cache_rewind(HANDLE file)
+{
+	LARGE_INTEGER start;
+	start.QuadPart = 0;
+	return SetFilePointerEx(file, start, NULL, FILE_BEGIN) != 0;
+}
+
+static void cache_tempname(const wchar_t *cachefile, wchar_t *buff, size_t bufflen)
+{
+	_snwprintf(buff, bufflen, L"%s.%lu.tmp", cachefile, GetCurrentProcessId());
+}
+
+/* move the written temporary file into place, or remove it */
+static void cache_commit(const wchar_t *tempfile, const wchar_t *cachefile, bool ok)
+{
+	if (!ok || MoveFileExW(tempfile, cachefile, MOVEFILE_REPLACE_EXISTING) == 0)
+	{
+		DeleteFileW(tempfile);
+	}
+}
+
+#else
+
+static bool cache_enabled()
+{
+	return getenv("WINLUA_NOCACHE") == NULL;
+}
+
+static bool cache_directory(char *buff, size_t bufflen)
+{
+	const char *dir = getenv("WINLUA_CACHEDIR");
+	if (dir != NULL && *dir != '\0' && strlen(dir) < bufflen)
+	{
+		strcpy(buff, dir);
+		mkdir(buff, 0755);
+		return true;
+	}
+
+	const char *base = getenv("XDG_CACHE_HOME");
+	bool home = base == NULL || *base == '\0';
+	if (home) { base = getenv("HOME"); }
+	if (base == NULL || strlen(base) + 15 >= bufflen)
+	{
+		return false;
+	}
+
+	/* create the directories one level at a time */
+	strcpy(buff, base);
+	if (home)
+	{
+		strcat(buff, "/.cache");
+		mkdir(buff, 0755);
+	}
+	strcat(buff, "/winlua");
+	return mkdir(buff, 0755) == 0 || errno == EEXIST;
+}
+
+static bool cache_source(lua_State *L, const char *filename, WinLuaCacheSource& src)
+{
+	(void)L;
+	struct stat st;
+	if (realpath(filename, src.path) == NULL || stat(src.path, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+	src.pathlen = static_cast<uint32_t>(strlen(src.path));
+#ifdef __linux__
+	src.time = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000u + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+#else
+	src.time = static_cast<uint64_t>(st.st_mtime);
+#endif
+	src.size = static_cast<uint64_t>(st.st_size);
+	return true;
+}
+
+static uint32_t cache_hashunit(char c)
+{
+	return static_cast<unsigned char>(c);
+}
+
+static CacheFile cache_open(const CacheChar *path, bool write)
+{
+	return fopen(path, write ? "wb" : "rb");
+}
+
+static bool cache_close(CacheFile file)
+{
+	return fclose(file) == 0;
+}
+
+static bool read_exactly(FILE *file, void *buff, size_t size)
+{
+	return fread(buff, 1, size, file) == size;
+}
+
+static bool write_exactly(FILE *file, const void *buff, size_t size)
+{
+	return fwrite(buff, 1, size, file) == size;
+}
+
+static bool cache_rewind(FILE *file)
+{
+	return fseek(file, 0, SEEK_SET) == 0;
+}
+
+static void cache_tempname(const char *cachefile, char *buff, size_t bufflen)
+{
+	snprintf(buff, bufflen, "%s.%ld.tmp", cachefile, static_cast<long>(getpid()));
+}
+
+static void cache_commit(const char *tempfile, const char *cachefile, bool ok)
+{
+	if (!ok || rename(tempfile, cachefile) != 0)
+	{
+		remove(tempfile);
+	}
+}
+
+#endif
+
+/*
+The cache file name is a FNV-1a hash of the full path (lower-cased on
+Windows); the path itself is stored in the file to rule out collisions.
+*/
+static bool cache_filename(const WinLuaCacheSource& src, CacheChar *buff, size_t bufflen)
+{
+	if (!cache_directory(buff, static_cast<uint32_t>(bufflen)))
+	{
+		return false;
+	}
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint32_t i = 0; i < src.pathlen; i++)
+	{
+		hash = (hash ^ cache_hashunit(src.path[i])) * 1099511628211ULL;
+	}
+
+#ifdef _WIN32
+	size_t dirlen = wcslen(buff);
+	if (dirlen + 23 >= bufflen)
+	{
+		return false;
+	}
+	_snwprintf(buff + dirlen, bufflen - dirlen, L"\\%016llx.luac", hash);
+#else
+	size_t dirlen = strlen(buff);
+	if (dirlen + 23 >= bufflen)
+	{
+		return false;
+	}
+	snprintf(buff + dirlen, bufflen - dirlen, "/%016llx.luac", static_cast<unsigned long long>(hash));
+#endif
+	return true;
+}
+
+/* ------------------------------------------------------------
+Cache loading and storing
+------------------------------------------------------------ */
+
+static int cache_load(lua_State *L, const char *filename, const WinLuaCacheSource& src, const CacheChar *cachefile)
+{
+	CacheFile file = cache_open(cachefile, false);
+	if (file == WINLUA_CACHE_NOFILE)
+	{
+		return LUA_ERRFILE;
+	}
+
+	WinLuaCacheHeader header;
+	if (!read_exactly(file, &header, sizeof(header))
+		|| memcmp(header.magic, WINLUA_CACHE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != WINLUA_CACHE_VERSION
+		|| header.luaversion != LUA_VERSION_NUM
+		|| header.pathlen != src.pathlen
+		|| header.sourcesize != src.size
+		|| header.sourcetime != src.time
+		|| header.chunksize > 0xffffffffu)
+	{
+		cache_close(file);
+		return LUA_ERRFILE;
+	}
+
+	CacheChar storedpath[WINLUA_CACHE_MAXPATH];
+	if (!read_exactly(file, storedpath, sizeof(CacheChar) * src.pathlen) || memcmp(storedpath, src.path, sizeof(CacheChar) * src.pathlen) != 0)
+	{
+		cache_close(file);
+		return LUA_ERRFILE;
+	}
+
+	size_t chunksize = static_cast<size_t>(header.chunksize);
+	lua_pushfstring(L, "@%s", filename);
+	char *chunk = static_cast<char*>(lua_newuserdata(L, chunksize));
+	bool complete = read_exactly(file, chunk, chunksize);
+	cache_close(file);
+
+	int status = complete ? luaL_loadbufferx(L, chunk, chunksize, lua_tostring(L, -2), "b") : LUA_ERRFILE;
+	if (status == LUA_OK)
+	{
+		lua_replace(L, -3); // replace chunk name with loaded function
+		lua_pop(L, 1); // pop temporary buffer
+	}
+	else
+	{
+		lua_pop(L, complete ? 3 : 2); // pop chunk name, buffer and error message
+	}
+	return status;
+}
+
+static int cache_writer(lua_State *, const void *p, size_t sz, void *ud)
+{
+	WinLuaCacheWriter *writer = static_cast<WinLuaCacheWriter*>(ud);
+	if (!write_exactly(writer->file, p, sz))
+	{
+		writer->failed = true;
+		return 1;
+	}
+	writer->written += sz;
+	return 0;
+}
+
+/*
+Dump the function at the top of the stack into the cache. The file is
+written under a temporary name and moved into place, so concurrent
+instances never see a partially written cache file.
+*/
+static void cache_store(lua_State *L, const WinLuaCacheSource& src, const CacheChar *cachefile)
+{
+	CacheChar tempfile[WINLUA_CACHE_MAXPATH + 32];
+	cache_tempname(cachefile, tempfile, WINLUA_CACHE_MAXPATH + 32);
+
+	CacheFile file = cache_open(tempfile, true);
+	if (file == WINLUA_CACHE_NOFILE)
+	{
+		return;
+	}
+
+	WinLuaCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, WINLUA_CACHE_MAGIC, sizeof(header.magic));
+	header.version = WINLUA_CACHE_VERSION;
+	header.luaversion = LUA_VERSION_NUM;
+	header.pathlen = src.pathlen;
+	header.sourcetime = src.time;
+	header.sourcesize = src.size;
+
+	/* the header is written twice: once to reserve space and once more with the chunk size */
+	WinLuaCacheWriter writer = { file, 0, false };
+	bool ok = write_exactly(file, &header, sizeof(header))
+		&& write_exactly(file, src.path, sizeof(CacheChar) * src.pathlen)
+		&& lua_dump(L, cache_writer, &writer, 0) == 0
+		&& !writer.failed;
+
+	if (ok)
+	{
+		header.chunksize = writer.written;
+		ok = cache_rewind(file) && write_exactly(file, &header, sizeof(header));
+	}
+	ok = cache_close(file) && ok;
+	cache_commit(tempfile, cachefile, ok);
+}
+
+/* ------------------------------------------------------------
+WinLua Chunk Cache functions
+------------------------------------------------------------ */
+
+/*
+Drop-in replacement for luaL_loadfile which goes through the chunk cache.
+*/
+int winlua_loadfile(lua_State *L, const char *filename)
+{
+	if (!cache_enabled())
+	{
+		return luaL_loadfile(L, filename);
+	}
+
+	WinLuaCacheSource src;
+	CacheChar cachefile[WINLUA_CACHE_MAXPATH];
+	if (!cache_source(L, filename, src) || !cache_filename(src, cachefile, WINLUA_CACHE_MAXPATH))
+	{
+		return luaL_loadfile(L, filename);
+	}
+
+	if (cache_load(L, filename, src, cachefile) == LUA_OK)
+	{
+		return LUA_OK;
+	}
+
+	int status = luaL_loadfile(L, filename);
+	if (status == LUA_OK)
+	{
+		cache_store(L, src, cachefile);
+	}
+	return status;
+}
+
+/*
+Replacement for the Lua file searcher in package.searchers.
+
+upvalues:
+	1 -> package table
+*/
+static int cache_searcher(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+
+	lua_getfield(L, lua_upvalueindex(1), "searchpath");
+	lua_pushvalue(L, 1);
+	if (lua_getfield(L, lua_upvalueindex(1), "path") != LUA_TSTRING)
+	{
+		return luaL_error(L, "'package.path' must be a string");
+	}
+	lua_call(L, 2, 2);
+
+	if (lua_isnil(L, -2))
+	{
+		return 1; /* module not found in this path; return error message */
+	}
+
+	const char *filename = lua_tostring(L, -2);
+	if (winlua_loadfile(L, filename) != LUA_OK)
+	{
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, filename, lua_tostring(L, -1));
+	}
+
+	lua_pushstring(L, filename); /* will be 2nd argument to module */
+	return 2;
+}
+
+void winlua_install_cache_searcher(lua_State *L)
+{
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "searchers");
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, cache_searcher, 1);
+	lua_rawseti(L, -2, 2); /* replace the default Lua file searcher */
+	lua_pop(L, 2); // pop searchers and package table
+}
@@ -0,0 +1,928 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* ------------------------------------------------------------
+WinLua File Copies
+
+	fs.copy(src, dst [, options])      -> true, or nil, message, code
+	fs.copy_tree(src, dst [, options]) -> files, bytes, errors
+
+Both copy inside the kernel instead of through Lua strings: on
+Windows with CopyFileExW (which clones blocks on ReFS by itself),
+on Linux with a reflink where the file system has them (btrfs,
+xfs), then copy_file_range, then sendfile, and only then a
+read/write loop. Permissions and, unless 'times' is false, access
+and modification times are carried over.
+
+fs.copy_tree first lists the source tree on the calling thread,
+creating the destination directories as it goes, then copies the
+files on a pool of workers, largest first so one big file does not
+hold up the end of the copy. Existing directories are merged into.
+Symbolic links are copied as links. A destination inside the
+source tree is left out of the listing, so the copy does not descend
+into itself. It returns the number of files copied, their size in
+bytes and a list of {path = src, error = code} for the entries that
+failed.
+
+Copying a file or tree onto itself (the same path, or another name
+of the same file) fails with EINVAL (ERROR_INVALID_PARAMETER on
+Windows) instead of truncating the source.
+
+options:
+	overwrite  replace existing files (default true)
+	times      keep access and modification times (default true)
+	threads    copy workers for fs.copy_tree (default: hardware threads)
+	progress   function(files_done, files_total, bytes_done, bytes_total)
+	           called on the calling thread while fs.copy_tree runs; it
+	           stops the copy by returning false, and fs.copy_tree then
+	           returns nil, "cancelled"
+	interval   milliseconds between progress calls (default 100)
+------------------------------------------------------------ */
+#define WINLUA_COPY_INTERVAL 100
+#define WINLUA_COPY_MAXTHREADS 64
+#define WINLUA_COPY_CHUNK (8 << 20) /* bytes per kernel copy call, so progress and cancel stay responsive */
+#define WINLUA_COPY_UNBUFFERED (256 << 20) /* files this large bypass the cache on Windows */
+
+#ifdef _WIN32
+#define COPY_SEP '\\'
+#else
+#define COPY_SEP '/'
+#ifdef __linux__
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+#endif
+
+struct CopyOptions
+{
+	bool overwrite;
+	bool times;
+};
+
+/* shared by the workers of one copy */
+struct CopyCounter
+{
+	std::atomic<uint64_t> bytes;
+	std::atomic<bool> stop;
+
+	CopyCounter() : bytes(0), stop(false) {}
+};
+
+struct CopyEntry
+{
+	std::string src, dst;
+	uint64_t size;
+	bool link;
+};
+
+struct CopyDir
+{
+	std::string dst;
+#ifdef _WIN32
+	FILETIME created, accessed, written;
+#else
+	mode_t mode;
+	struct timespec accessed, written;
+#endif
+};
+
+struct CopyError
+{
+	std::string path;
+	int error;
+};
+
+static std::string copy_join(const std::string& dir, const char *name)
+{
+	std::string path;
+	path.reserve(dir.size() + strlen(name) + 1);
+	path = dir;
+	if (!path.empty() && path[path.size() - 1] != '/' && path[path.size() - 1] != COPY_SEP)
+	{
+		path += COPY_SEP;
+	}
+	path += name;
+	return path;
+}
+
+/* ------------------------------------------------------------
+Single files
+------------------------------------------------------------ */
+
+#ifdef _WIN32
+
+static void copy_wide(const std::string& path, const char *suffix, std::vector<uint16_t>& out)
+{
+	size_t len = path.size(), extra = strlen(suffix);
+	out.resize(len + extra + 1);
+	size_t n = winlua_utf8_to_utf16(path.data(), len, &out[0]);
+	n += winlua_utf8_to_utf16(suffix, extra, &out[n]);
+	out[n] = 0;
+}
+
+static LPCWSTR wide_path(const std::vector<uint16_t>& path)
+{
+	return reinterpret_cast<LPCWSTR>(&path[0]);
+}
+
+struct CopyProgressState
+{
+	CopyCounter *counter;
+	uint64_t reported;
+};
+
+static DWORD CALLBACK copy_progress_routine(LARGE_INTEGER, LARGE_INTEGER transferred, LARGE_INTEGER, LARGE_INTEGER,
+	DWORD, DWORD, HANDLE, HANDLE, LPVOID data)
+{
+	CopyProgressState *state = static_cast<CopyProgressState*>(data);
+	uint64_t now = static_cast<uint64_t>(transferred.QuadPart);
+	if (now > state->reported)
+	{
+		state->counter->bytes += now - state->reported;
+		state->reported = now;
+	}
+	return state->counter->stop ? PROGRESS_CANCEL : PROGRESS_CONTINUE;
+}
+
+static int set_file_times(const std::vector<uint16_t>& path, const FILETIME *created, const FILETIME *accessed, const FILETIME *written)
+{
+	HANDLE file = CreateFileW(wide_path(path), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return static_cast<int>(GetLastError());
+	}
+	int err = SetFileTime(file, created, accessed, written) ? 0 : static_cast<int>(GetLastError());
+	CloseHandle(file);
+	return err;
+}
+
+/* volume and file index of a file or directory */
+static bool copy_identity(const std::vector<uint16_t>& path, uint64_t& volume, uint64_t& id)
+{
+	HANDLE file = CreateFileW(wide_path(path), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return false; }
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ret = GetFileInformationByHandle(file, &info);
+	CloseHandle(file);
+	if (ret == 0) { return false; }
+	volume = info.dwVolumeSerialNumber;
+	id = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+	return true;
+}
+
+static int copy_file(const CopyEntry& e, const CopyOptions& opts, CopyCounter& counter)
+{
+	std::vector<uint16_t> srcW, dstW;
+	copy_wide(e.src, "", srcW);
+	copy_wide(e.dst, "", dstW);
+
+	/* the destination first: it usually does not exist yet, which settles it */
+	uint64_t dstvolume, dstid, srcvolume, srcid;
+	if (!e.link && opts.overwrite && copy_identity(dstW, dstvolume, dstid) &&
+		copy_identity(srcW, srcvolume, srcid) && dstvolume == srcvolume && dstid == srcid)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DWORD flags = 0;
+	if (!opts.overwrite) { flags |= COPY_FILE_FAIL_IF_EXISTS; }
+	if (e.link) { flags |= COPY_FILE_COPY_SYMLINK; }
+	if (e.size >= WINLUA_COPY_UNBUFFERED) { flags |= COPY_FILE_NO_BUFFERING; }
+
+	CopyProgressState state;
+	state.counter = &counter;
+	state.reported = 0;
+	if (CopyFileExW(wide_path(srcW), wide_path(dstW), copy_progress_routine, &state, NULL, flags) == 0)
+	{
+		return static_cast<int>(GetLastError());
+	}
+
+	/* CopyFileExW always keeps the modification time; without 'times' the copy is new */
+	if (!opts.times)
+	{
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+		return set_file_times(dstW, NULL, &now, &now);
+	}
+	return 0;
+}
+
+#else
+
+static void stat_times(const struct stat& st, struct timespec times[2])
+{
+#ifdef __linux__
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+#else
+	times[0].tv_sec = st.st_atime;
+	times[0].tv_nsec = 0;
+	times[1].tv_sec = st.st_mtime;
+	times[1].tv_nsec = 0;
+#endif
+}
+
+static int copy_link(const CopyEntry& e, const CopyOptions& opts)
+{
+	struct stat st;
+	if (lstat(e.src.c_str(), &st) != 0) { return errno; }
+	std::vector<char> target(static_cast<size_t>(st.st_size > 0 ? st.st_size : PATH_MAX) + 1);
+	ssize_t n = readlink(e.src.c_str(), &target[0], target.size() - 1);
+	if (n < 0) { return errno; }
+	target[static_cast<size_t>(n)] = '\0';
+
+	if (symlink(&target[0], e.dst.c_str()) != 0)
+	{
+		if (errno != EEXIST || !opts.overwrite) { return errno; }
+		if (unlink(e.dst.c_str()) != 0 || symlink(&target[0], e.dst.c_str()) != 0) { return errno; }
+	}
+	if (opts.times)
+	{
+		struct timespec times[2];
+		stat_times(st, times);
+		utimensat(AT_FDCWD, e.dst.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+	return 0;
+}
+
+static int copy_write_all(int out, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(out, data, len);
+		if (n < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return errno;
+		}
+		data += n;
+		len -= static_cast<size_t>(n);
+	}
+	return 0;
+}
+
+/* copy everything from the current offset of 'in' to 'out' */
+static int copy_data(int in, int out, uint64_t size, CopyCounter& counter)
+{
+#ifdef __linux__
+	/* a reflink shares the blocks outright */
+	if (size > 0 && ioctl(out, FICLONE, in) == 0)
+	{
+		counter.bytes += size;
+		return 0;
+	}
+	/* both calls move the file offsets, so a later fallback carries on where they stopped */
+#ifdef SYS_copy_file_range
+	int method = 0;
+#else
+	int method = 1;
+#endif
+#else
+	(void)size;
+	int method = 2;
+#endif
+
+	std::vector<char> buffer;
+	for (;;)
+	{
+		if (counter.stop) { return ECANCELED; }
+		ssize_t n;
+#ifdef __linux__
+		if (method == 0)
+		{
+#ifdef SYS_copy_file_range
+			n = syscall(SYS_copy_file_range, in, NULL, out, NULL, static_cast<size_t>(WINLUA_COPY_CHUNK), 0u);
+			if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF))
+			{
+				method = 1;
+				continue;
+			}
+#endif
+		}
+		else if (method == 1)
+		{
+			n = sendfile(out, in, NULL, WINLUA_COPY_CHUNK);
+			if (n < 0 && (errno == ENOSYS || errno == EINVAL))
+			{
+				method = 2;
+				continue;
+			}
+		}
+		else
+#endif
+		{
+			if (buffer.empty()) { buffer.resize(1 << 20); }
+			n = read(in, &buffer[0], buffer.size());
+			if (n > 0)
+			{
+				int err = copy_write_all(out, &buffer[0], static_cast<size_t>(n));
+				if (err != 0) { return err; }
+			}
+		}
+		if (n < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return errno;
+		}
+		if (n == 0) { return 0; }
+		counter.bytes += static_cast<uint64_t>(n);
+	}
+}
+
+static int copy_file(const CopyEntry& e, const CopyOptions& opts, CopyCounter& counter)
+{
+	if (e.link) { return copy_link(e, opts); }
+
+	int in = open(e.src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) { return errno; }
+	struct stat st;
+	int err = (fstat(in, &st) != 0) ? errno : (S_ISDIR(st.st_mode) ? EISDIR : 0);
+	struct stat existing;
+	if (err == 0 && stat(e.dst.c_str(), &existing) == 0 && existing.st_dev == st.st_dev && existing.st_ino == st.st_ino)
+	{
+		err = EINVAL; /* opening it for writing would truncate the source */
+	}
+	if (err != 0)
+	{
+		close(in);
+		return err;
+	}
+	int out = open(e.dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (opts.overwrite ? 0 : O_EXCL), st.st_mode & 0777);
+	if (out < 0)
+	{
+		err = errno;
+		close(in);
+		return err;
+	}
+
+	err = copy_data(in, out, static_cast<uint64_t>(st.st_size), counter);
+	if (err == 0)
+	{
+		/* the creation mode is masked by the umask and ignored for existing files */
+		fchmod(out, st.st_mode & 07777);
+		if (opts.times)
+		{
+			struct timespec times[2];
+			stat_times(st, times);
+			futimens(out, times);
+		}
+	}
+	if (close(out) != 0 && err == 0) { err = errno; }
+	close(in);
+	if (err != 0) { unlink(e.dst.c_str()); }
+	return err;
+}
+
+#endif
+
+/* ------------------------------------------------------------
+Listing the source tree
+------------------------------------------------------------ */
+
+struct CopyJob
+{
+	CopyOptions opts;
+	std::vector<CopyEntry> files;
+	std::vector<CopyDir> dirs;
+	uint64_t total;
+
+	CopyCounter counter;
+	std::atomic<size_t> next, done;
+	std::vector<int> results; /* error code per file, written by the worker that copied it */
+
+	std::mutex lock;
+	std::condition_variable cv;
+	size_t active;
+
+	std::vector<CopyError> errors; /* from listing, owned by the calling thread */
+
+	/* identity of the destination root, which is not listed when it lies inside the source */
+	uint64_t root_volume, root_id;
+
+	CopyJob() : total(0), next(0), done(0), active(0), root_volume(0), root_id(0) {}
+};
+
+static void copy_fail(CopyJob& job, const std::string& path, int err)
+{
+	CopyError e;
+	e.path = path;
+	e.error = err;
+	job.errors.push_back(e);
+}
+
+static void add_file(CopyJob& job, const std::string& src, const std::string& dst, uint64_t size, bool link)
+{
+	job.files.push_back(CopyEntry());
+	CopyEntry& e = job.files.back();
+	e.src = src;
+	e.dst = dst;
+	e.size = size;
+	e.link = link;
+	job.total += size;
+}
+
+#ifdef _WIN32
+
+/* create the destination of a directory; an existing directory is merged into */
+static bool add_dir(CopyJob& job, const std::string& src, const std::string& dst, const FILETIME& created,
+	const FILETIME& accessed, const FILETIME& written)
+{
+	std::vector<uint16_t> dstW;
+	copy_wide(dst, "", dstW);
+	if (CreateDirectoryW(wide_path(dstW), NULL) == 0)
+	{
+		DWORD err = GetLastError();
+		DWORD attr = GetFileAttributesW(wide_path(dstW));
+		if (err != ERROR_ALREADY_EXISTS || attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			copy_fail(job, src, static_cast<int>(err));
+			return false;
+		}
+	}
+	job.dirs.push_back(CopyDir());
+	CopyDir& d = job.dirs.back();
+	d.dst = dst;
+	d.created = created;
+	d.accessed = accessed;
+	d.written = written;
+	return true;
+}
+
+static int copy_root(CopyJob& job, const std::string& src, const std::string& dst)
+{
+	std::vector<uint16_t> srcW;
+	copy_wide(src, "", srcW);
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (GetFileAttributesExW(wide_path(srcW), GetFileExInfoStandard, &data) == 0)
+	{
+		return static_cast<int>(GetLastError());
+	}
+	if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		return ERROR_DIRECTORY;
+	}
+	if (!add_dir(job, src, dst, data.ftCreationTime, data.ftLastAccessTime, data.ftLastWriteTime))
+	{
+		int err = job.errors.back().error;
+		job.errors.pop_back();
+		return err;
+	}
+
+	std::vector<uint16_t> dstW;
+	copy_wide(dst, "", dstW);
+	uint64_t volume, id;
+	if (!copy_identity(dstW, job.root_volume, job.root_id) || !copy_identity(srcW, volume, id))
+	{
+		return static_cast<int>(GetLastError());
+	}
+	if (volume == job.root_volume && id == job.root_id)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	return 0;
+}
+
+static void list_dir(CopyJob& job, const std::string& src, const std::string& dst, std::vector<std::pair<std::string, std::string> >& pending)
+{
+	std::vector<uint16_t> specW;
+	copy_wide(src, "\\*", specW);
+	WIN32_FIND_DATAW data;
+	HANDLE handle = FindFirstFileExW(wide_path(specW), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		DWORD err = GetLastError();
+		if (err != ERROR_FILE_NOT_FOUND) { copy_fail(job, src, static_cast<int>(err)); }
+		return;
+	}
+
+	std::vector<char> name;
+	do
+	{
+		const uint16_t *nameW = reinterpret_cast<const uint16_t*>(data.cFileName);
+		if (nameW[0] == '.' && (nameW[1] == 0 || (nameW[1] == '.' && nameW[2] == 0))) { continue; }
+		size_t len = 0;
+		while (nameW[len]) { len++; }
+		name.resize(3 * len + 1);
+		name[winlua_utf16_to_utf8(nameW, len, &name[0])] = '\0';
+
+		std::string from = copy_join(src, &name[0]), to = copy_join(dst, &name[0]);
+		DWORD attr = data.dwFileAttributes;
+		if (attr & FILE_ATTRIBUTE_REPARSE_POINT)
+		{
+			add_file(job, from, to, 0, true);
+		}
+		else if (attr & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			std::vector<uint16_t> fromW;
+			copy_wide(from, "", fromW);
+			uint64_t volume, id;
+			if (copy_identity(fromW, volume, id) && volume == job.root_volume && id == job.root_id)
+			{
+				continue; /* the destination itself */
+			}
+			if (add_dir(job, from, to, data.ftCreationTime, data.ftLastAccessTime, data.ftLastWriteTime))
+			{
+				pending.push_back(std::make_pair(from, to));
+			}
+		}
+		else
+		{
+			add_file(job, from, to, (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow, false);
+		}
+	}
+	while (FindNextFileW(handle, &data));
+	FindClose(handle);
+}
+
+static void finish_dir(const CopyDir& d, const CopyOptions& opts)
+{
+	if (opts.times)
+	{
+		std::vector<uint16_t> dstW;
+		copy_wide(d.dst, "", dstW);
+		set_file_times(dstW, &d.created, &d.accessed, &d.written);
+	}
+}
+
+#else
+
+/* create the destination of a directory; an existing directory is merged into */
+static bool add_dir(CopyJob& job, const std::string& src, const std::string& dst, const struct stat& st)
+{
+	/* owner write access until the files are in; the real mode is set at the end */
+	if (mkdir(dst.c_str(), (st.st_mode & 0777) | 0700) != 0)
+	{
+		int err = errno;
+		struct stat existing;
+		if (err != EEXIST || stat(dst.c_str(), &existing) != 0 || !S_ISDIR(existing.st_mode))
+		{
+			copy_fail(job, src, err);
+			return false;
+		}
+	}
+	job.dirs.push_back(CopyDir());
+	CopyDir& d = job.dirs.back();
+	d.dst = dst;
+	d.mode = st.st_mode & 07777;
+	struct timespec times[2];
+	stat_times(st, times);
+	d.accessed = times[0];
+	d.written = times[1];
+	return true;
+}
+
+static int copy_root(CopyJob& job, const std::string& src, const std::string& dst)
+{
+	struct stat st;
+	if (stat(src.c_str(), &st) != 0) { return errno; }
+	if (!S_ISDIR(st.st_mode)) { return ENOTDIR; }
+	if (!add_dir(job, src, dst, st))
+	{
+		int err = job.errors.back().error;
+		job.errors.pop_back();
+		return err;
+	}
+
+	struct stat root;
+	if (stat(dst.c_str(), &root) != 0) { return errno; }
+	if (root.st_dev == st.st_dev && root.st_ino == st.st_ino) { return EINVAL; }
+	job.root_volume = static_cast<uint64_t>(root.st_dev);
+	job.root_id = static_cast<uint64_t>(root.st_ino);
+	return 0;
+}
+
+static void list_dir(CopyJob& job, const std::string& src, const std::string& dst, std::vector<std::pair<std::string, std::string> >& pending)
+{
+	DIR *dir = opendir(src.c_str());
+	if (dir == NULL)
+	{
+		copy_fail(job, src, errno);
+		return;
+	}
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		const char *name = d->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) { continue; }
+
+		std::string from = copy_join(src, name), to = copy_join(dst, name);
+		struct stat st;
+		if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			copy_fail(job, from, errno);
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			if (static_cast<uint64_t>(st.st_dev) == job.root_volume && static_cast<uint64_t>(st.st_ino) == job.root_id)
+			{
+				continue; /* the destination itself */
+			}
+			if (add_dir(job, from, to, st))
+			{
+				pending.push_back(std::make_pair(from, to));
+			}
+		}
+		else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+		{
+			add_file(job, from, to, S_ISREG(st.st_mode) ? static_cast<uint64_t>(st.st_size) : 0, S_ISLNK(st.st_mode));
+		}
+		else
+		{
+			copy_fail(job, from, ENOTSUP); /* devices, pipes and sockets are not copied */
+		}
+	}
+	closedir(dir);
+}
+
+static void finish_dir(const CopyDir& d, const CopyOptions& opts)
+{
+	chmod(d.dst.c_str(), d.mode);
+	if (opts.times)
+	{
+		struct timespec times[2] = {d.accessed, d.written};
+		utimensat(AT_FDCWD, d.dst.c_str(), times, 0);
+	}
+}
+
+#endif
+
+static void list_tree(CopyJob& job, const std::string& src, const std::string& dst)
+{
+	std::vector<std::pair<std::string, std::string> > pending;
+	pending.push_back(std::make_pair(src, dst));
+	while (!pending.empty())
+	{
+		std::pair<std::string, std::string> next;
+		next.swap(pending.back());
+		pending.pop_back();
+		list_dir(job, next.first, next.second, pending);
+	}
+}
+
+/* ------------------------------------------------------------
+Workers
+------------------------------------------------------------ */
+
+static bool larger_first(const CopyEntry& a, const CopyEntry& b)
+{
+	return a.size > b.size;
+}
+
+static void copy_worker(CopyJob *job)
+{
+	for (;;)
+	{
+		if (job->counter.stop) { break; }
+		size_t i = job->next++;
+		if (i >= job->files.size()) { break; }
+		job->results[i] = copy_file(job->files[i], job->opts, job->counter);
+		job->done++;
+	}
+
+	std::lock_guard<std::mutex> lock(job->lock);
+	job->active--;
+	job->cv.notify_all();
+}
+
+/* ------------------------------------------------------------
+fs.copy and fs.copy_tree
+------------------------------------------------------------ */
+
+static void get_options(lua_State *L, int idx, CopyOptions& opts)
+{
+	opts.overwrite = true;
+	opts.times = true;
+	if (!lua_isnoneornil(L, idx))
+	{
+		luaL_checktype(L, idx, LUA_TTABLE);
+		opts.overwrite = winlua_option_boolean(L, idx, "overwrite", true);
+		opts.times = winlua_option_boolean(L, idx, "times", true);
+	}
+}
+
+static int push_copy_error(lua_State *L, const char *src, const char *dst, int err)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "could not copy '%s' to '%s' (%d)", src, dst, err);
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+int winlua_fs_copy(lua_State *L)
+{
+	const char *src = luaL_checkstring(L, 1);
+	const char *dst = luaL_checkstring(L, 2);
+	CopyOptions opts;
+	get_options(L, 3, opts);
+
+	int err;
+	{
+		CopyEntry e;
+		e.src = src;
+		e.dst = dst;
+		e.size = 0;
+		e.link = false;
+		CopyCounter counter;
+		err = copy_file(e, opts, counter);
+	}
+	if (err != 0)
+	{
+		return push_copy_error(L, src, dst, err);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* call the progress function at 'fn'; false when it asked to stop, error object left on the stack if it failed */
+static bool call_progress(lua_State *L, int fn, CopyJob& job, bool *failed)
+{
+	lua_pushvalue(L, fn);
+	lua_pushinteger(L, static_cast<lua_Integer>(job.done.load()));
+	lua_pushinteger(L, static_cast<lua_Integer>(job.files.size()));
+	lua_pushinteger(L, static_cast<lua_Integer>(job.counter.bytes.load()));
+	lua_pushinteger(L, static_cast<lua_Integer>(job.total));
+	if (lua_pcall(L, 4, 1, 0) != LUA_OK)
+	{
+		*failed = true;
+		return false;
+	}
+	bool go_on = !(lua_isboolean(L, -1) && !lua_toboolean(L, -1));
+	lua_pop(L, 1);
+	return go_on;
+}
+
+int winlua_fs_copy_tree(lua_State *L)
+{
+	const char *src = luaL_checkstring(L, 1);
+	const char *dst = luaL_checkstring(L, 2);
+	CopyOptions opts;
+	get_options(L, 3, opts);
+
+	size_t nthreads = std::thread::hardware_concurrency();
+	lua_Integer interval = WINLUA_COPY_INTERVAL;
+	int progress = 0;
+	if (lua_istable(L, 3))
+	{
+		lua_Integer threads = winlua_option_integer(L, 3, "threads", 0);
+		if (threads > 0) { nthreads = static_cast<size_t>(threads); }
+		interval = winlua_option_integer(L, 3, "interval", interval);
+		luaL_argcheck(L, interval > 0, 3, "'interval' must be positive");
+		int t = lua_getfield(L, 3, "progress");
+		if (t == LUA_TNIL)
+		{
+			lua_pop(L, 1);
+		}
+		else
+		{
+			luaL_argcheck(L, t == LUA_TFUNCTION, 3, "'progress' must be a function");
+			progress = lua_gettop(L);
+		}
+	}
+	if (nthreads < 1) { nthreads = 1; }
+	if (nthreads > WINLUA_COPY_MAXTHREADS) { nthreads = WINLUA_COPY_MAXTHREADS; }
+
+	/* nothing below may raise a Lua error until the job is gone */
+	int err = 0;
+	bool failed = false, cancelled = false;
+	{
+		CopyJob job;
+		job.opts = opts;
+		err = copy_root(job, src, dst);
+		if (err == 0)
+		{
+			list_tree(job, src, dst);
+			std::stable_sort(job.files.begin(), job.files.end(), larger_first);
+			job.results.resize(job.files.size(), 0);
+
+			std::vector<std::thread> threads;
+			size_t wanted = std::min(nthreads, job.files.size());
+			job.active = wanted;
+			for (size_t i = 0; i < wanted; i++)
+			{
+				try
+				{
+					threads.push_back(std::thread(copy_worker, &job));
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(job.lock);
+					job.active -= wanted - i;
+					break;
+				}
+			}
+			if (threads.empty())
+			{
+				/* no workers at all: copy on this thread */
+				job.active = 1;
+				copy_worker(&job);
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(job.lock);
+				while (job.active > 0)
+				{
+					if (progress == 0 || failed || cancelled)
+					{
+						job.cv.wait(lock);
+						continue;
+					}
+					job.cv.wait_for(lock, std::chrono::milliseconds(interval));
+					if (job.active == 0) { break; }
+					lock.unlock();
+					if (!call_progress(L, progress, job, &failed))
+					{
+						cancelled = true;
+						job.counter.stop = true;
+					}
+					lock.lock();
+				}
+			}
+			for (size_t i = 0; i < threads.size(); i++)
+			{
+				threads[i].join();
+			}
+
+			/* directory times last, deepest first, as creating the files changed them */
+			for (size_t i = job.dirs.size(); i-- > 0;)
+			{
+				finish_dir(job.dirs[i], opts);
+			}
+
+			if (progress != 0 && !failed && !cancelled && !call_progress(L, progress, job, &failed))
+			{
+				cancelled = !failed;
+			}
+
+			if (!failed && !cancelled)
+			{
+				lua_Integer copied = 0, bytes = 0;
+				for (size_t i = 0; i < job.files.size(); i++)
+				{
+					if (job.results[i] == 0)
+					{
+						copied++;
+						bytes += static_cast<lua_Integer>(job.files[i].size);
+					}
+					else
+					{
+						copy_fail(job, job.files[i].src, job.results[i]);
+					}
+				}
+				lua_pushinteger(L, copied);
+				lua_pushinteger(L, bytes);
+				lua_createtable(L, static_cast<int>(job.errors.size()), 0);
+				for (size_t i = 0; i < job.errors.size(); i++)
+				{
+					lua_createtable(L, 0, 2);
+					lua_pushlstring(L, job.errors[i].path.data(), job.errors[i].path.size());
+					lua_setfield(L, -2, "path");
+					lua_pushinteger(L, job.errors[i].error);
+					lua_setfield(L, -2, "error");
+					lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+				}
+			}
+		}
+	}
+
+	if (failed)
+	{
+		return lua_error(L); /* the progress function's error */
+	}
+	if (cancelled)
+	{
+		lua_pushnil(L);
+		lua_pushliteral(L, "cancelled");
+		return 2;
+	}
+	if (err != 0)
+	{
+		return push_copy_error(L, src, dst, err);
+	}
+	return 3;
+}
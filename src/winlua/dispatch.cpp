@@ -277,7 +277,8 @@ LuaWin TypeInfo functions
 static int dispatch_get_typeinfo(lua_State *L)
 {
 	const char *progid = luaL_checkstring(L, 1);
-	wchar_t *progidW = utf8_to_wstring(L, progid);
+	WinLuaScratch scratch(L);
+	wchar_t *progidW = scratch.wstring(progid);
 	
 	IDispatch *disp = NULL;
 	if (LuaCreateObject(L, progidW, disp))
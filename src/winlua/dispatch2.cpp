@@ -111,7 +111,7 @@ void winlua_push_variant(lua_State *L, VARIANT& variant)
 	}
 }
 
-void winlua_get_variant(lua_State *L, int idx, VARIANT& variant, bool& shouldFree)
+void winlua_get_variant(lua_State *L, int idx, VARIANT& variant, bool& shouldFree, WinLuaScratch& scratch)
 {
 	shouldFree = false;
 	int ltype = lua_type(L, idx);
@@ -144,13 +144,12 @@ void winlua_get_variant(lua_State *L, int idx, VARIANT& variant, bool& shouldFre
 		case LUA_TSTRING:
 		{
 			const char *value = lua_tostring(L, idx);
-			wchar_t *valueW = utf8_to_wstring(L, value);
+			wchar_t *valueW = scratch.wstring(value);
 			V_VT(&variant) = VT_BSTR;
 			V_BSTR(&variant) = SysAllocString(valueW);
 			// WriteConsoleW(GetStdHandle(STD_OUTPUT_HANDLE), L"'", 1, NULL, NULL);
 			// WriteConsoleW(GetStdHandle(STD_OUTPUT_HANDLE), valueW, lstrlenW(valueW), NULL, NULL);
 			// WriteConsoleW(GetStdHandle(STD_OUTPUT_HANDLE), L"'\n", 2, NULL, NULL);
-			lua_pop(L, 1);
 			shouldFree = true;
 		}
 		break;
@@ -250,7 +249,8 @@ static int idispatch_callmethod(lua_State *L)
 	IDispatch *disp = *(winlua_get_idispatch(L, 1));
 
 	const char *name = luaL_checkstring(L, 2);
-	wchar_t *nameW = utf8_to_wstring(L, name);
+	WinLuaScratch scratch(L);
+	wchar_t *nameW = scratch.wstring(name);
 
 	DISPID dispid;
 	if (FAILED(disp->GetIDsOfNames(IID_NULL, &nameW, 1, 
@@ -259,7 +259,7 @@ static int idispatch_callmethod(lua_State *L)
 		return luaL_error(L, "GetIDsOfNames on IDispatch failed (name: '%s')", name);
 	}
 
-	int argc = lua_gettop(L) - 3; // -2 for the object and name, -1 for the temporary wstring
+	int argc = lua_gettop(L) - 2; // -2 for the object and name
 
 	/* easy case with no arguments */
 	if (argc == 0)
@@ -287,7 +287,7 @@ static int idispatch_callmethod(lua_State *L)
 
 		for (int i = 0; i < argc; i++)
 		{
-			winlua_get_variant(L, 3+i, params[i], freeParams[i]);
+			winlua_get_variant(L, 3+i, params[i], freeParams[i], scratch);
 		}
 		
 		DISPPARAMS Params = { params, NULL, argc, 0 };
@@ -307,7 +307,8 @@ static int idispatch_getproperty(lua_State *L)
 	IDispatch *disp = *(winlua_get_idispatch(L, 1));
 
 	const char *name = luaL_checkstring(L, 2);
-	wchar_t *nameW = utf8_to_wstring(L, name);
+	WinLuaScratch scratch(L);
+	wchar_t *nameW = scratch.wstring(name);
 
 	DISPID dispid;
 	if (FAILED(disp->GetIDsOfNames(IID_NULL, &nameW, 1, 
@@ -331,7 +332,8 @@ static int idispatch_setproperty(lua_State *L)
 	}
 
 	const char *name = luaL_checkstring(L, 2);
-	wchar_t *nameW = utf8_to_wstring(L, name);
+	WinLuaScratch scratch(L);
+	wchar_t *nameW = scratch.wstring(name);
 
 	EXCEPINFO excep = { 0 };
 	DISPID dispid; DISPID dispidNamed  = DISPID_PROPERTYPUT;
@@ -342,7 +344,7 @@ static int idispatch_setproperty(lua_State *L)
 	}
 
 	VARIANT param; bool freeParam;
-	winlua_get_variant(L, 3, param, freeParam);
+	winlua_get_variant(L, 3, param, freeParam, scratch);
 
 	DISPPARAMS Params = { &param, &dispidNamed, 1, 1 };
 	perform_invoke(L, name, disp, dispid, DISPATCH_PROPERTYPUT, Params);
@@ -356,7 +358,8 @@ WinLua IDispatch functions
 static int dispatch_create_object(lua_State *L)
 {
 	const char *progid = luaL_checkstring(L, 1);
-	wchar_t *progidW = utf8_to_wstring(L, progid);
+	WinLuaScratch scratch(L);
+	wchar_t *progidW = scratch.wstring(progid);
 	
 	IDispatch *disp = NULL;
 	if (LuaCreateObject(L, progidW, disp))
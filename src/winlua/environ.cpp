@@ -0,0 +1,269 @@
+#include "winlua.hpp"
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifndef _WIN32
+extern char **environ;
+#endif
+
+/* ------------------------------------------------------------
+WinLua Environment Tables and Blocks
+
+	os.environ()             -> {NAME = value, ...}, or nil, message, code
+	os.environ_block(vars)   -> block
+
+os.environ reads the whole environment at once (one
+GetEnvironmentStringsW call and one transcode of the block on
+Windows, 'environ' on Linux) into a table, so scripts that look up
+many variables pay for a table index per lookup rather than an API
+call and two conversions. The hidden "=C:"-style variables Windows
+uses for per-drive directories are left out.
+
+os.environ_block turns a table of that shape into a complete,
+prepared environment that os.spawn accepts as 'env' and passes to
+the child as it is, without reading or merging the current
+environment again:
+
+	local vars = os.environ()
+	vars.RUST_LOG = "debug"
+	local env = os.environ_block(vars)
+	for _, dir in ipairs(crates) do os.spawn{"cargo", "build", cwd = dir, env = env}:wait() end
+
+On Windows the block is the sorted UTF-16 text CreateProcessW
+takes, on Linux an envp array.
+------------------------------------------------------------ */
+#define WINLUA_ENVIRON_META "WinLuaEnvironment"
+
+struct EnvBlock
+{
+#ifdef _WIN32
+	std::vector<uint16_t> block;
+#else
+	std::vector<char> text;
+	std::vector<char*> vars;
+#endif
+};
+
+/* environment block userdata */
+struct WinLuaEnvironment
+{
+	EnvBlock *env;
+	size_t count;
+};
+
+struct EnvVar
+{
+	const char *name, *value;
+	size_t namelen, valuelen;
+};
+
+/* ------------------------------------------------------------
+os.environ
+------------------------------------------------------------ */
+
+/* add the "NAME=value" entries of 'text' (NUL-separated, 'len' bytes) to the table on top */
+static void push_entries(lua_State *L, const char *text, size_t len)
+{
+	for (const char *p = text, *end = text + len; p < end; )
+	{
+		size_t entry = strlen(p);
+		const char *eq = static_cast<const char*>(memchr(p, '=', entry));
+		if (eq != NULL && eq != p)
+		{
+			lua_pushlstring(L, p, static_cast<size_t>(eq - p));
+			lua_pushlstring(L, eq + 1, entry - static_cast<size_t>(eq - p) - 1);
+			lua_rawset(L, -3);
+		}
+		p += entry + 1;
+	}
+}
+
+int winlua_os_environ(lua_State *L)
+{
+#ifdef _WIN32
+	LPWSTR block = GetEnvironmentStringsW();
+	if (block == NULL)
+	{
+		DWORD err = GetLastError();
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not read the environment (%d)", err);
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	/* the block ends with an empty entry; transcode everything before it in one go */
+	const uint16_t *wide = reinterpret_cast<const uint16_t*>(block);
+	size_t len = 0, count = 0;
+	while (wide[len] != 0)
+	{
+		while (wide[len] != 0) { len++; }
+		len++;
+		count++;
+	}
+
+	WinLuaScratch scratch(L);
+	char *text = static_cast<char*>(scratch.alloc(3 * len + 1));
+	size_t bytes = winlua_utf16_to_utf8(wide, len, text);
+	FreeEnvironmentStringsW(block);
+
+	lua_createtable(L, 0, static_cast<int>(count));
+	push_entries(L, text, bytes);
+#else
+	size_t count = 0;
+	while (environ[count] != NULL) { count++; }
+	lua_createtable(L, 0, static_cast<int>(count));
+	for (size_t i = 0; i < count; i++)
+	{
+		push_entries(L, environ[i], strlen(environ[i]));
+	}
+#endif
+	return 1;
+}
+
+/* ------------------------------------------------------------
+os.environ_block
+------------------------------------------------------------ */
+
+static bool var_less(const EnvVar& a, const EnvVar& b)
+{
+	size_t n = std::min(a.namelen, b.namelen);
+#ifdef _WIN32
+	/* CreateProcessW wants the block sorted by name, ignoring case */
+	for (size_t i = 0; i < n; i++)
+	{
+		int x = toupper(static_cast<unsigned char>(a.name[i])), y = toupper(static_cast<unsigned char>(b.name[i]));
+		if (x != y) { return x < y; }
+	}
+#else
+	int cmp = memcmp(a.name, b.name, n);
+	if (cmp != 0) { return cmp < 0; }
+#endif
+	return a.namelen < b.namelen;
+}
+
+static int environment_gc(lua_State *L)
+{
+	WinLuaEnvironment *e = static_cast<WinLuaEnvironment*>(luaL_checkudata(L, 1, WINLUA_ENVIRON_META));
+	delete e->env;
+	e->env = NULL;
+	return 0;
+}
+
+static int environment_len(lua_State *L)
+{
+	WinLuaEnvironment *e = static_cast<WinLuaEnvironment*>(luaL_checkudata(L, 1, WINLUA_ENVIRON_META));
+	lua_pushinteger(L, static_cast<lua_Integer>(e->count));
+	return 1;
+}
+
+int winlua_os_environ_block(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	/* the names and string values stay anchored in the table; numbers are copied */
+	WinLuaScratch scratch(L);
+	size_t count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 1) != 0)
+	{
+		int t = lua_type(L, -1);
+		size_t len;
+		const char *name = (lua_type(L, -2) == LUA_TSTRING) ? lua_tolstring(L, -2, &len) : NULL;
+		if (name == NULL || len == 0 || memchr(name + 1, '=', len - 1) != NULL || memchr(name, '\0', len) != NULL)
+		{
+			return luaL_argerror(L, 1, "variable names must be non-empty strings without '='");
+		}
+		const char *value = (t == LUA_TSTRING || t == LUA_TNUMBER) ? lua_tolstring(L, -1, &len) : NULL;
+		if (value == NULL || memchr(value, '\0', len) != NULL)
+		{
+			return luaL_argerror(L, 1, lua_pushfstring(L, "value of '%s' must be a string without NULs", name));
+		}
+		count++;
+		lua_pop(L, 1);
+	}
+
+	EnvVar *vars = static_cast<EnvVar*>(scratch.alloc(sizeof(EnvVar) * (count + 1)));
+	size_t n = 0, total = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 1) != 0)
+	{
+		EnvVar& v = vars[n++];
+		v.name = lua_tolstring(L, -2, &v.namelen);
+		if (lua_type(L, -1) == LUA_TSTRING)
+		{
+			v.value = lua_tolstring(L, -1, &v.valuelen);
+		}
+		else
+		{
+			const char *s = lua_tolstring(L, -1, &v.valuelen);
+			char *copy = static_cast<char*>(scratch.alloc(v.valuelen + 1));
+			memcpy(copy, s, v.valuelen + 1);
+			v.value = copy;
+		}
+		total += v.namelen + v.valuelen + 2;
+		lua_pop(L, 1);
+	}
+	std::sort(vars, vars + n, var_less);
+
+	WinLuaEnvironment *e = static_cast<WinLuaEnvironment*>(lua_newuserdata(L, sizeof(WinLuaEnvironment)));
+	e->env = NULL;
+	e->count = n;
+	if (luaL_newmetatable(L, WINLUA_ENVIRON_META))
+	{
+		lua_pushcfunction(L, environment_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, environment_len);
+		lua_setfield(L, -2, "__len");
+	}
+	lua_setmetatable(L, -2);
+
+	e->env = new EnvBlock;
+#ifdef _WIN32
+	std::vector<uint16_t>& block = e->env->block;
+	block.resize(total + 2);
+	size_t at = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		at += winlua_utf8_to_utf16(vars[i].name, vars[i].namelen, &block[at]);
+		block[at++] = '=';
+		at += winlua_utf8_to_utf16(vars[i].value, vars[i].valuelen, &block[at]);
+		block[at++] = 0;
+	}
+	if (n == 0) { block[at++] = 0; } /* an empty block still needs its two terminators */
+	block[at++] = 0;
+	block.resize(at);
+#else
+	std::vector<char>& text = e->env->text;
+	std::vector<char*>& list = e->env->vars;
+	text.resize(total + 1);
+	list.reserve(n + 1);
+	size_t at = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		list.push_back(&text[at]);
+		memcpy(&text[at], vars[i].name, vars[i].namelen);
+		at += vars[i].namelen;
+		text[at++] = '=';
+		memcpy(&text[at], vars[i].value, vars[i].valuelen);
+		at += vars[i].valuelen;
+		text[at++] = '\0';
+	}
+	list.push_back(NULL);
+#endif
+	return 1;
+}
+
+const void *winlua_environ_block(lua_State *L, int idx)
+{
+	WinLuaEnvironment *e = static_cast<WinLuaEnvironment*>(luaL_testudata(L, idx, WINLUA_ENVIRON_META));
+	if (e == NULL || e->env == NULL) { return NULL; }
+#ifdef _WIN32
+	return &e->env->block[0];
+#else
+	return &e->env->vars[0];
+#endif
+}
@@ -9,11 +9,11 @@ WinLua Filesystem functions
 static int fs_attributes(lua_State *L)
 {
 	const char *filepath = luaL_checkstring(L, 1);
-	wchar_t *filepathW = utf8_to_wstring(L, filepath);
+	WinLuaScratch scratch(L);
+	wchar_t *filepathW = scratch.wstring(filepath);
 
 	WIN32_FIND_DATAW fileData;
 	HANDLE findHandle = FindFirstFileW(filepathW, &fileData);
-	lua_pop(L, 1); // pop temporary wstring
 
 	if (findHandle == INVALID_HANDLE_VALUE)
 	{
@@ -49,7 +49,8 @@ static int fs_attributes(lua_State *L)
 static int fs_chdir(lua_State *L)
 {
 	const char *filepath = luaL_checkstring(L, 1);
-	wchar_t *filepathW = utf8_to_wstring(L, filepath);
+	WinLuaScratch scratch(L);
+	wchar_t *filepathW = scratch.wstring(filepath);
 
 	BOOL ret = SetCurrentDirectoryW(filepathW);
 	if (ret == 0)
@@ -63,13 +64,14 @@ static int fs_chdir(lua_State *L)
 
 static int fs_currentdir(lua_State *L)
 {
+	WinLuaScratch scratch(L);
 	DWORD needed = GetCurrentDirectoryW(0, NULL);
 	if (needed == 0)
 	{
 		return luaL_error(L, "could not get buffer size for current directory (%d)", GetLastError());
 	}
 
-	wchar_t *buff = static_cast<wchar_t*>(lua_newuserdata(L, sizeof(wchar_t) * needed));
+	wchar_t *buff = static_cast<wchar_t*>(scratch.alloc(sizeof(wchar_t) * needed));
 	needed = GetCurrentDirectoryW(needed, buff);
 	
 	if (needed == 0)
@@ -78,16 +80,16 @@ static int fs_currentdir(lua_State *L)
 	}
 
 	wstring_to_utf8(L, buff);
-	lua_remove(L, -2); // pop temporary buffer
 	return 1;
 }
 
 static int fs_symlink(lua_State *L)
 {
 	const char *filepath = luaL_checkstring(L, 1);
-	wchar_t *filepathW = utf8_to_wstring(L, filepath);
+	WinLuaScratch scratch(L);
+	wchar_t *filepathW = scratch.wstring(filepath);
 	const char *linkpath = luaL_checkstring(L, 1);
-	wchar_t *linkpathW = utf8_to_wstring(L, linkpath);
+	wchar_t *linkpathW = scratch.wstring(linkpath);
 
 	DWORD is_dir = GetFileAttributesW(filepathW);
 
@@ -111,7 +113,8 @@ static int fs_symlink(lua_State *L)
 static int fs_mkdir(lua_State *L)
 {
 	const char *filepath = luaL_checkstring(L, 1);
-	wchar_t *filepathW = utf8_to_wstring(L, filepath);
+	WinLuaScratch scratch(L);
+	wchar_t *filepathW = scratch.wstring(filepath);
 
 	BOOL ret = CreateDirectoryW(filepathW, NULL);
 	if (ret == 0)
@@ -126,7 +129,8 @@ static int fs_mkdir(lua_State *L)
 static int fs_rmdir(lua_State *L)
 {
 	const char *dirname = luaL_checkstring(L, 1);
-	wchar_t *dirnameW = utf8_to_wstring(L, dirname);
+	WinLuaScratch scratch(L);
+	wchar_t *dirnameW = scratch.wstring(dirname);
 
 	BOOL ret = RemoveDirectoryW(dirnameW);
 	if (ret == 0)
@@ -143,12 +147,40 @@ File iterator functions & structures
 ------------------------------------------------------------ */
 
 #define WINLUA_FINDFILES_META "WinLuaFindFilesUdata"
+#define WINLUA_FINDFILES_MAXFIELDS 8
+
+/*
+Besides the name, the iterators can return what the search already
+fetched, so scripts need no fs.attributes call per entry:
+
+	fs.dir(path, true)            -> name, entry
+	fs.dir(path, {"size", ...})   -> name, size, ...
+
+'entry' is a single table reused for every iteration, with the same
+fields as fs.attributes (mode, size, modification, access, creation).
+The times are integer seconds since 1970 (winlua_push_date on a
+FILETIME), not date tables, so refilling the entry allocates nothing
+beyond the name string.
+*/
+enum WinLuaFindField
+{
+	FIELD_MODE,
+	FIELD_SIZE,
+	FIELD_MODIFICATION,
+	FIELD_ACCESS,
+	FIELD_CREATION
+};
+
+static const char *const findfield_names[] = {"mode", "size", "modification", "access", "creation", NULL};
 
 struct WinLuaFindFilesUdata
 {
 	HANDLE handle;
 	WIN32_FIND_DATAW data;
 	bool finished;
+	bool record; /* return the reused entry table (upvalue 2) */
+	int nfields;
+	unsigned char fields[WINLUA_FINDFILES_MAXFIELDS];
 };
 
 static int findfiles__gc(lua_State *L)
@@ -169,6 +201,29 @@ static void create_findfiles_meta(lua_State *L)
 	lua_pop(L, 1);
 }
 
+static void push_findfield(lua_State *L, WIN32_FIND_DATAW& data, int field)
+{
+	switch (field)
+	{
+		case FIELD_MODE:
+			lua_pushstring(L, data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? "directory" : "file");
+			break;
+		case FIELD_SIZE:
+			lua_pushinteger(L, (static_cast<lua_Integer>(data.nFileSizeHigh) << 32) | data.nFileSizeLow);
+			break;
+		/* plain integers, which overwrite the entry's fields without allocating */
+		case FIELD_MODIFICATION:
+			winlua_push_date(L, data.ftLastWriteTime);
+			break;
+		case FIELD_ACCESS:
+			winlua_push_date(L, data.ftLastAccessTime);
+			break;
+		case FIELD_CREATION:
+			winlua_push_date(L, data.ftCreationTime);
+			break;
+	}
+}
+
 static int findfiles_next(lua_State *L)
 {
 	WinLuaFindFilesUdata *udata = static_cast<WinLuaFindFilesUdata*>(luaL_checkudata(L, lua_upvalueindex(1), WINLUA_FINDFILES_META));
@@ -179,6 +234,23 @@ static int findfiles_next(lua_State *L)
 	/* print the file name found in the previous iteration */
 	wstring_to_utf8(L, udata->data.cFileName);
 
+	int nresults = 1;
+	if (udata->record)
+	{
+		lua_pushvalue(L, lua_upvalueindex(2));
+		for (int i = FIELD_MODE; findfield_names[i] != NULL; i++)
+		{
+			push_findfield(L, udata->data, i);
+			lua_setfield(L, -2, findfield_names[i]);
+		}
+		nresults++;
+	}
+	for (int i = 0; i < udata->nfields; i++)
+	{
+		push_findfield(L, udata->data, udata->fields[i]);
+		nresults++;
+	}
+
 	/* move to the next file, checking for errors */
 	BOOL ret = FindNextFileW(udata->handle, &udata->data);
 	if (ret == 0)
@@ -194,44 +266,71 @@ static int findfiles_next(lua_State *L)
 		}
 	}
 
-	return 1;
+	return nresults;
 }
 
-static int fs_find(lua_State *L)
+/* start a search for 'filespec' and push the iterator; 'opt' is the index of the fields option */
+static int start_search(lua_State *L, const char *filespec, int opt)
 {
-	const char *filespec = luaL_checkstring(L, 1);
-	wchar_t *filespecW = utf8_to_wstring(L, filespec);
+	WinLuaScratch scratch(L);
+	wchar_t *filespecW = scratch.wstring(filespec);
+
 	WinLuaFindFilesUdata *udata = static_cast<WinLuaFindFilesUdata*>(lua_newuserdata(L, sizeof(WinLuaFindFilesUdata)));
+	udata->handle = INVALID_HANDLE_VALUE;
+	udata->finished = false;
+	udata->record = lua_toboolean(L, opt) && !lua_istable(L, opt);
+	udata->nfields = 0;
 	luaL_setmetatable(L, WINLUA_FINDFILES_META);
 
-	udata->handle = FindFirstFileW(filespecW, &udata->data);
+	if (lua_istable(L, opt))
+	{
+		for (lua_Integer i = 1; lua_rawgeti(L, opt, i) != LUA_TNIL; i++)
+		{
+			luaL_argcheck(L, udata->nfields < WINLUA_FINDFILES_MAXFIELDS, opt, "too many fields");
+			const char *name = lua_tostring(L, -1);
+			int field = 0;
+			while (findfield_names[field] != NULL && (name == NULL || strcmp(findfield_names[field], name) != 0)) { field++; }
+			if (findfield_names[field] == NULL)
+			{
+				return luaL_error(L, "invalid field '%s'", name ? name : luaL_typename(L, -1));
+			}
+			udata->fields[udata->nfields++] = static_cast<unsigned char>(field);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	/* the basic info level skips the short 8.3 name, which is never returned */
+	udata->handle = FindFirstFileExW(filespecW, FindExInfoBasic, &udata->data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
 	if (udata->handle == INVALID_HANDLE_VALUE)
 	{
 		return luaL_error(L, "could not start search for '%s' (%d)", filespec, GetLastError());
 	}
 
-	lua_pushcclosure(L, findfiles_next, 1);
+	if (udata->record)
+	{
+		lua_createtable(L, 0, 5);
+		lua_pushcclosure(L, findfiles_next, 2);
+	}
+	else
+	{
+		lua_pushcclosure(L, findfiles_next, 1);
+	}
 	return 1;
 }
 
+static int fs_find(lua_State *L)
+{
+	const char *filespec = luaL_checkstring(L, 1);
+	return start_search(L, filespec, 2);
+}
+
 static int fs_dir(lua_State *L)
 {
 	const char *directory = luaL_checkstring(L, 1);
 	char filespec[MAX_PATH+1];
 	_snprintf(filespec, MAX_PATH+1, "%s\\*", directory);
-	wchar_t *filespecW = utf8_to_wstring(L, filespec);
-
-	WinLuaFindFilesUdata *udata = static_cast<WinLuaFindFilesUdata*>(lua_newuserdata(L, sizeof(WinLuaFindFilesUdata)));
-	luaL_setmetatable(L, WINLUA_FINDFILES_META);
-
-	udata->handle = FindFirstFileW(filespecW, &udata->data);
-	if (udata->handle == INVALID_HANDLE_VALUE)
-	{
-		return luaL_error(L, "could not start search for '%s' (%d)", filespec, GetLastError());
-	}
-
-	lua_pushcclosure(L, findfiles_next, 1);
-	return 1;
+	return start_search(L, filespec, 2);
 }
 
 /* ------------------------------------------------------------
@@ -246,7 +345,8 @@ static time_t l_checktime (lua_State *L, int arg) {
 static int fs_touch(lua_State *L)
 {
 	const char *filepath = luaL_checkstring(L, 1);
-	wchar_t *filepathW = utf8_to_wstring(L, filepath);
+	WinLuaScratch scratch(L);
+	wchar_t *filepathW = scratch.wstring(filepath);
 
 	HANDLE file = CreateFileW(filepathW, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (file == INVALID_HANDLE_VALUE)
@@ -254,7 +354,6 @@ static int fs_touch(lua_State *L)
 		return luaL_error(L, "could not open file '%s' (%d)", filepath, GetLastError());
 	}
 
-	lua_pop(L, 1); // pop the temporary wide string
 	time_t now; time(&now);
 
 	time_t atime = lua_isnoneornil(L, 2) ? now : l_checktime(L, 2);
@@ -290,6 +389,18 @@ static const luaL_Reg library_methods[] = {
 	{"find", fs_find},
 	{"dir", fs_dir},
 	{"touch", fs_touch},
+	{"walk", winlua_fs_walk},
+	{"attributes_many", winlua_fs_attributes_many},
+	{"mmap", winlua_fs_mmap},
+	{"hash", winlua_fs_hash},
+	{"hash_many", winlua_fs_hash_many},
+	{"hasher", winlua_fs_hasher},
+	{"watch", winlua_fs_watch},
+	{"copy", winlua_fs_copy},
+	{"copy_tree", winlua_fs_copy_tree},
+	{"glob", winlua_fs_glob},
+	{"snapshot", winlua_fs_snapshot},
+	{"diff", winlua_fs_diff},
 	{NULL, NULL}
 };
 
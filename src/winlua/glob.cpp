@@ -0,0 +1,849 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+/* ------------------------------------------------------------
+WinLua Glob Patterns
+
+fs.glob(patterns [, what]) returns the paths matching one pattern
+or a list of them, in no particular order:
+
+	for _, p in ipairs(fs.glob("src\\**\\*.{c,h}")) do print(p) end
+	fs.glob({"**\\*.lua", "!build\\**", "!*_test.lua"}, "files")
+
+	*       any run of characters within one path component
+	?       one character
+	[a-z]   one character from a set; [!a-z] or [^a-z] one not in it
+	{a,b}   either alternative; alternatives may hold '/' and nest
+	**      a whole component: any number of directories, including none
+	\       escapes the next character (only where '\' is not a separator)
+
+Patterns starting with '!' remove paths from the result; one
+without a separator is matched against the entry name alone, so
+"!.git" skips every .git directory and all it holds. 'what' is
+"all" (default), "files" or "directories". Symbolic links are
+followed, except by '**', which never leaves the tree through a
+link (and so cannot loop).
+
+Each pattern is compiled once into its path components. The
+literal components at the front become the directory the search
+starts from, and a directory whose remaining components are all
+literal is probed for those names instead of listed, so only the
+directories a pattern can still reach are read. The tree is
+searched one level at a time with the directories of a level
+listed on the parallel loop workers.
+------------------------------------------------------------ */
+#define WINLUA_GLOB_MAXPATTERNS 4096 /* after expanding alternatives */
+
+#ifdef _WIN32
+#define GLOB_SEP '\\'
+#define GLOB_IS_SEP(c) ((c) == '/' || (c) == '\\')
+#else
+#define GLOB_SEP '/'
+#define GLOB_IS_SEP(c) ((c) == '/')
+#endif
+
+enum GlobTokenType { TOKEN_CHAR, TOKEN_ANY, TOKEN_STAR, TOKEN_CLASS };
+enum GlobSegmentKind { SEGMENT_LITERAL, SEGMENT_PATTERN, SEGMENT_GLOBSTAR };
+
+struct GlobToken
+{
+	unsigned char type;
+	unsigned char c;
+	uint16_t cls; /* index into GlobJob::classes */
+};
+
+struct GlobClass
+{
+	uint32_t bits[8];
+};
+
+struct GlobSegment
+{
+	int kind;
+	std::string literal; /* the name itself for SEGMENT_LITERAL */
+	std::vector<GlobToken> tokens;
+};
+
+struct GlobPattern
+{
+	std::string root; /* literal components at the front, joined */
+	std::vector<GlobSegment> segments; /* the rest */
+	bool name_only; /* exclusions without a separator */
+};
+
+/* a directory still to be searched and the pattern positions that reach it */
+struct GlobTask
+{
+	std::string path;
+	std::vector<uint32_t> states; /* pattern << 16 | segment */
+};
+
+struct GlobOutput
+{
+	std::vector<std::string> matches;
+	std::vector<GlobTask> children;
+};
+
+struct GlobJob
+{
+	std::vector<GlobPattern> patterns, excludes;
+	std::vector<GlobClass> classes;
+	int what; /* 0 all, 1 files, 2 directories */
+
+	/* the level being searched */
+	std::vector<GlobTask> *tasks;
+	std::vector<GlobOutput> *outputs;
+};
+
+/* ------------------------------------------------------------
+Compiling
+------------------------------------------------------------ */
+
+static inline unsigned char fold(unsigned char c)
+{
+#ifdef _WIN32
+	return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+#else
+	return c;
+#endif
+}
+
+#ifdef _WIN32
+#define GLOB_ESCAPES 0
+#else
+#define GLOB_ESCAPES 1
+#endif
+
+/* position of the '}' closing the brace at 'open', or npos */
+static size_t brace_close(const std::string& s, size_t open)
+{
+	int depth = 0;
+	for (size_t i = open; i < s.size(); i++)
+	{
+		if (GLOB_ESCAPES && s[i] == '\\' && i + 1 < s.size()) { i++; continue; }
+		if (s[i] == '{') { depth++; }
+		else if (s[i] == '}' && --depth == 0) { return i; }
+	}
+	return std::string::npos;
+}
+
+/* expand the first {a,b} of 's' and recurse; false when there are too many results */
+static bool brace_expand(const std::string& s, std::vector<std::string>& out)
+{
+	size_t open = 0, close = std::string::npos;
+	for (; open < s.size(); open++)
+	{
+		if (GLOB_ESCAPES && s[open] == '\\' && open + 1 < s.size()) { open++; continue; }
+		if (s[open] == '{' && (close = brace_close(s, open)) != std::string::npos) { break; }
+	}
+	if (close == std::string::npos)
+	{
+		if (out.size() >= WINLUA_GLOB_MAXPATTERNS) { return false; }
+		out.push_back(s);
+		return true;
+	}
+
+	std::string head = s.substr(0, open), tail = s.substr(close + 1);
+	int depth = 0;
+	size_t start = open + 1;
+	for (size_t i = open + 1; i <= close; i++)
+	{
+		if (GLOB_ESCAPES && s[i] == '\\' && i + 1 < close) { i++; continue; }
+		if (s[i] == '{') { depth++; }
+		else if (s[i] == '}' && depth > 0) { depth--; }
+		else if ((s[i] == ',' && depth == 0) || i == close)
+		{
+			if (!brace_expand(head + s.substr(start, i - start) + tail, out)) { return false; }
+			start = i + 1;
+		}
+	}
+	return true;
+}
+
+static void class_set(GlobClass& cls, unsigned char c)
+{
+	cls.bits[c >> 5] |= 1u << (c & 31);
+#ifdef _WIN32
+	unsigned char other = (c >= 'a' && c <= 'z') ? static_cast<unsigned char>(c - ('a' - 'A')) : fold(c);
+	cls.bits[other >> 5] |= 1u << (other & 31);
+#endif
+}
+
+/* compile one path component; false when it has no wildcards */
+static bool compile_segment(GlobJob& job, const std::string& text, GlobSegment& seg)
+{
+	seg.tokens.clear();
+	seg.literal.clear();
+	bool wild = false;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		GlobToken t;
+		t.type = TOKEN_CHAR;
+		t.c = static_cast<unsigned char>(text[i]);
+		t.cls = 0;
+		if (GLOB_ESCAPES && text[i] == '\\' && i + 1 < text.size())
+		{
+			t.c = static_cast<unsigned char>(text[++i]);
+		}
+		else if (text[i] == '*')
+		{
+			t.type = TOKEN_STAR;
+			wild = true;
+			if (!seg.tokens.empty() && seg.tokens.back().type == TOKEN_STAR) { continue; }
+		}
+		else if (text[i] == '?')
+		{
+			t.type = TOKEN_ANY;
+			wild = true;
+		}
+		else if (text[i] == '[')
+		{
+			/* find the end first: an unclosed '[' is an ordinary character */
+			size_t j = i + 1;
+			if (j < text.size() && (text[j] == '!' || text[j] == '^')) { j++; }
+			if (j < text.size() && text[j] == ']') { j++; }
+			while (j < text.size() && text[j] != ']') { j++; }
+			if (j < text.size() && job.classes.size() < 0xffff)
+			{
+				GlobClass cls;
+				memset(cls.bits, 0, sizeof(cls.bits));
+				size_t k = i + 1;
+				bool negate = text[k] == '!' || text[k] == '^';
+				if (negate) { k++; }
+				while (k < j)
+				{
+					unsigned char lo = static_cast<unsigned char>(text[k++]);
+					if (k + 1 < j && text[k] == '-')
+					{
+						unsigned char hi = static_cast<unsigned char>(text[k + 1]);
+						for (unsigned c = lo; c <= hi; c++) { class_set(cls, static_cast<unsigned char>(c)); }
+						k += 2;
+					}
+					else
+					{
+						class_set(cls, lo);
+					}
+				}
+				if (negate)
+				{
+					for (int w = 0; w < 8; w++) { cls.bits[w] = ~cls.bits[w]; }
+				}
+				t.type = TOKEN_CLASS;
+				t.cls = static_cast<uint16_t>(job.classes.size());
+				job.classes.push_back(cls);
+				wild = true;
+				i = j;
+			}
+		}
+		if (t.type == TOKEN_CHAR) { seg.literal += static_cast<char>(t.c); }
+		seg.tokens.push_back(t);
+	}
+	seg.kind = wild ? SEGMENT_PATTERN : SEGMENT_LITERAL;
+	if (wild) { seg.literal.clear(); }
+	return wild;
+}
+
+static std::string glob_join(const std::string& dir, const char *name, size_t len)
+{
+	std::string path;
+	path.reserve(dir.size() + len + 1);
+	path = dir;
+	if (!path.empty() && !GLOB_IS_SEP(path[path.size() - 1]))
+	{
+		path += GLOB_SEP;
+	}
+	path.append(name, len);
+	return path;
+}
+
+static void compile_pattern(GlobJob& job, const std::string& text, GlobPattern& p)
+{
+	/* leading separators (a root or UNC prefix) are kept as they are */
+	size_t i = 0;
+	while (i < text.size() && GLOB_IS_SEP(text[i])) { i++; }
+	p.root = text.substr(0, i);
+	p.name_only = true;
+
+	bool prefix = true;
+	while (i < text.size())
+	{
+		size_t j = i;
+		while (j < text.size() && !GLOB_IS_SEP(text[j])) { j++; }
+		if (j < text.size()) { p.name_only = false; }
+		std::string part = text.substr(i, j - i);
+		i = j + 1;
+		if (part.empty()) { continue; }
+
+		GlobSegment seg;
+		if (part == "**")
+		{
+			seg.kind = SEGMENT_GLOBSTAR;
+		}
+		else if (!compile_segment(job, part, seg) && prefix)
+		{
+			p.root = glob_join(p.root, seg.literal.data(), seg.literal.size());
+			continue;
+		}
+		prefix = false;
+		p.segments.push_back(seg);
+	}
+}
+
+/* ------------------------------------------------------------
+Matching
+------------------------------------------------------------ */
+
+static size_t utf8_length(const char *s)
+{
+	size_t n = 1;
+	while ((static_cast<unsigned char>(s[n]) & 0xc0) == 0x80) { n++; }
+	return n;
+}
+
+static bool literal_match(const char *lit, const char *name)
+{
+	while (*lit && fold(*lit) == fold(*name)) { lit++; name++; }
+	return *lit == '\0' && *name == '\0';
+}
+
+static bool segment_match(const GlobJob& job, const GlobSegment& seg, const char *name)
+{
+	if (seg.kind == SEGMENT_GLOBSTAR) { return true; }
+	if (seg.kind == SEGMENT_LITERAL) { return literal_match(seg.literal.c_str(), name); }
+
+	const GlobToken *t = seg.tokens.data(), *end = t + seg.tokens.size();
+	const GlobToken *star = NULL;
+	const char *resume = NULL;
+	while (*name)
+	{
+		unsigned char c = static_cast<unsigned char>(*name);
+		size_t len = 1;
+		bool ok = false;
+		if (t < end)
+		{
+			switch (t->type)
+			{
+				case TOKEN_STAR:
+					star = ++t;
+					resume = name;
+					continue;
+				case TOKEN_CHAR:
+					ok = fold(t->c) == fold(c);
+					break;
+				case TOKEN_ANY:
+					ok = true;
+					len = utf8_length(name);
+					break;
+				default:
+					ok = (job.classes[t->cls].bits[c >> 5] >> (c & 31)) & 1;
+					break;
+			}
+		}
+		if (ok)
+		{
+			t++;
+			name += len;
+		}
+		else if (star != NULL)
+		{
+			t = star;
+			resume += utf8_length(resume);
+			name = resume;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (t < end && t->type == TOKEN_STAR) { t++; }
+	return t == end;
+}
+
+static inline uint32_t make_state(size_t pattern, size_t segment)
+{
+	return static_cast<uint32_t>(pattern << 16 | segment);
+}
+
+/* add a position, and the one after it when it is a '**' that may match nothing */
+static void add_state(const GlobJob& job, std::vector<uint32_t>& states, size_t pattern, size_t segment)
+{
+	const std::vector<GlobSegment>& segs = job.patterns[pattern].segments;
+	for (;;)
+	{
+		uint32_t s = make_state(pattern, segment);
+		if (std::find(states.begin(), states.end(), s) == states.end()) { states.push_back(s); }
+		if (segment >= segs.size() || segs[segment].kind != SEGMENT_GLOBSTAR) { break; }
+		segment++;
+	}
+}
+
+/* step from 'states' over one entry; true when a pattern ends on it */
+static bool glob_step(const GlobJob& job, const std::vector<uint32_t>& states, const char *name, bool link, std::vector<uint32_t>& next)
+{
+	next.clear();
+	bool matched = false;
+	for (size_t i = 0; i < states.size(); i++)
+	{
+		size_t p = states[i] >> 16, seg = states[i] & 0xffff;
+		const std::vector<GlobSegment>& segs = job.patterns[p].segments;
+		if (seg >= segs.size()) { continue; }
+		if (segs[seg].kind == SEGMENT_GLOBSTAR && link)
+		{
+			/* '**' may end on a link but does not go through it */
+			size_t k = seg;
+			while (k < segs.size() && segs[k].kind == SEGMENT_GLOBSTAR) { k++; }
+			if (k == segs.size()) { matched = true; }
+		}
+		else if (segs[seg].kind == SEGMENT_GLOBSTAR)
+		{
+			add_state(job, next, p, seg); /* '**' takes this name and may take more */
+		}
+		else if (segment_match(job, segs[seg], name))
+		{
+			add_state(job, next, p, seg + 1);
+		}
+	}
+	for (size_t i = 0; i < next.size(); i++)
+	{
+		size_t p = next[i] >> 16, seg = next[i] & 0xffff;
+		if (seg >= job.patterns[p].segments.size()) { matched = true; }
+	}
+	return matched;
+}
+
+/* true when some position can still take a component below this one */
+static bool glob_open(const GlobJob& job, const std::vector<uint32_t>& states)
+{
+	for (size_t i = 0; i < states.size(); i++)
+	{
+		if ((states[i] & 0xffff) < job.patterns[states[i] >> 16].segments.size()) { return true; }
+	}
+	return false;
+}
+
+/* whole-path match for exclusions, component by component */
+static bool path_match(const GlobJob& job, const GlobPattern& p, const std::string& path)
+{
+	std::vector<size_t> states, next;
+	states.push_back(0);
+	for (size_t i = 0; i < states.size(); i++)
+	{
+		if (states[i] < p.segments.size() && p.segments[states[i]].kind == SEGMENT_GLOBSTAR) { states.push_back(states[i] + 1); }
+	}
+
+	/* the literal root has to be a prefix of the path */
+	size_t pos = 0;
+	if (!p.root.empty())
+	{
+		if (path.size() < p.root.size()) { return false; }
+		for (size_t i = 0; i < p.root.size(); i++)
+		{
+			char a = path[i], b = p.root[i];
+			if (!(GLOB_IS_SEP(a) && GLOB_IS_SEP(b)) && fold(a) != fold(b)) { return false; }
+		}
+		pos = p.root.size();
+		if (pos < path.size() && !GLOB_IS_SEP(path[pos]) && !GLOB_IS_SEP(p.root[pos - 1])) { return false; }
+	}
+
+	std::string name;
+	while (pos < path.size() && !states.empty())
+	{
+		while (pos < path.size() && GLOB_IS_SEP(path[pos])) { pos++; }
+		size_t end = pos;
+		while (end < path.size() && !GLOB_IS_SEP(path[end])) { end++; }
+		if (end == pos) { break; }
+		name.assign(path, pos, end - pos);
+		pos = end;
+
+		next.clear();
+		for (size_t i = 0; i < states.size(); i++)
+		{
+			size_t seg = states[i];
+			if (seg >= p.segments.size()) { continue; }
+			size_t to = (p.segments[seg].kind == SEGMENT_GLOBSTAR) ? seg : seg + 1;
+			if (p.segments[seg].kind == SEGMENT_GLOBSTAR || segment_match(job, p.segments[seg], name.c_str()))
+			{
+				for (;;)
+				{
+					if (std::find(next.begin(), next.end(), to) == next.end()) { next.push_back(to); }
+					if (to >= p.segments.size() || p.segments[to].kind != SEGMENT_GLOBSTAR) { break; }
+					to++;
+				}
+			}
+		}
+		states.swap(next);
+	}
+	return std::find(states.begin(), states.end(), p.segments.size()) != states.end();
+}
+
+static bool glob_excluded(const GlobJob& job, const std::string& path, const char *name)
+{
+	for (size_t i = 0; i < job.excludes.size(); i++)
+	{
+		const GlobPattern& p = job.excludes[i];
+		if (p.name_only)
+		{
+			if (p.segments.empty() ? literal_match(p.root.c_str(), name) : segment_match(job, p.segments[0], name)) { return true; }
+		}
+		else if (path_match(job, p, path))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------
+Searching
+------------------------------------------------------------ */
+
+/* 'type' is 'd' for directories, 'l' for links to directories, 'f' for everything else */
+static void glob_entry(const GlobJob& job, const GlobTask& task, GlobOutput& out, const char *name, size_t len, char type,
+	std::vector<uint32_t>& next)
+{
+	bool matched = glob_step(job, task.states, name, type == 'l', next);
+	bool descend = type != 'f' && glob_open(job, next);
+	if (!matched && !descend) { return; }
+
+	std::string path = glob_join(task.path, name, len);
+	if (!job.excludes.empty() && glob_excluded(job, path, name)) { return; }
+	if (matched && (job.what == 0 || (job.what == 1) == (type == 'f')))
+	{
+		out.matches.push_back(path);
+	}
+	if (descend)
+	{
+		out.children.push_back(GlobTask());
+		GlobTask& child = out.children.back();
+		child.path.swap(path);
+		child.states = next;
+	}
+}
+
+/* true when every open position wants one literal name, so the directory need not be listed */
+static bool glob_literal_only(const GlobJob& job, const std::vector<uint32_t>& states)
+{
+	for (size_t i = 0; i < states.size(); i++)
+	{
+		const std::vector<GlobSegment>& segs = job.patterns[states[i] >> 16].segments;
+		size_t seg = states[i] & 0xffff;
+		if (seg < segs.size() && segs[seg].kind != SEGMENT_LITERAL) { return false; }
+	}
+	return true;
+}
+
+#ifdef _WIN32
+
+static void glob_wide(const std::string& path, const char *suffix, std::vector<uint16_t>& out)
+{
+	size_t len = path.size(), extra = strlen(suffix);
+	out.resize(len + extra + 1);
+	size_t n = winlua_utf8_to_utf16(path.data(), len, &out[0]);
+	n += winlua_utf8_to_utf16(suffix, extra, &out[n]);
+	out[n] = 0;
+}
+
+static char glob_type(DWORD attr)
+{
+	if (!(attr & FILE_ATTRIBUTE_DIRECTORY)) { return 'f'; }
+	return (attr & FILE_ATTRIBUTE_REPARSE_POINT) ? 'l' : 'd';
+}
+
+/* entry type as for glob_entry, or 0 when the path does not exist */
+static char glob_probe(const std::string& path)
+{
+	std::vector<uint16_t> pathW;
+	glob_wide(path.empty() ? std::string(".") : path, "", pathW);
+	DWORD attr = GetFileAttributesW(reinterpret_cast<LPCWSTR>(&pathW[0]));
+	return (attr == INVALID_FILE_ATTRIBUTES) ? 0 : glob_type(attr);
+}
+
+static void glob_list(const GlobJob& job, const GlobTask& task, GlobOutput& out)
+{
+	std::vector<uint16_t> specW;
+	glob_wide(task.path.empty() ? std::string(".") : task.path, "\\*", specW);
+	WIN32_FIND_DATAW data;
+	HANDLE handle = FindFirstFileExW(reinterpret_cast<LPCWSTR>(&specW[0]), FindExInfoBasic, &data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (handle == INVALID_HANDLE_VALUE) { return; }
+
+	std::vector<char> name;
+	std::vector<uint32_t> next;
+	do
+	{
+		const uint16_t *nameW = reinterpret_cast<const uint16_t*>(data.cFileName);
+		if (nameW[0] == '.' && (nameW[1] == 0 || (nameW[1] == '.' && nameW[2] == 0))) { continue; }
+		size_t len = 0;
+		while (nameW[len]) { len++; }
+		name.resize(3 * len + 1);
+		len = winlua_utf16_to_utf8(nameW, len, &name[0]);
+		name[len] = '\0';
+		glob_entry(job, task, out, &name[0], len, glob_type(data.dwFileAttributes), next);
+	}
+	while (FindNextFileW(handle, &data));
+	FindClose(handle);
+}
+
+#else
+
+/* entry type as for glob_entry, or 0 when the path does not exist */
+static char glob_probe(const std::string& path)
+{
+	const char *p = path.empty() ? "." : path.c_str();
+	struct stat st;
+	if (lstat(p, &st) != 0) { return 0; }
+	if (S_ISLNK(st.st_mode)) { return (stat(p, &st) == 0 && S_ISDIR(st.st_mode)) ? 'l' : 'f'; }
+	return S_ISDIR(st.st_mode) ? 'd' : 'f';
+}
+
+static void glob_list(const GlobJob& job, const GlobTask& task, GlobOutput& out)
+{
+	DIR *dir = opendir(task.path.empty() ? "." : task.path.c_str());
+	if (dir == NULL) { return; }
+
+	std::vector<uint32_t> next;
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		const char *name = d->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) { continue; }
+		char type = 'f';
+		if (d->d_type == DT_DIR)
+		{
+			type = 'd';
+		}
+		else if (d->d_type == DT_UNKNOWN || d->d_type == DT_LNK)
+		{
+			struct stat st;
+			if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			{
+				if (S_ISDIR(st.st_mode)) { type = 'd'; }
+				else if (S_ISLNK(st.st_mode) && fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode)) { type = 'l'; }
+			}
+		}
+		glob_entry(job, task, out, name, strlen(name), type, next);
+	}
+	closedir(dir);
+}
+
+#endif
+
+static void glob_directory(const GlobJob& job, const GlobTask& task, GlobOutput& out)
+{
+	if (!glob_literal_only(job, task.states))
+	{
+		glob_list(job, task, out);
+		return;
+	}
+
+	/* probe the literal names instead of listing a directory that may be huge */
+	std::vector<std::string> probed;
+	std::vector<uint32_t> next;
+	for (size_t i = 0; i < task.states.size(); i++)
+	{
+		const std::vector<GlobSegment>& segs = job.patterns[task.states[i] >> 16].segments;
+		size_t seg = task.states[i] & 0xffff;
+		if (seg >= segs.size()) { continue; }
+		const std::string& name = segs[seg].literal;
+		if (std::find(probed.begin(), probed.end(), name) != probed.end()) { continue; }
+		probed.push_back(name);
+		char type = glob_probe(glob_join(task.path, name.data(), name.size()));
+		if (type != 0)
+		{
+			glob_entry(job, task, out, name.c_str(), name.size(), type, next);
+		}
+	}
+}
+
+static void glob_range(void *ud, size_t begin, size_t end)
+{
+	GlobJob *job = static_cast<GlobJob*>(ud);
+	for (size_t i = begin; i < end; i++)
+	{
+		glob_directory(*job, (*job->tasks)[i], (*job->outputs)[i]);
+	}
+}
+
+static void glob_search(GlobJob& job, std::vector<GlobTask>& tasks, std::vector<std::string>& results)
+{
+	std::vector<GlobOutput> outputs;
+	job.outputs = &outputs;
+	while (!tasks.empty())
+	{
+		job.tasks = &tasks;
+		outputs.clear();
+		outputs.resize(tasks.size());
+		winlua_parallel_for(tasks.size(), 1, glob_range, &job);
+
+		std::vector<GlobTask> next;
+		for (size_t i = 0; i < outputs.size(); i++)
+		{
+			GlobOutput& out = outputs[i];
+			for (size_t k = 0; k < out.matches.size(); k++)
+			{
+				results.push_back(std::string());
+				results.back().swap(out.matches[k]);
+			}
+			for (size_t k = 0; k < out.children.size(); k++)
+			{
+				next.push_back(GlobTask());
+				next.back().path.swap(out.children[k].path);
+				next.back().states.swap(out.children[k].states);
+			}
+		}
+		tasks.swap(next);
+	}
+}
+
+/* ------------------------------------------------------------
+fs.glob
+------------------------------------------------------------ */
+
+static const char *const glob_what[] = {"all", "files", "directories", NULL};
+
+static bool glob_compile(GlobJob& job, const std::vector<std::string>& texts)
+{
+	for (size_t i = 0; i < texts.size(); i++)
+	{
+		bool exclude = !texts[i].empty() && texts[i][0] == '!';
+		std::vector<std::string> expanded;
+		if (!brace_expand(exclude ? texts[i].substr(1) : texts[i], expanded)) { return false; }
+		std::vector<GlobPattern>& list = exclude ? job.excludes : job.patterns;
+		for (size_t k = 0; k < expanded.size(); k++)
+		{
+			if (list.size() >= WINLUA_GLOB_MAXPATTERNS) { return false; }
+			list.push_back(GlobPattern());
+			compile_pattern(job, expanded[k], list.back());
+			if (list.back().segments.size() > 0xfffe) { return false; }
+		}
+	}
+	return true;
+}
+
+static void glob_run(GlobJob& job, std::vector<std::string>& results)
+{
+	/* patterns sharing a root are searched together */
+	std::vector<GlobTask> tasks;
+	for (size_t i = 0; i < job.patterns.size(); i++)
+	{
+		const GlobPattern& p = job.patterns[i];
+		if (p.segments.empty())
+		{
+			/* nothing to search: the pattern names one path */
+			char type = glob_probe(p.root);
+			if (type != 0 && !p.root.empty() && (job.what == 0 || (job.what == 1) == (type == 'f')))
+			{
+				size_t slash = p.root.find_last_of(GLOB_SEP == '/' ? "/" : "/\\");
+				const char *name = p.root.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+				if (job.excludes.empty() || !glob_excluded(job, p.root, name)) { results.push_back(p.root); }
+			}
+			continue;
+		}
+		size_t t = 0;
+		while (t < tasks.size() && tasks[t].path != p.root) { t++; }
+		if (t == tasks.size())
+		{
+			char type = glob_probe(p.root);
+			if (type != 'd' && type != 'l') { continue; }
+			tasks.push_back(GlobTask());
+			tasks.back().path = p.root;
+		}
+		add_state(job, tasks[t].states, i, 0);
+	}
+
+	bool overlap = tasks.size() > 1 || results.size() > 0;
+	glob_search(job, tasks, results);
+
+	if (overlap)
+	{
+		/* roots inside other roots find some paths twice */
+		std::unordered_set<std::string> seen;
+		size_t kept = 0;
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			if (seen.insert(results[i]).second)
+			{
+				if (kept != i) { results[kept].swap(results[i]); }
+				kept++;
+			}
+		}
+		results.resize(kept);
+	}
+}
+
+int winlua_fs_glob(lua_State *L)
+{
+	int what = luaL_checkoption(L, 2, "all", glob_what);
+
+	/* check first: an error must not longjmp past the vectors below */
+	if (lua_type(L, 1) == LUA_TTABLE)
+	{
+		for (lua_Integer i = 1; lua_rawgeti(L, 1, i) != LUA_TNIL; i++)
+		{
+			if (lua_type(L, -1) != LUA_TSTRING)
+			{
+				return luaL_error(L, "pattern %d is not a string", static_cast<int>(i));
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	else
+	{
+		luaL_checkstring(L, 1);
+	}
+
+	bool ok;
+	{
+		std::vector<std::string> texts;
+		if (lua_type(L, 1) == LUA_TTABLE)
+		{
+			for (lua_Integer i = 1; lua_rawgeti(L, 1, i) != LUA_TNIL; i++)
+			{
+				size_t len;
+				const char *text = lua_tolstring(L, -1, &len);
+				texts.push_back(std::string(text, len));
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		else
+		{
+			size_t len;
+			const char *text = lua_tolstring(L, 1, &len);
+			texts.push_back(std::string(text, len));
+		}
+
+		GlobJob job;
+		job.what = what;
+		ok = glob_compile(job, texts);
+		if (ok)
+		{
+			std::vector<std::string> results;
+			glob_run(job, results);
+			lua_createtable(L, static_cast<int>(results.size()), 0);
+			for (size_t i = 0; i < results.size(); i++)
+			{
+				lua_pushlstring(L, results[i].data(), results[i].size());
+				lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+			}
+		}
+	}
+	if (!ok)
+	{
+		return luaL_error(L, "pattern has too many alternatives or components");
+	}
+	return 1;
+}
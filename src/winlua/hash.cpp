@@ -0,0 +1,1249 @@
+#include "winlua.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define WINLUA_HASH_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define WINLUA_TARGET_SSE42
+#define WINLUA_TARGET_SHA
+#else
+#include <cpuid.h>
+#define WINLUA_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define WINLUA_TARGET_SHA __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#endif
+
+/* ------------------------------------------------------------
+WinLua File Hashing
+
+	fs.hash(path [, algo])          -> hex digest, size
+	fs.hash_many(paths [, algo])    -> {digest = {...}, size = {...}, error = {...}}, failed
+	fs.hasher([algo])               -> streaming hasher for data made in Lua
+
+'algo' is "crc32c", "xxh3" (XXH3, 64 bits) or "sha256" (the
+default). Digests are lowercase hex, most significant byte first,
+the way the usual command line tools print them.
+
+Files are read in large blocks into page-aligned buffers. A single
+large file is read on a helper thread into one buffer while the
+other is hashed; fs.hash_many instead hashes several files at a
+time on the parallel loop workers. CRC32C uses the SSE4.2 crc32
+instruction and SHA-256 the SHA extensions when the CPU has them.
+------------------------------------------------------------ */
+#define WINLUA_HASH_BLOCK (1 << 20)
+#define WINLUA_HASH_ALIGN 4096
+#define WINLUA_HASHER_META "WinLuaHasher"
+
+enum HashAlgorithm
+{
+	HASH_CRC32C,
+	HASH_XXH3,
+	HASH_SHA256
+};
+
+static const char *const hash_names[] = {"crc32c", "xxh3", "sha256", NULL};
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* ------------------------------------------------------------
+CPU features
+------------------------------------------------------------ */
+
+#ifdef WINLUA_HASH_X64
+
+static void cpu_features(bool *sse42, bool *sha)
+{
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 1);
+	c = static_cast<unsigned int>(regs[2]);
+	__cpuidex(regs, 7, 0);
+	b = static_cast<unsigned int>(regs[1]);
+#else
+	__get_cpuid(1, &a, &b, &c, &d);
+	unsigned int ecx1 = c;
+	b = 0;
+	__get_cpuid_count(7, 0, &a, &b, &c, &d);
+	c = ecx1;
+#endif
+	*sse42 = (c & (1u << 20)) != 0;
+	/* the SHA-NI path also uses SSSE3 and SSE4.1, implied by any CPU with SHA */
+	*sha = (b & (1u << 29)) != 0 && *sse42;
+}
+
+static bool cpu_has(int which)
+{
+	bool sse42, sha;
+	cpu_features(&sse42, &sha);
+	return which == 0 ? sse42 : sha;
+}
+
+static const bool use_crc32_instruction = cpu_has(0);
+static const bool use_sha_extensions = cpu_has(1);
+
+#endif
+
+/* ------------------------------------------------------------
+CRC32C (Castagnoli, reflected polynomial 0x82F63B78)
+------------------------------------------------------------ */
+
+static uint32_t crc32c_table[8][256];
+
+static bool crc32c_make_table()
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++)
+		{
+			crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		for (int t = 1; t < 8; t++)
+		{
+			uint32_t prev = crc32c_table[t - 1][i];
+			crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+		}
+	}
+	return true;
+}
+
+static const bool crc32c_table_ready = crc32c_make_table();
+
+/* slicing-by-8; 'crc' is the running value without the final inversion */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len >= 8)
+	{
+		uint32_t lo = read32(p) ^ crc, hi = read32(p + 4);
+		crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+			crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+			crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+	{
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+	}
+	return crc;
+}
+
+#ifdef WINLUA_HASH_X64
+
+WINLUA_TARGET_SSE42
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+	for (; len >= 8; p += 8, len -= 8)
+	{
+		c = _mm_crc32_u64(c, read64(p));
+	}
+	crc = static_cast<uint32_t>(c);
+	for (; len > 0; p++, len--)
+	{
+		crc = _mm_crc32_u8(crc, *p);
+	}
+	return crc;
+}
+
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef WINLUA_HASH_X64
+	if (use_crc32_instruction)
+	{
+		return crc32c_sse42(crc, p, len);
+	}
+#endif
+	return crc32c_software(crc, p, len);
+}
+
+/* ------------------------------------------------------------
+XXH3 (64-bit, seed 0, default secret)
+
+The long-input loop works on 64-byte stripes with eight 64-bit
+accumulators and scrambles them after every 16 stripes. The
+streaming state keeps up to 256 bytes back so the last stripe can
+be taken from the end of the input, as the one-shot function does.
+------------------------------------------------------------ */
+#define XXH_PRIME32_1 0x9E3779B1u
+#define XXH_PRIME32_2 0x85EBCA77u
+#define XXH_PRIME32_3 0xC2B2AE3Du
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ull
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME64_3 0x165667B19E3779F9ull
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ull
+#define XXH_PRIME_MX1 0x165667919E3779F9ull
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ull
+
+#define XXH_STRIPE 64
+#define XXH_SECRET_SIZE 192
+#define XXH_SECRET_SIZE_MIN 136
+#define XXH_STRIPES_PER_BLOCK ((XXH_SECRET_SIZE - XXH_STRIPE) / 8)
+#define XXH_BUFFER_SIZE 256
+#define XXH_MIDSIZE_MAX 240
+
+static const unsigned char xxh3_secret[XXH_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+struct Xxh3State
+{
+	uint64_t acc[8];
+	unsigned char buffer[XXH_BUFFER_SIZE];
+	size_t buffered, stripes; /* bytes in 'buffer'; stripes consumed in the current block */
+	uint64_t total;
+};
+
+static inline uint64_t rotl64(uint64_t v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t swap64(uint64_t v)
+{
+	v = ((v & 0x00FF00FF00FF00FFull) << 8) | ((v >> 8) & 0x00FF00FF00FF00FFull);
+	v = ((v & 0x0000FFFF0000FFFFull) << 16) | ((v >> 16) & 0x0000FFFF0000FFFFull);
+	return (v << 32) | (v >> 32);
+}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 p = static_cast<unsigned __int128>(a) * b;
+	return static_cast<uint64_t>(p) ^ static_cast<uint64_t>(p >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	uint64_t hi;
+	uint64_t lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+#else
+	uint64_t lolo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+	uint64_t hilo = (a >> 32) * (b & 0xFFFFFFFF);
+	uint64_t lohi = (a & 0xFFFFFFFF) * (b >> 32);
+	uint64_t hihi = (a >> 32) * (b >> 32);
+	uint64_t cross = (lolo >> 32) + (hilo & 0xFFFFFFFF) + lohi;
+	uint64_t upper = (hilo >> 32) + (cross >> 32) + hihi;
+	uint64_t lower = (cross << 32) | (lolo & 0xFFFFFFFF);
+	return lower ^ upper;
+#endif
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= XXH_PRIME_MX1;
+	return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= XXH_PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= XXH_PRIME_MX2;
+	return h ^ (h >> 28);
+}
+
+static inline uint64_t xxh3_mix16(const unsigned char *p, const unsigned char *secret)
+{
+	return mul128_fold64(read64(p) ^ read64(secret), read64(p + 8) ^ read64(secret + 8));
+}
+
+static uint64_t xxh3_short(const unsigned char *p, size_t len)
+{
+	const unsigned char *s = xxh3_secret;
+	if (len > 8)
+	{
+		uint64_t lo = read64(p) ^ (read64(s + 24) ^ read64(s + 32));
+		uint64_t hi = read64(p + len - 8) ^ (read64(s + 40) ^ read64(s + 48));
+		return xxh3_avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+	}
+	if (len >= 4)
+	{
+		uint64_t input = read32(p + len - 4) + (static_cast<uint64_t>(read32(p)) << 32);
+		return xxh3_rrmxmx(input ^ (read64(s + 8) ^ read64(s + 16)), len);
+	}
+	if (len > 0)
+	{
+		uint32_t combined = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[len >> 1]) << 24) |
+			static_cast<uint32_t>(p[len - 1]) | (static_cast<uint32_t>(len) << 8);
+		return xxh64_avalanche(combined ^ static_cast<uint64_t>(read32(s) ^ read32(s + 4)));
+	}
+	return xxh64_avalanche(read64(s + 56) ^ read64(s + 64));
+}
+
+static uint64_t xxh3_medium(const unsigned char *p, size_t len)
+{
+	const unsigned char *s = xxh3_secret;
+	uint64_t acc = len * XXH_PRIME64_1;
+	if (len <= 128)
+	{
+		if (len > 32)
+		{
+			if (len > 64)
+			{
+				if (len > 96)
+				{
+					acc += xxh3_mix16(p + 48, s + 96);
+					acc += xxh3_mix16(p + len - 64, s + 112);
+				}
+				acc += xxh3_mix16(p + 32, s + 64);
+				acc += xxh3_mix16(p + len - 48, s + 80);
+			}
+			acc += xxh3_mix16(p + 16, s + 32);
+			acc += xxh3_mix16(p + len - 32, s + 48);
+		}
+		acc += xxh3_mix16(p, s);
+		acc += xxh3_mix16(p + len - 16, s + 16);
+		return xxh3_avalanche(acc);
+	}
+
+	for (size_t i = 0; i < 8; i++)
+	{
+		acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+	}
+	acc = xxh3_avalanche(acc);
+	for (size_t i = 8; i < len / 16; i++)
+	{
+		acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+	}
+	acc += xxh3_mix16(p + len - 16, s + XXH_SECRET_SIZE_MIN - 17);
+	return xxh3_avalanche(acc);
+}
+
+#ifdef WINLUA_HASH_X64
+
+/* SSE2 is part of x86-64, so these need no runtime check; the accumulators stay in registers across the stripes */
+static inline void xxh3_accumulate(uint64_t *acc, const unsigned char *p, const unsigned char *secret, size_t count)
+{
+	__m128i a[4];
+	for (int i = 0; i < 4; i++)
+	{
+		a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + i);
+	}
+	for (size_t n = 0; n < count; n++, p += XXH_STRIPE, secret += 8)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p) + i);
+			__m128i key = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+			__m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+			a[i] = _mm_add_epi64(_mm_add_epi64(a[i], _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))), product);
+		}
+	}
+	for (int i = 0; i < 4; i++)
+	{
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + i, a[i]);
+	}
+}
+
+static inline void xxh3_scramble(uint64_t *acc, const unsigned char *secret)
+{
+	const __m128i prime = _mm_set1_epi32(static_cast<int>(XXH_PRIME32_1));
+	for (int i = 0; i < 4; i++)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + i);
+		a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+		a = _mm_xor_si128(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+		__m128i lo = _mm_mul_epu32(a, prime);
+		__m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+	}
+}
+
+#else
+
+static inline void xxh3_accumulate(uint64_t *acc, const unsigned char *p, const unsigned char *secret, size_t count)
+{
+	for (size_t n = 0; n < count; n++, p += XXH_STRIPE, secret += 8)
+	{
+		for (int i = 0; i < 8; i++)
+		{
+			uint64_t data = read64(p + 8 * i);
+			uint64_t key = data ^ read64(secret + 8 * i);
+			acc[i ^ 1] += data;
+			acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+		}
+	}
+}
+
+static inline void xxh3_scramble(uint64_t *acc, const unsigned char *secret)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= read64(secret + 8 * i);
+		acc[i] = a * XXH_PRIME32_1;
+	}
+}
+
+#endif
+
+/* feed 'count' whole stripes, scrambling at every block boundary */
+static void xxh3_consume(uint64_t *acc, size_t *stripes, const unsigned char *p, size_t count)
+{
+	while (count > 0)
+	{
+		size_t n = XXH_STRIPES_PER_BLOCK - *stripes;
+		if (n > count) { n = count; }
+		xxh3_accumulate(acc, p, xxh3_secret + *stripes * 8, n);
+		p += n * XXH_STRIPE;
+		count -= n;
+		*stripes += n;
+		if (*stripes == XXH_STRIPES_PER_BLOCK)
+		{
+			xxh3_scramble(acc, xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE);
+			*stripes = 0;
+		}
+	}
+}
+
+static uint64_t xxh3_merge(const uint64_t *acc, uint64_t total)
+{
+	const unsigned char *s = xxh3_secret + 11;
+	uint64_t result = total * XXH_PRIME64_1;
+	for (int i = 0; i < 4; i++)
+	{
+		result += mul128_fold64(acc[2 * i] ^ read64(s + 16 * i), acc[2 * i + 1] ^ read64(s + 16 * i + 8));
+	}
+	return xxh3_avalanche(result);
+}
+
+static void xxh3_init(Xxh3State *x)
+{
+	static const uint64_t init[8] = {
+		XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+	};
+	memcpy(x->acc, init, sizeof(init));
+	x->buffered = x->stripes = 0;
+	x->total = 0;
+}
+
+static void xxh3_update(Xxh3State *x, const unsigned char *p, size_t len)
+{
+	x->total += len;
+	if (x->buffered + len <= XXH_BUFFER_SIZE)
+	{
+		memcpy(x->buffer + x->buffered, p, len);
+		x->buffered += len;
+		return;
+	}
+
+	/* there is more input after these stripes, so none of them is the last */
+	if (x->buffered > 0)
+	{
+		size_t fill = XXH_BUFFER_SIZE - x->buffered;
+		memcpy(x->buffer + x->buffered, p, fill);
+		p += fill;
+		len -= fill;
+		xxh3_consume(x->acc, &x->stripes, x->buffer, XXH_BUFFER_SIZE / XXH_STRIPE);
+		x->buffered = 0;
+	}
+	if (len > XXH_BUFFER_SIZE)
+	{
+		size_t count = (len - 1) / XXH_STRIPE;
+		xxh3_consume(x->acc, &x->stripes, p, count);
+		p += count * XXH_STRIPE;
+		len -= count * XXH_STRIPE;
+		/* keep the previous stripe for a short tail */
+		memcpy(x->buffer + XXH_BUFFER_SIZE - XXH_STRIPE, p - XXH_STRIPE, XXH_STRIPE);
+	}
+	memcpy(x->buffer, p, len);
+	x->buffered = len;
+}
+
+static uint64_t xxh3_digest(const Xxh3State *x)
+{
+	if (x->total <= XXH_MIDSIZE_MAX)
+	{
+		return (x->total <= 16) ? xxh3_short(x->buffer, static_cast<size_t>(x->total)) : xxh3_medium(x->buffer, static_cast<size_t>(x->total));
+	}
+
+	uint64_t acc[8];
+	size_t stripes = x->stripes;
+	memcpy(acc, x->acc, sizeof(acc));
+	unsigned char last[XXH_STRIPE];
+	const unsigned char *tail;
+	if (x->buffered >= XXH_STRIPE)
+	{
+		xxh3_consume(acc, &stripes, x->buffer, (x->buffered - 1) / XXH_STRIPE);
+		tail = x->buffer + x->buffered - XXH_STRIPE;
+	}
+	else
+	{
+		/* the last stripe starts in data that was already consumed */
+		size_t back = XXH_STRIPE - x->buffered;
+		memcpy(last, x->buffer + XXH_BUFFER_SIZE - back, back);
+		memcpy(last + back, x->buffer, x->buffered);
+		tail = last;
+	}
+	xxh3_accumulate(acc, tail, xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE - 7, 1);
+	return xxh3_merge(acc, x->total);
+}
+
+/* ------------------------------------------------------------
+SHA-256
+------------------------------------------------------------ */
+
+struct Sha256State
+{
+	uint32_t h[8];
+	unsigned char buffer[64];
+	size_t buffered;
+	uint64_t total;
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t v, int r)
+{
+	return (v >> r) | (v << (32 - r));
+}
+
+static inline uint32_t read32be(const unsigned char *p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+		(static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+static void sha256_blocks_portable(uint32_t *h, const unsigned char *p, size_t blocks)
+{
+	for (; blocks > 0; blocks--, p += 64)
+	{
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++)
+		{
+			w[i] = read32be(p + 4 * i);
+		}
+		for (int i = 16; i < 64; i++)
+		{
+			uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+		for (int i = 0; i < 64; i++)
+		{
+			uint32_t t1 = hh + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+	}
+}
+
+#ifdef WINLUA_HASH_X64
+
+/* four rounds per step; the message schedule runs three steps ahead */
+WINLUA_TARGET_SHA
+static void sha256_blocks_shani(uint32_t *h, const unsigned char *p, size_t blocks)
+{
+	const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + 4)), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+	for (; blocks > 0; blocks--, p += 64)
+	{
+		__m128i abef = state0, cdgh = state1;
+		__m128i w[4];
+		for (int g = 0; g < 16; g++)
+		{
+			if (g < 4)
+			{
+				w[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p) + g), byteswap);
+			}
+			__m128i msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(sha256_k) + g));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if (g >= 3 && g < 15)
+			{
+				__m128i next = _mm_add_epi32(w[(g + 1) & 3], _mm_alignr_epi8(w[g & 3], w[(g + 3) & 3], 4));
+				w[(g + 1) & 3] = _mm_sha256msg2_epu32(next, w[g & 3]);
+			}
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+			if (g >= 1 && g < 13)
+			{
+				w[(g + 3) & 3] = _mm_sha256msg1_epu32(w[(g + 3) & 3], w[g & 3]);
+			}
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B); /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1); /* DCHG */
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(h), _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(h + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#endif
+
+static void sha256_blocks(uint32_t *h, const unsigned char *p, size_t blocks)
+{
+#ifdef WINLUA_HASH_X64
+	if (use_sha_extensions)
+	{
+		sha256_blocks_shani(h, p, blocks);
+		return;
+	}
+#endif
+	sha256_blocks_portable(h, p, blocks);
+}
+
+static void sha256_init(Sha256State *s)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(s->h, init, sizeof(init));
+	s->buffered = 0;
+	s->total = 0;
+}
+
+static void sha256_update(Sha256State *s, const unsigned char *p, size_t len)
+{
+	s->total += len;
+	if (s->buffered > 0)
+	{
+		size_t fill = 64 - s->buffered;
+		if (fill > len) { fill = len; }
+		memcpy(s->buffer + s->buffered, p, fill);
+		s->buffered += fill;
+		p += fill;
+		len -= fill;
+		if (s->buffered < 64) { return; }
+		sha256_blocks(s->h, s->buffer, 1);
+		s->buffered = 0;
+	}
+	sha256_blocks(s->h, p, len / 64);
+	memcpy(s->buffer, p + (len & ~static_cast<size_t>(63)), len & 63);
+	s->buffered = len & 63;
+}
+
+static void sha256_digest(const Sha256State *s, unsigned char *out)
+{
+	uint32_t h[8];
+	unsigned char pad[128];
+	memcpy(h, s->h, sizeof(h));
+	memcpy(pad, s->buffer, s->buffered);
+	size_t n = s->buffered;
+	pad[n++] = 0x80;
+	size_t padded = (n <= 56) ? 64 : 128;
+	memset(pad + n, 0, padded - n);
+	uint64_t bits = s->total * 8;
+	for (int i = 0; i < 8; i++)
+	{
+		pad[padded - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+	}
+	sha256_blocks(h, pad, padded / 64);
+	for (int i = 0; i < 8; i++)
+	{
+		out[4 * i] = static_cast<unsigned char>(h[i] >> 24);
+		out[4 * i + 1] = static_cast<unsigned char>(h[i] >> 16);
+		out[4 * i + 2] = static_cast<unsigned char>(h[i] >> 8);
+		out[4 * i + 3] = static_cast<unsigned char>(h[i]);
+	}
+}
+
+/* ------------------------------------------------------------
+Hash state shared by all algorithms
+------------------------------------------------------------ */
+
+struct HashState
+{
+	int algo;
+	union
+	{
+		uint32_t crc;
+		Xxh3State xxh3;
+		Sha256State sha256;
+	} u;
+};
+
+static void hash_init(HashState *h, int algo)
+{
+	h->algo = algo;
+	switch (algo)
+	{
+	case HASH_CRC32C: h->u.crc = 0xFFFFFFFFu; break;
+	case HASH_XXH3: xxh3_init(&h->u.xxh3); break;
+	default: sha256_init(&h->u.sha256); break;
+	}
+}
+
+static void hash_update(HashState *h, const unsigned char *p, size_t len)
+{
+	switch (h->algo)
+	{
+	case HASH_CRC32C: h->u.crc = crc32c_update(h->u.crc, p, len); break;
+	case HASH_XXH3: xxh3_update(&h->u.xxh3, p, len); break;
+	default: sha256_update(&h->u.sha256, p, len); break;
+	}
+}
+
+/* big-endian digest bytes; the state is left as it is */
+static size_t hash_digest(const HashState *h, unsigned char *out)
+{
+	uint64_t v;
+	size_t n;
+	switch (h->algo)
+	{
+	case HASH_CRC32C: v = ~h->u.crc & 0xFFFFFFFFu; n = 4; break;
+	case HASH_XXH3: v = xxh3_digest(&h->u.xxh3); n = 8; break;
+	default: sha256_digest(&h->u.sha256, out); return 32;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		out[i] = static_cast<unsigned char>(v >> (8 * (n - 1 - i)));
+	}
+	return n;
+}
+
+static void push_digest(lua_State *L, const HashState *h)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char digest[WINLUA_HASH_MAXDIGEST];
+	char text[2 * WINLUA_HASH_MAXDIGEST];
+	size_t n = hash_digest(h, digest);
+	for (size_t i = 0; i < n; i++)
+	{
+		text[2 * i] = hex[digest[i] >> 4];
+		text[2 * i + 1] = hex[digest[i] & 15];
+	}
+	lua_pushlstring(L, text, 2 * n);
+}
+
+/* ------------------------------------------------------------
+File input: large, page-aligned reads, double buffered for big files
+------------------------------------------------------------ */
+
+#ifdef _WIN32
+typedef HANDLE HashFile;
+#else
+typedef int HashFile;
+#endif
+
+struct HashResult
+{
+	HashState state;
+	uint64_t size;
+	int error;
+	const char *failed; /* the step that failed: "open" or "read" */
+};
+
+static bool file_open(const char *path, size_t len, HashFile *f, uint64_t *size, int *err)
+{
+#ifdef _WIN32
+	std::vector<uint16_t> pathW(len + 1);
+	pathW[winlua_utf8_to_utf16(path, len, &pathW[0])] = 0;
+	*f = CreateFileW(reinterpret_cast<LPCWSTR>(&pathW[0]), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	LARGE_INTEGER filesize;
+	if (*f == INVALID_HANDLE_VALUE || GetFileSizeEx(*f, &filesize) == 0)
+	{
+		*err = static_cast<int>(GetLastError());
+		if (*f != INVALID_HANDLE_VALUE) { CloseHandle(*f); }
+		return false;
+	}
+	*size = static_cast<uint64_t>(filesize.QuadPart);
+#else
+	(void) len;
+	struct stat st;
+	*f = open(path, O_RDONLY | O_CLOEXEC);
+	if (*f < 0 || fstat(*f, &st) != 0)
+	{
+		*err = errno;
+		if (*f >= 0) { close(*f); }
+		return false;
+	}
+	*size = static_cast<uint64_t>(st.st_size);
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(*f, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+	return true;
+}
+
+static void file_close(HashFile f)
+{
+#ifdef _WIN32
+	CloseHandle(f);
+#else
+	close(f);
+#endif
+}
+
+/* fill 'buffer' unless the file ends first; returns the byte count, or -1 with 'err' set */
+static long long file_read(HashFile f, unsigned char *buffer, size_t capacity, int *err)
+{
+	size_t got = 0;
+	while (got < capacity)
+	{
+#ifdef _WIN32
+		DWORD n = 0;
+		if (ReadFile(f, buffer + got, static_cast<DWORD>(capacity - got), &n, NULL) == 0)
+		{
+			*err = static_cast<int>(GetLastError());
+			return -1;
+		}
+#else
+		ssize_t n = read(f, buffer + got, capacity - got);
+		if (n < 0)
+		{
+			if (errno == EINTR) { continue; }
+			*err = errno;
+			return -1;
+		}
+#endif
+		if (n == 0) { break; }
+		got += static_cast<size_t>(n);
+	}
+	return static_cast<long long>(got);
+}
+
+/* one aligned allocation holding both read buffers */
+struct HashBuffers
+{
+	unsigned char *memory, *block[2];
+	size_t capacity;
+
+	HashBuffers() : memory(NULL), capacity(0) { block[0] = block[1] = NULL; }
+	~HashBuffers() { free(memory); }
+
+	bool reserve(size_t size)
+	{
+		if (size <= capacity) { return true; }
+		unsigned char *p = static_cast<unsigned char*>(malloc(2 * size + WINLUA_HASH_ALIGN));
+		if (p == NULL) { return false; }
+		free(memory);
+		memory = p;
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(p) + WINLUA_HASH_ALIGN - 1) & ~static_cast<uintptr_t>(WINLUA_HASH_ALIGN - 1);
+		block[0] = reinterpret_cast<unsigned char*>(aligned);
+		block[1] = block[0] + size;
+		capacity = size;
+		return true;
+	}
+
+private:
+	HashBuffers(const HashBuffers&);
+	HashBuffers& operator=(const HashBuffers&);
+};
+
+/* the reader fills block i while the caller hashes block i ^ 1 */
+struct HashPipe
+{
+	HashFile file;
+	HashBuffers *buffers;
+	size_t lengths[2];
+	bool full[2];
+	int error;
+	std::mutex lock;
+	std::condition_variable changed;
+};
+
+static void pipe_reader(HashPipe *pipe)
+{
+	for (int i = 0;; i ^= 1)
+	{
+		{
+			std::unique_lock<std::mutex> guard(pipe->lock);
+			while (pipe->full[i]) { pipe->changed.wait(guard); }
+		}
+		int err = 0;
+		long long n = file_read(pipe->file, pipe->buffers->block[i], pipe->buffers->capacity, &err);
+		{
+			std::lock_guard<std::mutex> guard(pipe->lock);
+			pipe->lengths[i] = (n > 0) ? static_cast<size_t>(n) : 0;
+			pipe->error = (n < 0) ? err : 0;
+			pipe->full[i] = true;
+		}
+		pipe->changed.notify_all();
+		if (n <= 0) { return; }
+	}
+}
+
+static bool hash_overlapped(HashFile file, HashBuffers& buffers, HashState *state, int *err)
+{
+	HashPipe pipe;
+	pipe.file = file;
+	pipe.buffers = &buffers;
+	pipe.full[0] = pipe.full[1] = false;
+	pipe.error = 0;
+	std::thread reader;
+	try
+	{
+		reader = std::thread(pipe_reader, &pipe);
+	}
+	catch (...)
+	{
+		return false;
+	}
+
+	for (int i = 0;; i ^= 1)
+	{
+		size_t n;
+		{
+			std::unique_lock<std::mutex> guard(pipe.lock);
+			while (!pipe.full[i]) { pipe.changed.wait(guard); }
+			n = pipe.lengths[i];
+			*err = pipe.error;
+		}
+		if (n == 0) { break; }
+		hash_update(state, buffers.block[i], n);
+		{
+			std::lock_guard<std::mutex> guard(pipe.lock);
+			pipe.full[i] = false;
+		}
+		pipe.changed.notify_all();
+	}
+	reader.join();
+	return true;
+}
+
+/* hash a whole file; 'overlap' allows a reader thread for files larger than one block */
+static void hash_file(const char *path, size_t len, int algo, bool overlap, HashBuffers& buffers, HashResult *r)
+{
+	HashFile file;
+	hash_init(&r->state, algo);
+	r->size = 0;
+	r->error = 0;
+	r->failed = NULL;
+	if (!file_open(path, len, &file, &r->size, &r->error))
+	{
+		r->size = 0;
+		r->failed = "open";
+		return;
+	}
+
+	/* small files get a buffer of their own size, rounded up to whole pages */
+	uint64_t want = (r->size < WINLUA_HASH_BLOCK) ? r->size + 1 : WINLUA_HASH_BLOCK;
+	want = (want + WINLUA_HASH_ALIGN - 1) & ~static_cast<uint64_t>(WINLUA_HASH_ALIGN - 1);
+	if (!buffers.reserve(buffers.capacity > want ? buffers.capacity : static_cast<size_t>(want)))
+	{
+		file_close(file);
+#ifdef _WIN32
+		r->error = ERROR_NOT_ENOUGH_MEMORY;
+#else
+		r->error = ENOMEM;
+#endif
+		r->failed = "read";
+		return;
+	}
+
+	if (!(overlap && r->size > buffers.capacity && hash_overlapped(file, buffers, &r->state, &r->error)))
+	{
+		for (;;)
+		{
+			long long n = file_read(file, buffers.block[0], buffers.capacity, &r->error);
+			if (n <= 0) { break; }
+			hash_update(&r->state, buffers.block[0], static_cast<size_t>(n));
+		}
+	}
+	if (r->error != 0)
+	{
+		r->failed = "read";
+		r->size = 0;
+	}
+	file_close(file);
+}
+
+/* ------------------------------------------------------------
+fs.hash and fs.hash_many
+------------------------------------------------------------ */
+
+int winlua_fs_hash(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	int algo = luaL_checkoption(L, 2, "sha256", hash_names);
+
+	HashResult r;
+	{
+		HashBuffers buffers;
+		hash_file(path, len, algo, true, buffers, &r);
+	}
+	if (r.failed != NULL)
+	{
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not %s '%s' (%d)", r.failed, path, r.error);
+		lua_pushinteger(L, r.error);
+		return 3;
+	}
+	push_digest(L, &r.state);
+	lua_pushinteger(L, static_cast<lua_Integer>(r.size));
+	return 2;
+}
+
+struct HashBatch
+{
+	std::vector<const char*> paths;
+	std::vector<size_t> lengths;
+	std::vector<HashResult> results;
+	int algo;
+	bool overlap;
+};
+
+static void hash_range(void *ud, size_t begin, size_t end)
+{
+	HashBatch *batch = static_cast<HashBatch*>(ud);
+	HashBuffers buffers;
+	for (size_t i = begin; i < end; i++)
+	{
+		hash_file(batch->paths[i], batch->lengths[i], batch->algo, batch->overlap, buffers, &batch->results[i]);
+	}
+}
+
+int winlua_hash_algorithm(const char *name)
+{
+	for (int i = 0; hash_names[i] != NULL; i++)
+	{
+		if (strcmp(hash_names[i], name) == 0) { return i; }
+	}
+	return -1;
+}
+
+const char *winlua_hash_name(int algo)
+{
+	return hash_names[algo];
+}
+
+size_t winlua_hash_size(int algo)
+{
+	switch (algo)
+	{
+	case HASH_CRC32C: return 4;
+	case HASH_XXH3: return 8;
+	default: return 32;
+	}
+}
+
+int winlua_hash_file(const char *path, size_t len, int algo, unsigned char *digest)
+{
+	HashResult r;
+	{
+		HashBuffers buffers;
+		hash_file(path, len, algo, false, buffers, &r);
+	}
+	if (r.failed != NULL) { return r.error; }
+	hash_digest(&r.state, digest);
+	return 0;
+}
+
+int winlua_fs_hash_many(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int algo = luaL_checkoption(L, 2, "sha256", hash_names);
+	size_t n = lua_rawlen(L, 1);
+
+	/* check first: an error must not longjmp past the vectors below */
+	for (size_t i = 0; i < n; i++)
+	{
+		if (lua_rawgeti(L, 1, static_cast<lua_Integer>(i + 1)) != LUA_TSTRING)
+		{
+			return luaL_error(L, "path %d is not a string", static_cast<int>(i + 1));
+		}
+		lua_pop(L, 1);
+	}
+
+	/* the strings stay anchored by the argument table while the workers read them */
+	int failed = 0;
+	{
+		HashBatch batch;
+		batch.paths.resize(n);
+		batch.lengths.resize(n);
+		batch.results.resize(n);
+		batch.algo = algo;
+		/* with several workers the files themselves overlap reading and hashing */
+		batch.overlap = winlua_parallel_threads(n, 1) <= 1;
+		for (size_t i = 0; i < n; i++)
+		{
+			lua_rawgeti(L, 1, static_cast<lua_Integer>(i + 1));
+			batch.paths[i] = lua_tolstring(L, -1, &batch.lengths[i]);
+			lua_pop(L, 1);
+		}
+
+		winlua_parallel_for(n, 1, hash_range, &batch);
+
+		lua_createtable(L, 0, 3);
+		lua_createtable(L, static_cast<int>(n), 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			if (batch.results[i].failed != NULL) { lua_pushboolean(L, 0); failed++; }
+			else { push_digest(L, &batch.results[i].state); }
+			lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+		}
+		lua_setfield(L, -2, "digest");
+		lua_createtable(L, static_cast<int>(n), 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			lua_pushinteger(L, static_cast<lua_Integer>(batch.results[i].size));
+			lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+		}
+		lua_setfield(L, -2, "size");
+		lua_createtable(L, static_cast<int>(n), 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			lua_pushinteger(L, batch.results[i].error);
+			lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+		}
+		lua_setfield(L, -2, "error");
+	}
+
+	lua_pushinteger(L, failed);
+	return 2;
+}
+
+/* ------------------------------------------------------------
+fs.hasher: streaming hasher object
+
+	local h = fs.hasher("xxh3")
+	h:update(chunk1):update(chunk2, chunk3)
+	print(h:digest())   -- the hasher can still be updated afterwards
+	h:reset()
+------------------------------------------------------------ */
+
+static HashState *check_hasher(lua_State *L, int idx)
+{
+	return static_cast<HashState*>(luaL_checkudata(L, idx, WINLUA_HASHER_META));
+}
+
+static int hasher_update(lua_State *L)
+{
+	HashState *h = check_hasher(L, 1);
+	int top = lua_gettop(L);
+	for (int i = 2; i <= top; i++)
+	{
+		size_t len;
+		const char *data;
+		/* string views (fs.mmap) are hashed in place */
+		if (lua_type(L, i) == LUA_TUSERDATA && luaL_getmetafield(L, i, LUAL_STRVIEW) != LUA_TNIL)
+		{
+			const luaL_StrView *v = static_cast<const luaL_StrView*>(lua_touserdata(L, i));
+			lua_pop(L, 1);
+			luaL_argcheck(L, v->data != NULL, i, "string view is closed");
+			data = v->data;
+			len = v->len;
+		}
+		else
+		{
+			data = luaL_checklstring(L, i, &len);
+		}
+		hash_update(h, reinterpret_cast<const unsigned char*>(data), len);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int hasher_digest(lua_State *L)
+{
+	push_digest(L, check_hasher(L, 1));
+	return 1;
+}
+
+static int hasher_reset(lua_State *L)
+{
+	HashState *h = check_hasher(L, 1);
+	hash_init(h, h->algo);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int hasher__tostring(lua_State *L)
+{
+	HashState *h = check_hasher(L, 1);
+	lua_pushfstring(L, "hasher (%s): %p", hash_names[h->algo], h);
+	return 1;
+}
+
+static const luaL_Reg hasher_methods[] = {
+	{"update", hasher_update},
+	{"digest", hasher_digest},
+	{"reset", hasher_reset},
+	{"__tostring", hasher__tostring},
+	{NULL, NULL}
+};
+
+int winlua_fs_hasher(lua_State *L)
+{
+	int algo = luaL_checkoption(L, 1, "sha256", hash_names);
+	HashState *h = static_cast<HashState*>(lua_newuserdata(L, sizeof(HashState)));
+	hash_init(h, algo);
+	if (luaL_newmetatable(L, WINLUA_HASHER_META))
+	{
+		luaL_setfuncs(L, hasher_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
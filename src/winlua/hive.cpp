@@ -0,0 +1,1090 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ------------------------------------------------------------
+WinLua Registry Hive Files
+
+	registry.load_hive(path [, {index = true}])  -> key, or nil, message, code
+
+Opens a registry hive file (the regf format of SYSTEM, SOFTWARE,
+NTUSER.DAT and reg save output) read-only, on any platform, and
+returns its root key. Hive keys work like live registry keys:
+
+	key:open(path)    -> subkey ('\\' or '/' separated, case-insensitive)
+	key:subkeys()     -> iterator over subkey names
+	key:values()      -> iterator over value name, data, type
+	key:value(name)   -> data, type; nil when there is no such value
+	key:class()       -> class name
+	key:name()        -> key name
+	key:read_tree([options])  -> the whole subtree as tables (see regtree.cpp)
+	key:export(file, name [, options])  -> the whole subtree as a .reg file (see regfile.cpp)
+
+Value data comes back as Lua values: strings as UTF-8, REG_MULTI_SZ
+as a list, DWORDs and QWORDs as integers, anything else as the raw
+bytes; the type as its name ("REG_SZ", ...). The default value has
+the name "".
+
+The file is mapped and its cells are read in place: a key is the
+offset of its nk cell, and names and data are converted only when
+they are pushed. With {index = true} the paths of all keys are
+hashed once when the hive is loaded, after which key:open costs one
+hash lookup instead of a search through each level's subkey list.
+
+The format is read as Windows writes it (little-endian, cells
+relative to the first hive bin); every offset is bounds-checked, so
+a damaged hive yields errors or missing entries rather than faults.
+------------------------------------------------------------ */
+#define WINLUA_HIVE_META "WinLuaHive"
+#define WINLUA_HIVEKEY_META "WinLuaHiveKey"
+
+#define HIVE_BINS 4096 /* cells are relative to the end of the base block */
+#define HIVE_NONE 0xffffffffu
+#define HIVE_MAXDEPTH 512
+#define HIVE_BIGDATA 16344 /* larger values are split into db segments (hive 1.4 and later) */
+
+/* nk (key) cells */
+#define NK_FLAGS 2
+#define NK_SUBKEYS 20
+#define NK_SUBLIST 28
+#define NK_VALUES 36
+#define NK_VALLIST 40
+#define NK_CLASS 48
+#define NK_NAMELEN 72
+#define NK_CLASSLEN 74
+#define NK_NAME 76
+#define KEY_COMP_NAME 0x0020
+
+/* vk (value) cells */
+#define VK_NAMELEN 2
+#define VK_SIZE 4
+#define VK_DATA 8
+#define VK_TYPE 12
+#define VK_FLAGS 16
+#define VK_NAME 20
+#define VALUE_COMP_NAME 0x0001
+
+struct HiveIndex
+{
+	std::unordered_map<std::string, uint32_t> paths; /* upper-cased path below the root -> nk cell */
+	std::unordered_map<uint32_t, const std::string*> keys; /* nk cell -> its path */
+};
+
+/* hive userdata: the mapping */
+struct WinLuaHive
+{
+	const unsigned char *bins;
+	size_t size; /* bytes of hive bins */
+	uint32_t root;
+	uint32_t minor;
+	HiveIndex *index;
+
+	void *base;
+	size_t mapped;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+/* key userdata; its uservalue keeps the hive alive */
+struct WinLuaHiveKey
+{
+	const WinLuaHive *hive;
+	uint32_t cell;
+};
+
+/* subkeys() position: an ri list of lists, or a single list */
+struct HiveCursor
+{
+	uint32_t ri, ri_index;
+	uint32_t list, index;
+	bool hashed; /* the last entry came from an lh list, with 'hash' */
+	uint32_t hash;
+};
+
+/* ------------------------------------------------------------
+Cells
+------------------------------------------------------------ */
+
+static uint32_t rd16(const unsigned char *p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8);
+}
+
+static uint32_t rd32(const unsigned char *p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/* the data of the allocated cell at 'offset' if it holds at least 'need' bytes, or NULL */
+static const unsigned char *hive_cell(const WinLuaHive *h, uint32_t offset, size_t need, size_t *len)
+{
+	if (offset == HIVE_NONE || offset > h->size || h->size - offset < 8) { return NULL; }
+	int32_t size = static_cast<int32_t>(rd32(h->bins + offset));
+	if (size >= 0) { return NULL; } /* free */
+	size_t bytes = static_cast<size_t>(-static_cast<int64_t>(size));
+	if (bytes < 4 || bytes > h->size - offset || bytes - 4 < need) { return NULL; }
+	*len = bytes - 4;
+	return h->bins + offset + 4;
+}
+
+static bool has_signature(const unsigned char *p, const char *sig)
+{
+	return p[0] == static_cast<unsigned char>(sig[0]) && p[1] == static_cast<unsigned char>(sig[1]);
+}
+
+/* the nk cell at 'offset', or NULL */
+static const unsigned char *hive_key(const WinLuaHive *h, uint32_t offset)
+{
+	size_t len;
+	const unsigned char *nk = hive_cell(h, offset, NK_NAME, &len);
+	if (nk == NULL || !has_signature(nk, "nk") || NK_NAME + rd16(nk + NK_NAMELEN) > len) { return NULL; }
+	return nk;
+}
+
+static void cursor_init(const WinLuaHive *h, const unsigned char *nk, HiveCursor *c)
+{
+	size_t len;
+	uint32_t list = rd32(nk + NK_SUBLIST);
+	const unsigned char *p = (rd32(nk + NK_SUBKEYS) == 0) ? NULL : hive_cell(h, list, 4, &len);
+	c->ri = HIVE_NONE;
+	c->ri_index = 0;
+	c->list = HIVE_NONE;
+	c->index = 0;
+	c->hashed = false;
+	c->hash = 0;
+	if (p != NULL && has_signature(p, "ri"))
+	{
+		c->ri = list;
+	}
+	else if (p != NULL)
+	{
+		c->list = list;
+	}
+}
+
+/* the next subkey's nk offset, or HIVE_NONE */
+static uint32_t cursor_next(const WinLuaHive *h, HiveCursor *c)
+{
+	for (;;)
+	{
+		size_t len;
+		const unsigned char *p = hive_cell(h, c->list, 4, &len);
+		if (p != NULL)
+		{
+			/* li lists hold offsets; lf and lh lists offsets and name hints or hashes */
+			size_t entry = has_signature(p, "li") ? 4 : (has_signature(p, "lf") || has_signature(p, "lh")) ? 8 : 0;
+			size_t count = rd16(p + 2);
+			if (entry != 0 && c->index < count && 4 + (c->index + 1) * entry <= len)
+			{
+				const unsigned char *e = p + 4 + (c->index++) * entry;
+				c->hashed = has_signature(p, "lh");
+				c->hash = c->hashed ? rd32(e + 4) : 0;
+				return rd32(e);
+			}
+		}
+		c->list = HIVE_NONE;
+
+		p = hive_cell(h, c->ri, 4, &len);
+		if (p == NULL || c->ri_index >= rd16(p + 2) || 4 + (c->ri_index + 1) * 4 > len)
+		{
+			return HIVE_NONE;
+		}
+		c->list = rd32(p + 4 + (c->ri_index++) * 4);
+		c->index = 0;
+	}
+}
+
+/* ------------------------------------------------------------
+Names
+------------------------------------------------------------ */
+
+/* names are Latin-1 when compressed, UTF-16LE otherwise */
+static void push_name(lua_State *L, const unsigned char *p, size_t len, bool compressed, WinLuaScratch& scratch)
+{
+	if (!compressed)
+	{
+		char *utf8 = static_cast<char*>(scratch.alloc(3 * (len / 2) + 1));
+		lua_pushlstring(L, utf8, winlua_utf16_to_utf8(reinterpret_cast<const uint16_t*>(p), len / 2, utf8));
+		return;
+	}
+	size_t i = 0;
+	while (i < len && p[i] < 0x80) { i++; }
+	if (i == len)
+	{
+		lua_pushlstring(L, reinterpret_cast<const char*>(p), len);
+		return;
+	}
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	for (i = 0; i < len; i++)
+	{
+		if (p[i] < 0x80)
+		{
+			luaL_addchar(&b, static_cast<char>(p[i]));
+		}
+		else
+		{
+			luaL_addchar(&b, static_cast<char>(0xc0 | (p[i] >> 6)));
+			luaL_addchar(&b, static_cast<char>(0x80 | (p[i] & 0x3f)));
+		}
+	}
+	luaL_pushresult(&b);
+}
+
+static uint32_t fold(uint32_t c)
+{
+	return (c >= 'a' && c <= 'z') ? c - 32 : c;
+}
+
+/* a stored name against UTF-16 'query', ignoring ASCII case as the registry does */
+static bool name_equal(const unsigned char *p, size_t len, bool compressed, const uint16_t *query, size_t qlen)
+{
+	if ((compressed ? len : len / 2) != qlen) { return false; }
+	for (size_t i = 0; i < qlen; i++)
+	{
+		uint32_t c = compressed ? p[i] : rd16(p + 2 * i);
+		if (fold(c) != fold(query[i])) { return false; }
+	}
+	return true;
+}
+
+/* the hash lh lists keep for each subkey */
+static uint32_t name_hash(const uint16_t *name, size_t len)
+{
+	uint32_t h = 0;
+	for (size_t i = 0; i < len; i++) { h = h * 37 + fold(name[i]); }
+	return h;
+}
+
+/* the subkey of 'nk' named 'name', or HIVE_NONE */
+static uint32_t find_subkey(const WinLuaHive *h, const unsigned char *nk, const uint16_t *name, size_t len)
+{
+	/* lh hashes only fold ASCII the same way as fold(); skip the filter otherwise */
+	bool ascii = true;
+	for (size_t i = 0; i < len; i++) { ascii = ascii && name[i] < 0x80; }
+	uint32_t hash = name_hash(name, len);
+
+	HiveCursor c;
+	cursor_init(h, nk, &c);
+	for (uint32_t offset = cursor_next(h, &c); offset != HIVE_NONE; offset = cursor_next(h, &c))
+	{
+		if (ascii && c.hashed && c.hash != hash) { continue; }
+		const unsigned char *child = hive_key(h, offset);
+		if (child != NULL && name_equal(child + NK_NAME, rd16(child + NK_NAMELEN), (rd16(child + NK_FLAGS) & KEY_COMP_NAME) != 0, name, len))
+		{
+			return offset;
+		}
+	}
+	return HIVE_NONE;
+}
+
+/* ------------------------------------------------------------
+Values
+------------------------------------------------------------ */
+
+static const char *const regtype_names[] = {
+	"REG_NONE", "REG_SZ", "REG_EXPAND_SZ", "REG_BINARY", "REG_DWORD", "REG_DWORD_BIG_ENDIAN", "REG_LINK",
+	"REG_MULTI_SZ", "REG_RESOURCE_LIST", "REG_FULL_RESOURCE_DESCRIPTOR", "REG_RESOURCE_REQUIREMENTS_LIST", "REG_QWORD"
+};
+
+void winlua_push_regtype(lua_State *L, uint32_t type)
+{
+	if (type < sizeof(regtype_names) / sizeof(regtype_names[0]))
+	{
+		lua_pushstring(L, regtype_names[type]);
+	}
+	else
+	{
+		lua_pushinteger(L, static_cast<lua_Integer>(type));
+	}
+}
+
+int winlua_regtype(const char *name)
+{
+	for (size_t i = 0; i < sizeof(regtype_names) / sizeof(regtype_names[0]); i++)
+	{
+		if (strcmp(name, regtype_names[i]) == 0) { return static_cast<int>(i); }
+	}
+	return -1;
+}
+
+static void push_utf16(lua_State *L, const unsigned char *data, size_t units, WinLuaScratch& scratch)
+{
+	char *utf8 = static_cast<char*>(scratch.alloc(3 * units + 1));
+	if (reinterpret_cast<uintptr_t>(data) & 1)
+	{
+		void *aligned = scratch.alloc(2 * units + 1);
+		memcpy(aligned, data, 2 * units);
+		data = static_cast<const unsigned char*>(aligned);
+	}
+	lua_pushlstring(L, utf8, winlua_utf16_to_utf8(reinterpret_cast<const uint16_t*>(data), units, utf8));
+}
+
+void winlua_push_regvalue(lua_State *L, uint32_t type, const unsigned char *data, size_t len, WinLuaScratch& scratch)
+{
+	size_t units = len / 2;
+	switch (type)
+	{
+	case 1: /* REG_SZ */
+	case 2: /* REG_EXPAND_SZ */
+	case 6: /* REG_LINK */
+		/* up to the terminator, which writers do not always include */
+		for (size_t i = 0; i < units; i++)
+		{
+			if (rd16(data + 2 * i) == 0)
+			{
+				units = i;
+				break;
+			}
+		}
+		push_utf16(L, data, units, scratch);
+		return;
+	case 7: /* REG_MULTI_SZ */
+	{
+		lua_newtable(L);
+		lua_Integer n = 0;
+		size_t start = 0;
+		for (size_t i = 0; i <= units; i++)
+		{
+			if (i < units && rd16(data + 2 * i) != 0) { continue; }
+			if (i == start) { break; } /* the empty string ends the list */
+			push_utf16(L, data + 2 * start, i - start, scratch);
+			lua_rawseti(L, -2, ++n);
+			start = i + 1;
+		}
+		return;
+	}
+	case 4: /* REG_DWORD */
+		if (len == 4)
+		{
+			lua_pushinteger(L, static_cast<lua_Integer>(rd32(data)));
+			return;
+		}
+		break;
+	case 5: /* REG_DWORD_BIG_ENDIAN */
+		if (len == 4)
+		{
+			lua_pushinteger(L, static_cast<lua_Integer>((static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) | (static_cast<uint32_t>(data[2]) << 8) | data[3]));
+			return;
+		}
+		break;
+	case 11: /* REG_QWORD */
+		if (len == 8)
+		{
+			lua_pushinteger(L, static_cast<lua_Integer>(static_cast<uint64_t>(rd32(data)) | (static_cast<uint64_t>(rd32(data + 4)) << 32)));
+			return;
+		}
+		break;
+	}
+	lua_pushlstring(L, reinterpret_cast<const char*>(data), len);
+}
+
+/* the vk cell at 'offset', or NULL */
+static const unsigned char *hive_value(const WinLuaHive *h, uint32_t offset)
+{
+	size_t len;
+	const unsigned char *vk = hive_cell(h, offset, VK_NAME, &len);
+	if (vk == NULL || !has_signature(vk, "vk") || VK_NAME + rd16(vk + VK_NAMELEN) > len) { return NULL; }
+	return vk;
+}
+
+/* the vk offsets of a key, no more than its list cell holds */
+static const unsigned char *value_list(const WinLuaHive *h, const unsigned char *nk, uint32_t *count)
+{
+	size_t len = 0;
+	const unsigned char *list = (rd32(nk + NK_VALUES) == 0) ? NULL : hive_cell(h, rd32(nk + NK_VALLIST), 0, &len);
+	*count = (list == NULL) ? 0 : rd32(nk + NK_VALUES);
+	if (*count > len / 4) { *count = static_cast<uint32_t>(len / 4); }
+	return list;
+}
+
+/* the data of a value in place, or NULL and its db cell when it is split into segments */
+static const unsigned char *value_data(const WinLuaHive *h, const unsigned char *vk, size_t *len, const unsigned char **db)
+{
+	uint32_t size = rd32(vk + VK_SIZE);
+	size_t celllen;
+	*len = size & 0x7fffffff;
+	*db = NULL;
+	if (size & 0x80000000)
+	{
+		/* up to four bytes are kept in the offset field itself */
+		if (*len > 4) { *len = 4; }
+		return vk + VK_DATA;
+	}
+	const unsigned char *data = hive_cell(h, rd32(vk + VK_DATA), 0, &celllen);
+	if (*len > HIVE_BIGDATA && h->minor >= 4 && data != NULL && celllen >= 8 && has_signature(data, "db"))
+	{
+		if (*len > h->size) { *len = h->size; }
+		*db = data;
+		return NULL;
+	}
+	if (data == NULL) { *len = 0; }
+	else if (*len > celllen) { *len = celllen; }
+	return data;
+}
+
+/* join the segments of a big value into 'dst', up to 'len' bytes; returns the bytes found */
+static size_t join_segments(const WinLuaHive *h, const unsigned char *db, unsigned char *dst, size_t len)
+{
+	size_t got = 0, listlen, seglen;
+	uint32_t count = rd16(db + 2);
+	const unsigned char *list = hive_cell(h, rd32(db + 4), 0, &listlen);
+	for (uint32_t i = 0; list != NULL && i < count && (i + 1) * 4 <= listlen && got < len; i++)
+	{
+		const unsigned char *segment = hive_cell(h, rd32(list + 4 * i), 0, &seglen);
+		if (segment == NULL) { break; }
+		size_t n = len - got;
+		if (n > seglen) { n = seglen; }
+		if (n > HIVE_BIGDATA) { n = HIVE_BIGDATA; }
+		memcpy(dst + got, segment, n);
+		got += n;
+	}
+	return got;
+}
+
+/* push the data and type of a value, with buffers from the caller's scope */
+static void push_value(lua_State *L, const WinLuaHive *h, const unsigned char *vk, WinLuaScratch& scratch)
+{
+	uint32_t type = rd32(vk + VK_TYPE);
+	size_t len;
+	const unsigned char *db, *data = value_data(h, vk, &len, &db);
+	if (db != NULL)
+	{
+		unsigned char *joined = static_cast<unsigned char*>(scratch.alloc(len));
+		winlua_push_regvalue(L, type, joined, join_segments(h, db, joined, len), scratch);
+	}
+	else
+	{
+		winlua_push_regvalue(L, type, data, len, scratch);
+	}
+	winlua_push_regtype(L, type);
+}
+
+/* ------------------------------------------------------------
+Hive keys
+------------------------------------------------------------ */
+
+static WinLuaHiveKey *check_key(lua_State *L, int idx)
+{
+	return static_cast<WinLuaHiveKey*>(luaL_checkudata(L, idx, WINLUA_HIVEKEY_META));
+}
+
+static const unsigned char *check_nk(lua_State *L, WinLuaHiveKey *k)
+{
+	const unsigned char *nk = hive_key(k->hive, k->cell);
+	if (nk == NULL)
+	{
+		luaL_error(L, "damaged key cell at offset %d", static_cast<int>(k->cell));
+	}
+	return nk;
+}
+
+/* push a key of the same hive as the key at 'idx' */
+static void push_key(lua_State *L, int idx, const WinLuaHive *hive, uint32_t cell)
+{
+	idx = lua_absindex(L, idx);
+	WinLuaHiveKey *k = static_cast<WinLuaHiveKey*>(lua_newuserdata(L, sizeof(WinLuaHiveKey)));
+	k->hive = hive;
+	k->cell = cell;
+	luaL_setmetatable(L, WINLUA_HIVEKEY_META);
+	lua_getuservalue(L, idx);
+	lua_setuservalue(L, -2);
+}
+
+/* upper-cased, '\\'-separated form of a key path, without leading or trailing separators */
+static void normalize_path(const char *path, size_t len, std::string& out)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		char c = (path[i] == '/') ? '\\' : path[i];
+		if (c == '\\' && (out.empty() || out[out.size() - 1] == '\\')) { continue; }
+		out += static_cast<char>(fold(static_cast<unsigned char>(c)));
+	}
+	if (!out.empty() && out[out.size() - 1] == '\\') { out.erase(out.size() - 1); }
+}
+
+static int hivekey_open(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	size_t len;
+	const char *subkey = luaL_checklstring(L, 2, &len);
+	const WinLuaHive *h = k->hive;
+	uint32_t cell = k->cell;
+
+	if (h->index != NULL)
+	{
+		uint32_t found = HIVE_NONE;
+		{
+			std::unordered_map<uint32_t, const std::string*>::const_iterator base = h->index->keys.find(cell);
+			std::string path = (base == h->index->keys.end()) ? std::string() : *base->second;
+			if (!path.empty()) { path += '\\'; }
+			normalize_path(subkey, len, path);
+			std::unordered_map<std::string, uint32_t>::const_iterator it = h->index->paths.find(path);
+			if (it != h->index->paths.end()) { found = it->second; }
+		}
+		if (found == HIVE_NONE)
+		{
+			return luaL_error(L, "could not open subkey '%s' (%d)", subkey, 2);
+		}
+		push_key(L, 1, h, found);
+		return 1;
+	}
+
+	WinLuaScratch scratch(L);
+	uint16_t *name = static_cast<uint16_t*>(scratch.alloc(sizeof(uint16_t) * (len + 1)));
+	for (size_t start = 0; start <= len && cell != HIVE_NONE; )
+	{
+		size_t end = start;
+		while (end < len && subkey[end] != '\\' && subkey[end] != '/') { end++; }
+		if (end > start)
+		{
+			const unsigned char *nk = hive_key(h, cell);
+			size_t n = winlua_utf8_to_utf16(subkey + start, end - start, name);
+			cell = (nk == NULL) ? HIVE_NONE : find_subkey(h, nk, name, n);
+		}
+		start = end + 1;
+	}
+	if (cell == HIVE_NONE)
+	{
+		return luaL_error(L, "could not open subkey '%s' (%d)", subkey, 2);
+	}
+	push_key(L, 1, h, cell);
+	return 1;
+}
+
+static int hivekey_name(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	const unsigned char *nk = check_nk(L, k);
+	WinLuaScratch scratch(L);
+	push_name(L, nk + NK_NAME, rd16(nk + NK_NAMELEN), (rd16(nk + NK_FLAGS) & KEY_COMP_NAME) != 0, scratch);
+	return 1;
+}
+
+static int hivekey_class(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	const unsigned char *nk = check_nk(L, k);
+	size_t len, classlen = rd16(nk + NK_CLASSLEN);
+	const unsigned char *p = (classlen == 0) ? NULL : hive_cell(k->hive, rd32(nk + NK_CLASS), classlen, &len);
+	if (p == NULL)
+	{
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	WinLuaScratch scratch(L);
+	push_utf16(L, p, classlen / 2, scratch);
+	return 1;
+}
+
+/*
+upvalues:
+	1 -> key userdata
+	2 -> HiveCursor userdata
+*/
+static int hivekey_subkeys_next(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, lua_upvalueindex(1));
+	HiveCursor *c = static_cast<HiveCursor*>(lua_touserdata(L, lua_upvalueindex(2)));
+	for (;;)
+	{
+		uint32_t offset = cursor_next(k->hive, c);
+		if (offset == HIVE_NONE) { return 0; }
+		const unsigned char *nk = hive_key(k->hive, offset);
+		if (nk != NULL)
+		{
+			WinLuaScratch scratch(L);
+			push_name(L, nk + NK_NAME, rd16(nk + NK_NAMELEN), (rd16(nk + NK_FLAGS) & KEY_COMP_NAME) != 0, scratch);
+			return 1;
+		}
+	}
+}
+
+static int hivekey_subkeys(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	const unsigned char *nk = check_nk(L, k);
+	lua_pushvalue(L, 1);
+	HiveCursor *c = static_cast<HiveCursor*>(lua_newuserdata(L, sizeof(HiveCursor)));
+	cursor_init(k->hive, nk, c);
+	lua_pushcclosure(L, hivekey_subkeys_next, 2);
+	return 1;
+}
+
+/*
+upvalues:
+	1 -> key userdata
+	2 -> current index of iteration
+*/
+static int hivekey_values_next(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, lua_upvalueindex(1));
+	const unsigned char *nk = check_nk(L, k);
+	uint32_t i = static_cast<uint32_t>(lua_tointeger(L, lua_upvalueindex(2))), count;
+	const unsigned char *list = value_list(k->hive, nk, &count);
+	while (i < count)
+	{
+		const unsigned char *vk = hive_value(k->hive, rd32(list + 4 * i++));
+		if (vk == NULL) { continue; }
+		lua_pushinteger(L, i);
+		lua_replace(L, lua_upvalueindex(2));
+		WinLuaScratch scratch(L);
+		push_name(L, vk + VK_NAME, rd16(vk + VK_NAMELEN), (rd16(vk + VK_FLAGS) & VALUE_COMP_NAME) != 0, scratch);
+		push_value(L, k->hive, vk, scratch);
+		return 3;
+	}
+	return 0;
+}
+
+static int hivekey_values(lua_State *L)
+{
+	check_nk(L, check_key(L, 1));
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, hivekey_values_next, 2);
+	return 1;
+}
+
+static int hivekey_value(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	size_t len;
+	const char *name = luaL_optlstring(L, 2, "", &len);
+	const unsigned char *nk = check_nk(L, k);
+
+	WinLuaScratch scratch(L);
+	uint16_t *nameW = static_cast<uint16_t*>(scratch.alloc(sizeof(uint16_t) * (len + 1)));
+	size_t n = winlua_utf8_to_utf16(name, len, nameW);
+	uint32_t count;
+	const unsigned char *list = value_list(k->hive, nk, &count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const unsigned char *vk = hive_value(k->hive, rd32(list + 4 * i));
+		if (vk != NULL && name_equal(vk + VK_NAME, rd16(vk + VK_NAMELEN), (rd16(vk + VK_FLAGS) & VALUE_COMP_NAME) != 0, nameW, n))
+		{
+			push_value(L, k->hive, vk, scratch);
+			return 2;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+/* ------------------------------------------------------------
+key:read_tree backend
+------------------------------------------------------------ */
+#define HIVE_DAMAGED 13 /* ERROR_INVALID_DATA */
+#define HIVE_MAXNAME 255 /* longest key name the registry allows */
+
+/* the number of entries of a subkey list cell, no more than it holds */
+static uint32_t list_count(const WinLuaHive *h, uint32_t offset, const unsigned char **list, size_t *entry)
+{
+	size_t len;
+	const unsigned char *p = hive_cell(h, offset, 4, &len);
+	*list = p;
+	*entry = (p == NULL) ? 0 : (has_signature(p, "li") || has_signature(p, "ri")) ? 4 : (has_signature(p, "lf") || has_signature(p, "lh")) ? 8 : 0;
+	if (*entry == 0) { return 0; }
+	uint32_t count = rd16(p + 2);
+	return (4 + count * *entry <= len) ? count : static_cast<uint32_t>((len - 4) / *entry);
+}
+
+/* the 'index'th subkey of 'nk', or HIVE_NONE */
+static uint32_t subkey_at(const WinLuaHive *h, const unsigned char *nk, uint32_t index)
+{
+	const unsigned char *list, *sub;
+	size_t entry, subentry;
+	uint32_t count = list_count(h, rd32(nk + NK_SUBLIST), &list, &entry);
+	if (count == 0 || !has_signature(list, "ri"))
+	{
+		return (index < count && !has_signature(list, "ri")) ? rd32(list + 4 + index * entry) : HIVE_NONE;
+	}
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t n = list_count(h, rd32(list + 4 + 4 * i), &sub, &subentry);
+		if (n != 0 && has_signature(sub, "ri")) { continue; }
+		if (index < n) { return rd32(sub + 4 + index * subentry); }
+		index -= n;
+	}
+	return HIVE_NONE;
+}
+
+static uint32_t subkey_total(const WinLuaHive *h, const unsigned char *nk)
+{
+	const unsigned char *list, *sub;
+	size_t entry, subentry;
+	uint32_t count = list_count(h, rd32(nk + NK_SUBLIST), &list, &entry), total = 0;
+	if (count == 0 || !has_signature(list, "ri")) { return count; }
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t n = list_count(h, rd32(list + 4 + 4 * i), &sub, &subentry);
+		if (n != 0 && !has_signature(sub, "ri")) { total += n; }
+	}
+	return total;
+}
+
+/* copy a name as UTF-16; 'len' is the room in 'name' on the way in */
+static int copy_name(const unsigned char *p, size_t bytes, bool compressed, uint16_t *name, size_t *len)
+{
+	size_t units = compressed ? bytes : bytes / 2;
+	if (units + 1 > *len)
+	{
+		*len = units + 1;
+		return WINLUA_REG_MORE_DATA;
+	}
+	for (size_t i = 0; i < units; i++)
+	{
+		name[i] = static_cast<uint16_t>(compressed ? p[i] : rd16(p + 2 * i));
+	}
+	name[units] = 0;
+	*len = units;
+	return 0;
+}
+
+/* 'seen' has a bit per eight bytes of hive bins, so that no key cell is read twice even when a damaged hive links keys in a loop */
+class HiveBackend : public WinLuaRegBackend
+{
+public:
+	HiveBackend(const WinLuaHive *hive, std::atomic<unsigned char> *visited) : h(hive), seen(visited) {}
+
+	bool first_visit(uint32_t offset)
+	{
+		unsigned char bit = static_cast<unsigned char>(1 << ((offset / 8) % 8));
+		return (seen[offset / 64].fetch_or(bit) & bit) == 0;
+	}
+
+	int info(WinLuaRegHandle key, WinLuaRegInfo *info)
+	{
+		const unsigned char *nk = hive_key(h, static_cast<uint32_t>(key));
+		if (nk == NULL) { return HIVE_DAMAGED; }
+		uint32_t subkeys = rd32(nk + NK_SUBKEYS), total = (subkeys == 0) ? 0 : subkey_total(h, nk);
+		info->subkeys = (subkeys < total) ? subkeys : total;
+		value_list(h, nk, &info->values);
+		/* the maxima kept in the key are not always right; value() reports what it needs */
+		info->max_subkey = HIVE_MAXNAME;
+		info->max_value_name = HIVE_MAXNAME;
+		info->max_data = rd32(nk + 64);
+		if (info->max_data > h->size) { info->max_data = 0; }
+		return 0;
+	}
+
+	int subkey(WinLuaRegHandle key, uint32_t index, uint16_t *name, size_t *len, WinLuaRegHandle *sub)
+	{
+		const unsigned char *nk = hive_key(h, static_cast<uint32_t>(key));
+		uint32_t offset = (nk == NULL) ? HIVE_NONE : subkey_at(h, nk, index);
+		const unsigned char *child = hive_key(h, offset);
+		if (child == NULL)
+		{
+			*len = 0;
+			return HIVE_DAMAGED;
+		}
+		*sub = offset;
+		int err = copy_name(child + NK_NAME, rd16(child + NK_NAMELEN), (rd16(child + NK_FLAGS) & KEY_COMP_NAME) != 0, name, len);
+		return (err == 0 && !first_visit(offset)) ? HIVE_DAMAGED : err;
+	}
+
+	int value(WinLuaRegHandle key, uint32_t index, uint16_t *name, size_t *namelen, uint32_t *type, unsigned char *data, size_t *size)
+	{
+		const unsigned char *nk = hive_key(h, static_cast<uint32_t>(key));
+		uint32_t count = 0;
+		const unsigned char *list = (nk == NULL) ? NULL : value_list(h, nk, &count);
+		const unsigned char *vk = (index < count) ? hive_value(h, rd32(list + 4 * index)) : NULL;
+		if (vk == NULL) { return HIVE_DAMAGED; }
+
+		size_t len;
+		const unsigned char *db, *p = value_data(h, vk, &len, &db);
+		size_t room = *size;
+		int err = copy_name(vk + VK_NAME, rd16(vk + VK_NAMELEN), (rd16(vk + VK_FLAGS) & VALUE_COMP_NAME) != 0, name, namelen);
+		*size = len;
+		if (err != 0 || len > room) { return WINLUA_REG_MORE_DATA; }
+		*type = rd32(vk + VK_TYPE);
+		if (db != NULL)
+		{
+			*size = join_segments(h, db, data, len);
+		}
+		else if (len != 0)
+		{
+			memcpy(data, p, len);
+		}
+		return 0;
+	}
+
+	void close(WinLuaRegHandle) {}
+
+private:
+	const WinLuaHive *h;
+	std::atomic<unsigned char> *seen;
+};
+
+/* the visited bitmap for a walk from 'k', in a userdata pushed after the arguments */
+static std::atomic<unsigned char> *push_visited(lua_State *L, const WinLuaHiveKey *k, int args)
+{
+	lua_settop(L, args);
+	size_t n = k->hive->size / 64 + 1;
+	std::atomic<unsigned char> *seen = static_cast<std::atomic<unsigned char>*>(lua_newuserdata(L, n * sizeof(std::atomic<unsigned char>)));
+	for (size_t i = 0; i < n; i++) { new (&seen[i]) std::atomic<unsigned char>(0); }
+	return seen;
+}
+
+static int hivekey_read_tree(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	check_nk(L, k);
+	HiveBackend backend(k->hive, push_visited(L, k, 2));
+	backend.first_visit(k->cell);
+	return winlua_registry_read_tree(L, &backend, k->cell);
+}
+
+static int hivekey_export(lua_State *L)
+{
+	WinLuaHiveKey *k = check_key(L, 1);
+	check_nk(L, k);
+	HiveBackend backend(k->hive, push_visited(L, k, 4));
+	backend.first_visit(k->cell);
+	return winlua_registry_export(L, &backend, k->cell);
+}
+
+/* ------------------------------------------------------------
+Loading hives
+------------------------------------------------------------ */
+
+/* the upper-cased UTF-8 form of a key's name */
+static void index_name(const unsigned char *nk, std::string& out)
+{
+	const unsigned char *p = nk + NK_NAME;
+	size_t len = rd16(nk + NK_NAMELEN);
+	if (rd16(nk + NK_FLAGS) & KEY_COMP_NAME)
+	{
+		for (size_t i = 0; i < len; i++)
+		{
+			if (p[i] < 0x80)
+			{
+				out += static_cast<char>(fold(p[i]));
+			}
+			else
+			{
+				out += static_cast<char>(0xc0 | (p[i] >> 6));
+				out += static_cast<char>(0x80 | (p[i] & 0x3f));
+			}
+		}
+		return;
+	}
+	std::vector<uint16_t> wide(len / 2 + 1);
+	for (size_t i = 0; i < len / 2; i++) { wide[i] = static_cast<uint16_t>(fold(rd16(p + 2 * i))); }
+	std::vector<char> utf8(3 * (len / 2) + 1);
+	out.append(&utf8[0], winlua_utf16_to_utf8(&wide[0], len / 2, &utf8[0]));
+}
+
+static void build_index(WinLuaHive *h)
+{
+	struct Pending
+	{
+		uint32_t cell;
+		const std::string *path;
+		int depth;
+	};
+	h->index = new HiveIndex;
+	std::vector<Pending> stack;
+	Pending root = {h->root, NULL, 0};
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		Pending p = stack.back();
+		stack.pop_back();
+		const unsigned char *nk = hive_key(h, p.cell);
+		if (nk == NULL || p.depth > HIVE_MAXDEPTH) { continue; }
+
+		HiveCursor c;
+		cursor_init(h, nk, &c);
+		for (uint32_t child = cursor_next(h, &c); child != HIVE_NONE; child = cursor_next(h, &c))
+		{
+			const unsigned char *childnk = hive_key(h, child);
+			if (childnk == NULL || h->index->keys.count(child) != 0) { continue; }
+			std::string path = (p.path == NULL) ? std::string() : *p.path + "\\";
+			index_name(childnk, path);
+			std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> added = h->index->paths.insert(std::make_pair(path, child));
+			h->index->keys[child] = &added.first->first;
+			Pending next = {child, &added.first->first, p.depth + 1};
+			stack.push_back(next);
+		}
+	}
+}
+
+static void hive_unmap(WinLuaHive *h)
+{
+	if (h->base != NULL)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(h->base);
+		CloseHandle(h->mapping);
+#else
+		munmap(h->base, h->mapped);
+#endif
+		h->base = NULL;
+	}
+}
+
+static int hive__gc(lua_State *L)
+{
+	WinLuaHive *h = static_cast<WinLuaHive*>(luaL_checkudata(L, 1, WINLUA_HIVE_META));
+	delete h->index;
+	h->index = NULL;
+	hive_unmap(h);
+	return 0;
+}
+
+/* map the file; 0 or the system error code */
+static int hive_map(lua_State *L, WinLuaHive *h, const char *path)
+{
+#ifdef _WIN32
+	WinLuaScratch scratch(L);
+	HANDLE file = CreateFileW(scratch.wstring(path), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return static_cast<int>(GetLastError()); }
+	LARGE_INTEGER filesize;
+	if (GetFileSizeEx(file, &filesize) == 0)
+	{
+		DWORD err = GetLastError();
+		CloseHandle(file);
+		return static_cast<int>(err);
+	}
+	h->mapped = static_cast<size_t>(filesize.QuadPart);
+	if (h->mapped < HIVE_BINS)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	DWORD err = GetLastError();
+	CloseHandle(file);
+	if (mapping == NULL) { return static_cast<int>(err); }
+	h->base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, h->mapped);
+	if (h->base == NULL)
+	{
+		err = GetLastError();
+		CloseHandle(mapping);
+		return static_cast<int>(err);
+	}
+	h->mapping = mapping;
+#else
+	(void)L;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) { return errno; }
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		int err = errno;
+		close(fd);
+		return err;
+	}
+	h->mapped = static_cast<size_t>(st.st_size);
+	if (h->mapped < HIVE_BINS)
+	{
+		close(fd);
+		return 0;
+	}
+	void *base = mmap(NULL, h->mapped, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (base == MAP_FAILED) { return err; }
+	h->base = base;
+#endif
+	return 0;
+}
+
+/* check the base block and find the root key */
+static bool hive_valid(WinLuaHive *h)
+{
+	const unsigned char *p = static_cast<const unsigned char*>(h->base);
+	if (p == NULL || memcmp(p, "regf", 4) != 0 || rd32(p + 20) != 1) { return false; }
+	h->minor = rd32(p + 24);
+	h->bins = p + HIVE_BINS;
+	h->size = h->mapped - HIVE_BINS;
+	uint32_t declared = rd32(p + 40);
+	if (declared != 0 && declared < h->size) { h->size = declared; } /* ignore anything after the last bin */
+	if (h->size < 32 || memcmp(h->bins, "hbin", 4) != 0) { return false; }
+	h->root = rd32(p + 36);
+	return hive_key(h, h->root) != NULL;
+}
+
+int winlua_registry_load_hive(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	bool index = false;
+	if (!lua_isnoneornil(L, 2))
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "index");
+		index = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 1);
+	}
+
+	WinLuaHive *h = static_cast<WinLuaHive*>(lua_newuserdata(L, sizeof(WinLuaHive)));
+	memset(h, 0, sizeof(WinLuaHive));
+	if (luaL_newmetatable(L, WINLUA_HIVE_META))
+	{
+		lua_pushcfunction(L, hive__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	int err = hive_map(L, h, path);
+	if (err != 0 || !hive_valid(h))
+	{
+		hive_unmap(h);
+		lua_pushnil(L);
+		if (err != 0)
+		{
+			lua_pushfstring(L, "could not open hive '%s' (%d)", path, err);
+		}
+		else
+		{
+			err = -1;
+			lua_pushfstring(L, "'%s' is not a registry hive", path);
+		}
+		lua_pushinteger(L, err);
+		return 3;
+	}
+	if (index)
+	{
+		build_index(h);
+	}
+
+	WinLuaHiveKey *k = static_cast<WinLuaHiveKey*>(lua_newuserdata(L, sizeof(WinLuaHiveKey)));
+	k->hive = h;
+	k->cell = h->root;
+	if (luaL_newmetatable(L, WINLUA_HIVEKEY_META))
+	{
+		static const luaL_Reg hivekey_methods[] = {
+			{"open", hivekey_open},
+			{"class", hivekey_class},
+			{"name", hivekey_name},
+			{"subkeys", hivekey_subkeys},
+			{"values", hivekey_values},
+			{"value", hivekey_value},
+			{"read_tree", hivekey_read_tree},
+			{"export", hivekey_export},
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_setfuncs(L, hivekey_methods, 0);
+	}
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -2);
+	lua_setuservalue(L, -2);
+	return 1;
+}
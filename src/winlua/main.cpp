@@ -2,6 +2,7 @@
 #include "winlua_modules.hpp"
 
 #include <io.h>
+#include <string.h>
 #define access _access
 #ifndef F_OK
 #define F_OK 00
@@ -10,18 +11,30 @@
 /* default main file to load */
 #define DEFAULT_MAIN_FILE "main.lua"
 
+/* command-line switch selecting the pool allocator */
+#define POOL_ALLOC_SWITCH "--pool-alloc"
+
 /* Lua main function */
 static int lua_main(lua_State *L);
 
-/* setup the WinLua environment */
-static void winlua_setup_env(lua_State *L);
-
 // ----------------------------------------------------------------------------------------------------
 
 int main(int argc, char const *argv[])
 {
+	/* map the application bundle, if any */
+	winlua_bundle_open();
+
+	/* check for the allocator switch and hide it from the script */
+	bool pooled = false;
+	if (argc > 1 && strcmp(argv[1], POOL_ALLOC_SWITCH) == 0)
+	{
+		pooled = true;
+		argv[1] = argv[0];
+		argv++; argc--;
+	}
+
 	/* allocate Lua state */
-	lua_State *L = luaL_newstate();
+	lua_State *L = winlua_newstate(pooled);
 	if (L == NULL)
 	{
 		printf("%s: could not allocate Lua state\n", argv[0]);
@@ -37,12 +50,14 @@ int main(int argc, char const *argv[])
 	lua_pushlightuserdata(L, static_cast<void*>(argv));
 	if (lua_pcall(L, 2, 0, 0) != LUA_OK)
 	{
+		winlua_flush_output(L);
 		printf("%s: %s\n", argv[0], lua_tostring(L, -1));
 		lua_pop(L, 1);
 	}
 
 	/* clean up resources and exit */
-	lua_close(L);
+	winlua_closestate(L);
+	winlua_bundle_close();
 	return 0;
 }
 
@@ -66,12 +81,21 @@ static int lua_main(lua_State *L)
 		lua_rawseti(L, -2, i+1);
 	}
 	lua_setglobal(L, "arg");
-	/* check and run main file */
-	if (argc > 1 && access(argv[1], F_OK) == 0)
+	/* check and run main file; a bundled application always runs its own main */
+	int status;
+	if (winlua_bundle_contains(WINLUA_BUNDLE_MAIN))
+	{
+		status = winlua_bundle_load(L, WINLUA_BUNDLE_MAIN);
+	}
+	else
 	{
-		mainfile = argv[1];
+		if (argc > 1 && access(argv[1], F_OK) == 0)
+		{
+			mainfile = argv[1];
+		}
+		status = winlua_loadfile(L, mainfile);
 	}
-	if (luaL_dofile(L, mainfile) != LUA_OK)
+	if (status != LUA_OK || lua_pcall(L, 0, LUA_MULTRET, 0) != LUA_OK)
 	{
 		/* propagate existing error */
 		return lua_error(L);
@@ -99,12 +123,21 @@ static const luaL_Reg preloadlibs[] = {
 	{"fs", luaopen_fs},
 	{"shell", luaopen_shell},
 	{"registry", luaopen_registry},
+	{"bundle", luaopen_bundle},
+	{"allocator", luaopen_allocator},
+	{"threads", luaopen_threads},
+	{"serialize", luaopen_serialize},
+	{"profiler", luaopen_profiler},
+	{"async", luaopen_async},
 	{"dispatch.typeinfo", luaopen_dispatch_typeinfo},
 	{"dispatch.thin", luaopen_dispatch_thin},
 	{NULL, NULL}
 };
 
-static void winlua_setup_env(lua_State *L)
+/*
+Prepare a Lua state with the WinLua libraries; also used for worker threads.
+*/
+void winlua_setup_env(lua_State *L)
 {
 	const luaL_Reg *lib;
 	
@@ -122,38 +155,12 @@ static void winlua_setup_env(lua_State *L)
 	}
 	lua_pop(L, 1);  // remove _PRELOAD table
 
-	/* replace print with Unicode-enabled version */
-	lua_pushcfunction(L, winlua_print);
-	lua_setglobal(L, "print");
-}
-
-// ----------------------------------------------------------------------------------------------------
+	/* load Lua modules through the chunk cache */
+	winlua_install_cache_searcher(L);
 
-/*
-Unicode-enabled version of the Lua print function
-*/
-int winlua_print (lua_State *L) {
-	HANDLE StdOut = GetStdHandle(STD_OUTPUT_HANDLE);
-	int n = lua_gettop(L);  /* number of arguments */
-	lua_getglobal(L, "tostring");
-
-	for (int i = 1; i <= n; i++) {
-		
-		lua_pushvalue(L, -1);  /* function to be called */
-		lua_pushvalue(L, i);   /* value to print */
-		lua_call(L, 1, 1);
-		
-		const char *output = lua_tostring(L, -1);  /* get result */
-		if (output == NULL)
-			return luaL_error(L, "'tostring' must return a string to 'print'");
-
-		if (i > 1) WriteConsoleW(StdOut, L"\t", 1, NULL, NULL);
-
-		wchar_t *outputW = utf8_to_wstring(L, output);
-		WriteConsoleW(StdOut, outputW, lstrlenW(outputW), NULL, NULL);
-		lua_pop(L, 2);  /* pop result and temporary wstring */
-	}
+	/* look for modules in the application bundle before the file system */
+	winlua_install_bundle_searcher(L);
 
-	WriteConsoleW(StdOut, L"\n", 1, NULL, NULL);
-	return 0;
+	/* replace print with a buffered, Unicode-enabled version */
+	winlua_open_print(L);
 }
\ No newline at end of file
@@ -0,0 +1,337 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ------------------------------------------------------------
+WinLua Memory-Mapped File Views
+
+fs.mmap(path [, offset [, length]]) maps (part of) a file read-only
+and returns a view. The view works like a read-only string that is
+never copied into Lua:
+
+	local v = fs.mmap("big.log")
+	print(#v, v:byte(1), v:sub(1, 80))
+	for line in v:gmatch("[^\n]+") do ... end
+	local s, e = string.find(v, "ERROR", 1, true)
+
+find, match, gmatch and unpack read the mapping in place through the
+string view hook in lstrlib.c; sub and captures copy only the bytes
+they return. view:close() unmaps the file early; a closed view can no
+longer be searched.
+------------------------------------------------------------ */
+#define WINLUA_VIEW_META "WinLuaView"
+
+struct WinLuaView
+{
+	luaL_StrView view; /* must come first, read by lstrlib.c */
+	void *base; /* start of the mapping, page aligned */
+	size_t mapped;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+static const char empty_view[1] = "";
+
+static WinLuaView *check_view(lua_State *L, int idx)
+{
+	return static_cast<WinLuaView*>(luaL_checkudata(L, idx, WINLUA_VIEW_META));
+}
+
+static void view_unmap(WinLuaView *v)
+{
+	if (v->base != NULL)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(v->base);
+		CloseHandle(v->mapping);
+#else
+		munmap(v->base, v->mapped);
+#endif
+		v->base = NULL;
+	}
+	v->view.data = NULL;
+	v->view.len = 0;
+}
+
+static int view__gc(lua_State *L)
+{
+	view_unmap(check_view(L, 1));
+	return 0;
+}
+
+static int view__len(lua_State *L)
+{
+	lua_pushinteger(L, static_cast<lua_Integer>(check_view(L, 1)->view.len));
+	return 1;
+}
+
+static int view__tostring(lua_State *L)
+{
+	WinLuaView *v = check_view(L, 1);
+	if (v->view.data == NULL)
+	{
+		lua_pushliteral(L, "view (closed)");
+	}
+	else
+	{
+		lua_pushfstring(L, "view (%I bytes): %p", static_cast<lua_Integer>(v->view.len), v->view.data);
+	}
+	return 1;
+}
+
+static const luaL_StrView *check_open(lua_State *L, int idx)
+{
+	WinLuaView *v = check_view(L, idx);
+	luaL_argcheck(L, v->view.data != NULL, idx, "view is closed");
+	return &v->view;
+}
+
+/* string.sub/byte style positions: negative counts from the end, clamped to the view */
+static size_t view_start(lua_Integer pos, size_t len)
+{
+	if (pos > 0) { return static_cast<size_t>(pos); }
+	if (pos == 0 || static_cast<size_t>(-pos) > len) { return 1; }
+	return len + static_cast<size_t>(pos) + 1;
+}
+
+static size_t view_end(lua_Integer pos, size_t len)
+{
+	if (pos >= 0) { return static_cast<size_t>(pos) > len ? len : static_cast<size_t>(pos); }
+	if (static_cast<size_t>(-pos) > len) { return 0; }
+	return len + static_cast<size_t>(pos) + 1;
+}
+
+static int view_sub(lua_State *L)
+{
+	const luaL_StrView *v = check_open(L, 1);
+	size_t i = view_start(luaL_optinteger(L, 2, 1), v->len);
+	size_t j = view_end(luaL_optinteger(L, 3, -1), v->len);
+	if (i > j)
+	{
+		lua_pushliteral(L, "");
+	}
+	else
+	{
+		lua_pushlstring(L, v->data + i - 1, j - i + 1);
+	}
+	return 1;
+}
+
+static int view_byte(lua_State *L)
+{
+	const luaL_StrView *v = check_open(L, 1);
+	lua_Integer first = luaL_optinteger(L, 2, 1);
+	size_t i = view_start(first, v->len);
+	size_t j = view_end(luaL_optinteger(L, 3, first), v->len);
+	if (i > j) { return 0; }
+	luaL_argcheck(L, j - i < static_cast<size_t>(INT_MAX), 3, "range too large");
+	int n = static_cast<int>(j - i + 1);
+	luaL_checkstack(L, n, "range too large");
+	for (int k = 0; k < n; k++)
+	{
+		lua_pushinteger(L, static_cast<unsigned char>(v->data[i + k - 1]));
+	}
+	return n;
+}
+
+static int view_close(lua_State *L)
+{
+	view_unmap(check_view(L, 1));
+	return 0;
+}
+
+/* view:unpack(fmt [, pos]) is string.unpack(fmt, view [, pos]) */
+static int view_unpack(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 1);
+	for (int i = 3; i <= nargs; i++)
+	{
+		lua_pushvalue(L, i);
+	}
+	lua_call(L, nargs, LUA_MULTRET);
+	return lua_gettop(L) - nargs;
+}
+
+static const luaL_Reg view_methods[] = {
+	{"__gc", view__gc},
+	{"__len", view__len},
+	{"__tostring", view__tostring},
+	{"sub", view_sub},
+	{"byte", view_byte},
+	{"close", view_close},
+	{NULL, NULL}
+};
+
+static void create_view_meta(lua_State *L)
+{
+	if (!luaL_newmetatable(L, WINLUA_VIEW_META))
+	{
+		return;
+	}
+	luaL_setfuncs(L, view_methods, 0);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, LUAL_STRVIEW);
+
+	/* the searching functions are the string library's own, which accept views */
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+	if (lua_getfield(L, -1, LUA_STRLIBNAME) == LUA_TTABLE)
+	{
+		const char *forwarded[] = {"find", "match", "gmatch"};
+		for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++)
+		{
+			lua_getfield(L, -1, forwarded[i]);
+			lua_setfield(L, -4, forwarded[i]);
+		}
+		lua_getfield(L, -1, "unpack");
+		lua_pushcclosure(L, view_unpack, 1);
+		lua_setfield(L, -4, "unpack");
+	}
+	lua_pop(L, 2);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+}
+
+/* ------------------------------------------------------------
+Mapping
+------------------------------------------------------------ */
+
+static int push_map_error(lua_State *L, const char *what, const char *path, int err)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "could not %s '%s' (%d)", what, path, err);
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+int winlua_fs_mmap(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer offset = luaL_optinteger(L, 2, 0);
+	lua_Integer length = luaL_optinteger(L, 3, -1);
+	luaL_argcheck(L, offset >= 0, 2, "offset must not be negative");
+
+	create_view_meta(L);
+	lua_pop(L, 1);
+	WinLuaView *v = static_cast<WinLuaView*>(lua_newuserdata(L, sizeof(WinLuaView)));
+	v->view.data = NULL;
+	v->view.len = 0;
+	v->base = NULL;
+	v->mapped = 0;
+	luaL_setmetatable(L, WINLUA_VIEW_META);
+
+#ifdef _WIN32
+	WinLuaScratch scratch(L);
+	HANDLE file = CreateFileW(scratch.wstring(path), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return push_map_error(L, "open", path, static_cast<int>(GetLastError()));
+	}
+	LARGE_INTEGER filesize;
+	if (GetFileSizeEx(file, &filesize) == 0)
+	{
+		DWORD err = GetLastError();
+		CloseHandle(file);
+		return push_map_error(L, "get the size of", path, static_cast<int>(err));
+	}
+	uint64_t size = static_cast<uint64_t>(filesize.QuadPart);
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return push_map_error(L, "open", path, errno);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		int err = errno;
+		close(fd);
+		return push_map_error(L, "get the size of", path, err);
+	}
+	uint64_t size = static_cast<uint64_t>(st.st_size);
+#endif
+
+	uint64_t start = static_cast<uint64_t>(offset);
+	uint64_t count = (start >= size) ? 0 : size - start;
+	if (length >= 0 && static_cast<uint64_t>(length) < count)
+	{
+		count = static_cast<uint64_t>(length);
+	}
+	if (count > static_cast<uint64_t>(static_cast<size_t>(-1) / 2))
+	{
+#ifdef _WIN32
+		CloseHandle(file);
+#else
+		close(fd);
+#endif
+		return luaL_error(L, "view of '%s' does not fit in the address space", path);
+	}
+
+	if (count == 0)
+	{
+		/* nothing to map; zero-length mappings are invalid on both systems */
+#ifdef _WIN32
+		CloseHandle(file);
+#else
+		close(fd);
+#endif
+		v->view.data = empty_view;
+		return 1;
+	}
+
+	/* mappings start on an allocation boundary; the view skips the slack */
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	uint64_t aligned = start - start % si.dwAllocationGranularity;
+	size_t slack = static_cast<size_t>(start - aligned);
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	DWORD err = GetLastError();
+	CloseHandle(file); /* the mapping keeps the file open */
+	if (mapping == NULL)
+	{
+		return push_map_error(L, "map", path, static_cast<int>(err));
+	}
+	void *base = MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(aligned >> 32), static_cast<DWORD>(aligned),
+		static_cast<SIZE_T>(slack + count));
+	if (base == NULL)
+	{
+		err = GetLastError();
+		CloseHandle(mapping);
+		return push_map_error(L, "map", path, static_cast<int>(err));
+	}
+	v->mapping = mapping;
+#else
+	uint64_t pagesize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	uint64_t aligned = start - start % pagesize;
+	size_t slack = static_cast<size_t>(start - aligned);
+	void *base = mmap(NULL, slack + count, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(aligned));
+	int err = errno;
+	close(fd); /* the mapping keeps the file open */
+	if (base == MAP_FAILED)
+	{
+		return push_map_error(L, "map", path, err);
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(base, slack + count, MADV_SEQUENTIAL);
+#endif
+#endif
+
+	v->base = base;
+	v->mapped = slack + static_cast<size_t>(count);
+	v->view.data = static_cast<const char*>(base) + slack;
+	v->view.len = static_cast<size_t>(count);
+	return 1;
+}
@@ -0,0 +1,35 @@
+#include "winlua.hpp"
+
+/* ------------------------------------------------------------
+WinLua Option Tables
+
+Readers for the optional fields of an options table argument, as
+taken by fs.walk, fs.watch and the copy functions. A missing or nil
+field gives the default; a field of the wrong type raises an error
+that names it.
+------------------------------------------------------------ */
+
+lua_Integer winlua_option_integer(lua_State *L, int idx, const char *field, lua_Integer def)
+{
+	lua_getfield(L, idx, field);
+	lua_Integer value = def;
+	if (!lua_isnil(L, -1))
+	{
+		int isnum;
+		value = lua_tointegerx(L, -1, &isnum);
+		if (!isnum)
+		{
+			luaL_error(L, "'%s' must be an integer", field);
+		}
+	}
+	lua_pop(L, 1);
+	return value;
+}
+
+bool winlua_option_boolean(lua_State *L, int idx, const char *field, bool def)
+{
+	lua_getfield(L, idx, field);
+	bool value = lua_isnil(L, -1) ? def : (lua_toboolean(L, -1) != 0);
+	lua_pop(L, 1);
+	return value;
+}
@@ -0,0 +1,81 @@
+#include "winlua.hpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/* ------------------------------------------------------------
+WinLua Parallel Loops
+
+winlua_parallel_for splits [0, count) into chunks of 'grain' items
+and runs them on short-lived worker threads plus the calling
+thread. Chunks are handed out through a shared counter, so a slow
+chunk (a cold directory, a large file) does not hold up the rest.
+The callback runs without a Lua state and must not raise errors.
+------------------------------------------------------------ */
+#define WINLUA_PARALLEL_MAXTHREADS 8
+
+struct WinLuaParallelLoop
+{
+	std::atomic<size_t> next;
+	size_t count, grain;
+	WinLuaRangeFunction fn;
+	void *ud;
+};
+
+static void parallel_run(WinLuaParallelLoop *loop)
+{
+	for (;;)
+	{
+		size_t begin = loop->next.fetch_add(loop->grain);
+		if (begin >= loop->count) { break; }
+		size_t end = (loop->count - begin > loop->grain) ? begin + loop->grain : loop->count;
+		loop->fn(loop->ud, begin, end);
+	}
+}
+
+size_t winlua_parallel_threads(size_t count, size_t grain)
+{
+	size_t n = std::thread::hardware_concurrency();
+	size_t chunks = (count + grain - 1) / grain;
+	if (n > WINLUA_PARALLEL_MAXTHREADS) { n = WINLUA_PARALLEL_MAXTHREADS; }
+	if (n > chunks) { n = chunks; }
+	return n < 1 ? 1 : n;
+}
+
+void winlua_parallel_for(size_t count, size_t grain, WinLuaRangeFunction fn, void *ud)
+{
+	if (grain < 1) { grain = 1; }
+	size_t nthreads = winlua_parallel_threads(count, grain);
+	if (nthreads <= 1)
+	{
+		if (count > 0) { fn(ud, 0, count); }
+		return;
+	}
+
+	WinLuaParallelLoop loop;
+	loop.next = 0;
+	loop.count = count;
+	loop.grain = grain;
+	loop.fn = fn;
+	loop.ud = ud;
+
+	/* the calling thread is one of the workers, so the loop completes even without helpers */
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < nthreads; i++)
+	{
+		try
+		{
+			threads.push_back(std::thread(parallel_run, &loop));
+		}
+		catch (...)
+		{
+			break;
+		}
+	}
+	parallel_run(&loop);
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
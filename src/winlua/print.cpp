@@ -0,0 +1,316 @@
+#include "winlua.hpp"
+#include "winlua_modules.hpp"
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* ------------------------------------------------------------
+WinLua Output Buffer
+
+print() appends to a per-state buffer instead of writing every
+argument separately. The buffer is written when it fills up, before
+anything else can reach standard output (io.write, io.flush, the
+write, flush, seek, setvbuf and close methods of io.stdout, os.exit,
+os.execute and io.popen) and when the state is closed. Interactive
+consoles additionally get a flush after every line, converting the
+whole line to UTF-16 at once for WriteConsoleW; pipes and files
+receive the UTF-8 bytes unchanged through WriteFile (or write() on
+other systems).
+------------------------------------------------------------ */
+#define WINLUA_OUTPUT_META "WinLuaOutput"
+#define WINLUA_OUTPUT_SIZE 65536
+#define WINLUA_CONSOLE_CHUNK 4096
+
+static const char output_key = 'o';
+
+struct WinLuaOutput
+{
+#ifdef _WIN32
+	HANDLE handle;  /* handle the console check below was made for */
+#endif
+	bool interactive;
+	size_t len;
+	char buff[WINLUA_OUTPUT_SIZE];
+};
+
+#ifdef _WIN32
+
+static void write_console(HANDLE handle, const char *p, size_t len)
+{
+	wchar_t buffW[WINLUA_CONSOLE_CHUNK];
+	while (len > 0)
+	{
+		/* convert in chunks that end on a UTF-8 character boundary */
+		size_t n = (len > WINLUA_CONSOLE_CHUNK) ? WINLUA_CONSOLE_CHUNK : len;
+		if (n < len)
+		{
+			while (n > 1 && (p[n] & 0xC0) == 0x80) { n--; }
+		}
+		size_t needed = winlua_utf8_to_utf16(p, n, reinterpret_cast<uint16_t*>(buffW));
+		WriteConsoleW(handle, buffW, static_cast<DWORD>(needed), NULL, NULL);
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+Standard output can be replaced at runtime, so the console check is
+repeated whenever the handle changes.
+*/
+static HANDLE output_handle(WinLuaOutput *out)
+{
+	HANDLE handle = GetStdHandle(STD_OUTPUT_HANDLE);
+	if (handle != out->handle)
+	{
+		DWORD mode;
+		out->handle = handle;
+		out->interactive = handle != NULL && handle != INVALID_HANDLE_VALUE &&
+			GetFileType(handle) == FILE_TYPE_CHAR && GetConsoleMode(handle, &mode) != 0;
+	}
+	return handle;
+}
+
+static void write_output(WinLuaOutput *out, const char *p, size_t len)
+{
+	HANDLE handle = output_handle(out);
+	if (handle == NULL || handle == INVALID_HANDLE_VALUE)
+	{
+		return; /* no standard output (e.g. a GUI subsystem process) */
+	}
+
+	if (out->interactive)
+	{
+		write_console(handle, p, len);
+		return;
+	}
+
+	while (len > 0)
+	{
+		DWORD written = 0;
+		DWORD n = (len > 0x40000000) ? 0x40000000 : static_cast<DWORD>(len);
+		if (WriteFile(handle, p, n, &written, NULL) == 0 || written == 0)
+		{
+			return; /* closed pipe; drop the output like the CRT does */
+		}
+		p += written;
+		len -= written;
+	}
+}
+
+#else
+
+static void write_output(WinLuaOutput *out, const char *p, size_t len)
+{
+	out->interactive = isatty(STDOUT_FILENO) != 0;
+	while (len > 0)
+	{
+		ssize_t written = write(STDOUT_FILENO, p, len);
+		if (written <= 0)
+		{
+			return;
+		}
+		p += written;
+		len -= static_cast<size_t>(written);
+	}
+}
+
+#endif
+
+static void flush_output(WinLuaOutput *out)
+{
+	if (out->len > 0)
+	{
+		/* keep the order of anything io.write left in the CRT buffer */
+		fflush(stdout);
+		write_output(out, out->buff, out->len);
+		out->len = 0;
+	}
+}
+
+static void append_output(WinLuaOutput *out, const char *p, size_t len)
+{
+	if (out->len + len > WINLUA_OUTPUT_SIZE)
+	{
+		flush_output(out);
+		if (len > WINLUA_OUTPUT_SIZE)
+		{
+			write_output(out, p, len);
+			return;
+		}
+	}
+	memcpy(out->buff + out->len, p, len);
+	out->len += len;
+}
+
+static int output__gc(lua_State *L)
+{
+	flush_output(static_cast<WinLuaOutput*>(luaL_checkudata(L, 1, WINLUA_OUTPUT_META)));
+	return 0;
+}
+
+/* ------------------------------------------------------------
+print and flush functions
+------------------------------------------------------------ */
+
+/*
+Unicode-enabled version of the Lua print function; upvalue 1 is the output buffer
+*/
+int winlua_print (lua_State *L) {
+	WinLuaOutput *out = static_cast<WinLuaOutput*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int n = lua_gettop(L);  /* number of arguments */
+	lua_getglobal(L, "tostring");
+
+	for (int i = 1; i <= n; i++) {
+		size_t len;
+		const char *output;
+
+		if (lua_type(L, i) == LUA_TSTRING) {
+			output = lua_tolstring(L, i, &len);  /* tostring would return it unchanged */
+		}
+		else {
+			lua_pushvalue(L, -1);  /* function to be called */
+			lua_pushvalue(L, i);   /* value to print */
+			lua_call(L, 1, 1);
+			lua_replace(L, i);  /* keep the result alive until it is copied */
+
+			output = lua_tolstring(L, i, &len);  /* get result */
+			if (output == NULL)
+				return luaL_error(L, "'tostring' must return a string to 'print'");
+		}
+
+		if (i > 1) append_output(out, "\t", 1);
+		append_output(out, output, len);
+	}
+
+	append_output(out, "\n", 1);
+	if (out->interactive)
+	{
+		flush_output(out);
+	}
+	return 0;
+}
+
+/*
+Flush pending print output, then call the wrapped function (upvalue 2).
+*/
+static int flush_and_forward(lua_State *L)
+{
+	flush_output(static_cast<WinLuaOutput*>(lua_touserdata(L, lua_upvalueindex(1))));
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+/*
+Same for file methods, but only when they are called on standard output.
+*/
+static int flush_stdout_and_forward(lua_State *L)
+{
+	luaL_Stream *stream = static_cast<luaL_Stream*>(luaL_testudata(L, 1, LUA_FILEHANDLE));
+	if (stream != NULL && stream->f == stdout)
+	{
+		flush_output(static_cast<WinLuaOutput*>(lua_touserdata(L, lua_upvalueindex(1))));
+	}
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+static void wrap_method_with_flush(lua_State *L, const char *name)
+{
+	if (luaL_getmetatable(L, LUA_FILEHANDLE) == LUA_TTABLE)
+	{
+		/* liolib keeps the methods in the metatable itself, which is also __index */
+		if (lua_getfield(L, -1, name) == LUA_TFUNCTION)
+		{
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &output_key);
+			lua_insert(L, -2);
+			lua_pushcclosure(L, flush_stdout_and_forward, 2);
+			lua_setfield(L, -2, name);
+		}
+		else
+		{
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+static void wrap_with_flush(lua_State *L, const char *lib, const char *name)
+{
+	if (lua_getglobal(L, lib) == LUA_TTABLE)
+	{
+		if (lua_getfield(L, -1, name) == LUA_TFUNCTION)
+		{
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &output_key);
+			lua_insert(L, -2);
+			lua_pushcclosure(L, flush_and_forward, 2);
+			lua_setfield(L, -2, name);
+		}
+		else
+		{
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+void winlua_flush_output(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &output_key);
+	WinLuaOutput *out = static_cast<WinLuaOutput*>(lua_touserdata(L, -1));
+	if (out != NULL)
+	{
+		flush_output(out);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+Create the output buffer and install print; the functions that can
+also write to standard output are wrapped so buffered lines are
+written first.
+*/
+void winlua_open_print(lua_State *L)
+{
+	WinLuaOutput *out = static_cast<WinLuaOutput*>(lua_newuserdata(L, sizeof(WinLuaOutput)));
+#ifdef _WIN32
+	out->handle = NULL;
+	out->interactive = false;
+#else
+	out->interactive = isatty(STDOUT_FILENO) != 0;
+#endif
+	out->len = 0;
+
+	if (luaL_newmetatable(L, WINLUA_OUTPUT_META))
+	{
+		lua_pushcfunction(L, output__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &output_key);
+
+#ifdef _WIN32
+	output_handle(out);
+#endif
+
+	lua_pushcclosure(L, winlua_print, 1);
+	lua_setglobal(L, "print");
+
+	wrap_with_flush(L, LUA_IOLIBNAME, "write");
+	wrap_with_flush(L, LUA_IOLIBNAME, "flush");
+	wrap_with_flush(L, LUA_IOLIBNAME, "popen");
+	wrap_with_flush(L, LUA_OSLIBNAME, "exit");
+	wrap_with_flush(L, LUA_OSLIBNAME, "execute");
+	wrap_method_with_flush(L, "write");
+	wrap_method_with_flush(L, "flush");
+	wrap_method_with_flush(L, "seek");
+	wrap_method_with_flush(L, "setvbuf");
+	wrap_method_with_flush(L, "close");
+}
@@ -0,0 +1,559 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "lstate.h"
+#include "lobject.h"
+#include "ldebug.h"
+}
+
+#ifdef _WIN32
+#pragma comment(lib, "winmm.lib")
+#include <mmsystem.h>
+#else
+#include <errno.h>
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#define _snprintf snprintf
+#endif
+
+/* ------------------------------------------------------------
+WinLua Sampling Profiler
+
+A timer raises a flag every 'interval' milliseconds; a count hook
+that runs every WINLUA_PROFILER_COUNT VM instructions checks the
+flag and, when set, records the call stack by walking the
+CallInfo chain directly. Frames are keyed by function and current
+line, and names are resolved only the first time a function is
+seen. A Lua function is looked up by its Proto*, but once the
+prototype is collected its address can be reused, so each lookup
+checks the source and first line the name was made from, and a
+mismatch starts a new function instead of renaming the old one.
+
+Lua has a single debug hook per thread. profiler.start() saves the
+main thread's hook and profiler.stop() puts it back, unless it was
+replaced in the meantime.
+
+Coroutines inherit the hook when they are created, so coroutines
+created before profiler.start() are not sampled. The hook is set
+on the main thread, which outlives every coroutine; a coroutine
+that still carries it after profiler.stop() removes it on its next
+call.
+------------------------------------------------------------ */
+#define WINLUA_PROFILER_META "WinLuaProfiler"
+#define WINLUA_PROFILER_COUNT 10000
+#define WINLUA_PROFILER_MAXDEPTH 256
+
+static const char profiler_key = 'p';
+
+struct WinLuaProfFrame
+{
+	const void *fn;
+	int line;
+
+	bool operator<(const WinLuaProfFrame& other) const
+	{
+		return (fn != other.fn) ? (fn < other.fn) : (line < other.line);
+	}
+};
+
+typedef std::vector<WinLuaProfFrame> WinLuaProfStack;
+
+/* a Lua function seen in a sample; its address is the frame key */
+struct WinLuaProfFunction
+{
+	std::string source;
+	int linedefined;
+};
+
+#ifdef _WIN32
+typedef HANDLE WinLuaProfTimer;
+#else
+/* a thread stands in for the timer queue */
+struct WinLuaProfTicker
+{
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stop;
+};
+typedef WinLuaProfTicker *WinLuaProfTimer;
+#endif
+
+struct WinLuaProfiler
+{
+	std::atomic<bool> pending;
+	WinLuaProfTimer timer;
+	unsigned period;
+	lua_State *L; /* main thread */
+	lua_Hook hook; /* the main thread's hook before profiler.start() */
+	int hookmask, hookcount;
+	std::map<WinLuaProfStack, unsigned long> *stacks;
+	std::map<const void*, std::string> *names;
+	std::map<const Proto*, WinLuaProfFunction*> *protos;
+	std::deque<WinLuaProfFunction> *functions;
+	unsigned long samples;
+};
+
+static WinLuaProfiler *get_profiler(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &profiler_key);
+	WinLuaProfiler *prof = static_cast<WinLuaProfiler*>(lua_touserdata(L, -1));
+	lua_pop(L, 1);
+	return prof;
+}
+
+/* ------------------------------------------------------------
+Sampling
+------------------------------------------------------------ */
+
+static void name_lua_function(std::string& name, const Proto *p)
+{
+	const char *source = p->source ? getstr(p->source) : "?";
+	if (*source == '@' || *source == '=')
+	{
+		source++;
+	}
+	else
+	{
+		source = "[string]";
+	}
+
+	char buff[32];
+	if (p->linedefined == 0)
+	{
+		name.assign(source).append(":main");
+	}
+	else
+	{
+		_snprintf(buff, sizeof(buff), ":%d", p->linedefined);
+		name.assign(source).append(buff);
+	}
+}
+
+/* the frame key for 'p', resolving its name when it is new or its address was reused */
+static const void *lua_function_key(WinLuaProfiler *prof, const Proto *p)
+{
+	const char *source = p->source ? getstr(p->source) : "?";
+	size_t len = p->source ? tsslen(p->source) : 1;
+
+	std::map<const Proto*, WinLuaProfFunction*>::iterator it = prof->protos->find(p);
+	if (it != prof->protos->end())
+	{
+		const WinLuaProfFunction *fn = it->second;
+		if (fn->linedefined == p->linedefined && fn->source.size() == len && memcmp(fn->source.data(), source, len) == 0)
+		{
+			return fn;
+		}
+	}
+
+	prof->functions->push_back(WinLuaProfFunction());
+	WinLuaProfFunction *fn = &prof->functions->back();
+	fn->source.assign(source, len);
+	fn->linedefined = p->linedefined;
+	(*prof->protos)[p] = fn;
+	name_lua_function((*prof->names)[fn], p);
+	return fn;
+}
+
+static void record_sample(WinLuaProfiler *prof, lua_State *L)
+{
+	WinLuaProfStack stack;
+	stack.reserve(32);
+
+	for (CallInfo *ci = L->ci; ci != &L->base_ci && stack.size() < WINLUA_PROFILER_MAXDEPTH; ci = ci->previous)
+	{
+		WinLuaProfFrame frame;
+		const TValue *func = ci->func;
+
+		if (ttisLclosure(func))
+		{
+			Proto *p = clLvalue(func)->p;
+			frame.fn = lua_function_key(prof, p);
+			frame.line = getfuncline(p, pcRel(ci->u.l.savedpc, p));
+		}
+		else if (ttislcf(func))
+		{
+			frame.fn = reinterpret_cast<const void*>(fvalue(func));
+			frame.line = -1;
+		}
+		else if (ttisCclosure(func))
+		{
+			frame.fn = reinterpret_cast<const void*>(clCvalue(func)->f);
+			frame.line = -1;
+		}
+		else
+		{
+			continue;
+		}
+		stack.push_back(frame);
+	}
+
+	(*prof->stacks)[stack]++;
+	prof->samples++;
+}
+
+static void profiler_hook(lua_State *L, lua_Debug *)
+{
+	WinLuaProfiler *prof = get_profiler(L);
+	if (prof == NULL || prof->timer == NULL)
+	{
+		/* a coroutine that inherited the hook before profiler.stop() gets the one it would have inherited */
+		if (prof != NULL) { lua_sethook(L, prof->hook, prof->hookmask, prof->hookcount); }
+		else { lua_sethook(L, NULL, 0, 0); }
+		return;
+	}
+	if (prof->pending.exchange(false, std::memory_order_acq_rel))
+	{
+		record_sample(prof, L);
+	}
+}
+
+#ifdef _WIN32
+static void CALLBACK profiler_tick(LPVOID param, BOOLEAN)
+{
+	static_cast<WinLuaProfiler*>(param)->pending.store(true, std::memory_order_release);
+}
+
+static bool timer_start(WinLuaProfiler *prof, unsigned interval)
+{
+	/* raise the timer resolution so short intervals are honored */
+	prof->period = 1;
+	timeBeginPeriod(prof->period);
+	if (CreateTimerQueueTimer(&prof->timer, NULL, profiler_tick, prof, interval, interval, WT_EXECUTEINTIMERTHREAD) == 0)
+	{
+		timeEndPeriod(prof->period);
+		prof->timer = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void timer_stop(WinLuaProfiler *prof)
+{
+	DeleteTimerQueueTimer(NULL, prof->timer, INVALID_HANDLE_VALUE); /* waits for running callbacks */
+	timeEndPeriod(prof->period);
+}
+#else
+static void profiler_tick(WinLuaProfiler *prof, WinLuaProfTicker *ticker, unsigned interval)
+{
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(ticker->lock);
+	for (;;)
+	{
+		next += std::chrono::milliseconds(interval);
+		if (ticker->wake.wait_until(lock, next, [ticker] { return ticker->stop; }))
+		{
+			return;
+		}
+		prof->pending.store(true, std::memory_order_release);
+	}
+}
+
+static bool timer_start(WinLuaProfiler *prof, unsigned interval)
+{
+	WinLuaProfTicker *ticker = new WinLuaProfTicker;
+	ticker->stop = false;
+	try
+	{
+		ticker->thread = std::thread(profiler_tick, prof, ticker, interval);
+	}
+	catch (...)
+	{
+		delete ticker;
+		return false;
+	}
+	prof->timer = ticker;
+	return true;
+}
+
+static void timer_stop(WinLuaProfiler *prof)
+{
+	WinLuaProfTicker *ticker = prof->timer;
+	{
+		std::lock_guard<std::mutex> lock(ticker->lock);
+		ticker->stop = true;
+	}
+	ticker->wake.notify_one();
+	ticker->thread.join();
+	delete ticker;
+}
+#endif
+
+static void profiler_halt(WinLuaProfiler *prof)
+{
+	if (prof->timer != NULL)
+	{
+		timer_stop(prof);
+		prof->timer = NULL;
+		if (lua_gethook(prof->L) == profiler_hook)
+		{
+			lua_sethook(prof->L, prof->hook, prof->hookmask, prof->hookcount);
+		}
+	}
+}
+
+/* ------------------------------------------------------------
+Profiler userdata
+------------------------------------------------------------ */
+
+static int profiler__gc(lua_State *L)
+{
+	WinLuaProfiler *prof = static_cast<WinLuaProfiler*>(luaL_checkudata(L, 1, WINLUA_PROFILER_META));
+	profiler_halt(prof);
+	delete prof->stacks;
+	delete prof->names;
+	delete prof->protos;
+	delete prof->functions;
+	prof->stacks = NULL;
+	prof->names = NULL;
+	prof->protos = NULL;
+	prof->functions = NULL;
+	return 0;
+}
+
+static WinLuaProfiler *create_profiler(lua_State *L)
+{
+	WinLuaProfiler *prof = get_profiler(L);
+	if (prof != NULL)
+	{
+		return prof;
+	}
+
+	prof = static_cast<WinLuaProfiler*>(lua_newuserdata(L, sizeof(WinLuaProfiler)));
+	new (&prof->pending) std::atomic<bool>(false);
+	prof->timer = NULL;
+	prof->period = 1;
+	prof->L = NULL;
+	prof->hook = NULL;
+	prof->hookmask = prof->hookcount = 0;
+	prof->stacks = new std::map<WinLuaProfStack, unsigned long>();
+	prof->names = new std::map<const void*, std::string>();
+	prof->protos = new std::map<const Proto*, WinLuaProfFunction*>();
+	prof->functions = new std::deque<WinLuaProfFunction>();
+	prof->samples = 0;
+	luaL_setmetatable(L, WINLUA_PROFILER_META);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &profiler_key);
+	return prof;
+}
+
+/* ------------------------------------------------------------
+Folded stack output
+------------------------------------------------------------ */
+
+/*
+Give C functions found in loaded modules names like 'string.find'.
+*/
+static void name_c_functions(lua_State *L, std::map<const void*, std::string>& names)
+{
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0)
+	{
+		if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1))
+		{
+			const char *module = lua_tostring(L, -2);
+			bool global = strcmp(module, "_G") == 0;
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0)
+			{
+				if (lua_type(L, -2) == LUA_TSTRING && lua_iscfunction(L, -1))
+				{
+					const void *fn = reinterpret_cast<const void*>(lua_tocfunction(L, -1));
+					if (fn != NULL && names.find(fn) == names.end())
+					{
+						std::string& name = names[fn];
+						if (!global) { name.assign(module).append("."); }
+						name.append(lua_tostring(L, -2));
+					}
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1); // pop _LOADED table
+}
+
+static void frame_name(std::string& out, WinLuaProfiler *prof, const WinLuaProfFrame& frame, bool lines)
+{
+	std::map<const void*, std::string>::const_iterator it = prof->names->find(frame.fn);
+	out.append(it != prof->names->end() ? it->second : "[C]");
+	if (lines && frame.line >= 0)
+	{
+		char buff[16];
+		_snprintf(buff, sizeof(buff), "@%d", frame.line);
+		out.append(buff);
+	}
+}
+
+/* ------------------------------------------------------------
+WinLua Profiler functions
+------------------------------------------------------------ */
+
+/*
+profiler.start([interval]) -- interval in milliseconds, default 1
+*/
+static int profiler_start(lua_State *L)
+{
+	lua_Integer interval = luaL_optinteger(L, 1, 1);
+	luaL_argcheck(L, interval > 0 && interval <= 60000, 1, "interval out of range");
+
+	WinLuaProfiler *prof = create_profiler(L);
+	if (prof->timer != NULL)
+	{
+		return luaL_error(L, "profiler already running");
+	}
+
+	prof->stacks->clear();
+	prof->samples = 0;
+	prof->pending = false;
+
+	/* 'L' may be a coroutine that is collected before profiler.stop() */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	prof->L = lua_tothread(L, -1);
+	lua_pop(L, 1);
+
+	if (!timer_start(prof, static_cast<unsigned>(interval)))
+	{
+#ifdef _WIN32
+		return luaL_error(L, "could not create profiler timer (%d)", GetLastError());
+#else
+		return luaL_error(L, "could not create profiler timer");
+#endif
+	}
+
+	prof->hook = lua_gethook(prof->L);
+	prof->hookmask = lua_gethookmask(prof->L);
+	prof->hookcount = lua_gethookcount(prof->L);
+	if (prof->hook == profiler_hook)
+	{
+		/* never restore the profiler's own hook */
+		prof->hook = NULL;
+		prof->hookmask = prof->hookcount = 0;
+	}
+	lua_sethook(prof->L, profiler_hook, LUA_MASKCOUNT, WINLUA_PROFILER_COUNT);
+	if (L != prof->L)
+	{
+		lua_sethook(L, profiler_hook, LUA_MASKCOUNT, WINLUA_PROFILER_COUNT);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int profiler_stop(lua_State *L)
+{
+	WinLuaProfiler *prof = get_profiler(L);
+	if (prof == NULL || prof->timer == NULL)
+	{
+		return luaL_error(L, "profiler not running");
+	}
+
+	profiler_halt(prof);
+	lua_pushinteger(L, static_cast<lua_Integer>(prof->samples));
+	return 1;
+}
+
+/*
+profiler.dump(path [, lines]) -- write folded stacks ('a;b;c count') for flamegraph tools
+*/
+static int profiler_dump(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	bool lines = lua_toboolean(L, 2) != 0;
+	WinLuaProfiler *prof = get_profiler(L);
+	if (prof == NULL)
+	{
+		return luaL_error(L, "profiler was never started");
+	}
+
+	name_c_functions(L, *prof->names);
+
+	/* stacks that differ only in lines merge when lines are not written */
+	std::map<std::string, unsigned long> folded;
+	std::string line;
+	for (std::map<WinLuaProfStack, unsigned long>::const_iterator it = prof->stacks->begin(); it != prof->stacks->end(); ++it)
+	{
+		const WinLuaProfStack& stack = it->first;
+		line.clear();
+		for (size_t i = stack.size(); i > 0; i--)
+		{
+			if (i != stack.size()) { line.append(";"); }
+			frame_name(line, prof, stack[i - 1], lines);
+		}
+		folded[line] += it->second;
+	}
+
+	std::string output;
+	char count[24];
+	for (std::map<std::string, unsigned long>::const_iterator it = folded.begin(); it != folded.end(); ++it)
+	{
+		_snprintf(count, sizeof(count), " %lu\n", it->second);
+		output.append(it->first).append(count);
+	}
+
+#ifdef _WIN32
+	WinLuaScratch scratch(L);
+	wchar_t *pathW = scratch.wstring(path);
+	HANDLE file = CreateFileW(pathW, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return luaL_error(L, "could not create '%s' (%d)", path, GetLastError());
+	}
+
+	DWORD written = 0;
+	BOOL ret = WriteFile(file, output.data(), static_cast<DWORD>(output.size()), &written, NULL);
+	DWORD err = GetLastError();
+	CloseHandle(file);
+	if (ret == 0 || written != output.size())
+	{
+		return luaL_error(L, "could not write '%s' (%d)", path, err);
+	}
+#else
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		return luaL_error(L, "could not create '%s' (%d)", path, errno);
+	}
+	size_t written = fwrite(output.data(), 1, output.size(), file);
+	if (fclose(file) != 0 || written != output.size())
+	{
+		return luaL_error(L, "could not write '%s' (%d)", path, errno);
+	}
+#endif
+
+	lua_pushinteger(L, static_cast<lua_Integer>(prof->samples));
+	return 1;
+}
+
+/* ------------------------------------------------------------
+WinLua Profiler module
+------------------------------------------------------------ */
+
+static const luaL_Reg library_methods[] = {
+	{"start", profiler_start},
+	{"stop", profiler_stop},
+	{"dump", profiler_dump},
+	{NULL, NULL}
+};
+
+int luaopen_profiler(lua_State *L)
+{
+	luaL_newmetatable(L, WINLUA_PROFILER_META);
+	lua_pushcfunction(L, profiler__gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, library_methods);
+	return 1;
+}
@@ -0,0 +1,1479 @@
+#include "winlua.hpp"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* ------------------------------------------------------------
+WinLua .reg Files
+
+	registry.parse_reg(file [, callback [, batch]])  -> tree, or records; nil, message, code
+	registry.reg_writer(file [, options])  -> writer, or nil, message, code
+	key:export(file, name [, options])     -> keys, errors; or nil, message, code
+	registry.import(file)                  -> true, or nil, message, code (registry.cpp)
+
+Reads and writes the text format of regedit: REGEDIT5 ("Windows
+Registry Editor Version 5.00", UTF-16LE with a byte order mark, as
+regedit writes it, or UTF-8) and REGEDIT4. The file is read in
+blocks and parsed line by line in C, joining the '\' continuation
+lines of hex data; nothing but the records reaches the Lua side.
+
+Without a callback parse_reg returns the file as nested tables,
+shaped like key:read_tree's from a root that holds the top-level
+keys:
+
+	{keys = {HKEY_CURRENT_USER = {keys = {...}, values = {...}, types = {...}}}}
+
+A [-key] line sets deleted = true on its table, a "name"=- line
+sets values[name] = false. With a callback, the records are passed
+on in batches of 'batch' (default 1024) as parallel lists, and
+parse_reg returns their count:
+
+	callback({n = count, key = {...}, name = {...}, value = {...}, type = {...}})
+
+where key[i] is the full path of the record's key. A key line has
+name[i] = false and value[i] = true ([key]) or false ([-key]); a
+value line has its name ("" for @) and data, decoded as by hive
+key:values(), or false for "name"=-; type[i] is the type name, or
+false. REGEDIT4 strings are taken as they are, so only ASCII text
+survives a REGEDIT4 file.
+
+The writer buffers its output and converts it to UTF-16LE (the
+default) or leaves it UTF-8 ({encoding = "utf-8"}):
+
+	writer:key(path)             [path]
+	writer:delete_key(path)      [-path]
+	writer:value(name, data [, type])
+	writer:delete_value(name)    "name"=-
+	writer:tree(tree [, path])   a read_tree or parse_reg table
+	writer:close()               -> true, or nil, message, code
+
+value() takes data as hive key:values() returns it and writes it in
+regedit's notation: quoted strings, dword:, and wrapped hex(n):
+bytes for the rest. The type is a name, a number, or follows from
+the data (string, integer, list). tree() writes keys and values in
+case-insensitive order, so exports compare cleanly.
+
+key:export writes a live or hive key and everything below it under
+the path 'name' without building tables; it returns the number of
+keys written and a list of {path = name, error = code} for keys that
+could not be read.
+------------------------------------------------------------ */
+#define WINLUA_REGPARSER_META "WinLuaRegParser"
+#define WINLUA_REGWRITER_META "WinLuaRegWriter"
+
+#define REGFILE_BLOCK (1 << 20)
+#define REGFILE_BATCH 1024
+#define REGFILE_WRAP 80 /* regedit's line width for hex data */
+#define REGFILE_MAXDEPTH 512
+#define REGFILE_RETRIES 8
+
+#define REGFILE_SZ 1
+#define REGFILE_EXPAND_SZ 2
+#define REGFILE_BINARY 3
+#define REGFILE_DWORD 4
+#define REGFILE_DWORD_BIG_ENDIAN 5
+#define REGFILE_LINK 6
+#define REGFILE_MULTI_SZ 7
+#define REGFILE_QWORD 11
+
+struct RegParser
+{
+	FILE *f;
+	bool utf16, eof, keyed;
+	int version; /* 4 for REGEDIT4, whose hex strings are single bytes */
+	long line, first; /* last physical line read, and where the current record began */
+	int code;
+	const char *error;
+
+	std::vector<char> raw; /* UTF-16 input not converted yet */
+	size_t rawlen;
+	std::vector<char> text; /* UTF-8 input in [start, end) */
+	size_t start, end;
+
+	std::string joined, key, name, value;
+	std::vector<unsigned char> data;
+	WinLuaRegRecord record;
+
+	RegParser() : f(NULL), utf16(false), eof(false), keyed(false), version(5), line(0), first(0), code(0), error(NULL), rawlen(0), start(0), end(0) {}
+	~RegParser() { if (f != NULL) { fclose(f); } }
+};
+
+struct RegName
+{
+	const char *s;
+	size_t n;
+};
+
+struct RegWriter
+{
+	FILE *f;
+	bool utf16;
+	int error;
+	std::string out; /* UTF-8 not written yet */
+	std::vector<uint16_t> wide;
+	std::vector<unsigned char> bytes;
+	std::vector<char> utf8;
+	std::string path;
+	std::vector<RegName> values;
+	std::vector<std::vector<RegName> > keys; /* per level of writer:tree */
+
+	RegWriter() : f(NULL), utf16(true), error(0) {}
+	~RegWriter() { if (f != NULL) { fclose(f); } }
+};
+
+struct WinLuaRegParser
+{
+	RegParser *parser;
+};
+
+struct WinLuaRegWriter
+{
+	RegWriter *writer;
+};
+
+template <typename T>
+static void grow(std::vector<T>& v, size_t size)
+{
+	if (v.size() < size) { v.resize(size); }
+}
+
+static bool blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static int hexdigit(char c)
+{
+	if (c >= '0' && c <= '9') { return c - '0'; }
+	if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+	if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+	return -1;
+}
+
+static bool string_type(uint32_t type)
+{
+	return type == REGFILE_SZ || type == REGFILE_EXPAND_SZ || type == REGFILE_LINK || type == REGFILE_MULTI_SZ;
+}
+
+static FILE *open_file(lua_State *L, const char *path, bool write)
+{
+#ifdef _WIN32
+	WinLuaScratch scratch(L);
+	return _wfopen(scratch.wstring(path), write ? L"wb" : L"rb");
+#else
+	(void)L;
+	return fopen(path, write ? "wb" : "rb");
+#endif
+}
+
+/* ------------------------------------------------------------
+Reading lines
+------------------------------------------------------------ */
+
+/* open 'path' and look at its byte order mark; returns 0 or the system error code */
+static int parser_open(lua_State *L, RegParser *p, const char *path)
+{
+	p->f = open_file(L, path, false);
+	if (p->f == NULL) { return errno; }
+	p->text.resize(REGFILE_BLOCK);
+	unsigned char bom[3];
+	size_t n = fread(bom, 1, sizeof(bom), p->f);
+	p->eof = n < sizeof(bom);
+	if (n >= 2 && bom[0] == 0xff && bom[1] == 0xfe)
+	{
+		p->utf16 = true;
+		p->raw.resize(REGFILE_BLOCK + 4);
+		if (n == 3) { p->raw[0] = static_cast<char>(bom[2]); }
+		p->rawlen = n - 2;
+	}
+	else
+	{
+		size_t skip = (n == 3 && bom[0] == 0xef && bom[1] == 0xbb && bom[2] == 0xbf) ? 3 : 0;
+		memcpy(&p->text[0], bom + skip, n - skip);
+		p->end = n - skip;
+	}
+	return ferror(p->f) ? EIO : 0;
+}
+
+/* move the unread text to the front and read another block after it; false at the end of the file */
+static bool parser_fill(RegParser *p)
+{
+	if (p->start > 0)
+	{
+		memmove(&p->text[0], &p->text[p->start], p->end - p->start);
+		p->end -= p->start;
+		p->start = 0;
+	}
+	if (p->eof) { return false; }
+
+	size_t before = p->end;
+	if (!p->utf16)
+	{
+		grow(p->text, p->end + REGFILE_BLOCK);
+		size_t n = fread(&p->text[p->end], 1, REGFILE_BLOCK, p->f);
+		p->eof = n < REGFILE_BLOCK;
+		p->end += n;
+	}
+	else
+	{
+		size_t n = fread(&p->raw[p->rawlen], 1, REGFILE_BLOCK, p->f);
+		p->eof = n < REGFILE_BLOCK;
+		size_t total = p->rawlen + n, units = total / 2;
+		const uint16_t *src = reinterpret_cast<const uint16_t*>(&p->raw[0]);
+		/* a lead surrogate waits for the other half of its pair */
+		if (!p->eof && units > 0 && (src[units - 1] & 0xfc00) == 0xd800) { units--; }
+		grow(p->text, p->end + 3 * units);
+		p->end += winlua_utf16_to_utf8(src, units, &p->text[p->end]);
+		p->rawlen = total - 2 * units;
+		memmove(&p->raw[0], &p->raw[2 * units], p->rawlen);
+	}
+	if (ferror(p->f)) { p->code = EIO; }
+	return p->end > before || !p->eof;
+}
+
+/* the next physical line without its line break, valid until the next call; NULL at the end */
+static const char *parser_line(RegParser *p, size_t *len)
+{
+	for (;;)
+	{
+		const char *s = &p->text[0] + p->start;
+		size_t avail = p->end - p->start, n;
+		const char *nl = static_cast<const char*>(memchr(s, '\n', avail));
+		if (nl != NULL)
+		{
+			n = nl - s;
+			p->start += n + 1;
+		}
+		else if (parser_fill(p))
+		{
+			continue;
+		}
+		else if (avail > 0)
+		{
+			/* the last line has no line break */
+			s = &p->text[0];
+			n = avail;
+			p->start = p->end;
+		}
+		else
+		{
+			return NULL;
+		}
+		if (n > 0 && s[n - 1] == '\r') { n--; }
+		p->line++;
+		*len = n;
+		return s;
+	}
+}
+
+/* does the line end in a '\' continuation? 'len' then leaves out the backslash */
+static bool continued(const char *s, size_t *len)
+{
+	size_t n = *len;
+	while (n > 0 && blank(s[n - 1])) { n--; }
+	if (n == 0 || s[n - 1] != '\\') { return false; }
+	*len = n - 1;
+	return true;
+}
+
+/* the next line with its continuation lines joined */
+static const char *parser_logical(RegParser *p, size_t *len)
+{
+	const char *s = parser_line(p, len);
+	p->first = p->line;
+	size_t n = (s != NULL) ? *len : 0;
+	if (s == NULL || !continued(s, &n)) { return s; }
+
+	p->joined.assign(s, n);
+	while ((s = parser_line(p, len)) != NULL)
+	{
+		size_t i = 0;
+		n = *len;
+		while (i < n && blank(s[i])) { i++; }
+		bool more = continued(s, &n);
+		p->joined.append(s + i, n - i);
+		if (!more) { break; }
+	}
+	*len = p->joined.size();
+	return p->joined.data();
+}
+
+/* ------------------------------------------------------------
+Parsing lines
+------------------------------------------------------------ */
+
+static int parse_error(RegParser *p, const char *message)
+{
+	p->error = message;
+	return -1;
+}
+
+/* the string quoted at s[*i], with \\ and \" unescaped; *i moves past the closing quote */
+static bool parse_quoted(const char *s, size_t len, size_t *i, std::string& out)
+{
+	out.clear();
+	size_t from = *i + 1;
+	for (size_t j = from; j < len; j++)
+	{
+		if (s[j] == '\\' && j + 1 < len)
+		{
+			/* keep the escaped character, drop the backslash */
+			out.append(s + from, j - from);
+			from = ++j;
+		}
+		else if (s[j] == '"')
+		{
+			out.append(s + from, j - from);
+			*i = j + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* comma separated hex bytes from s[i] */
+static bool parse_hex(const char *s, size_t len, size_t i, std::vector<unsigned char>& out)
+{
+	out.clear();
+	out.reserve(len / 3 + 1);
+	while (i < len)
+	{
+		if (s[i] == ',' || blank(s[i]))
+		{
+			i++;
+			continue;
+		}
+		int hi = hexdigit(s[i]);
+		int lo = (i + 1 < len) ? hexdigit(s[i + 1]) : -1;
+		if (hi < 0) { return false; }
+		if (lo < 0)
+		{
+			out.push_back(static_cast<unsigned char>(hi));
+			i++;
+		}
+		else
+		{
+			out.push_back(static_cast<unsigned char>(hi * 16 + lo));
+			i += 2;
+		}
+	}
+	return true;
+}
+
+static bool prefix(const char *s, size_t len, const char *p)
+{
+	size_t n = strlen(p);
+	if (len < n) { return false; }
+	for (size_t i = 0; i < n; i++)
+	{
+		char c = s[i];
+		if (c >= 'A' && c <= 'Z') { c = static_cast<char>(c - 'A' + 'a'); }
+		if (c != p[i]) { return false; }
+	}
+	return true;
+}
+
+/* the data after '=' */
+static int parse_data(RegParser *p, const char *s, size_t len)
+{
+	WinLuaRegRecord& r = p->record;
+	if (len == 1 && s[0] == '-')
+	{
+		r.kind = WINLUA_REG_DELETE_VALUE;
+		return 1;
+	}
+	if (len > 0 && s[0] == '"')
+	{
+		size_t i = 0;
+		if (!parse_quoted(s, len, &i, p->value) || i != len) { return parse_error(p, "unterminated string"); }
+		r.type = REGFILE_SZ;
+		r.text = p->value.data();
+		r.textlen = p->value.size();
+		return 1;
+	}
+	if (prefix(s, len, "dword:"))
+	{
+		uint32_t v = 0;
+		size_t i = 6;
+		for (; i < len && i < 14; i++)
+		{
+			int d = hexdigit(s[i]);
+			if (d < 0) { break; }
+			v = v * 16 + static_cast<uint32_t>(d);
+		}
+		if (i == 6 || i != len) { return parse_error(p, "bad dword"); }
+		p->data.resize(4);
+		for (int k = 0; k < 4; k++) { p->data[k] = static_cast<unsigned char>(v >> (8 * k)); }
+		r.type = REGFILE_DWORD;
+		r.data = &p->data[0];
+		r.size = 4;
+		return 1;
+	}
+	if (prefix(s, len, "hex"))
+	{
+		size_t i = 3;
+		uint32_t type = REGFILE_BINARY;
+		if (i < len && s[i] == '(')
+		{
+			type = 0;
+			int d;
+			for (i++; i < len && i < 12 && (d = hexdigit(s[i])) >= 0; i++) { type = type * 16 + static_cast<uint32_t>(d); }
+			if (i == 4 || i == len || s[i] != ')') { return parse_error(p, "bad value type"); }
+			i++;
+		}
+		if (i == len || s[i] != ':') { return parse_error(p, "expected ':'"); }
+		if (!parse_hex(s, len, i + 1, p->data)) { return parse_error(p, "bad hex data"); }
+		if (p->version == 4 && string_type(type))
+		{
+			/* REGEDIT4 stores strings as single bytes; the registry wants UTF-16 */
+			size_t n = p->data.size();
+			p->data.resize(2 * n);
+			for (size_t k = n; k-- > 0;)
+			{
+				p->data[2 * k] = p->data[k];
+				p->data[2 * k + 1] = 0;
+			}
+		}
+		static const unsigned char empty = 0;
+		r.type = type;
+		r.data = p->data.empty() ? &empty : &p->data[0];
+		r.size = p->data.size();
+		return 1;
+	}
+	return parse_error(p, "unknown value type");
+}
+
+/* 1 with a record, 0 for a line without one, -1 with p->error set */
+static int parse_line(RegParser *p, const char *s, size_t len)
+{
+	while (len > 0 && blank(*s)) { s++; len--; }
+	while (len > 0 && blank(s[len - 1])) { len--; }
+	if (len == 0 || s[0] == ';') { return 0; }
+
+	WinLuaRegRecord& r = p->record;
+	if (s[0] == '[')
+	{
+		if (s[len - 1] != ']') { return parse_error(p, "unterminated key"); }
+		bool remove = len > 2 && s[1] == '-';
+		p->key.assign(s + (remove ? 2 : 1), len - (remove ? 3 : 2));
+		p->keyed = true;
+		r.kind = remove ? WINLUA_REG_DELETE_KEY : WINLUA_REG_KEY;
+		r.key = p->key.data();
+		r.keylen = p->key.size();
+		r.name = NULL;
+		r.namelen = 0;
+		return 1;
+	}
+	if (len == 8 && memcmp(s, "REGEDIT4", 8) == 0)
+	{
+		p->version = 4;
+		return 0;
+	}
+	if (prefix(s, len, "windows registry editor version "))
+	{
+		p->version = 5;
+		return 0;
+	}
+
+	size_t i = 0;
+	if (s[0] == '@')
+	{
+		p->name.clear();
+		i = 1;
+	}
+	else if (s[0] != '"')
+	{
+		return parse_error(p, "expected a key or a value");
+	}
+	else if (!parse_quoted(s, len, &i, p->name))
+	{
+		return parse_error(p, "unterminated name");
+	}
+	while (i < len && blank(s[i])) { i++; }
+	if (i == len || s[i] != '=') { return parse_error(p, "expected '='"); }
+	for (i++; i < len && blank(s[i]); i++) {}
+	if (!p->keyed) { return parse_error(p, "value outside of a key"); }
+
+	r.kind = WINLUA_REG_VALUE;
+	r.name = p->name.data();
+	r.namelen = p->name.size();
+	r.type = 0;
+	r.data = NULL;
+	r.size = 0;
+	r.text = NULL;
+	r.textlen = 0;
+	return parse_data(p, s + i, len - i);
+}
+
+/* 1 with the next record in p->record, 0 at the end of the file, -1 on errors */
+static int parser_next(RegParser *p)
+{
+	size_t len;
+	const char *s;
+	while ((s = parser_logical(p, &len)) != NULL)
+	{
+		int ret = parse_line(p, s, len);
+		if (ret != 0) { return ret; }
+	}
+	return (p->code != 0) ? parse_error(p, "read error") : 0;
+}
+
+static int regparser__gc(lua_State *L)
+{
+	WinLuaRegParser *u = static_cast<WinLuaRegParser*>(luaL_checkudata(L, 1, WINLUA_REGPARSER_META));
+	delete u->parser;
+	u->parser = NULL;
+	return 0;
+}
+
+/* a parser for 'path' in a userdata on the stack (closed by __gc if Lua errors out); NULL with nil, message, code pushed */
+static RegParser *push_parser(lua_State *L, const char *path)
+{
+	WinLuaRegParser *u = static_cast<WinLuaRegParser*>(lua_newuserdata(L, sizeof(WinLuaRegParser)));
+	u->parser = NULL;
+	if (luaL_newmetatable(L, WINLUA_REGPARSER_META))
+	{
+		lua_pushcfunction(L, regparser__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	RegParser *p = u->parser = new RegParser;
+	int err = parser_open(L, p, path);
+	if (err != 0)
+	{
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not open '%s' (%d)", path, err);
+		lua_pushinteger(L, err);
+		return NULL;
+	}
+	return p;
+}
+
+static int push_parse_error(lua_State *L, const char *path, const RegParser *p)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "could not parse '%s' line %d: %s", path, static_cast<int>(p->first), p->error);
+	lua_pushinteger(L, (p->code != 0) ? p->code : -1);
+	return 3;
+}
+
+/* ------------------------------------------------------------
+registry.parse_reg
+------------------------------------------------------------ */
+
+static void push_record_value(lua_State *L, const WinLuaRegRecord& r)
+{
+	if (r.text != NULL)
+	{
+		lua_pushlstring(L, r.text, r.textlen);
+	}
+	else
+	{
+		WinLuaScratch scratch(L);
+		winlua_push_regvalue(L, r.type, r.data, r.size, scratch);
+	}
+}
+
+/* slots: 5 current key path, 6 batch, 7 to 10 its key, name, value and type lists */
+static void new_batch(lua_State *L, lua_Integer size)
+{
+	static const char *const fields[] = {"key", "name", "value", "type"};
+	int n = (size < INT_MAX) ? static_cast<int>(size) : INT_MAX;
+	lua_settop(L, 5);
+	lua_createtable(L, 0, 5);
+	for (int i = 0; i < 4; i++)
+	{
+		lua_createtable(L, n, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, 6, fields[i]);
+	}
+}
+
+static void call_batch(lua_State *L, lua_Integer n)
+{
+	lua_pushinteger(L, n);
+	lua_setfield(L, 6, "n");
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 6);
+	lua_call(L, 1, 0);
+}
+
+static int parse_batches(lua_State *L, RegParser *p, lua_Integer size)
+{
+	lua_pushnil(L);
+	new_batch(L, size);
+	lua_Integer n = 0, total = 0;
+	int ret;
+	while ((ret = parser_next(p)) > 0)
+	{
+		const WinLuaRegRecord& r = p->record;
+		bool key = r.kind == WINLUA_REG_KEY || r.kind == WINLUA_REG_DELETE_KEY;
+		if (key)
+		{
+			lua_pushlstring(L, r.key, r.keylen);
+			lua_replace(L, 5);
+		}
+		n++;
+		lua_pushvalue(L, 5);
+		lua_rawseti(L, 7, n);
+		if (key)
+		{
+			lua_pushboolean(L, 0);
+			lua_rawseti(L, 8, n);
+			lua_pushboolean(L, r.kind == WINLUA_REG_KEY);
+			lua_rawseti(L, 9, n);
+			lua_pushboolean(L, 0);
+			lua_rawseti(L, 10, n);
+		}
+		else
+		{
+			lua_pushlstring(L, r.name, r.namelen);
+			lua_rawseti(L, 8, n);
+			if (r.kind == WINLUA_REG_VALUE)
+			{
+				push_record_value(L, r);
+				lua_rawseti(L, 9, n);
+				winlua_push_regtype(L, r.type);
+				lua_rawseti(L, 10, n);
+			}
+			else
+			{
+				lua_pushboolean(L, 0);
+				lua_rawseti(L, 9, n);
+				lua_pushboolean(L, 0);
+				lua_rawseti(L, 10, n);
+			}
+		}
+		if (n == size)
+		{
+			call_batch(L, n);
+			new_batch(L, size);
+			total += n;
+			n = 0;
+		}
+	}
+	if (ret < 0) { return -1; }
+	if (n > 0) { call_batch(L, n); }
+	lua_pushinteger(L, total + n);
+	return 1;
+}
+
+/* the table at node[field], created if needed, on top of the stack */
+static void subtable(lua_State *L, int node, const char *field)
+{
+	if (lua_getfield(L, node, field) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, node, field);
+	}
+}
+
+/* slots: 5 root, 6 current key, 7 and 8 its values and types once a value needs them */
+static void tree_key(lua_State *L, const char *path, size_t len, bool remove)
+{
+	lua_settop(L, 5);
+	lua_pushvalue(L, 5);
+	size_t i = 0;
+	for (;;)
+	{
+		size_t j = i;
+		while (j < len && path[j] != '\\') { j++; }
+		subtable(L, lua_gettop(L), "keys");   /* node keys */
+		lua_pushlstring(L, path + i, j - i);  /* node keys name */
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, -3) != LUA_TTABLE)  /* node keys name child */
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_insert(L, -3);                /* node keys child name child */
+			lua_rawset(L, -4);
+		}
+		else
+		{
+			lua_remove(L, -2);
+		}
+		lua_replace(L, -3);                   /* child keys */
+		lua_pop(L, 1);
+		if (j >= len) { break; }
+		i = j + 1;
+	}
+	if (remove)
+	{
+		lua_pushboolean(L, 1);
+		lua_setfield(L, 6, "deleted");
+	}
+	lua_pushnil(L);
+	lua_pushnil(L);
+}
+
+static int parse_tree(lua_State *L, RegParser *p)
+{
+	lua_newtable(L);
+	int ret;
+	while ((ret = parser_next(p)) > 0)
+	{
+		const WinLuaRegRecord& r = p->record;
+		if (r.kind == WINLUA_REG_KEY || r.kind == WINLUA_REG_DELETE_KEY)
+		{
+			tree_key(L, r.key, r.keylen, r.kind == WINLUA_REG_DELETE_KEY);
+			continue;
+		}
+		if (lua_isnil(L, 7))
+		{
+			subtable(L, 6, "values");
+			lua_replace(L, 7);
+			subtable(L, 6, "types");
+			lua_replace(L, 8);
+		}
+		lua_pushlstring(L, r.name, r.namelen);
+		lua_pushvalue(L, -1);
+		if (r.kind == WINLUA_REG_VALUE)
+		{
+			push_record_value(L, r);
+			lua_rawset(L, 7);
+			winlua_push_regtype(L, r.type);
+		}
+		else
+		{
+			lua_pushboolean(L, 0);
+			lua_rawset(L, 7);
+			lua_pushnil(L);
+		}
+		lua_rawset(L, 8);
+	}
+	if (ret < 0) { return -1; }
+	lua_settop(L, 5);
+	return 1;
+}
+
+int winlua_registry_parse_reg(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	bool batched = !lua_isnoneornil(L, 2);
+	if (batched) { luaL_checktype(L, 2, LUA_TFUNCTION); }
+	lua_Integer size = luaL_optinteger(L, 3, REGFILE_BATCH);
+	if (size < 1) { size = 1; }
+	lua_settop(L, 3);
+
+	RegParser *p = push_parser(L, path);
+	if (p == NULL) { return 3; }
+	int ret = batched ? parse_batches(L, p, size) : parse_tree(L, p);
+	if (ret < 0) { return push_parse_error(L, path, p); }
+	return ret;
+}
+
+int winlua_registry_import(lua_State *L, WinLuaRegSink sink, void *ud)
+{
+	const char *path = luaL_checkstring(L, 1);
+	RegParser *p = push_parser(L, path);
+	if (p == NULL) { return 3; }
+	int ret;
+	while ((ret = parser_next(p)) > 0)
+	{
+		int err = sink(ud, &p->record);
+		if (err != 0)
+		{
+			lua_pushnil(L);
+			lua_pushfstring(L, "could not import '%s' line %d (%d)", path, static_cast<int>(p->first), err);
+			lua_pushinteger(L, err);
+			return 3;
+		}
+	}
+	if (ret < 0) { return push_parse_error(L, path, p); }
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* ------------------------------------------------------------
+Writing
+------------------------------------------------------------ */
+
+static void writer_flush(RegWriter *w)
+{
+	if (w->out.empty()) { return; }
+	const void *data = w->out.data();
+	size_t size = w->out.size();
+	if (w->utf16)
+	{
+		grow(w->wide, size);
+		size = 2 * winlua_utf8_to_utf16(w->out.data(), w->out.size(), &w->wide[0]);
+		data = &w->wide[0];
+	}
+	if (w->error == 0 && w->f != NULL && fwrite(data, 1, size, w->f) != size) { w->error = (errno != 0) ? errno : EIO; }
+	w->out.clear();
+}
+
+/* pieces never split a UTF-8 sequence, so the buffer can be converted whenever it fills */
+static void writer_put(RegWriter *w, const char *s, size_t n)
+{
+	w->out.append(s, n);
+	if (w->out.size() >= REGFILE_BLOCK) { writer_flush(w); }
+}
+
+static void writer_quoted(RegWriter *w, const char *s, size_t n)
+{
+	w->out.push_back('"');
+	size_t from = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (s[i] == '\\' || s[i] == '"')
+		{
+			writer_put(w, s + from, i - from);
+			w->out.push_back('\\');
+			from = i;
+		}
+	}
+	writer_put(w, s + from, n - from);
+	w->out.push_back('"');
+}
+
+static void writer_key(RegWriter *w, const char *path, size_t len, bool remove)
+{
+	writer_put(w, remove ? "\r\n[-" : "\r\n[", remove ? 4 : 3);
+	writer_put(w, path, len);
+	writer_put(w, "]\r\n", 3);
+}
+
+/* hex bytes wrapped like regedit's, after 'col' characters of the line */
+static void writer_hex(RegWriter *w, const unsigned char *data, size_t size, size_t col)
+{
+	static const char digits[] = "0123456789abcdef";
+	for (size_t i = 0; i < size; i++)
+	{
+		char buf[8];
+		size_t k = 0;
+		buf[k++] = digits[data[i] >> 4];
+		buf[k++] = digits[data[i] & 15];
+		col += 2;
+		if (i + 1 < size)
+		{
+			buf[k++] = ',';
+			if (++col > REGFILE_WRAP - 4)
+			{
+				memcpy(buf + k, "\\\r\n  ", 5);
+				k += 5;
+				col = 2;
+			}
+		}
+		w->out.append(buf, k);
+	}
+	writer_put(w, "\r\n", 2);
+}
+
+/* can the text stand between quotes on one line? */
+static bool plain(const char *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		if (s[i] == '\r' || s[i] == '\n' || s[i] == '\0') { return false; }
+	}
+	return true;
+}
+
+/* one value line; REG_SZ data comes as UTF-8 'text' or as the registry's UTF-16 'data' */
+static void writer_value(RegWriter *w, const char *name, size_t namelen, uint32_t type, const unsigned char *data, size_t size, const char *text, size_t textlen)
+{
+	if (namelen == 0)
+	{
+		writer_put(w, "@=", 2);
+	}
+	else
+	{
+		writer_quoted(w, name, namelen);
+		writer_put(w, "=", 1);
+	}
+	size_t col = (namelen == 0) ? 2 : namelen + 3;
+
+	if (type == REGFILE_SZ && text == NULL && size % 2 == 0)
+	{
+		/* quoted when it is one terminated string */
+		size_t units = size / 2;
+		if (units > 0 && data[size - 1] == 0 && data[size - 2] == 0) { units--; }
+		grow(w->wide, units + 1);
+		memcpy(&w->wide[0], data, 2 * units);
+		if (std::find(w->wide.begin(), w->wide.begin() + units, 0) == w->wide.begin() + units)
+		{
+			grow(w->utf8, 3 * units + 1);
+			text = &w->utf8[0];
+			textlen = winlua_utf16_to_utf8(&w->wide[0], units, &w->utf8[0]);
+			if (!plain(text, textlen)) { text = NULL; }
+		}
+	}
+	if (type == REGFILE_SZ && text != NULL)
+	{
+		if (plain(text, textlen))
+		{
+			writer_quoted(w, text, textlen);
+			writer_put(w, "\r\n", 2);
+			return;
+		}
+		/* regedit writes such strings as hex(1) */
+		grow(w->wide, textlen + 1);
+		size_t units = winlua_utf8_to_utf16(text, textlen, &w->wide[0]);
+		w->wide[units] = 0;
+		data = reinterpret_cast<const unsigned char*>(&w->wide[0]);
+		size = 2 * (units + 1);
+	}
+	if (type == REGFILE_DWORD && size == 4)
+	{
+		char buf[24];
+		uint32_t v = data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+		int n = snprintf(buf, sizeof(buf), "dword:%08x\r\n", v);
+		writer_put(w, buf, static_cast<size_t>(n));
+		return;
+	}
+
+	char buf[24];
+	int n = (type == REGFILE_BINARY) ? snprintf(buf, sizeof(buf), "hex:") : snprintf(buf, sizeof(buf), "hex(%x):", type);
+	writer_put(w, buf, static_cast<size_t>(n));
+	writer_hex(w, data, size, col + n);
+}
+
+/* the type argument at 'idx', or the one the data at 'data' implies */
+static uint32_t check_type(lua_State *L, int idx, int data)
+{
+	if (lua_type(L, idx) == LUA_TSTRING)
+	{
+		int type = winlua_regtype(lua_tostring(L, idx));
+		if (type < 0) { luaL_argerror(L, idx, "unknown value type"); }
+		return static_cast<uint32_t>(type);
+	}
+	if (!lua_isnoneornil(L, idx))
+	{
+		return static_cast<uint32_t>(luaL_checkinteger(L, idx));
+	}
+	switch (lua_type(L, data))
+	{
+	case LUA_TTABLE:
+		return REGFILE_MULTI_SZ;
+	case LUA_TNUMBER:
+	{
+		lua_Integer v = luaL_checkinteger(L, data);
+		return (v >= 0 && v <= 0xffffffffLL) ? REGFILE_DWORD : REGFILE_QWORD;
+	}
+	default:
+		return REGFILE_SZ;
+	}
+}
+
+static void append_utf16(RegWriter *w, const char *s, size_t n)
+{
+	size_t at = w->bytes.size();
+	grow(w->wide, n + 1);
+	size_t units = winlua_utf8_to_utf16(s, n, &w->wide[0]);
+	w->wide[units++] = 0;
+	w->bytes.resize(at + 2 * units);
+	memcpy(&w->bytes[at], &w->wide[0], 2 * units);
+}
+
+/* write the Lua value at 'data' as a value of 'type' */
+static void write_lua_value(lua_State *L, RegWriter *w, const char *name, size_t namelen, uint32_t type, int data)
+{
+	size_t len;
+	const char *s;
+	w->bytes.clear();
+	switch (type)
+	{
+	case REGFILE_SZ:
+		s = luaL_checklstring(L, data, &len);
+		writer_value(w, name, namelen, type, NULL, 0, s, len);
+		return;
+	case REGFILE_EXPAND_SZ:
+	case REGFILE_LINK:
+		s = luaL_checklstring(L, data, &len);
+		append_utf16(w, s, len);
+		break;
+	case REGFILE_MULTI_SZ:
+		if (lua_type(L, data) == LUA_TTABLE)
+		{
+			lua_Integer n = luaL_len(L, data);
+			for (lua_Integer i = 1; i <= n; i++)
+			{
+				lua_rawgeti(L, data, i);
+				s = luaL_checklstring(L, -1, &len);
+				append_utf16(w, s, len);
+				lua_pop(L, 1);
+			}
+		}
+		else
+		{
+			s = luaL_checklstring(L, data, &len);
+			append_utf16(w, s, len);
+		}
+		w->bytes.push_back(0);
+		w->bytes.push_back(0);
+		break;
+	case REGFILE_DWORD:
+	case REGFILE_DWORD_BIG_ENDIAN:
+	case REGFILE_QWORD:
+	{
+		uint64_t v = static_cast<uint64_t>(luaL_checkinteger(L, data));
+		size_t n = (type == REGFILE_QWORD) ? 8 : 4;
+		for (size_t k = 0; k < n; k++)
+		{
+			size_t shift = (type == REGFILE_DWORD_BIG_ENDIAN) ? 8 * (3 - k) : 8 * k;
+			w->bytes.push_back(static_cast<unsigned char>(v >> shift));
+		}
+		break;
+	}
+	default:
+		s = luaL_checklstring(L, data, &len);
+		w->bytes.assign(s, s + len);
+		break;
+	}
+	static const unsigned char empty = 0;
+	writer_value(w, name, namelen, type, w->bytes.empty() ? &empty : &w->bytes[0], w->bytes.size(), NULL, 0);
+}
+
+/* ------------------------------------------------------------
+writer:tree
+------------------------------------------------------------ */
+
+static bool name_less(const RegName& a, const RegName& b)
+{
+	size_t n = (a.n < b.n) ? a.n : b.n;
+	for (size_t i = 0; i < n; i++)
+	{
+		unsigned char x = static_cast<unsigned char>(a.s[i]), y = static_cast<unsigned char>(b.s[i]);
+		if (x >= 'a' && x <= 'z') { x = static_cast<unsigned char>(x - 'a' + 'A'); }
+		if (y >= 'a' && y <= 'z') { y = static_cast<unsigned char>(y - 'a' + 'A'); }
+		if (x != y) { return x < y; }
+	}
+	return a.n < b.n;
+}
+
+/* the string keys of the table at 'idx', sorted; the table keeps them alive */
+static void sorted_names(lua_State *L, int idx, std::vector<RegName>& names)
+{
+	names.clear();
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0)
+	{
+		lua_pop(L, 1);
+		if (lua_type(L, -1) == LUA_TSTRING)
+		{
+			RegName n;
+			n.s = lua_tolstring(L, -1, &n.n);
+			names.push_back(n);
+		}
+	}
+	std::sort(names.begin(), names.end(), name_less);
+}
+
+static void write_values(lua_State *L, RegWriter *w, int node)
+{
+	if (lua_getfield(L, node, "values") != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	int values = lua_gettop(L);
+	lua_getfield(L, node, "types");
+	int types = lua_istable(L, -1) ? values + 1 : 0;
+	sorted_names(L, values, w->values);
+	for (size_t i = 0; i < w->values.size(); i++)
+	{
+		const RegName& n = w->values[i];
+		lua_pushlstring(L, n.s, n.n);
+		lua_rawget(L, values);
+		if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1))
+		{
+			if (n.n == 0)
+			{
+				writer_put(w, "@=-\r\n", 5);
+			}
+			else
+			{
+				writer_quoted(w, n.s, n.n);
+				writer_put(w, "=-\r\n", 4);
+			}
+		}
+		else
+		{
+			if (types != 0)
+			{
+				lua_pushlstring(L, n.s, n.n);
+				lua_rawget(L, types);
+			}
+			else
+			{
+				lua_pushnil(L);
+			}
+			uint32_t type = check_type(L, -1, -2);
+			write_lua_value(L, w, n.s, n.n, type, lua_gettop(L) - 1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+}
+
+/* the table at 'node' as the key at w->path, or only its subkeys when the path is empty */
+static void write_node(lua_State *L, RegWriter *w, int node, size_t depth)
+{
+	if (depth >= REGFILE_MAXDEPTH) { luaL_error(L, "tree is too deep"); }
+	luaL_checkstack(L, 8, "tree is too deep");
+	if (!w->path.empty())
+	{
+		bool deleted = lua_getfield(L, node, "deleted") != LUA_TNIL && lua_toboolean(L, -1);
+		bool values = lua_getfield(L, node, "values") == LUA_TTABLE;
+		lua_pop(L, 2);
+		if (deleted) { writer_key(w, w->path.data(), w->path.size(), true); }
+		if (!deleted || values) { writer_key(w, w->path.data(), w->path.size(), false); }
+		write_values(L, w, node);
+	}
+
+	if (lua_getfield(L, node, "keys") != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	int keys = lua_gettop(L);
+	if (w->keys.size() <= depth) { w->keys.resize(depth + 1); }
+	sorted_names(L, keys, w->keys[depth]);
+	size_t base = w->path.size();
+	for (size_t i = 0; i < w->keys[depth].size(); i++)
+	{
+		const RegName n = w->keys[depth][i];
+		lua_pushlstring(L, n.s, n.n);
+		if (lua_rawget(L, keys) == LUA_TTABLE)
+		{
+			if (base > 0) { w->path += '\\'; }
+			w->path.append(n.s, n.n);
+			write_node(L, w, lua_gettop(L), depth + 1);
+			w->path.resize(base);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/* ------------------------------------------------------------
+registry.reg_writer
+------------------------------------------------------------ */
+
+static RegWriter *check_writer(lua_State *L)
+{
+	WinLuaRegWriter *u = static_cast<WinLuaRegWriter*>(luaL_checkudata(L, 1, WINLUA_REGWRITER_META));
+	if (u->writer == NULL) { luaL_error(L, "attempt to use a closed writer"); }
+	return u->writer;
+}
+
+static int close_writer(RegWriter *w)
+{
+	writer_put(w, "\r\n", 2);
+	writer_flush(w);
+	int err = w->error;
+	if (fclose(w->f) != 0 && err == 0) { err = errno; }
+	w->f = NULL;
+	return err;
+}
+
+static int regwriter_key(lua_State *L)
+{
+	RegWriter *w = check_writer(L);
+	size_t len;
+	const char *path = luaL_checklstring(L, 2, &len);
+	writer_key(w, path, len, false);
+	return 0;
+}
+
+static int regwriter_delete_key(lua_State *L)
+{
+	RegWriter *w = check_writer(L);
+	size_t len;
+	const char *path = luaL_checklstring(L, 2, &len);
+	writer_key(w, path, len, true);
+	return 0;
+}
+
+static int regwriter_value(lua_State *L)
+{
+	RegWriter *w = check_writer(L);
+	size_t len;
+	const char *name = luaL_checklstring(L, 2, &len);
+	luaL_checkany(L, 3);
+	uint32_t type = check_type(L, 4, 3);
+	write_lua_value(L, w, name, len, type, 3);
+	return 0;
+}
+
+static int regwriter_delete_value(lua_State *L)
+{
+	RegWriter *w = check_writer(L);
+	size_t len;
+	const char *name = luaL_checklstring(L, 2, &len);
+	if (len == 0)
+	{
+		writer_put(w, "@=-\r\n", 5);
+	}
+	else
+	{
+		writer_quoted(w, name, len);
+		writer_put(w, "=-\r\n", 4);
+	}
+	return 0;
+}
+
+static int regwriter_tree(lua_State *L)
+{
+	RegWriter *w = check_writer(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t len = 0;
+	const char *path = luaL_optlstring(L, 3, "", &len);
+	lua_settop(L, 3);
+	w->path.assign(path, len);
+	write_node(L, w, 2, 0);
+	return 0;
+}
+
+static int regwriter_close(lua_State *L)
+{
+	WinLuaRegWriter *u = static_cast<WinLuaRegWriter*>(luaL_checkudata(L, 1, WINLUA_REGWRITER_META));
+	if (u->writer == NULL) { return luaL_error(L, "attempt to use a closed writer"); }
+	int err = close_writer(u->writer);
+	delete u->writer;
+	u->writer = NULL;
+	if (err != 0)
+	{
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not write file (%d)", err);
+		lua_pushinteger(L, err);
+		return 3;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int regwriter__gc(lua_State *L)
+{
+	WinLuaRegWriter *u = static_cast<WinLuaRegWriter*>(luaL_checkudata(L, 1, WINLUA_REGWRITER_META));
+	if (u->writer != NULL)
+	{
+		close_writer(u->writer);
+		delete u->writer;
+		u->writer = NULL;
+	}
+	return 0;
+}
+
+/* a writer for 'path' (options at 'options') in a userdata on the stack; NULL with nil, message, code pushed */
+static RegWriter *push_writer(lua_State *L, const char *path, int options)
+{
+	bool utf16 = true;
+	if (!lua_isnoneornil(L, options))
+	{
+		luaL_checktype(L, options, LUA_TTABLE);
+		if (lua_getfield(L, options, "encoding") != LUA_TNIL)
+		{
+			const char *encoding = luaL_checkstring(L, -1);
+			if (strcmp(encoding, "utf-8") == 0) { utf16 = false; }
+			else if (strcmp(encoding, "utf-16") != 0) { luaL_error(L, "unknown encoding '%s'", encoding); }
+		}
+		lua_pop(L, 1);
+	}
+
+	WinLuaRegWriter *u = static_cast<WinLuaRegWriter*>(lua_newuserdata(L, sizeof(WinLuaRegWriter)));
+	u->writer = NULL;
+	if (luaL_newmetatable(L, WINLUA_REGWRITER_META))
+	{
+		static const luaL_Reg regwriter_methods[] = {
+			{"key", regwriter_key},
+			{"delete_key", regwriter_delete_key},
+			{"value", regwriter_value},
+			{"delete_value", regwriter_delete_value},
+			{"tree", regwriter_tree},
+			{"close", regwriter_close},
+			{"__gc", regwriter__gc},
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_setfuncs(L, regwriter_methods, 0);
+	}
+	lua_setmetatable(L, -2);
+
+	FILE *f = open_file(L, path, true);
+	if (f == NULL)
+	{
+		int err = errno;
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not open '%s' (%d)", path, err);
+		lua_pushinteger(L, err);
+		return NULL;
+	}
+	RegWriter *w = u->writer = new RegWriter;
+	w->f = f;
+	w->utf16 = utf16;
+	if (utf16)
+	{
+		static const unsigned char bom[] = {0xff, 0xfe};
+		if (fwrite(bom, 1, sizeof(bom), f) != sizeof(bom)) { w->error = errno; }
+	}
+	writer_put(w, "Windows Registry Editor Version 5.00\r\n", 38);
+	return w;
+}
+
+int winlua_registry_reg_writer(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	return (push_writer(L, path, 2) != NULL) ? 1 : 3;
+}
+
+/* ------------------------------------------------------------
+key:export
+------------------------------------------------------------ */
+
+struct RegExportError
+{
+	std::string path;
+	int error;
+};
+
+struct RegExport
+{
+	WinLuaRegBackend *backend;
+	RegWriter *w;
+	std::string path;
+	std::vector<uint16_t> name;
+	std::vector<uint64_t> data; /* aligned for UTF-16 */
+	std::vector<char> utf8;
+	lua_Integer keys;
+	std::vector<RegExportError> errors;
+};
+
+static void export_error(RegExport& e, int err)
+{
+	RegExportError x;
+	x.path = e.path;
+	x.error = err;
+	e.errors.push_back(x);
+}
+
+static void export_values(RegExport& e, WinLuaRegHandle key, const WinLuaRegInfo& info)
+{
+	grow(e.name, info.max_value_name + 1);
+	grow(e.data, info.max_data / 8 + 1);
+	for (uint32_t i = 0; i < info.values; i++)
+	{
+		for (int attempt = 0; attempt < REGFILE_RETRIES; attempt++)
+		{
+			size_t namelen = e.name.size(), size = 8 * e.data.size();
+			uint32_t type = 0;
+			unsigned char *data = reinterpret_cast<unsigned char*>(&e.data[0]);
+			int err = e.backend->value(key, i, &e.name[0], &namelen, &type, data, &size);
+			if (err == WINLUA_REG_MORE_DATA)
+			{
+				e.name.resize((namelen > e.name.size()) ? namelen : 2 * e.name.size());
+				e.data.resize((size > 8 * e.data.size()) ? size / 8 + 1 : 2 * e.data.size());
+				continue;
+			}
+			if (err == 0)
+			{
+				grow(e.utf8, 3 * namelen + 1);
+				size_t n = winlua_utf16_to_utf8(&e.name[0], namelen, &e.utf8[0]);
+				writer_value(e.w, &e.utf8[0], n, type, data, size, NULL, 0);
+			}
+			break;
+		}
+	}
+}
+
+static void export_key(RegExport& e, WinLuaRegHandle key, int depth)
+{
+	writer_key(e.w, e.path.data(), e.path.size(), false);
+	e.keys++;
+	WinLuaRegInfo info;
+	int err = e.backend->info(key, &info);
+	if (err != 0)
+	{
+		export_error(e, err);
+		return;
+	}
+	export_values(e, key, info);
+	if (depth >= REGFILE_MAXDEPTH) { return; }
+
+	size_t base = e.path.size();
+	grow(e.name, info.max_subkey + 1);
+	for (uint32_t i = 0; i < info.subkeys; i++)
+	{
+		size_t len = 0;
+		WinLuaRegHandle sub = 0;
+		err = WINLUA_REG_MORE_DATA;
+		for (int attempt = 0; err == WINLUA_REG_MORE_DATA && attempt < REGFILE_RETRIES; attempt++)
+		{
+			if (attempt > 0) { e.name.resize((len > e.name.size()) ? len : 2 * e.name.size()); }
+			len = e.name.size();
+			err = e.backend->subkey(key, i, &e.name[0], &len, &sub);
+		}
+		if (err == WINLUA_REG_MORE_DATA || (err != 0 && len == 0)) { continue; }
+
+		grow(e.utf8, 3 * len + 1);
+		e.path += '\\';
+		e.path.append(&e.utf8[0], winlua_utf16_to_utf8(&e.name[0], len, &e.utf8[0]));
+		if (err == 0)
+		{
+			export_key(e, sub, depth + 1);
+			e.backend->close(sub);
+		}
+		else
+		{
+			export_error(e, err);
+		}
+		e.path.resize(base);
+	}
+}
+
+int winlua_registry_export(lua_State *L, WinLuaRegBackend *backend, WinLuaRegHandle root)
+{
+	const char *path = luaL_checkstring(L, 2);
+	size_t len;
+	const char *name = luaL_checklstring(L, 3, &len);
+	RegWriter *w = push_writer(L, path, 4);
+	if (w == NULL) { return 3; }
+
+	lua_Integer keys;
+	{
+		RegExport e;
+		e.backend = backend;
+		e.w = w;
+		e.path.assign(name, len);
+		e.keys = 0;
+		export_key(e, root, 0);
+		keys = e.keys;
+
+		lua_createtable(L, static_cast<int>(e.errors.size()), 0);
+		for (size_t i = 0; i < e.errors.size(); i++)
+		{
+			lua_createtable(L, 0, 2);
+			lua_pushlstring(L, e.errors[i].path.data(), e.errors[i].path.size());
+			lua_setfield(L, -2, "path");
+			lua_pushinteger(L, e.errors[i].error);
+			lua_setfield(L, -2, "error");
+			lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+		}
+	}
+
+	WinLuaRegWriter *u = static_cast<WinLuaRegWriter*>(lua_touserdata(L, -2));
+	int err = close_writer(w);
+	delete w;
+	u->writer = NULL;
+	if (err != 0)
+	{
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not write '%s' (%d)", path, err);
+		lua_pushinteger(L, err);
+		return 3;
+	}
+	lua_pushinteger(L, keys);
+	lua_insert(L, -2);
+	return 2;
+}
@@ -1,4 +1,8 @@
 #include "winlua.hpp"
+#include <string.h>
+#include <wchar.h>
+
+#include <vector>
 
 /* ------------------------------------------------------------
 WinLua Registry userdata and metatable
@@ -220,6 +224,183 @@ static int regkey_values(lua_State *L)
 }
 
 
+/* ------------------------------------------------------------
+RegKey subtree reads (key:read_tree, see regtree.cpp)
+------------------------------------------------------------ */
+
+/* live keys through the Unicode APIs; HKEYs may be shared between threads */
+class RegKeyBackend : public WinLuaRegBackend
+{
+public:
+	int info(WinLuaRegHandle key, WinLuaRegInfo *info)
+	{
+		DWORD subkeys, maxSubkey, values, maxValueName, maxData;
+		LONG ret = RegQueryInfoKeyW(reinterpret_cast<HKEY>(key),
+			NULL, NULL, // class
+			NULL, // reserved
+			&subkeys, &maxSubkey, NULL, // subkeys
+			&values, &maxValueName, &maxData, // values
+			NULL, // security descriptor
+			NULL // last write time
+		);
+		if (ret != ERROR_SUCCESS) { return static_cast<int>(ret); }
+		info->subkeys = subkeys;
+		info->values = values;
+		info->max_subkey = maxSubkey;
+		info->max_value_name = maxValueName;
+		info->max_data = maxData;
+		return 0;
+	}
+
+	int subkey(WinLuaRegHandle key, uint32_t index, uint16_t *name, size_t *len, WinLuaRegHandle *sub)
+	{
+		DWORD namelen = static_cast<DWORD>(*len);
+		LONG ret = RegEnumKeyExW(reinterpret_cast<HKEY>(key), index, reinterpret_cast<LPWSTR>(name), &namelen, NULL, NULL, NULL, NULL);
+		if (ret == ERROR_MORE_DATA) { return WINLUA_REG_MORE_DATA; }
+		*len = (ret == ERROR_SUCCESS) ? namelen : 0;
+		if (ret != ERROR_SUCCESS) { return static_cast<int>(ret); }
+
+		HKEY newkey = NULL;
+		ret = RegOpenKeyExW(reinterpret_cast<HKEY>(key), reinterpret_cast<LPCWSTR>(name), 0, KEY_READ, &newkey);
+		*sub = reinterpret_cast<WinLuaRegHandle>(newkey);
+		return static_cast<int>(ret);
+	}
+
+	int value(WinLuaRegHandle key, uint32_t index, uint16_t *name, size_t *namelen, uint32_t *type, unsigned char *data, size_t *size)
+	{
+		DWORD nameLength = static_cast<DWORD>(*namelen), dataSize = static_cast<DWORD>(*size), valueType = REG_NONE;
+		LONG ret = RegEnumValueW(reinterpret_cast<HKEY>(key), index, reinterpret_cast<LPWSTR>(name), &nameLength, NULL, &valueType, data, &dataSize);
+		if (ret == ERROR_MORE_DATA)
+		{
+			*size = dataSize;
+			return WINLUA_REG_MORE_DATA;
+		}
+		if (ret != ERROR_SUCCESS) { return static_cast<int>(ret); }
+		*namelen = nameLength;
+		*type = valueType;
+		*size = dataSize;
+		return 0;
+	}
+
+	void close(WinLuaRegHandle key)
+	{
+		RegCloseKey(reinterpret_cast<HKEY>(key));
+	}
+};
+
+static int regkey_read_tree(lua_State *L)
+{
+	WinLuaRegKey *udata = static_cast<WinLuaRegKey*>(luaL_checkudata(L, 1, WINLUA_REGKEY_META));
+	RegKeyBackend backend;
+	return winlua_registry_read_tree(L, &backend, reinterpret_cast<WinLuaRegHandle>(udata->handle));
+}
+
+static int regkey_export(lua_State *L)
+{
+	WinLuaRegKey *udata = static_cast<WinLuaRegKey*>(luaL_checkudata(L, 1, WINLUA_REGKEY_META));
+	RegKeyBackend backend;
+	return winlua_registry_export(L, &backend, reinterpret_cast<WinLuaRegHandle>(udata->handle));
+}
+
+/* ------------------------------------------------------------
+RegKey .reg imports (registry.import, see regfile.cpp)
+------------------------------------------------------------ */
+
+struct RegImport
+{
+	HKEY key; /* the key of the last [path] line, or NULL */
+	std::vector<uint16_t> wide, data;
+};
+
+static const struct { const char *name; HKEY key; } import_roots[] = {
+	{"HKEY_CLASSES_ROOT", HKEY_CLASSES_ROOT},
+	{"HKEY_CURRENT_CONFIG", HKEY_CURRENT_CONFIG},
+	{"HKEY_CURRENT_USER", HKEY_CURRENT_USER},
+	{"HKEY_LOCAL_MACHINE", HKEY_LOCAL_MACHINE},
+	{"HKEY_USERS", HKEY_USERS},
+	{"HKCR", HKEY_CLASSES_ROOT},
+	{"HKCC", HKEY_CURRENT_CONFIG},
+	{"HKCU", HKEY_CURRENT_USER},
+	{"HKLM", HKEY_LOCAL_MACHINE},
+	{"HKU", HKEY_USERS},
+};
+
+/* NUL-terminated UTF-16 copy of s[0, len) in 'out' */
+static LPCWSTR import_wide(std::vector<uint16_t>& out, const char *s, size_t len)
+{
+	if (out.size() < len + 1) { out.resize(len + 1); }
+	out[winlua_utf8_to_utf16(s, len, &out[0])] = 0;
+	return reinterpret_cast<LPCWSTR>(&out[0]);
+}
+
+/* the predefined key a path starts with, and the rest of the path after its backslash */
+static HKEY import_root(const char *path, size_t len, size_t *rest)
+{
+	for (size_t i = 0; i < sizeof(import_roots) / sizeof(import_roots[0]); i++)
+	{
+		size_t n = strlen(import_roots[i].name);
+		if (len >= n && _strnicmp(path, import_roots[i].name, n) == 0 && (len == n || path[n] == '\\'))
+		{
+			*rest = (len == n) ? n : n + 1;
+			return import_roots[i].key;
+		}
+	}
+	return NULL;
+}
+
+static int import_record(void *ud, const WinLuaRegRecord *r)
+{
+	RegImport *im = static_cast<RegImport*>(ud);
+	if (r->kind == WINLUA_REG_KEY || r->kind == WINLUA_REG_DELETE_KEY)
+	{
+		if (im->key != NULL)
+		{
+			RegCloseKey(im->key);
+			im->key = NULL;
+		}
+		size_t rest;
+		HKEY root = import_root(r->key, r->keylen, &rest);
+		if (root == NULL) { return ERROR_BAD_PATHNAME; }
+		LPCWSTR sub = import_wide(im->wide, r->key + rest, r->keylen - rest);
+		LONG ret;
+		if (r->kind == WINLUA_REG_DELETE_KEY)
+		{
+			/* like regedit, never a whole predefined key */
+			if (rest >= r->keylen) { return ERROR_BAD_PATHNAME; }
+			ret = RegDeleteTreeW(root, sub);
+			if (ret == ERROR_SUCCESS) { ret = RegDeleteKeyW(root, sub); }
+			return (ret == ERROR_FILE_NOT_FOUND) ? 0 : static_cast<int>(ret);
+		}
+		ret = RegCreateKeyExW(root, sub, 0, NULL, REG_OPTION_NON_VOLATILE, KEY_WRITE, NULL, &im->key, NULL);
+		return static_cast<int>(ret);
+	}
+
+	LPCWSTR name = import_wide(im->wide, r->name, r->namelen);
+	if (r->kind == WINLUA_REG_DELETE_VALUE)
+	{
+		LONG ret = RegDeleteValueW(im->key, name);
+		return (ret == ERROR_FILE_NOT_FOUND) ? 0 : static_cast<int>(ret);
+	}
+	const BYTE *data = r->data;
+	size_t size = r->size;
+	if (r->text != NULL)
+	{
+		import_wide(im->data, r->text, r->textlen);
+		data = reinterpret_cast<const BYTE*>(&im->data[0]);
+		size = 2 * (wcslen(reinterpret_cast<const wchar_t*>(data)) + 1);
+	}
+	return static_cast<int>(RegSetValueExW(im->key, name, 0, r->type, data, static_cast<DWORD>(size)));
+}
+
+static int registry_import(lua_State *L)
+{
+	RegImport im;
+	im.key = NULL;
+	int ret = winlua_registry_import(L, import_record, &im);
+	if (im.key != NULL) { RegCloseKey(im.key); }
+	return ret;
+}
+
 /* ------------------------------------------------------------
 WinLua Registry functions
 ------------------------------------------------------------ */
@@ -234,6 +415,8 @@ static const luaL_Reg regkey_methods[] = {
 	{"class", regkey_getclass},
 	{"subkeys", regkey_subkeys},
 	{"values", regkey_values},
+	{"read_tree", regkey_read_tree},
+	{"export", regkey_export},
 	{NULL, NULL}
 };
 
@@ -257,7 +440,15 @@ int luaopen_registry(lua_State *L)
 {
 	create_regkey_meta(L);
 
-	lua_createtable(L, 0, 6);
+	lua_createtable(L, 0, 10);
+	lua_pushcfunction(L, winlua_registry_load_hive);
+	lua_setfield(L, -2, "load_hive");
+	lua_pushcfunction(L, winlua_registry_parse_reg);
+	lua_setfield(L, -2, "parse_reg");
+	lua_pushcfunction(L, winlua_registry_reg_writer);
+	lua_setfield(L, -2, "reg_writer");
+	lua_pushcfunction(L, registry_import);
+	lua_setfield(L, -2, "import");
 	winlua_push_regkey(L, HKEY_CLASSES_ROOT, false);
 	lua_setfield(L, -2, "HKEY_CLASSES_ROOT");
 	winlua_push_regkey(L, HKEY_CURRENT_CONFIG, false);
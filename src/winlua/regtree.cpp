@@ -0,0 +1,442 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+/* ------------------------------------------------------------
+WinLua Registry Subtree Reads
+
+	key:read_tree([options])  -> tree
+
+	options:
+		depth = n          levels of subkeys to read (default: all)
+		values = false     leave out the values (default: read them)
+		parallel = true    read the subtrees of the key's subkeys on several threads
+
+Reads a key and everything below it in one call and returns it as
+nested tables:
+
+	{
+		keys = {[name] = tree, ...},     -- missing below the depth limit
+		values = {[name] = data, ...},   -- decoded as by hive key:values()
+		types = {[name] = "REG_SZ", ...},
+		error = "could not read key (5)" -- when the key could not be opened or read
+	}
+
+The subtree is first read into flat arrays without touching the Lua
+state, with name and data buffers sized once per key from the key's
+information, then turned into tables. That keeps the registry reads
+off the Lua side and lets the subtrees of sibling keys be read on
+worker threads when 'parallel' is set. Live keys (registry.cpp) and
+hive keys (hive.cpp) each pass in a WinLuaRegBackend.
+------------------------------------------------------------ */
+#define WINLUA_REGTREE_META "WinLuaRegTree"
+#define WINLUA_REGTREE_MAXDEPTH 512 /* the deepest the registry nests keys */
+#define WINLUA_REGTREE_RETRIES 8
+
+#define WINLUA_REGTREE_CHUNK (1 << 20)
+
+struct RegTreeKey
+{
+	const char *name; /* UTF-8 in the pool */
+	size_t namelen;
+	size_t values, nvalues; /* range in 'vals' */
+	size_t end; /* one past the last key of the subtree */
+	int error;
+	bool expanded;
+};
+
+struct RegTreeValue
+{
+	const char *name;
+	size_t namelen;
+	const unsigned char *data;
+	size_t size;
+	uint32_t type;
+};
+
+/* names and data, in chunks that never move; the backend writes data straight into them */
+struct RegTreePool
+{
+	std::vector<std::unique_ptr<char[]> > chunks;
+	char *at;
+	size_t left;
+
+	RegTreePool() : at(NULL), left(0) {}
+
+	/* room for 'size' bytes at an 'align'ed address, taken by commit() */
+	char *reserve(size_t size, size_t align)
+	{
+		size_t pad = (align - reinterpret_cast<uintptr_t>(at) % align) % align;
+		if (at == NULL || left < pad + size)
+		{
+			size_t chunk = (size > WINLUA_REGTREE_CHUNK) ? size : WINLUA_REGTREE_CHUNK;
+			chunks.push_back(std::unique_ptr<char[]>(new char[chunk]));
+			at = chunks.back().get();
+			left = chunk;
+			pad = 0;
+		}
+		at += pad;
+		left -= pad;
+		return at;
+	}
+
+	void commit(size_t size)
+	{
+		at += size;
+		left -= size;
+	}
+};
+
+/* keys in depth-first order, with their names and data in one pool */
+struct RegTreeReader
+{
+	WinLuaRegBackend *backend;
+	bool values;
+	std::vector<RegTreeKey> keys;
+	std::vector<RegTreeValue> vals;
+	RegTreePool pool;
+
+	std::vector<uint16_t> name;
+	size_t room; /* data bytes to reserve per value */
+
+	RegTreeReader() : backend(NULL), values(true), room(0) {}
+};
+
+/* a subkey of the root, read on its own for parallel reads */
+struct RegTreeChild
+{
+	std::vector<uint16_t> name;
+	WinLuaRegHandle handle;
+	int error;
+	RegTreeReader reader;
+};
+
+/* tree userdata: the readers, freed by __gc if building the tables fails */
+struct RegTree
+{
+	RegTreeReader root;
+	std::vector<RegTreeChild> children;
+	WinLuaRegHandle handle;
+	int depth;
+};
+
+struct WinLuaRegTree
+{
+	RegTree *tree;
+};
+
+/* ------------------------------------------------------------
+Reading
+------------------------------------------------------------ */
+
+template <typename T>
+static void grow(std::vector<T>& v, size_t size)
+{
+	if (v.size() < size) { v.resize(size); }
+}
+
+static const char *add_name(RegTreeReader& r, const uint16_t *name, size_t len, size_t *bytes)
+{
+	char *at = r.pool.reserve(3 * len + 1, 1);
+	*bytes = winlua_utf16_to_utf8(name, len, at);
+	r.pool.commit(*bytes);
+	return at;
+}
+
+static size_t add_key(RegTreeReader& r, const uint16_t *name, size_t len)
+{
+	RegTreeKey key;
+	key.name = add_name(r, name, len, &key.namelen);
+	key.values = r.vals.size();
+	key.nvalues = 0;
+	key.end = r.keys.size() + 1;
+	key.error = 0;
+	key.expanded = false;
+	r.keys.push_back(key);
+	return r.keys.size() - 1;
+}
+
+static void read_values(RegTreeReader& r, WinLuaRegHandle key, const WinLuaRegInfo& info)
+{
+	grow(r.name, info.max_value_name + 1);
+	if (r.room < info.max_data) { r.room = info.max_data; }
+	for (uint32_t i = 0; i < info.values; i++)
+	{
+		for (int attempt = 0; attempt < WINLUA_REGTREE_RETRIES; attempt++)
+		{
+			/* aligned, so UTF-16 data can be read in place */
+			unsigned char *data = reinterpret_cast<unsigned char*>(r.pool.reserve(r.room + 1, 8));
+			size_t namelen = r.name.size(), size = r.room + 1;
+			uint32_t type = 0;
+			int err = r.backend->value(key, i, &r.name[0], &namelen, &type, data, &size);
+			if (err == WINLUA_REG_MORE_DATA)
+			{
+				/* the value changed since the key was queried, or the backend could not tell */
+				r.name.resize((namelen > r.name.size()) ? namelen : 2 * r.name.size());
+				r.room = (size > r.room) ? size : 2 * r.room + 1;
+				continue;
+			}
+			if (err == 0)
+			{
+				RegTreeValue v;
+				r.pool.commit(size);
+				v.data = data;
+				v.size = size;
+				v.type = type;
+				v.name = add_name(r, &r.name[0], namelen, &v.namelen);
+				r.vals.push_back(v);
+			}
+			break;
+		}
+	}
+}
+
+static void read_key(RegTreeReader& r, WinLuaRegHandle key, size_t k, int depth);
+
+/* name and open the 'i'th subkey into r.name, growing it as needed */
+static int open_subkey(RegTreeReader& r, WinLuaRegHandle key, uint32_t i, size_t *len, WinLuaRegHandle *sub)
+{
+	int err = WINLUA_REG_MORE_DATA;
+	*len = 0;
+	for (int attempt = 0; err == WINLUA_REG_MORE_DATA && attempt < WINLUA_REGTREE_RETRIES; attempt++)
+	{
+		if (attempt > 0) { r.name.resize((*len > r.name.size()) ? *len : 2 * r.name.size()); }
+		*len = r.name.size();
+		*sub = 0;
+		err = r.backend->subkey(key, i, &r.name[0], len, sub);
+	}
+	if (err == WINLUA_REG_MORE_DATA) { *len = 0; }
+	return err;
+}
+
+static void read_subkeys(RegTreeReader& r, WinLuaRegHandle key, const WinLuaRegInfo& info, int depth)
+{
+	grow(r.name, info.max_subkey + 1);
+	for (uint32_t i = 0; i < info.subkeys; i++)
+	{
+		size_t len;
+		WinLuaRegHandle sub;
+		int err = open_subkey(r, key, i, &len, &sub);
+		if (err == 0)
+		{
+			read_key(r, sub, add_key(r, &r.name[0], len), depth);
+			r.backend->close(sub);
+		}
+		else if (len != 0)
+		{
+			r.keys[add_key(r, &r.name[0], len)].error = err;
+		}
+	}
+}
+
+/* fill in key 'k' and read its subtree; 'depth' levels of subkeys, none at 0 */
+static void read_key(RegTreeReader& r, WinLuaRegHandle key, size_t k, int depth)
+{
+	WinLuaRegInfo info;
+	int err = r.backend->info(key, &info);
+	if (err != 0)
+	{
+		r.keys[k].error = err;
+		return;
+	}
+	if (r.values)
+	{
+		read_values(r, key, info);
+		r.keys[k].nvalues = r.vals.size() - r.keys[k].values;
+	}
+	if (depth > 0)
+	{
+		r.keys[k].expanded = true;
+		read_subkeys(r, key, info, depth - 1);
+		r.keys[k].end = r.keys.size();
+	}
+}
+
+static void read_child(void *ud, size_t begin, size_t end)
+{
+	RegTree *tree = static_cast<RegTree*>(ud);
+	for (size_t i = begin; i < end; i++)
+	{
+		RegTreeChild& c = tree->children[i];
+		size_t k = add_key(c.reader, c.name.empty() ? NULL : &c.name[0], c.name.size());
+		if (c.error != 0)
+		{
+			c.reader.keys[k].error = c.error;
+			continue;
+		}
+		read_key(c.reader, c.handle, k, tree->depth - 1);
+		c.reader.backend->close(c.handle);
+	}
+}
+
+/* the root's values, then its subkeys opened here and their subtrees read on worker threads */
+static void read_parallel(RegTree *tree)
+{
+	RegTreeReader& r = tree->root;
+	WinLuaRegInfo info;
+	size_t k = add_key(r, NULL, 0);
+	int err = r.backend->info(tree->handle, &info);
+	if (err != 0)
+	{
+		r.keys[k].error = err;
+		return;
+	}
+	if (r.values)
+	{
+		read_values(r, tree->handle, info);
+		r.keys[k].nvalues = r.vals.size();
+	}
+	r.keys[k].expanded = true;
+
+	grow(r.name, info.max_subkey + 1);
+	tree->children.reserve(info.subkeys);
+	for (uint32_t i = 0; i < info.subkeys; i++)
+	{
+		size_t len;
+		WinLuaRegHandle sub;
+		int suberr = open_subkey(r, tree->handle, i, &len, &sub);
+		if (suberr != 0 && len == 0) { continue; }
+		tree->children.push_back(RegTreeChild());
+		RegTreeChild& c = tree->children.back();
+		c.name.assign(r.name.begin(), r.name.begin() + len);
+		c.handle = sub;
+		c.error = suberr;
+		c.reader.backend = r.backend;
+		c.reader.values = r.values;
+	}
+	winlua_parallel_for(tree->children.size(), 1, read_child, tree);
+}
+
+/* ------------------------------------------------------------
+Building the tables
+------------------------------------------------------------ */
+
+static void push_key(lua_State *L, const RegTreeReader& r, size_t k);
+
+static void push_children(lua_State *L, const RegTreeReader& r, size_t k)
+{
+	lua_newtable(L);
+	for (size_t child = k + 1; child < r.keys[k].end; child = r.keys[child].end)
+	{
+		lua_pushlstring(L, r.keys[child].name, r.keys[child].namelen);
+		push_key(L, r, child);
+		lua_rawset(L, -3);
+	}
+}
+
+/* the table for key 'k', without its subkeys */
+static void push_node(lua_State *L, const RegTreeReader& r, size_t k)
+{
+	const RegTreeKey& key = r.keys[k];
+	luaL_checkstack(L, 8, "registry tree too deep");
+	lua_createtable(L, 0, 3);
+	if (key.error != 0)
+	{
+		lua_pushfstring(L, "could not read key (%d)", key.error);
+		lua_setfield(L, -2, "error");
+		return;
+	}
+	if (!r.values) { return; }
+
+	int n = static_cast<int>(key.nvalues);
+	lua_createtable(L, 0, n);
+	lua_createtable(L, 0, n);
+	WinLuaScratch scratch(L);
+	for (size_t i = key.values; i < key.values + key.nvalues; i++)
+	{
+		const RegTreeValue& v = r.vals[i];
+		lua_pushlstring(L, v.name, v.namelen);
+		lua_pushvalue(L, -1);
+		winlua_push_regvalue(L, v.type, v.data, v.size, scratch);
+		lua_rawset(L, -5);
+		winlua_push_regtype(L, v.type);
+		lua_rawset(L, -3);
+	}
+	lua_setfield(L, -3, "types");
+	lua_setfield(L, -2, "values");
+}
+
+static void push_key(lua_State *L, const RegTreeReader& r, size_t k)
+{
+	push_node(L, r, k);
+	if (r.keys[k].expanded)
+	{
+		push_children(L, r, k);
+		lua_setfield(L, -2, "keys");
+	}
+}
+
+static int regtree__gc(lua_State *L)
+{
+	WinLuaRegTree *t = static_cast<WinLuaRegTree*>(luaL_checkudata(L, 1, WINLUA_REGTREE_META));
+	delete t->tree;
+	t->tree = NULL;
+	return 0;
+}
+
+int winlua_registry_read_tree(lua_State *L, WinLuaRegBackend *backend, WinLuaRegHandle root)
+{
+	int depth = WINLUA_REGTREE_MAXDEPTH;
+	bool values = true, parallel = false;
+	if (!lua_isnoneornil(L, 2))
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "depth") != LUA_TNIL)
+		{
+			lua_Integer n = luaL_checkinteger(L, -1);
+			if (n >= 0 && n < depth) { depth = static_cast<int>(n); }
+		}
+		if (lua_getfield(L, 2, "values") != LUA_TNIL) { values = lua_toboolean(L, -1) != 0; }
+		parallel = lua_getfield(L, 2, "parallel") != LUA_TNIL && lua_toboolean(L, -1);
+		lua_pop(L, 3);
+	}
+
+	WinLuaRegTree *t = static_cast<WinLuaRegTree*>(lua_newuserdata(L, sizeof(WinLuaRegTree)));
+	t->tree = NULL;
+	if (luaL_newmetatable(L, WINLUA_REGTREE_META))
+	{
+		lua_pushcfunction(L, regtree__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	RegTree *tree = t->tree = new RegTree;
+	tree->root.backend = backend;
+	tree->root.values = values;
+	tree->handle = root;
+	tree->depth = depth;
+	parallel = parallel && depth > 0;
+	if (parallel)
+	{
+		read_parallel(tree);
+	}
+	else
+	{
+		read_key(tree->root, root, add_key(tree->root, NULL, 0), depth);
+	}
+
+	push_node(L, tree->root, 0);
+	if (parallel && tree->root.keys[0].expanded)
+	{
+		lua_createtable(L, 0, static_cast<int>(tree->children.size()));
+		for (size_t i = 0; i < tree->children.size(); i++)
+		{
+			const RegTreeReader& r = tree->children[i].reader;
+			lua_pushlstring(L, r.keys[0].name, r.keys[0].namelen);
+			push_key(L, r, 0);
+			lua_rawset(L, -3);
+		}
+		lua_setfield(L, -2, "keys");
+	}
+	else if (tree->root.keys[0].expanded)
+	{
+		push_children(L, tree->root, 0);
+		lua_setfield(L, -2, "keys");
+	}
+
+	delete tree;
+	t->tree = NULL;
+	return 1;
+}
@@ -0,0 +1,207 @@
+#include "winlua.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <vector>
+
+/* ------------------------------------------------------------
+WinLua Scratch Arena
+
+Memory comes from 64k chunks that are kept for reuse; a scope
+records the position (chunk and offset) when it opens and rewinds
+to it when it closes. Scopes are registered with their address so
+that scopes abandoned by a longjmp (Lua errors and yields) can be
+recognized: the C stack grows downwards, so a registered scope at
+or below the address of a newly opened one belongs to a frame that
+no longer exists. This requires at most one open scope per C
+function: the compiler may inline a helper and place its locals
+anywhere in the caller's frame, so a helper that opened a second
+scope could look older than the one it runs in.
+------------------------------------------------------------ */
+#define WINLUA_ARENA_META "WinLuaArena"
+#define WINLUA_ARENA_CHUNK (64 * 1024)
+#define WINLUA_ARENA_KEEP (1024 * 1024) /* memory kept between calls */
+#define WINLUA_ARENA_ALIGN 16
+
+static const char arena_key = 's';
+
+struct WinLuaArenaChunk
+{
+	char *base;
+	size_t size;
+};
+
+struct WinLuaArenaScope
+{
+	const void *address;
+	size_t chunk, offset;
+};
+
+struct WinLuaArena
+{
+	std::vector<WinLuaArenaChunk> chunks;
+	std::vector<WinLuaArenaScope> scopes;
+	size_t chunk, offset; /* allocation position */
+	size_t total; /* bytes held by all chunks */
+};
+
+static void arena_rewind(WinLuaArena *arena, const WinLuaArenaScope& scope)
+{
+	arena->chunk = scope.chunk;
+	arena->offset = scope.offset;
+}
+
+/*
+Release chunks beyond WINLUA_ARENA_KEEP once no scope is open, so a
+single large conversion does not pin its memory for good.
+*/
+static void arena_trim(WinLuaArena *arena)
+{
+	size_t kept = 0, i = 0;
+	for (; i < arena->chunks.size(); i++)
+	{
+		if (kept + arena->chunks[i].size > WINLUA_ARENA_KEEP) { break; }
+		kept += arena->chunks[i].size;
+	}
+	for (size_t j = i; j < arena->chunks.size(); j++)
+	{
+		free(arena->chunks[j].base);
+	}
+	arena->total = kept;
+	if (i < arena->chunks.size())
+	{
+		arena->chunks.resize(i);
+	}
+}
+
+static int arena__gc(lua_State *L)
+{
+	WinLuaArena **box = static_cast<WinLuaArena**>(luaL_checkudata(L, 1, WINLUA_ARENA_META));
+	if (*box != NULL)
+	{
+		for (size_t i = 0; i < (*box)->chunks.size(); i++)
+		{
+			free((*box)->chunks[i].base);
+		}
+		delete *box;
+		*box = NULL;
+	}
+	return 0;
+}
+
+static WinLuaArena *get_arena(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &arena_key);
+	WinLuaArena **box = static_cast<WinLuaArena**>(lua_touserdata(L, -1));
+	lua_pop(L, 1);
+	if (box != NULL)
+	{
+		return *box;
+	}
+
+	box = static_cast<WinLuaArena**>(lua_newuserdata(L, sizeof(WinLuaArena*)));
+	*box = NULL;
+	if (luaL_newmetatable(L, WINLUA_ARENA_META))
+	{
+		lua_pushcfunction(L, arena__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	*box = new WinLuaArena;
+	(*box)->chunk = 0;
+	(*box)->offset = 0;
+	(*box)->total = 0;
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &arena_key);
+	return *box;
+}
+
+/* ------------------------------------------------------------
+Scopes
+------------------------------------------------------------ */
+
+WinLuaScratch::WinLuaScratch(lua_State *L) : L(L), arena(get_arena(L))
+{
+	/* drop scopes whose frames were unwound without running their destructor */
+	while (!arena->scopes.empty() && arena->scopes.back().address <= static_cast<const void*>(this))
+	{
+		arena_rewind(arena, arena->scopes.back());
+		arena->scopes.pop_back();
+	}
+
+	WinLuaArenaScope scope;
+	scope.address = this;
+	scope.chunk = arena->chunk;
+	scope.offset = arena->offset;
+	arena->scopes.push_back(scope);
+}
+
+WinLuaScratch::~WinLuaScratch()
+{
+	/* normally the innermost scope; anything above it is stale */
+	while (!arena->scopes.empty())
+	{
+		WinLuaArenaScope scope = arena->scopes.back();
+		arena->scopes.pop_back();
+		arena_rewind(arena, scope);
+		if (scope.address == this) { break; }
+	}
+	if (arena->scopes.empty() && arena->total > WINLUA_ARENA_KEEP)
+	{
+		arena_trim(arena);
+	}
+}
+
+void *WinLuaScratch::alloc(size_t size)
+{
+	size = (size + WINLUA_ARENA_ALIGN - 1) & ~static_cast<size_t>(WINLUA_ARENA_ALIGN - 1);
+	for (;;)
+	{
+		if (arena->chunk == arena->chunks.size())
+		{
+			WinLuaArenaChunk chunk;
+			chunk.size = (size > WINLUA_ARENA_CHUNK) ? size : WINLUA_ARENA_CHUNK;
+			chunk.base = static_cast<char*>(malloc(chunk.size));
+			if (chunk.base == NULL)
+			{
+				luaL_error(L, "not enough memory for scratch buffer");
+			}
+			arena->chunks.push_back(chunk);
+			arena->total += chunk.size;
+		}
+
+		WinLuaArenaChunk& chunk = arena->chunks[arena->chunk];
+		if (chunk.size - arena->offset >= size)
+		{
+			void *p = chunk.base + arena->offset;
+			arena->offset += size;
+			return p;
+		}
+
+		if (arena->offset == 0)
+		{
+			/* an unused chunk that is too small: replace it with a larger one */
+			char *base = static_cast<char*>(malloc(size));
+			if (base == NULL)
+			{
+				luaL_error(L, "not enough memory for scratch buffer");
+			}
+			free(chunk.base);
+			arena->total += size - chunk.size;
+			chunk.base = base;
+			chunk.size = size;
+			continue;
+		}
+
+		arena->chunk++;
+		arena->offset = 0;
+	}
+}
+
+uint16_t *WinLuaScratch::utf16(const char *inputs)
+{
+	size_t len = strlen(inputs);
+	uint16_t *buff = static_cast<uint16_t*>(alloc(sizeof(uint16_t) * (len + 1)));
+	buff[winlua_utf8_to_utf16(inputs, len, buff)] = 0;
+	return buff;
+}
@@ -0,0 +1,427 @@
+#include "winlua_serialize.hpp"
+#include <string.h>
+#include <new>
+
+/* ------------------------------------------------------------
+WinLua Serializer
+
+Each value starts with a one byte tag. Integers are zigzag
+varints, strings and counts are varints. A table stores the
+length of its array part and the number of remaining pairs up
+front so the decoder can presize it, followed by the array
+values in order and then the key/value pairs. Tables and strings
+seen before are written as back-references, which also makes
+shared and cyclic tables round-trip.
+------------------------------------------------------------ */
+#define WINLUA_SERIALIZE_BUFFER_META "WinLuaSerializeBuffer"
+#define WINLUA_SERIALIZE_MAXDEPTH 200
+
+/* shorter strings are cheaper to repeat than to reference */
+#define WINLUA_SERIALIZE_MINREF 3
+
+enum WinLuaSerializeTag
+{
+	SER_NIL = 0,
+	SER_FALSE = 1,
+	SER_TRUE = 2,
+	SER_INTEGER = 3,
+	SER_NUMBER = 4,
+	SER_STRING = 5,
+	SER_TABLE = 6,
+	SER_REF = 7,
+	SER_USERDATA = 8
+};
+
+struct WinLuaEncoder
+{
+	lua_State *L;
+	std::string *out;
+	int seen; /* table: value -> reference id */
+	lua_Integer nrefs;
+	const WinLuaSerializeUdata *udata;
+};
+
+struct WinLuaDecoder
+{
+	lua_State *L;
+	const char *end;
+	int refs; /* table: reference id -> value */
+	lua_Integer nrefs;
+	const WinLuaSerializeUdata *udata;
+};
+
+/* ------------------------------------------------------------
+Encoding
+------------------------------------------------------------ */
+
+static void put_varint(std::string& out, unsigned long long v)
+{
+	char buff[10];
+	int n = 0;
+	while (v >= 0x80)
+	{
+		buff[n++] = static_cast<char>((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	buff[n++] = static_cast<char>(v);
+	out.append(buff, n);
+}
+
+/*
+Write a back-reference if the value at idx was seen before,
+otherwise remember it under the next reference id.
+*/
+static bool encode_ref(WinLuaEncoder *E, int idx)
+{
+	lua_State *L = E->L;
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, E->seen) == LUA_TNUMBER)
+	{
+		*E->out += static_cast<char>(SER_REF);
+		put_varint(*E->out, static_cast<unsigned long long>(lua_tointeger(L, -1)));
+		lua_pop(L, 1);
+		return true;
+	}
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, idx);
+	lua_pushinteger(L, ++E->nrefs);
+	lua_rawset(L, E->seen);
+	return false;
+}
+
+static void encode_value(WinLuaEncoder *E, int idx, int depth)
+{
+	lua_State *L = E->L;
+	std::string& out = *E->out;
+
+	switch (lua_type(L, idx))
+	{
+		case LUA_TNIL:
+			out += static_cast<char>(SER_NIL);
+			break;
+
+		case LUA_TBOOLEAN:
+			out += static_cast<char>(lua_toboolean(L, idx) ? SER_TRUE : SER_FALSE);
+			break;
+
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, idx))
+			{
+				unsigned long long v = static_cast<unsigned long long>(lua_tointeger(L, idx));
+				out += static_cast<char>(SER_INTEGER);
+				put_varint(out, (v << 1) ^ (0ULL - (v >> 63))); /* zigzag */
+			}
+			else
+			{
+				double n = static_cast<double>(lua_tonumber(L, idx));
+				out += static_cast<char>(SER_NUMBER);
+				out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+			}
+			break;
+
+		case LUA_TSTRING:
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, idx, &len);
+			if (len >= WINLUA_SERIALIZE_MINREF && encode_ref(E, idx))
+			{
+				break;
+			}
+			out += static_cast<char>(SER_STRING);
+			put_varint(out, len);
+			out.append(s, len);
+		}
+		break;
+
+		case LUA_TTABLE:
+		{
+			if (encode_ref(E, idx))
+			{
+				break;
+			}
+			if (depth >= WINLUA_SERIALIZE_MAXDEPTH)
+			{
+				luaL_error(L, "table nested too deeply to serialize");
+			}
+			luaL_checkstack(L, 4, "table nested too deeply to serialize");
+
+			/* the array part is everything up to the border; the rest are pairs */
+			lua_Integer narr = static_cast<lua_Integer>(lua_rawlen(L, idx));
+			unsigned long long npairs = 0;
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0)
+			{
+				lua_pop(L, 1);
+				if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1 || lua_tointeger(L, -1) > narr)
+				{
+					npairs++;
+				}
+			}
+
+			out += static_cast<char>(SER_TABLE);
+			put_varint(out, static_cast<unsigned long long>(narr));
+			put_varint(out, npairs);
+
+			for (lua_Integer i = 1; i <= narr; i++)
+			{
+				lua_rawgeti(L, idx, i);
+				encode_value(E, lua_gettop(L), depth + 1);
+				lua_pop(L, 1);
+			}
+
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0)
+			{
+				if (!lua_isinteger(L, -2) || lua_tointeger(L, -2) < 1 || lua_tointeger(L, -2) > narr)
+				{
+					int top = lua_gettop(L);
+					encode_value(E, top - 1, depth + 1);
+					encode_value(E, top, depth + 1);
+				}
+				lua_pop(L, 1); // pop value, keep key for next iteration
+			}
+		}
+		break;
+
+		case LUA_TUSERDATA:
+			if (E->udata != NULL)
+			{
+				size_t mark = out.size();
+				out += static_cast<char>(SER_USERDATA);
+				if (E->udata->encode(L, idx, out, E->udata->ud))
+				{
+					break;
+				}
+				out.resize(mark);
+			}
+			/* fallthrough */
+
+		default:
+			luaL_error(L, "cannot serialize a %s value", luaL_typename(L, idx));
+			break;
+	}
+}
+
+/*
+Append the encoding of the value at idx to 'out'.
+*/
+void winlua_serialize(lua_State *L, int idx, std::string& out, const WinLuaSerializeUdata *udata)
+{
+	idx = lua_absindex(L, idx);
+	lua_newtable(L);
+
+	WinLuaEncoder E = { L, &out, lua_gettop(L), 0, udata };
+	encode_value(&E, idx, 0);
+	lua_pop(L, 1); // pop table of seen values
+}
+
+/* ------------------------------------------------------------
+Decoding
+------------------------------------------------------------ */
+
+static const char *get_varint(WinLuaDecoder *D, const char *p, unsigned long long& v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (p >= D->end)
+		{
+			break;
+		}
+		unsigned char c = static_cast<unsigned char>(*p++);
+		v |= static_cast<unsigned long long>(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+		{
+			return p;
+		}
+	}
+	luaL_error(D->L, "corrupt serialized data (bad varint)");
+	return p;
+}
+
+static void decode_register(WinLuaDecoder *D)
+{
+	lua_pushvalue(D->L, -1);
+	lua_rawseti(D->L, D->refs, ++D->nrefs);
+}
+
+static const char *decode_value(WinLuaDecoder *D, const char *p, int depth)
+{
+	lua_State *L = D->L;
+	if (p >= D->end)
+	{
+		luaL_error(L, "corrupt serialized data (truncated)");
+	}
+
+	unsigned long long v;
+	switch (*p++)
+	{
+		case SER_NIL: lua_pushnil(L); break;
+		case SER_FALSE: lua_pushboolean(L, 0); break;
+		case SER_TRUE: lua_pushboolean(L, 1); break;
+
+		case SER_INTEGER:
+			p = get_varint(D, p, v);
+			lua_pushinteger(L, static_cast<lua_Integer>((v >> 1) ^ (0ULL - (v & 1))));
+			break;
+
+		case SER_NUMBER:
+		{
+			double n;
+			if (static_cast<size_t>(D->end - p) < sizeof(n))
+			{
+				luaL_error(L, "corrupt serialized data (truncated)");
+			}
+			memcpy(&n, p, sizeof(n));
+			lua_pushnumber(L, static_cast<lua_Number>(n));
+			p += sizeof(n);
+		}
+		break;
+
+		case SER_STRING:
+			p = get_varint(D, p, v);
+			if (v > static_cast<unsigned long long>(D->end - p))
+			{
+				luaL_error(L, "corrupt serialized data (truncated)");
+			}
+			lua_pushlstring(L, p, static_cast<size_t>(v));
+			p += v;
+			if (v >= WINLUA_SERIALIZE_MINREF)
+			{
+				decode_register(D);
+			}
+			break;
+
+		case SER_TABLE:
+		{
+			unsigned long long narr, npairs;
+			p = get_varint(D, p, narr);
+			p = get_varint(D, p, npairs);
+			/* every value takes at least one byte, which bounds the presizing */
+			unsigned long long left = static_cast<unsigned long long>(D->end - p);
+			if (narr > left || npairs > left / 2)
+			{
+				luaL_error(L, "corrupt serialized data (bad table size)");
+			}
+			if (depth >= WINLUA_SERIALIZE_MAXDEPTH)
+			{
+				luaL_error(L, "serialized data nested too deeply");
+			}
+			luaL_checkstack(L, 4, "serialized data nested too deeply");
+
+			lua_createtable(L, static_cast<int>(narr), static_cast<int>(npairs));
+			decode_register(D);
+			for (unsigned long long i = 1; i <= narr; i++)
+			{
+				p = decode_value(D, p, depth + 1);
+				lua_rawseti(L, -2, static_cast<lua_Integer>(i));
+			}
+			for (unsigned long long i = 0; i < npairs; i++)
+			{
+				p = decode_value(D, p, depth + 1);
+				if (lua_isnil(L, -1))
+				{
+					luaL_error(L, "corrupt serialized data (nil key)");
+				}
+				p = decode_value(D, p, depth + 1);
+				lua_rawset(L, -3);
+			}
+		}
+		break;
+
+		case SER_REF:
+			p = get_varint(D, p, v);
+			if (v == 0 || v > static_cast<unsigned long long>(D->nrefs))
+			{
+				luaL_error(L, "corrupt serialized data (bad reference)");
+			}
+			lua_rawgeti(L, D->refs, static_cast<lua_Integer>(v));
+			break;
+
+		case SER_USERDATA:
+			if (D->udata == NULL)
+			{
+				luaL_error(L, "serialized data contains userdata");
+			}
+			p = D->udata->decode(L, p, D->end, D->udata->ud);
+			break;
+
+		default:
+			luaL_error(L, "corrupt serialized data (tag %d)", static_cast<unsigned char>(p[-1]));
+			break;
+	}
+	return p;
+}
+
+/*
+Push the value encoded at p and return the position after it.
+*/
+const char *winlua_deserialize(lua_State *L, const char *p, const char *end, const WinLuaSerializeUdata *udata)
+{
+	lua_newtable(L);
+
+	WinLuaDecoder D = { L, end, lua_gettop(L), 0, udata };
+	p = decode_value(&D, p, 0);
+	lua_remove(L, -2); // pop table of references
+	return p;
+}
+
+/* ------------------------------------------------------------
+Serializer module functions
+------------------------------------------------------------ */
+
+/* the output buffer lives in a userdata so it is released if encoding raises an error */
+static int buffer__gc(lua_State *L)
+{
+	std::string *buffer = static_cast<std::string*>(luaL_checkudata(L, 1, WINLUA_SERIALIZE_BUFFER_META));
+	buffer->~basic_string();
+	return 0;
+}
+
+static int serialize_encode(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+
+	std::string *buffer = new (lua_newuserdata(L, sizeof(std::string))) std::string();
+	luaL_setmetatable(L, WINLUA_SERIALIZE_BUFFER_META);
+
+	winlua_serialize(L, 1, *buffer);
+	lua_pushlstring(L, buffer->data(), buffer->size());
+	return 1;
+}
+
+static int serialize_decode(lua_State *L)
+{
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+
+	const char *end = winlua_deserialize(L, data, data + len);
+	if (end != data + len)
+	{
+		return luaL_error(L, "corrupt serialized data (trailing bytes)");
+	}
+	return 1;
+}
+
+/* ------------------------------------------------------------
+WinLua Serializer module
+------------------------------------------------------------ */
+
+static const luaL_Reg library_methods[] = {
+	{"encode", serialize_encode},
+	{"decode", serialize_decode},
+	{NULL, NULL}
+};
+
+int luaopen_serialize(lua_State *L)
+{
+	luaL_newmetatable(L, WINLUA_SERIALIZE_BUFFER_META);
+	lua_pushcfunction(L, buffer__gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, library_methods);
+	return 1;
+}
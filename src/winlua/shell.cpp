@@ -13,7 +13,8 @@ WinLua Shell functions
 static int shell_displayname(lua_State *L)
 {
 	const char *path = luaL_checkstring(L, 1);
-	wchar_t *pathW = utf8_to_wstring(L, path);
+	WinLuaScratch scratch(L);
+	wchar_t *pathW = scratch.wstring(path);
 
 	SHFILEINFOW sfi;
 	DWORD_PTR ret = SHGetFileInfoW(pathW, 0, &sfi, sizeof(sfi), SHGFI_DISPLAYNAME);
@@ -29,7 +30,8 @@ static int shell_displayname(lua_State *L)
 static int shell_filetype(lua_State *L)
 {
 	const char *path = luaL_checkstring(L, 1);
-	wchar_t *pathW = utf8_to_wstring(L, path);
+	WinLuaScratch scratch(L);
+	wchar_t *pathW = scratch.wstring(path);
 
 	SHFILEINFOW sfi;
 	DWORD_PTR ret = SHGetFileInfoW(pathW, 0, &sfi, sizeof(sfi), SHGFI_TYPENAME);
@@ -59,6 +61,7 @@ static int shell_shldisp_filerun(lua_State *L)
 
 static int shell_shldisp_open(lua_State *L)
 {
+	WinLuaScratch scratch(L);
 	VARIANT vDir;
 	VariantInit(&vDir);
 
@@ -73,7 +76,7 @@ static int shell_shldisp_open(lua_State *L)
 		const char *path = luaL_checkstring(L, 1);
 
 		vDir.vt = VT_BSTR;
-		vDir.bstrVal = utf8_to_wstring(L, path);
+		vDir.bstrVal = scratch.wstring(path);
 	}
 
 	IShellDispatch *shell = NULL;
@@ -0,0 +1,911 @@
+#include "winlua.hpp"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#else
+#include <dirent.h>
+#endif
+#endif
+
+/* ------------------------------------------------------------
+WinLua Tree Snapshots
+
+	fs.snapshot(root, file [, options])  -> entries, or nil, message, code
+	fs.diff(file, root [, options])      -> changes, or nil, message, code
+
+fs.snapshot records every entry below 'root' (path, type, size,
+modification time and, with options.hash, a digest of each file)
+in an index file. fs.diff compares a tree with such an index:
+
+	local c = assert(fs.diff("site.snap", "D:\\site", {save = "site.snap"}))
+	for _, p in ipairs(c.modified) do upload(p) end
+
+'changes' holds lists of the paths that were added, removed and
+modified, relative to the root with '/' separators, and in
+'errors' {path = ..., error = code} for directories that could not
+be read (their old entries are kept). Added and removed
+directories are listed along with everything they held.
+
+A file counts as modified when its size or modification time
+changed; when the index has digests, only files whose metadata
+changed are hashed again, and those with the same content after
+all are not reported. options:
+
+	hash   (fs.snapshot) "crc32c", "xxh3" or "sha256" to store digests
+	save   (fs.diff) write the index of the current tree to this file,
+	       which may be the index being compared
+	trust  (fs.diff) take a directory whose modification time did not
+	       change to hold the same names as before: it is not listed and
+	       its files are not looked at again, only its subdirectories.
+	       Right for trees whose files are replaced rather than
+	       rewritten in place (most sync and build tools), as rewriting
+	       a file does not touch its directory.
+
+The index is a flat file meant to be mapped, not parsed: a header,
+one fixed-size record per entry sorted by path (so a directory's
+subtree follows it and a directory record knows where its subtree
+ends), the digests, then the path text. Directory listings come
+from FindFirstFileExW on Windows and getdents64 with fstatat on
+Linux.
+------------------------------------------------------------ */
+#define WINLUA_SNAPSHOT_MAGIC "WLSNAP1"
+#define WINLUA_SNAPSHOT_VERSION 1
+
+#ifdef _WIN32
+#define SNAP_SEP "\\"
+#else
+#define SNAP_SEP "/"
+#endif
+
+/* on-disk layout, native byte order */
+struct SnapHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t digest; /* bytes per digest, 0 without digests */
+	uint64_t count;
+	uint64_t names; /* bytes of path text */
+	int64_t root_mtime;
+	char algo[8];
+};
+
+struct SnapRecord
+{
+	uint64_t size;
+	int64_t mtime; /* nanoseconds since the epoch */
+	uint32_t name, len; /* path in the text block */
+	uint32_t next; /* for directories, the first record after the subtree */
+	uint8_t type; /* 'f', 'd', 'l' or 'o' */
+	uint8_t pad[3];
+};
+
+/* the index being compared against, mapped read-only */
+struct SnapIndex
+{
+	const SnapRecord *records;
+	const unsigned char *digests;
+	const char *names;
+	size_t count, digest;
+	int64_t root_mtime;
+	int algo;
+
+	void *base;
+	size_t mapped;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+
+	SnapIndex() : records(NULL), digests(NULL), names(NULL), count(0), digest(0), root_mtime(0), algo(-1), base(NULL), mapped(0) {}
+};
+
+/* an entry of the current tree, in index order */
+struct SnapEntry
+{
+	std::string path;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t next;
+	char type;
+	int state; /* SNAP_ADDED, SNAP_SAME, SNAP_CHANGED */
+	size_t old; /* record in the old index for SNAP_SAME and SNAP_CHANGED */
+};
+
+enum { SNAP_ADDED, SNAP_SAME, SNAP_CHANGED };
+
+struct SnapChild
+{
+	std::string name;
+	uint64_t size;
+	int64_t mtime;
+	char type;
+};
+
+struct SnapError
+{
+	std::string path;
+	int error;
+};
+
+struct SnapScan
+{
+	std::string root;
+	const SnapIndex *old;
+	bool trust;
+
+	std::vector<SnapEntry> entries;
+	std::vector<size_t> removed; /* old records */
+	std::vector<SnapError> errors;
+};
+
+/* ------------------------------------------------------------
+Listing directories
+------------------------------------------------------------ */
+
+static bool child_less(const SnapChild& a, const SnapChild& b)
+{
+	return a.name < b.name;
+}
+
+static std::string snap_path(const SnapScan& scan, const std::string& rel)
+{
+	return rel.empty() ? scan.root : scan.root + SNAP_SEP + rel;
+}
+
+#ifdef _WIN32
+
+static int64_t filetime_ns(const FILETIME& ft)
+{
+	uint64_t t = (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+	return (static_cast<int64_t>(t) - 116444736000000000LL) * 100;
+}
+
+static void snap_wide(const std::string& path, const char *suffix, std::vector<uint16_t>& out)
+{
+	size_t len = path.size(), extra = strlen(suffix);
+	out.resize(len + extra + 1);
+	size_t n = winlua_utf8_to_utf16(path.data(), len, &out[0]);
+	n += winlua_utf8_to_utf16(suffix, extra, &out[n]);
+	out[n] = 0;
+}
+
+static char attr_type(DWORD attr)
+{
+	if (attr & FILE_ATTRIBUTE_REPARSE_POINT) { return 'l'; }
+	return (attr & FILE_ATTRIBUTE_DIRECTORY) ? 'd' : 'f';
+}
+
+/* type and time of one path; false when it cannot be looked up */
+static bool snap_stat(const std::string& path, char *type, int64_t *mtime, int *err)
+{
+	std::vector<uint16_t> pathW;
+	snap_wide(path, "", pathW);
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (GetFileAttributesExW(reinterpret_cast<LPCWSTR>(&pathW[0]), GetFileExInfoStandard, &data) == 0)
+	{
+		*err = static_cast<int>(GetLastError());
+		return false;
+	}
+	*type = attr_type(data.dwFileAttributes);
+	*mtime = filetime_ns(data.ftLastWriteTime);
+	return true;
+}
+
+static int snap_list(const std::string& path, std::vector<SnapChild>& children)
+{
+	std::vector<uint16_t> specW;
+	snap_wide(path, "\\*", specW);
+	WIN32_FIND_DATAW data;
+	HANDLE handle = FindFirstFileExW(reinterpret_cast<LPCWSTR>(&specW[0]), FindExInfoBasic, &data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		DWORD err = GetLastError();
+		return (err == ERROR_FILE_NOT_FOUND) ? 0 : static_cast<int>(err);
+	}
+
+	std::vector<char> name;
+	do
+	{
+		const uint16_t *nameW = reinterpret_cast<const uint16_t*>(data.cFileName);
+		if (nameW[0] == '.' && (nameW[1] == 0 || (nameW[1] == '.' && nameW[2] == 0))) { continue; }
+		size_t len = 0;
+		while (nameW[len]) { len++; }
+		name.resize(3 * len + 1);
+		len = winlua_utf16_to_utf8(nameW, len, &name[0]);
+
+		children.push_back(SnapChild());
+		SnapChild& c = children.back();
+		c.name.assign(&name[0], len);
+		c.type = attr_type(data.dwFileAttributes);
+		c.size = (c.type == 'f') ? (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow : 0;
+		c.mtime = filetime_ns(data.ftLastWriteTime);
+	}
+	while (FindNextFileW(handle, &data));
+	FindClose(handle);
+	return 0;
+}
+
+#else
+
+static char mode_type(mode_t mode)
+{
+	if (S_ISREG(mode)) { return 'f'; }
+	if (S_ISDIR(mode)) { return 'd'; }
+	if (S_ISLNK(mode)) { return 'l'; }
+	return 'o';
+}
+
+static int64_t stat_ns(const struct stat& st)
+{
+#ifdef __linux__
+	return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	return static_cast<int64_t>(st.st_mtime) * 1000000000;
+#endif
+}
+
+static bool snap_stat(const std::string& path, char *type, int64_t *mtime, int *err)
+{
+	struct stat st;
+	if (lstat(path.c_str(), &st) != 0)
+	{
+		*err = errno;
+		return false;
+	}
+	*type = mode_type(st.st_mode);
+	*mtime = stat_ns(st);
+	return true;
+}
+
+static void snap_child(std::vector<SnapChild>& children, int fd, const char *name)
+{
+	if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) { return; }
+	struct stat st;
+	if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) { return; } /* gone since it was listed */
+	children.push_back(SnapChild());
+	SnapChild& c = children.back();
+	c.name = name;
+	c.type = mode_type(st.st_mode);
+	c.size = (c.type == 'f') ? static_cast<uint64_t>(st.st_size) : 0;
+	c.mtime = stat_ns(st);
+}
+
+#ifdef __linux__
+/* the kernel's record layout for getdents64 */
+struct snap_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
+static int snap_list(const std::string& path, std::vector<SnapChild>& children)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) { return errno; }
+	int err = 0;
+#ifdef __linux__
+	union { char bytes[32 * 1024]; uint64_t align; } buffer;
+	for (;;)
+	{
+		long n = syscall(SYS_getdents64, fd, buffer.bytes, sizeof(buffer.bytes));
+		if (n <= 0)
+		{
+			if (n < 0) { err = errno; }
+			break;
+		}
+		for (long offset = 0; offset < n;)
+		{
+			const snap_dirent64 *d = reinterpret_cast<const snap_dirent64*>(buffer.bytes + offset);
+			snap_child(children, fd, d->d_name);
+			offset += d->d_reclen;
+		}
+	}
+	close(fd);
+#else
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL)
+	{
+		err = errno;
+		close(fd);
+		return err;
+	}
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		snap_child(children, dirfd(dir), d->d_name);
+	}
+	closedir(dir);
+#endif
+	return err;
+}
+
+#endif
+
+/* ------------------------------------------------------------
+Comparing a directory with its old records
+------------------------------------------------------------ */
+
+/* the record after 'i' and everything below it */
+static size_t skip_record(const SnapIndex& old, size_t i)
+{
+	return (old.records[i].type == 'd') ? old.records[i].next : i + 1;
+}
+
+/* name of old record 'i' below a directory whose path is 'prefix' bytes long */
+static std::string old_name(const SnapIndex& old, size_t i, size_t prefix)
+{
+	const SnapRecord& r = old.records[i];
+	size_t skip = prefix == 0 ? 0 : prefix + 1;
+	return std::string(old.names + r.name + skip, r.len - skip);
+}
+
+/* old record 'i' against a current name, as std::string::compare would order them */
+static int compare_name(const SnapIndex& old, size_t i, size_t prefix, const std::string& name)
+{
+	const SnapRecord& r = old.records[i];
+	size_t skip = prefix == 0 ? 0 : prefix + 1;
+	size_t len = r.len - skip, n = std::min(len, name.size());
+	int cmp = memcmp(old.names + r.name + skip, name.data(), n);
+	if (cmp != 0) { return cmp; }
+	return (len < name.size()) ? -1 : (len > name.size()) ? 1 : 0;
+}
+
+static void remove_subtree(SnapScan& scan, size_t i)
+{
+	for (size_t end = skip_record(*scan.old, i); i < end; i++)
+	{
+		scan.removed.push_back(i);
+	}
+}
+
+/*
+the children of an unchanged directory, rebuilt from the old records; with
+'probe', subdirectories are looked up and false means something no longer
+fits, so the directory has to be listed after all.
+*/
+static bool old_children(SnapScan& scan, const std::string& rel, size_t lo, size_t hi, bool probe, std::vector<SnapChild>& children)
+{
+	const SnapIndex& old = *scan.old;
+	for (size_t i = lo; i < hi; i = skip_record(old, i))
+	{
+		const SnapRecord& r = old.records[i];
+		children.push_back(SnapChild());
+		SnapChild& c = children.back();
+		c.name = old_name(old, i, rel.size());
+		c.type = static_cast<char>(r.type);
+		c.size = r.size;
+		c.mtime = r.mtime;
+		if (probe && c.type == 'd')
+		{
+			int err;
+			std::string path = rel.empty() ? c.name : rel + "/" + c.name;
+			if (!snap_stat(snap_path(scan, path), &c.type, &c.mtime, &err) || c.type != 'd') { return false; }
+		}
+	}
+	return true;
+}
+
+static void scan_dir(SnapScan& scan, const std::string& rel, size_t lo, size_t hi, bool unchanged)
+{
+	const SnapIndex& old = *scan.old;
+	std::vector<SnapChild> children;
+	if (!(unchanged && scan.trust && old_children(scan, rel, lo, hi, true, children)))
+	{
+		children.clear();
+		int err = snap_list(snap_path(scan, rel), children);
+		if (err != 0)
+		{
+			/* keep what the old index knew rather than report it all removed */
+			SnapError e;
+			e.path = rel;
+			e.error = err;
+			scan.errors.push_back(e);
+			children.clear();
+			old_children(scan, rel, lo, hi, false, children);
+		}
+		std::sort(children.begin(), children.end(), child_less);
+	}
+
+	size_t i = lo;
+	for (size_t k = 0; k < children.size(); k++)
+	{
+		SnapChild& c = children[k];
+
+		/* old entries that sort before this one are gone */
+		int cmp = 1;
+		while (i < hi)
+		{
+			cmp = compare_name(old, i, rel.size(), c.name);
+			if (cmp >= 0) { break; }
+			remove_subtree(scan, i);
+			i = skip_record(old, i);
+		}
+		bool found = i < hi && cmp == 0 && old.records[i].type == static_cast<uint8_t>(c.type);
+		if (i < hi && cmp == 0 && !found)
+		{
+			/* same name, different type: the old entry went away */
+			remove_subtree(scan, i);
+			i = skip_record(old, i);
+		}
+
+		size_t index = scan.entries.size();
+		scan.entries.push_back(SnapEntry());
+		SnapEntry& e = scan.entries.back();
+		e.path = rel.empty() ? c.name : rel + "/" + c.name;
+		e.size = c.size;
+		e.mtime = c.mtime;
+		e.type = c.type;
+		e.next = 0;
+		e.state = SNAP_ADDED;
+		e.old = 0;
+		if (found)
+		{
+			const SnapRecord& r = old.records[i];
+			e.old = i;
+			e.state = (c.type == 'd' || (r.size == c.size && r.mtime == c.mtime)) ? SNAP_SAME : SNAP_CHANGED;
+		}
+
+		if (c.type == 'd')
+		{
+			std::string path = e.path;
+			if (found)
+			{
+				scan_dir(scan, path, i + 1, old.records[i].next, old.records[i].mtime == c.mtime);
+			}
+			else
+			{
+				scan_dir(scan, path, 0, 0, false);
+			}
+			scan.entries[index].next = static_cast<uint32_t>(scan.entries.size());
+		}
+		if (found) { i = skip_record(old, i); }
+	}
+	for (; i < hi; i = skip_record(old, i))
+	{
+		remove_subtree(scan, i);
+	}
+}
+
+/* ------------------------------------------------------------
+Hashing what changed
+------------------------------------------------------------ */
+
+struct SnapHashing
+{
+	const SnapScan *scan;
+	std::vector<size_t> files; /* entries to hash */
+	std::vector<unsigned char> *digests;
+	int algo;
+	size_t size;
+};
+
+static void hash_range(void *ud, size_t begin, size_t end)
+{
+	SnapHashing *h = static_cast<SnapHashing*>(ud);
+	for (size_t i = begin; i < end; i++)
+	{
+		const SnapEntry& e = h->scan->entries[h->files[i]];
+		std::string path = snap_path(*h->scan, e.path);
+		unsigned char *digest = &(*h->digests)[h->files[i] * h->size];
+		if (winlua_hash_file(path.c_str(), path.size(), h->algo, digest) != 0)
+		{
+			memset(digest, 0, h->size);
+		}
+	}
+}
+
+/* fill in the digests, reusing the old ones for unchanged files; changed files with the old content become SNAP_SAME */
+static void scan_digests(SnapScan& scan, int algo, std::vector<unsigned char>& digests)
+{
+	if (algo < 0) { return; }
+	const SnapIndex& old = *scan.old;
+	size_t size = winlua_hash_size(algo);
+	digests.assign(scan.entries.size() * size, 0);
+
+	SnapHashing h;
+	h.scan = &scan;
+	h.digests = &digests;
+	h.algo = algo;
+	h.size = size;
+	for (size_t i = 0; i < scan.entries.size(); i++)
+	{
+		const SnapEntry& e = scan.entries[i];
+		if (e.type != 'f') { continue; }
+		if (e.state == SNAP_SAME && old.algo == algo)
+		{
+			memcpy(&digests[i * size], old.digests + e.old * size, size);
+		}
+		else
+		{
+			h.files.push_back(i);
+		}
+	}
+	winlua_parallel_for(h.files.size(), 1, hash_range, &h);
+
+	for (size_t k = 0; k < h.files.size(); k++)
+	{
+		SnapEntry& e = scan.entries[h.files[k]];
+		if (e.state == SNAP_CHANGED && old.algo == algo && memcmp(&digests[h.files[k] * size], old.digests + e.old * size, size) == 0)
+		{
+			e.state = SNAP_SAME;
+		}
+	}
+}
+
+/* ------------------------------------------------------------
+Index files
+------------------------------------------------------------ */
+
+static void index_close(SnapIndex& index)
+{
+	if (index.base != NULL)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(index.base);
+		CloseHandle(index.mapping);
+#else
+		munmap(index.base, index.mapped);
+#endif
+		index.base = NULL;
+	}
+}
+
+static bool index_valid(SnapIndex& index, const unsigned char *p, size_t size)
+{
+	if (size < sizeof(SnapHeader)) { return false; }
+	SnapHeader header;
+	memcpy(&header, p, sizeof(header));
+	if (memcmp(header.magic, WINLUA_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != WINLUA_SNAPSHOT_VERSION) { return false; }
+
+	header.algo[sizeof(header.algo) - 1] = '\0';
+	index.algo = header.digest ? winlua_hash_algorithm(header.algo) : -1;
+	if (header.digest != 0 && (index.algo < 0 || header.digest != winlua_hash_size(index.algo))) { return false; }
+
+	uint64_t room = size - sizeof(SnapHeader);
+	uint64_t per = sizeof(SnapRecord) + header.digest;
+	if (header.count > room / per || header.names != room - header.count * per || header.count >= 0xffffffffu) { return false; }
+
+	index.count = static_cast<size_t>(header.count);
+	index.digest = header.digest;
+	index.root_mtime = header.root_mtime;
+	index.records = reinterpret_cast<const SnapRecord*>(p + sizeof(SnapHeader));
+	index.digests = p + sizeof(SnapHeader) + index.count * sizeof(SnapRecord);
+	index.names = reinterpret_cast<const char*>(index.digests + index.count * index.digest);
+	for (size_t i = 0; i < index.count; i++)
+	{
+		const SnapRecord& r = index.records[i];
+		if (static_cast<uint64_t>(r.name) + r.len > header.names) { return false; }
+		if (r.type == 'd' && (r.next <= i || r.next > index.count)) { return false; }
+	}
+	return true;
+}
+
+/* map an index file; 0, the system error code, or -1 when it is not an index */
+static int index_open(SnapIndex& index, const char *path)
+{
+#ifdef _WIN32
+	std::vector<uint16_t> pathW;
+	snap_wide(path, "", pathW);
+	HANDLE file = CreateFileW(reinterpret_cast<LPCWSTR>(&pathW[0]), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return static_cast<int>(GetLastError()); }
+	LARGE_INTEGER filesize;
+	if (GetFileSizeEx(file, &filesize) == 0)
+	{
+		DWORD err = GetLastError();
+		CloseHandle(file);
+		return static_cast<int>(err);
+	}
+	size_t size = static_cast<size_t>(filesize.QuadPart);
+	if (size < sizeof(SnapHeader))
+	{
+		CloseHandle(file);
+		return -1;
+	}
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	DWORD err = GetLastError();
+	CloseHandle(file);
+	if (mapping == NULL) { return static_cast<int>(err); }
+	void *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+	if (base == NULL)
+	{
+		err = GetLastError();
+		CloseHandle(mapping);
+		return static_cast<int>(err);
+	}
+	index.mapping = mapping;
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) { return errno; }
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		int err = errno;
+		close(fd);
+		return err;
+	}
+	size_t size = static_cast<size_t>(st.st_size);
+	if (size < sizeof(SnapHeader))
+	{
+		close(fd);
+		return -1;
+	}
+	void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (base == MAP_FAILED) { return err; }
+#endif
+	index.base = base;
+	index.mapped = size;
+	if (!index_valid(index, static_cast<const unsigned char*>(base), size))
+	{
+		index_close(index);
+		return -1;
+	}
+	return 0;
+}
+
+/* write the index of 'scan' to a temporary file and move it over 'path' */
+static int index_save(const SnapScan& scan, int64_t root_mtime, int algo, const std::vector<unsigned char>& digests, const char *path)
+{
+	SnapHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, WINLUA_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = WINLUA_SNAPSHOT_VERSION;
+	header.digest = (algo < 0) ? 0 : static_cast<uint32_t>(winlua_hash_size(algo));
+	header.count = scan.entries.size();
+	header.root_mtime = root_mtime;
+	if (algo >= 0) { strncpy(header.algo, winlua_hash_name(algo), sizeof(header.algo) - 1); }
+
+	std::vector<SnapRecord> records(scan.entries.size());
+	uint64_t names = 0;
+	for (size_t i = 0; i < scan.entries.size(); i++)
+	{
+		const SnapEntry& e = scan.entries[i];
+		SnapRecord& r = records[i];
+		memset(&r, 0, sizeof(r));
+		r.size = e.size;
+		r.mtime = e.mtime;
+		r.name = static_cast<uint32_t>(names);
+		r.len = static_cast<uint32_t>(e.path.size());
+		r.next = e.next;
+		r.type = static_cast<uint8_t>(e.type);
+		names += e.path.size();
+	}
+	if (names > 0xffffffffu) { return EFBIG; }
+	header.names = names;
+
+	std::string temp = std::string(path) + ".tmp";
+#ifdef _WIN32
+	std::vector<uint16_t> tempW;
+	snap_wide(temp, "", tempW);
+	FILE *f = _wfopen(reinterpret_cast<const wchar_t*>(&tempW[0]), L"wb");
+#else
+	FILE *f = fopen(temp.c_str(), "wb");
+#endif
+	if (f == NULL) { return errno; }
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	if (ok && !records.empty()) { ok = fwrite(&records[0], sizeof(SnapRecord), records.size(), f) == records.size(); }
+	if (ok && !digests.empty()) { ok = fwrite(&digests[0], 1, digests.size(), f) == digests.size(); }
+	for (size_t i = 0; ok && i < scan.entries.size(); i++)
+	{
+		const std::string& p = scan.entries[i].path;
+		ok = fwrite(p.data(), 1, p.size(), f) == p.size();
+	}
+	int err = ok ? 0 : errno;
+	if (fclose(f) != 0 && err == 0) { err = errno; }
+	if (err == 0 && !ok) { err = EIO; }
+#ifdef _WIN32
+	if (err == 0)
+	{
+		std::vector<uint16_t> pathW;
+		snap_wide(path, "", pathW);
+		if (MoveFileExW(reinterpret_cast<LPCWSTR>(&tempW[0]), reinterpret_cast<LPCWSTR>(&pathW[0]), MOVEFILE_REPLACE_EXISTING) == 0)
+		{
+			err = static_cast<int>(GetLastError());
+		}
+	}
+	if (err != 0) { DeleteFileW(reinterpret_cast<LPCWSTR>(&tempW[0])); }
+#else
+	if (err == 0 && rename(temp.c_str(), path) != 0) { err = errno; }
+	if (err != 0) { remove(temp.c_str()); }
+#endif
+	return err;
+}
+
+/* ------------------------------------------------------------
+fs.snapshot and fs.diff
+------------------------------------------------------------ */
+
+static int push_snapshot_error(lua_State *L, const char *what, const char *path, int err)
+{
+	lua_pushnil(L);
+	if (err < 0)
+	{
+		lua_pushfstring(L, "'%s' is not a snapshot index", path);
+	}
+	else
+	{
+		lua_pushfstring(L, "could not %s '%s' (%d)", what, path, err);
+	}
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+/* scan 'root' against 'old'; the root's own time in 'root_mtime', 0 or an error code */
+static int scan_root(SnapScan& scan, const char *root, int64_t *root_mtime)
+{
+	char type;
+	int err = 0;
+	scan.root = root;
+	while (scan.root.size() > 1 && scan.root[scan.root.size() - 2] != ':' && (scan.root[scan.root.size() - 1] == '/' || scan.root[scan.root.size() - 1] == SNAP_SEP[0]))
+	{
+		scan.root.erase(scan.root.size() - 1);
+	}
+	if (!snap_stat(scan.root, &type, root_mtime, &err)) { return err; }
+#ifdef _WIN32
+	if (type != 'd') { return ERROR_DIRECTORY; }
+#else
+	if (type != 'd') { return ENOTDIR; }
+#endif
+	scan_dir(scan, "", 0, scan.old->count, scan.old->count > 0 && scan.old->root_mtime == *root_mtime);
+	return 0;
+}
+
+static void push_paths(lua_State *L, const char *field, const std::vector<const std::string*>& paths)
+{
+	lua_createtable(L, static_cast<int>(paths.size()), 0);
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		lua_pushlstring(L, paths[i]->data(), paths[i]->size());
+		lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+	}
+	lua_setfield(L, -2, field);
+}
+
+int winlua_fs_snapshot(lua_State *L)
+{
+	const char *root = luaL_checkstring(L, 1);
+	const char *file = luaL_checkstring(L, 2);
+	int algo = -1;
+	if (!lua_isnoneornil(L, 3))
+	{
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "hash");
+		if (!lua_isnil(L, -1))
+		{
+			algo = winlua_hash_algorithm(luaL_checkstring(L, -1));
+			luaL_argcheck(L, algo >= 0, 3, "'hash' must be \"crc32c\", \"xxh3\" or \"sha256\"");
+		}
+		lua_pop(L, 1);
+	}
+
+	int err;
+	const char *what = "scan", *subject = root;
+	size_t count = 0;
+	{
+		SnapIndex none;
+		SnapScan scan;
+		scan.old = &none;
+		scan.trust = false;
+		int64_t root_mtime;
+		err = scan_root(scan, root, &root_mtime);
+		if (err == 0)
+		{
+			std::vector<unsigned char> digests;
+			scan_digests(scan, algo, digests);
+			what = "write";
+			subject = file;
+			err = index_save(scan, root_mtime, algo, digests, file);
+			count = scan.entries.size();
+		}
+	}
+	if (err != 0)
+	{
+		return push_snapshot_error(L, what, subject, err);
+	}
+	lua_pushinteger(L, static_cast<lua_Integer>(count));
+	return 1;
+}
+
+int winlua_fs_diff(lua_State *L)
+{
+	const char *file = luaL_checkstring(L, 1);
+	const char *root = luaL_checkstring(L, 2);
+	const char *save = NULL;
+	bool trust = false;
+	if (!lua_isnoneornil(L, 3))
+	{
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "save");
+		save = lua_isnil(L, -1) ? NULL : luaL_checkstring(L, -1); /* anchored by the options table */
+		lua_getfield(L, 3, "trust");
+		trust = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 2);
+	}
+
+	int err;
+	const char *what = "read", *subject = file;
+	{
+		SnapIndex old;
+		err = index_open(old, file);
+		if (err == 0)
+		{
+			SnapScan scan;
+			scan.old = &old;
+			scan.trust = trust;
+			int64_t root_mtime;
+			what = "scan";
+			subject = root;
+			err = scan_root(scan, root, &root_mtime);
+			if (err == 0)
+			{
+				std::vector<unsigned char> digests;
+				scan_digests(scan, old.algo, digests);
+
+				std::vector<const std::string*> added, modified, removed;
+				std::vector<std::string> removed_paths(scan.removed.size());
+				for (size_t i = 0; i < scan.entries.size(); i++)
+				{
+					if (scan.entries[i].state == SNAP_ADDED) { added.push_back(&scan.entries[i].path); }
+					else if (scan.entries[i].state == SNAP_CHANGED) { modified.push_back(&scan.entries[i].path); }
+				}
+				for (size_t i = 0; i < scan.removed.size(); i++)
+				{
+					const SnapRecord& r = old.records[scan.removed[i]];
+					removed_paths[i].assign(old.names + r.name, r.len);
+					removed.push_back(&removed_paths[i]);
+				}
+
+				/* the old index may be the file being replaced */
+				index_close(old);
+				if (save != NULL)
+				{
+					what = "write";
+					subject = save;
+					err = index_save(scan, root_mtime, old.algo, digests, save);
+				}
+				if (err == 0)
+				{
+					lua_createtable(L, 0, 4);
+					push_paths(L, "added", added);
+					push_paths(L, "removed", removed);
+					push_paths(L, "modified", modified);
+					lua_createtable(L, static_cast<int>(scan.errors.size()), 0);
+					for (size_t i = 0; i < scan.errors.size(); i++)
+					{
+						lua_createtable(L, 0, 2);
+						lua_pushlstring(L, scan.errors[i].path.data(), scan.errors[i].path.size());
+						lua_setfield(L, -2, "path");
+						lua_pushinteger(L, scan.errors[i].error);
+						lua_setfield(L, -2, "error");
+						lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+					}
+					lua_setfield(L, -2, "errors");
+				}
+			}
+		}
+		index_close(old);
+	}
+	if (err != 0)
+	{
+		return push_snapshot_error(L, what, subject, err);
+	}
+	return 1;
+}
@@ -0,0 +1,1203 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+/* ------------------------------------------------------------
+WinLua Process Spawning
+
+	os.spawn{cmd, args = {...}, env = {...}, cwd = dir}  -> process, or nil, message, code
+	os.run_all(jobs [, concurrency])                      -> results
+
+os.spawn starts a program directly (CreateProcessW, posix_spawnp),
+without a shell. The program is looked up on the PATH; its
+arguments are 'args', or the table's array items after 'cmd'
+(os.spawn{"git", "status"}). 'env' names variables to set in the
+child's copy of the environment, false removing one, or is a
+complete environment from os.environ_block. The child's
+stdin is the null device; stdout and stderr come back through
+separate pipes read 64 KiB at a time:
+
+	process:read([timeout])  -> "stdout" or "stderr", chunk; nil once
+	                            both streams are closed, false after
+	                            'timeout' milliseconds without output
+	process:wait()           -> exit code, stdout, stderr (what was not
+	                            read yet)
+	process:kill()           -> true, or nil, message, code
+	process:pid()            -> process id
+
+os.run_all runs a list of os.spawn tables, keeping 'concurrency'
+children (by default one per core, up to 8) running, and returns
+their results in job order: {code = ..., stdout = ..., stderr = ...},
+or {error = message} for a job that could not be started.
+
+Everything is driven from the calling thread: pipes and exits are
+events on an I/O completion port (named pipes opened for
+overlapped reads; exit waits post to the port) on Windows, and on
+epoll (non-blocking pipes; pidfds) on Linux. A child killed by a
+signal exits with 128 + the signal number, as in a shell.
+------------------------------------------------------------ */
+#define WINLUA_PROCESS_META "WinLuaProcess"
+#define WINLUA_SPAWN_CHUNK 65536
+#define WINLUA_SPAWN_EVENTS 64
+
+enum SpawnKind
+{
+	SPAWN_STDOUT,
+	SPAWN_STDERR,
+	SPAWN_EXIT
+};
+
+struct SpawnChild;
+
+/* a pipe or a process exit that the loop waits on */
+struct SpawnSource
+{
+#ifdef _WIN32
+	OVERLAPPED ov; /* completions hand back this pointer */
+	HANDLE handle; /* pipe, or the exit wait registration */
+	HANDLE port;
+	bool reading;
+#else
+	int fd;        /* pipe, or pidfd */
+	int epfd;
+#endif
+	SpawnChild *child;
+	SpawnKind kind;
+	bool open;
+	std::vector<char> buffer;
+};
+
+struct SpawnChild
+{
+	SpawnSource sources[3];
+#ifdef _WIN32
+	HANDLE process;
+#else
+	pid_t pid;
+#endif
+	unsigned long id;
+	bool exited;
+	lua_Integer code;
+	std::string output[2]; /* collected stdout and stderr */
+	size_t job;
+};
+
+struct SpawnLoop
+{
+#ifdef _WIN32
+	HANDLE port;
+#else
+	int epfd;
+#endif
+};
+
+struct SpawnEvent
+{
+	SpawnSource *source;
+	const char *data; /* valid until the loop is polled again */
+	size_t len;
+};
+
+struct SpawnVar
+{
+	std::string name, value;
+	bool remove;
+};
+
+struct SpawnSpec
+{
+	std::string cmd, cwd;
+	std::vector<std::string> args;
+	std::vector<SpawnVar> env;
+	const void *block; /* from os.environ_block, anchored by the job table */
+	bool has_cwd;
+};
+
+/* process userdata */
+struct WinLuaProcess
+{
+	SpawnLoop *loop;
+	SpawnChild *child;
+};
+
+/* ------------------------------------------------------------
+Job tables
+------------------------------------------------------------ */
+
+static bool is_text(lua_State *L, int idx)
+{
+	int t = lua_type(L, idx);
+	return t == LUA_TSTRING || t == LUA_TNUMBER;
+}
+
+/* NULL when the table at 'idx' is a valid job, or what is wrong with it */
+static const char *check_spec(lua_State *L, int idx)
+{
+	if (lua_type(L, idx) != LUA_TTABLE) { return "table expected"; }
+	idx = lua_absindex(L, idx);
+	const char *problem = NULL;
+
+	lua_pushliteral(L, "cmd");
+	if (lua_rawget(L, idx) == LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		lua_rawgeti(L, idx, 1);
+	}
+	if (!lua_isstring(L, -1)) { problem = "'cmd' must be a string"; }
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "args");
+	int t = lua_rawget(L, idx);
+	if (t == LUA_TTABLE)
+	{
+		for (lua_Integer i = 1, n = static_cast<lua_Integer>(lua_rawlen(L, -1)); i <= n && problem == NULL; i++)
+		{
+			lua_rawgeti(L, -1, i);
+			if (!is_text(L, -1)) { problem = "'args' must be a list of strings"; }
+			lua_pop(L, 1);
+		}
+	}
+	else if (t != LUA_TNIL)
+	{
+		problem = "'args' must be a list of strings";
+	}
+	lua_pop(L, 1);
+	for (lua_Integer i = 1, n = static_cast<lua_Integer>(lua_rawlen(L, idx)); i <= n && problem == NULL; i++)
+	{
+		lua_rawgeti(L, idx, i);
+		if (!is_text(L, -1)) { problem = "arguments must be strings"; }
+		lua_pop(L, 1);
+	}
+
+	lua_pushliteral(L, "env");
+	t = lua_rawget(L, idx);
+	if (t == LUA_TTABLE)
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0)
+		{
+			bool value_ok = is_text(L, -1) || (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1));
+			if (problem == NULL && (lua_type(L, -2) != LUA_TSTRING || !value_ok))
+			{
+				problem = "'env' must map names to strings or false";
+			}
+			lua_pop(L, 1);
+		}
+	}
+	else if (t != LUA_TNIL && winlua_environ_block(L, -1) == NULL)
+	{
+		problem = "'env' must be a table or an environment block";
+	}
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "cwd");
+	t = lua_rawget(L, idx);
+	if (t != LUA_TNIL && t != LUA_TSTRING && problem == NULL) { problem = "'cwd' must be a string"; }
+	lua_pop(L, 1);
+	return problem;
+}
+
+static std::string raw_string(lua_State *L, int idx)
+{
+	size_t len;
+	const char *s = lua_tolstring(L, idx, &len);
+	return std::string(s, len);
+}
+
+/* read a job that passed check_spec */
+static void read_spec(lua_State *L, int idx, SpawnSpec& spec)
+{
+	idx = lua_absindex(L, idx);
+	lua_pushliteral(L, "cmd");
+	bool named = lua_rawget(L, idx) != LUA_TNIL;
+	if (!named)
+	{
+		lua_pop(L, 1);
+		lua_rawgeti(L, idx, 1);
+	}
+	spec.cmd = raw_string(L, -1);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "args");
+	if (lua_rawget(L, idx) == LUA_TTABLE)
+	{
+		for (lua_Integer i = 1, n = static_cast<lua_Integer>(lua_rawlen(L, -1)); i <= n; i++)
+		{
+			lua_rawgeti(L, -1, i);
+			spec.args.push_back(raw_string(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	else
+	{
+		for (lua_Integer i = named ? 1 : 2, n = static_cast<lua_Integer>(lua_rawlen(L, idx)); i <= n; i++)
+		{
+			lua_rawgeti(L, idx, i);
+			spec.args.push_back(raw_string(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "env");
+	spec.block = NULL;
+	if (lua_rawget(L, idx) == LUA_TUSERDATA)
+	{
+		spec.block = winlua_environ_block(L, -1);
+	}
+	else if (lua_istable(L, -1))
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0)
+		{
+			SpawnVar var;
+			var.name = raw_string(L, -2);
+			var.remove = lua_type(L, -1) == LUA_TBOOLEAN;
+			if (!var.remove) { var.value = raw_string(L, -1); }
+			spec.env.push_back(var);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "cwd");
+	spec.has_cwd = lua_rawget(L, idx) == LUA_TSTRING;
+	if (spec.has_cwd) { spec.cwd = raw_string(L, -1); }
+	lua_pop(L, 1);
+}
+
+/* ------------------------------------------------------------
+Environments
+------------------------------------------------------------ */
+
+static size_t var_name_length(const std::string& entry)
+{
+	/* Windows keeps per-drive directories in variables named "=C:" */
+	size_t eq = entry.find('=', 1);
+	return (eq == std::string::npos) ? entry.size() : eq;
+}
+
+static bool same_name(const std::string& entry, const std::string& name)
+{
+	if (var_name_length(entry) != name.size()) { return false; }
+#ifdef _WIN32
+	for (size_t i = 0; i < name.size(); i++)
+	{
+		if (tolower(static_cast<unsigned char>(entry[i])) != tolower(static_cast<unsigned char>(name[i]))) { return false; }
+	}
+	return true;
+#else
+	return entry.compare(0, name.size(), name) == 0;
+#endif
+}
+
+/* "NAME=value" entries of this process, with the job's changes applied */
+static void child_environment(const SpawnSpec& spec, std::vector<std::string>& entries)
+{
+#ifdef _WIN32
+	LPWSTR block = GetEnvironmentStringsW();
+	std::vector<char> entry;
+	for (const uint16_t *p = reinterpret_cast<const uint16_t*>(block); p != NULL && *p; )
+	{
+		size_t len = 0;
+		while (p[len]) { len++; }
+		entry.resize(3 * len + 1);
+		entries.push_back(std::string(&entry[0], winlua_utf16_to_utf8(p, len, &entry[0])));
+		p += len + 1;
+	}
+	if (block != NULL) { FreeEnvironmentStringsW(block); }
+#else
+	for (char **p = environ; *p != NULL; p++)
+	{
+		entries.push_back(*p);
+	}
+#endif
+	for (size_t i = 0; i < spec.env.size(); i++)
+	{
+		const SpawnVar& var = spec.env[i];
+		size_t k = 0;
+		while (k < entries.size() && !same_name(entries[k], var.name)) { k++; }
+		if (var.remove)
+		{
+			if (k < entries.size()) { entries.erase(entries.begin() + k); }
+		}
+		else if (k < entries.size())
+		{
+			entries[k] = var.name + "=" + var.value;
+		}
+		else
+		{
+			entries.push_back(var.name + "=" + var.value);
+		}
+	}
+}
+
+/* ------------------------------------------------------------
+Starting children
+------------------------------------------------------------ */
+
+static void child_init(SpawnChild *c, size_t job)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		SpawnSource& s = c->sources[i];
+#ifdef _WIN32
+		memset(&s.ov, 0, sizeof(s.ov));
+		s.handle = NULL;
+		s.port = NULL;
+		s.reading = false;
+#else
+		s.fd = -1;
+		s.epfd = -1;
+#endif
+		s.child = c;
+		s.kind = static_cast<SpawnKind>(i);
+		s.open = false;
+		if (i != SPAWN_EXIT) { s.buffer.resize(WINLUA_SPAWN_CHUNK); }
+	}
+#ifdef _WIN32
+	c->process = NULL;
+#else
+	c->pid = 0;
+#endif
+	c->id = 0;
+	c->exited = false;
+	c->code = 0;
+	c->job = job;
+}
+
+#ifdef _WIN32
+
+static void quote_arg(std::string& line, const std::string& arg)
+{
+	if (!line.empty()) { line += ' '; }
+	if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos)
+	{
+		line += arg;
+		return;
+	}
+	/* the quoting CommandLineToArgvW and the C runtime undo */
+	line += '"';
+	for (size_t i = 0; ; i++)
+	{
+		size_t slashes = 0;
+		while (i < arg.size() && arg[i] == '\\')
+		{
+			i++;
+			slashes++;
+		}
+		if (i == arg.size())
+		{
+			line.append(slashes * 2, '\\');
+			break;
+		}
+		if (arg[i] == '"')
+		{
+			line.append(slashes * 2 + 1, '\\');
+		}
+		else
+		{
+			line.append(slashes, '\\');
+		}
+		line += arg[i];
+	}
+	line += '"';
+}
+
+static void to_wide(const std::string& s, std::vector<uint16_t>& out)
+{
+	out.resize(s.size() + 1);
+	out[winlua_utf8_to_utf16(s.data(), s.size(), &out[0])] = 0;
+}
+
+static bool env_less(const std::string& a, const std::string& b)
+{
+	size_t n = std::min(var_name_length(a), var_name_length(b));
+	for (size_t i = 0; i < n; i++)
+	{
+		int x = toupper(static_cast<unsigned char>(a[i])), y = toupper(static_cast<unsigned char>(b[i]));
+		if (x != y) { return x < y; }
+	}
+	return var_name_length(a) < var_name_length(b);
+}
+
+static void CALLBACK child_exited(PVOID param, BOOLEAN)
+{
+	SpawnSource *s = static_cast<SpawnSource*>(param);
+	PostQueuedCompletionStatus(s->port, 0, 0, &s->ov);
+}
+
+/* a pipe whose read end is ours (overlapped, on the port) and whose write end the child inherits */
+static DWORD make_pipe(SpawnLoop& loop, SpawnSource& s, HANDLE *child_end)
+{
+	static std::atomic<unsigned long> serial(0);
+	wchar_t name[64];
+	_snwprintf(name, 64, L"\\\\.\\pipe\\winlua-spawn-%lu-%lu", GetCurrentProcessId(), serial++);
+
+	s.handle = CreateNamedPipeW(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 0, WINLUA_SPAWN_CHUNK, 0, NULL);
+	if (s.handle == INVALID_HANDLE_VALUE)
+	{
+		s.handle = NULL;
+		return GetLastError();
+	}
+	s.open = true;
+	if (CreateIoCompletionPort(s.handle, loop.port, 0, 0) == NULL) { return GetLastError(); }
+
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = NULL;
+	sa.bInheritHandle = TRUE;
+	*child_end = CreateFileW(name, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, 0, NULL);
+	return (*child_end == INVALID_HANDLE_VALUE) ? GetLastError() : 0;
+}
+
+static DWORD child_start(SpawnLoop& loop, SpawnChild *c, const SpawnSpec& spec)
+{
+	HANDLE ends[3] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE}; /* stdin, stdout, stderr */
+	DWORD err = make_pipe(loop, c->sources[SPAWN_STDOUT], &ends[1]);
+	if (err == 0) { err = make_pipe(loop, c->sources[SPAWN_STDERR], &ends[2]); }
+	if (err == 0)
+	{
+		SECURITY_ATTRIBUTES sa;
+		sa.nLength = sizeof(sa);
+		sa.lpSecurityDescriptor = NULL;
+		sa.bInheritHandle = TRUE;
+		ends[0] = CreateFileW(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+		if (ends[0] == INVALID_HANDLE_VALUE) { err = GetLastError(); }
+	}
+
+	/* only these three handles go to the child, whatever else is inheritable */
+	SIZE_T size = 0;
+	std::vector<char> attributes;
+	STARTUPINFOEXW si;
+	memset(&si, 0, sizeof(si));
+	if (err == 0)
+	{
+		InitializeProcThreadAttributeList(NULL, 1, 0, &size);
+		attributes.resize(size);
+		si.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(&attributes[0]);
+		if (InitializeProcThreadAttributeList(si.lpAttributeList, 1, 0, &size) == 0)
+		{
+			err = GetLastError();
+			si.lpAttributeList = NULL;
+		}
+		else if (UpdateProcThreadAttribute(si.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, ends, sizeof(ends), NULL, NULL) == 0)
+		{
+			err = GetLastError();
+		}
+	}
+
+	if (err == 0)
+	{
+		std::string line;
+		quote_arg(line, spec.cmd);
+		for (size_t i = 0; i < spec.args.size(); i++) { quote_arg(line, spec.args[i]); }
+		std::vector<uint16_t> lineW, cwdW, envW;
+		to_wide(line, lineW);
+		if (spec.has_cwd) { to_wide(spec.cwd, cwdW); }
+
+		DWORD flags = EXTENDED_STARTUPINFO_PRESENT;
+		LPVOID env = const_cast<void*>(spec.block);
+		if (env != NULL)
+		{
+			flags |= CREATE_UNICODE_ENVIRONMENT;
+		}
+		else if (!spec.env.empty())
+		{
+			/* CreateProcessW wants the block sorted by name */
+			std::vector<std::string> entries;
+			child_environment(spec, entries);
+			std::sort(entries.begin(), entries.end(), env_less);
+			for (size_t i = 0; i < entries.size(); i++)
+			{
+				size_t at = envW.size();
+				envW.resize(at + entries[i].size() + 1);
+				envW.resize(at + winlua_utf8_to_utf16(entries[i].data(), entries[i].size(), &envW[at]));
+				envW.push_back(0);
+			}
+			envW.push_back(0);
+			env = &envW[0];
+			flags |= CREATE_UNICODE_ENVIRONMENT;
+		}
+
+		si.StartupInfo.cb = sizeof(si);
+		si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+		si.StartupInfo.hStdInput = ends[0];
+		si.StartupInfo.hStdOutput = ends[1];
+		si.StartupInfo.hStdError = ends[2];
+		PROCESS_INFORMATION pi;
+		/* CreateProcessW may modify the command line buffer */
+		if (CreateProcessW(NULL, reinterpret_cast<LPWSTR>(&lineW[0]), NULL, NULL, TRUE, flags,
+			env, spec.has_cwd ? reinterpret_cast<LPCWSTR>(&cwdW[0]) : NULL, &si.StartupInfo, &pi) == 0)
+		{
+			err = GetLastError();
+		}
+		else
+		{
+			CloseHandle(pi.hThread);
+			c->process = pi.hProcess;
+			c->id = pi.dwProcessId;
+
+			SpawnSource& s = c->sources[SPAWN_EXIT];
+			s.port = loop.port;
+			s.open = RegisterWaitForSingleObject(&s.handle, pi.hProcess, child_exited, &s, INFINITE, WT_EXECUTEONLYONCE) != 0;
+		}
+	}
+
+	if (si.lpAttributeList != NULL) { DeleteProcThreadAttributeList(si.lpAttributeList); }
+	for (int i = 0; i < 3; i++)
+	{
+		if (ends[i] != INVALID_HANDLE_VALUE) { CloseHandle(ends[i]); }
+	}
+	return err;
+}
+
+#else
+
+static lua_Integer exit_code(int status)
+{
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static int watch_fd(SpawnLoop& loop, SpawnSource& s)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s;
+	s.epfd = loop.epfd;
+	return (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, s.fd, &ev) == 0) ? 0 : errno;
+}
+
+static int child_start(SpawnLoop& loop, SpawnChild *c, const SpawnSpec& spec)
+{
+	int ends[2][2] = {{-1, -1}, {-1, -1}};
+	int err = 0;
+	for (int i = 0; i < 2 && err == 0; i++)
+	{
+		if (pipe2(ends[i], O_CLOEXEC) != 0)
+		{
+			err = errno;
+			break;
+		}
+		SpawnSource& s = c->sources[i];
+		s.fd = ends[i][0];
+		s.open = true;
+		fcntl(s.fd, F_SETFL, O_NONBLOCK);
+		err = watch_fd(loop, s);
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (err == 0)
+	{
+		/* dup2 clears close-on-exec on the target descriptor */
+		posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+		posix_spawn_file_actions_adddup2(&actions, ends[0][1], 1);
+		posix_spawn_file_actions_adddup2(&actions, ends[1][1], 2);
+		if (spec.has_cwd)
+		{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+			err = posix_spawn_file_actions_addchdir_np(&actions, spec.cwd.c_str());
+#else
+			err = ENOSYS;
+#endif
+		}
+	}
+
+	if (err == 0)
+	{
+		std::vector<char*> argv;
+		argv.push_back(const_cast<char*>(spec.cmd.c_str()));
+		for (size_t i = 0; i < spec.args.size(); i++) { argv.push_back(const_cast<char*>(spec.args[i].c_str())); }
+		argv.push_back(NULL);
+
+		std::vector<std::string> entries;
+		std::vector<char*> envp;
+		char **env = environ;
+		if (spec.block != NULL)
+		{
+			env = static_cast<char**>(const_cast<void*>(spec.block));
+		}
+		else if (!spec.env.empty())
+		{
+			child_environment(spec, entries);
+			for (size_t i = 0; i < entries.size(); i++) { envp.push_back(const_cast<char*>(entries[i].c_str())); }
+			envp.push_back(NULL);
+			env = &envp[0];
+		}
+
+		err = posix_spawnp(&c->pid, spec.cmd.c_str(), &actions, NULL, &argv[0], env);
+		if (err == 0)
+		{
+			c->id = static_cast<unsigned long>(c->pid);
+			SpawnSource& s = c->sources[SPAWN_EXIT];
+			s.fd = static_cast<int>(syscall(SYS_pidfd_open, c->pid, 0));
+			if (s.fd >= 0)
+			{
+				/* kernels without pidfds wait for the exit once the pipes close */
+				fcntl(s.fd, F_SETFD, FD_CLOEXEC);
+				s.open = watch_fd(loop, s) == 0;
+			}
+		}
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	for (int i = 0; i < 2; i++)
+	{
+		if (ends[i][1] >= 0) { close(ends[i][1]); }
+	}
+	return err;
+}
+
+#endif
+
+/* ------------------------------------------------------------
+The event loop
+------------------------------------------------------------ */
+
+static void source_close(SpawnSource& s)
+{
+	if (!s.open) { return; }
+	s.open = false;
+#ifdef _WIN32
+	if (s.kind == SPAWN_EXIT)
+	{
+		UnregisterWaitEx(s.handle, INVALID_HANDLE_VALUE); /* waits for a running callback */
+		return;
+	}
+	DWORD bytes;
+	if (s.reading && (CancelIoEx(s.handle, &s.ov) != 0 || GetLastError() != ERROR_NOT_FOUND))
+	{
+		/* the buffer must stay alive until the cancellation has completed */
+		GetOverlappedResult(s.handle, &s.ov, &bytes, TRUE);
+	}
+	s.reading = false;
+	CloseHandle(s.handle);
+	s.handle = NULL;
+#else
+	/* a spawn in progress may hold a copy of the descriptor, keeping it registered */
+	epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.fd, NULL);
+	close(s.fd);
+	s.fd = -1;
+#endif
+}
+
+static void child_destroy(SpawnChild *c)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		source_close(c->sources[i]);
+	}
+#ifdef _WIN32
+	if (c->process != NULL) { CloseHandle(c->process); }
+#else
+	int status;
+	if (c->pid > 0 && !c->exited) { waitpid(c->pid, &status, WNOHANG); }
+#endif
+	delete c;
+}
+
+static bool loop_open(SpawnLoop& loop)
+{
+#ifdef _WIN32
+	loop.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	return loop.port != NULL;
+#else
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	return loop.epfd >= 0;
+#endif
+}
+
+static void loop_close(SpawnLoop& loop)
+{
+#ifdef _WIN32
+	CloseHandle(loop.port);
+#else
+	close(loop.epfd);
+#endif
+}
+
+static int loop_error()
+{
+#ifdef _WIN32
+	return static_cast<int>(GetLastError());
+#else
+	return errno;
+#endif
+}
+
+/* start reads on the child's idle pipes (Windows reads complete on the port; epoll needs nothing) */
+static void child_arm(SpawnChild *c)
+{
+#ifdef _WIN32
+	for (int i = SPAWN_STDOUT; i <= SPAWN_STDERR; i++)
+	{
+		SpawnSource& s = c->sources[i];
+		if (!s.open || s.reading) { continue; }
+		memset(&s.ov, 0, sizeof(s.ov));
+		if (ReadFile(s.handle, &s.buffer[0], WINLUA_SPAWN_CHUNK, NULL, &s.ov) != 0 || GetLastError() == ERROR_IO_PENDING)
+		{
+			s.reading = true;
+		}
+		else
+		{
+			source_close(s); /* the child closed its end */
+		}
+	}
+#else
+	(void)c;
+#endif
+}
+
+/*
+both pipes are closed and the exit code is known. Once the pipes close the
+child is usually gone, so it is reaped directly rather than through another
+round of the loop; with 'block' (nothing else to wait for) it is waited for.
+*/
+static bool child_finished(SpawnChild *c, bool block)
+{
+	if (c->sources[SPAWN_STDOUT].open || c->sources[SPAWN_STDERR].open) { return false; }
+	if (c->exited) { return true; }
+	if (block || !c->sources[SPAWN_EXIT].open)
+	{
+		source_close(c->sources[SPAWN_EXIT]);
+#ifdef _WIN32
+		DWORD code = 0;
+		WaitForSingleObject(c->process, INFINITE);
+		GetExitCodeProcess(c->process, &code);
+		c->code = static_cast<lua_Integer>(code);
+#else
+		int status = 0;
+		waitpid(c->pid, &status, 0);
+		c->code = exit_code(status);
+#endif
+		c->exited = true;
+	}
+	/* on Windows the exit packet, which must be consumed before the child is freed, says so */
+#ifndef _WIN32
+	else
+	{
+		int status = 0;
+		if (waitpid(c->pid, &status, WNOHANG) == c->pid)
+		{
+			source_close(c->sources[SPAWN_EXIT]);
+			c->code = exit_code(status);
+			c->exited = true;
+		}
+	}
+#endif
+	return c->exited;
+}
+
+/*
+Wait up to 'timeout' milliseconds (-1 for ever) and handle what happened:
+exits are recorded and closed pipes marked, and chunks of output are
+returned as events. The number of events, or -1 after a timeout.
+*/
+static int loop_poll(SpawnLoop& loop, int timeout, SpawnEvent *events, int max)
+{
+	int count = 0;
+#ifdef _WIN32
+	OVERLAPPED_ENTRY entries[WINLUA_SPAWN_EVENTS];
+	ULONG n = 0;
+	if (GetQueuedCompletionStatusEx(loop.port, entries, static_cast<ULONG>(max), &n, (timeout < 0) ? INFINITE : static_cast<DWORD>(timeout), FALSE) == 0)
+	{
+		return -1;
+	}
+	for (ULONG i = 0; i < n; i++)
+	{
+		SpawnSource *s = reinterpret_cast<SpawnSource*>(entries[i].lpOverlapped);
+		SpawnChild *c = s->child;
+		if (s->kind == SPAWN_EXIT)
+		{
+			DWORD code = 0;
+			UnregisterWaitEx(s->handle, NULL);
+			s->open = false;
+			GetExitCodeProcess(c->process, &code);
+			c->code = static_cast<lua_Integer>(code);
+			c->exited = true;
+			continue;
+		}
+
+		DWORD bytes = 0;
+		s->reading = false;
+		if (GetOverlappedResult(s->handle, &s->ov, &bytes, FALSE) == 0)
+		{
+			source_close(*s); /* ERROR_BROKEN_PIPE once the child closed its end */
+		}
+		else if (bytes > 0)
+		{
+			events[count].source = s;
+			events[count].data = &s->buffer[0];
+			events[count].len = bytes;
+			count++;
+		}
+	}
+#else
+	struct epoll_event ev[WINLUA_SPAWN_EVENTS];
+	int n = epoll_wait(loop.epfd, ev, max, timeout);
+	if (n < 0 && errno == EINTR) { return 0; }
+	if (n <= 0) { return -1; }
+	for (int i = 0; i < n; i++)
+	{
+		SpawnSource *s = static_cast<SpawnSource*>(ev[i].data.ptr);
+		SpawnChild *c = s->child;
+		if (s->kind == SPAWN_EXIT)
+		{
+			int status = 0;
+			waitpid(c->pid, &status, 0);
+			c->code = exit_code(status);
+			c->exited = true;
+			source_close(*s);
+			continue;
+		}
+
+		ssize_t bytes = read(s->fd, &s->buffer[0], WINLUA_SPAWN_CHUNK);
+		if (bytes > 0)
+		{
+			events[count].source = s;
+			events[count].data = &s->buffer[0];
+			events[count].len = static_cast<size_t>(bytes);
+			count++;
+		}
+		else if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+		{
+			source_close(*s);
+		}
+	}
+#endif
+	return count;
+}
+
+/* run a child until it is finished, collecting its output */
+static void child_drain(SpawnLoop& loop, SpawnChild *c)
+{
+	SpawnEvent events[2];
+	for (;;)
+	{
+		child_arm(c);
+		if (child_finished(c, true)) { return; }
+		int n = loop_poll(loop, -1, events, 2);
+		for (int i = 0; i < n; i++)
+		{
+			c->output[events[i].source->kind].append(events[i].data, events[i].len);
+		}
+	}
+}
+
+/* ------------------------------------------------------------
+Process objects
+------------------------------------------------------------ */
+
+static WinLuaProcess *check_process(lua_State *L)
+{
+	WinLuaProcess *p = static_cast<WinLuaProcess*>(luaL_checkudata(L, 1, WINLUA_PROCESS_META));
+	if (p->child == NULL)
+	{
+		luaL_error(L, "attempt to use a closed process");
+	}
+	return p;
+}
+
+static int push_error(lua_State *L, const char *what, const char *path, int err)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "could not %s '%s' (%d)", what, path, err);
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+static int process_read(lua_State *L)
+{
+	WinLuaProcess *p = check_process(L);
+	int timeout = static_cast<int>(luaL_optinteger(L, 2, -1));
+	SpawnEvent event;
+	for (;;)
+	{
+		child_arm(p->child);
+		if (!p->child->sources[SPAWN_STDOUT].open && !p->child->sources[SPAWN_STDERR].open)
+		{
+			lua_pushnil(L);
+			return 1;
+		}
+		int n = loop_poll(*p->loop, timeout, &event, 1);
+		if (n < 0)
+		{
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (n == 1)
+		{
+			lua_pushstring(L, event.source->kind == SPAWN_STDOUT ? "stdout" : "stderr");
+			lua_pushlstring(L, event.data, event.len);
+			return 2;
+		}
+	}
+}
+
+static int process_wait(lua_State *L)
+{
+	WinLuaProcess *p = check_process(L);
+	SpawnChild *c = p->child;
+	child_drain(*p->loop, c);
+	lua_pushinteger(L, c->code);
+	lua_pushlstring(L, c->output[SPAWN_STDOUT].data(), c->output[SPAWN_STDOUT].size());
+	lua_pushlstring(L, c->output[SPAWN_STDERR].data(), c->output[SPAWN_STDERR].size());
+	c->output[SPAWN_STDOUT].clear();
+	c->output[SPAWN_STDERR].clear();
+	return 3;
+}
+
+static int process_kill(lua_State *L)
+{
+	WinLuaProcess *p = check_process(L);
+	SpawnChild *c = p->child;
+	if (!c->exited)
+	{
+#ifdef _WIN32
+		if (TerminateProcess(c->process, 1) == 0)
+		{
+			return push_error(L, "kill", "process", static_cast<int>(GetLastError()));
+		}
+#else
+		if (kill(c->pid, SIGKILL) != 0)
+		{
+			return push_error(L, "kill", "process", errno);
+		}
+#endif
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int process_pid(lua_State *L)
+{
+	WinLuaProcess *p = check_process(L);
+	lua_pushinteger(L, static_cast<lua_Integer>(p->child->id));
+	return 1;
+}
+
+static void process_release(WinLuaProcess *p)
+{
+	if (p->child != NULL)
+	{
+		child_destroy(p->child);
+		p->child = NULL;
+	}
+	if (p->loop != NULL)
+	{
+		loop_close(*p->loop);
+		delete p->loop;
+		p->loop = NULL;
+	}
+}
+
+/* an unfinished child keeps running once its process object is collected */
+static int process_gc(lua_State *L)
+{
+	process_release(static_cast<WinLuaProcess*>(luaL_checkudata(L, 1, WINLUA_PROCESS_META)));
+	return 0;
+}
+
+static const luaL_Reg process_methods[] = {
+	{"read", process_read},
+	{"wait", process_wait},
+	{"kill", process_kill},
+	{"pid", process_pid},
+	{NULL, NULL}
+};
+
+int winlua_os_spawn(lua_State *L)
+{
+	const char *problem = check_spec(L, 1);
+	if (problem != NULL)
+	{
+		return luaL_argerror(L, 1, problem);
+	}
+
+	WinLuaProcess *p = static_cast<WinLuaProcess*>(lua_newuserdata(L, sizeof(WinLuaProcess)));
+	p->loop = NULL;
+	p->child = NULL;
+	if (luaL_newmetatable(L, WINLUA_PROCESS_META))
+	{
+		lua_pushcfunction(L, process_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_newtable(L);
+		luaL_setfuncs(L, process_methods, 0);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+
+	int err = 0;
+	std::string cmd;
+	{
+		SpawnSpec spec;
+		read_spec(L, 1, spec);
+		cmd = spec.cmd;
+		p->loop = new SpawnLoop;
+		if (!loop_open(*p->loop))
+		{
+			err = loop_error();
+			delete p->loop;
+			p->loop = NULL;
+		}
+		else
+		{
+			p->child = new SpawnChild;
+			child_init(p->child, 0);
+			err = child_start(*p->loop, p->child, spec);
+		}
+	}
+	if (err != 0)
+	{
+		process_release(p);
+		return push_error(L, "run", cmd.c_str(), err);
+	}
+	return 1;
+}
+
+/* ------------------------------------------------------------
+os.run_all
+------------------------------------------------------------ */
+
+struct SpawnResult
+{
+	lua_Integer code;
+	std::string output[2];
+	int error; /* could not start */
+};
+
+int winlua_os_run_all(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	size_t count = lua_rawlen(L, 1);
+	lua_Integer concurrency = luaL_optinteger(L, 2, static_cast<lua_Integer>(winlua_parallel_threads(count > 0 ? count : 1, 1)));
+	luaL_argcheck(L, concurrency > 0, 2, "concurrency must be positive");
+	for (size_t i = 1; i <= count; i++)
+	{
+		lua_rawgeti(L, 1, static_cast<lua_Integer>(i));
+		const char *problem = check_spec(L, -1);
+		if (problem != NULL)
+		{
+			return luaL_error(L, "bad job #%d (%s)", static_cast<int>(i), problem);
+		}
+		lua_pop(L, 1);
+	}
+
+	int err = 0;
+	{
+		std::vector<SpawnSpec> specs(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			lua_rawgeti(L, 1, static_cast<lua_Integer>(i + 1));
+			read_spec(L, -1, specs[i]);
+			lua_pop(L, 1);
+		}
+
+		SpawnLoop loop;
+		if (!loop_open(loop))
+		{
+			err = loop_error();
+		}
+		else
+		{
+			std::vector<SpawnResult> results(count);
+			std::vector<SpawnChild*> active;
+			std::vector<SpawnEvent> events(WINLUA_SPAWN_EVENTS);
+			size_t next = 0, done = 0;
+			while (done < count)
+			{
+				while (next < count && active.size() < static_cast<size_t>(concurrency))
+				{
+					SpawnChild *c = new SpawnChild;
+					child_init(c, next);
+					results[next].error = child_start(loop, c, specs[next]);
+					if (results[next].error != 0)
+					{
+						child_destroy(c);
+						done++;
+					}
+					else
+					{
+						active.push_back(c);
+					}
+					next++;
+				}
+
+				/* collect the finished children, then wait for the others */
+				for (size_t i = 0; i < active.size();)
+				{
+					SpawnChild *c = active[i];
+					child_arm(c);
+					if (!child_finished(c, false))
+					{
+						i++;
+						continue;
+					}
+					SpawnResult& r = results[c->job];
+					r.code = c->code;
+					r.output[0].swap(c->output[0]);
+					r.output[1].swap(c->output[1]);
+					child_destroy(c);
+					active[i] = active.back();
+					active.pop_back();
+					done++;
+				}
+				if (active.empty()) { continue; }
+
+				int n = loop_poll(loop, -1, &events[0], WINLUA_SPAWN_EVENTS);
+				for (int i = 0; i < n; i++)
+				{
+					SpawnSource *s = events[i].source;
+					s->child->output[s->kind].append(events[i].data, events[i].len);
+				}
+			}
+			loop_close(loop);
+
+			lua_createtable(L, static_cast<int>(count), 0);
+			for (size_t i = 0; i < count; i++)
+			{
+				const SpawnResult& r = results[i];
+				if (r.error != 0)
+				{
+					lua_createtable(L, 0, 1);
+					lua_pushfstring(L, "could not run '%s' (%d)", specs[i].cmd.c_str(), r.error);
+					lua_setfield(L, -2, "error");
+				}
+				else
+				{
+					lua_createtable(L, 0, 3);
+					lua_pushinteger(L, r.code);
+					lua_setfield(L, -2, "code");
+					lua_pushlstring(L, r.output[0].data(), r.output[0].size());
+					lua_setfield(L, -2, "stdout");
+					lua_pushlstring(L, r.output[1].data(), r.output[1].size());
+					lua_setfield(L, -2, "stderr");
+				}
+				lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+			}
+		}
+	}
+	if (err != 0)
+	{
+		return luaL_error(L, "could not create the process loop (%d)", err);
+	}
+	return 1;
+}
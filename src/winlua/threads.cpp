@@ -0,0 +1,756 @@
+#include "winlua_serialize.hpp"
+#include "winlua_modules.hpp"
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/* ------------------------------------------------------------
+WinLua Channels
+
+A channel is a bounded lock-free MPMC queue (Vyukov's sequence
+numbered ring) of serialized Lua values. Two semaphores count the
+free and filled slots so send and receive can block without
+spinning. Channels are reference counted and shared between the
+Lua states of all threads.
+------------------------------------------------------------ */
+#define WINLUA_CHANNEL_META "WinLuaChannel"
+#define WINLUA_THREADPOOL_META "WinLuaThreadPool"
+
+#define WINLUA_CHANNEL_DEFAULT_CAPACITY 1024
+#define WINLUA_WAIT_FOREVER 0xFFFFFFFFUL
+#define WINLUA_WAIT_SLICE 50 /* ms between checks for a closing pool */
+
+#ifdef _WIN32
+typedef HANDLE WinLuaSemaphore;
+
+static void semaphore_init(WinLuaSemaphore& sem, size_t count, size_t max)
+{
+	sem = CreateSemaphoreW(NULL, static_cast<LONG>(count), static_cast<LONG>(max), NULL);
+}
+
+static void semaphore_destroy(WinLuaSemaphore& sem)
+{
+	CloseHandle(sem);
+}
+
+static bool semaphore_wait(WinLuaSemaphore& sem, unsigned long ms)
+{
+	return WaitForSingleObject(sem, (ms == WINLUA_WAIT_FOREVER) ? INFINITE : static_cast<DWORD>(ms)) == WAIT_OBJECT_0;
+}
+
+static void semaphore_post(WinLuaSemaphore& sem)
+{
+	ReleaseSemaphore(sem, 1, NULL);
+}
+#else
+struct WinLuaSemaphore
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	size_t count;
+};
+
+static void semaphore_init(WinLuaSemaphore& sem, size_t count, size_t)
+{
+	sem.count = count;
+}
+
+static void semaphore_destroy(WinLuaSemaphore&)
+{
+}
+
+static bool semaphore_wait(WinLuaSemaphore& sem, unsigned long ms)
+{
+	std::unique_lock<std::mutex> lock(sem.lock);
+	if (ms == WINLUA_WAIT_FOREVER)
+	{
+		sem.cond.wait(lock, [&sem] { return sem.count > 0; });
+	}
+	else if (!sem.cond.wait_for(lock, std::chrono::milliseconds(ms), [&sem] { return sem.count > 0; }))
+	{
+		return false;
+	}
+	sem.count--;
+	return true;
+}
+
+static void semaphore_post(WinLuaSemaphore& sem)
+{
+	{
+		std::lock_guard<std::mutex> lock(sem.lock);
+		sem.count++;
+	}
+	sem.cond.notify_one();
+}
+#endif
+
+struct WinLuaChannel;
+
+/*
+A serialized value and the channels inside it, each of which the
+message holds a reference to until it is dropped.
+*/
+struct WinLuaMessage
+{
+	std::string data;
+	std::vector<WinLuaChannel*> channels;
+
+	void swap(WinLuaMessage& other)
+	{
+		data.swap(other.data);
+		channels.swap(other.channels);
+	}
+};
+
+struct WinLuaChannelCell
+{
+	std::atomic<size_t> sequence;
+	WinLuaMessage message;
+};
+
+struct WinLuaChannel
+{
+	std::atomic<long> refcount;
+	size_t mask;
+	WinLuaChannelCell *cells;
+	std::atomic<size_t> enqueuepos;
+	std::atomic<size_t> dequeuepos;
+	WinLuaSemaphore slots; /* free cells */
+	WinLuaSemaphore items; /* filled cells */
+};
+
+static WinLuaChannel *channel_create(size_t capacity)
+{
+	size_t size = 2;
+	while (size < capacity) { size <<= 1; }
+
+	WinLuaChannel *ch = new WinLuaChannel;
+	ch->refcount = 1;
+	ch->mask = size - 1;
+	ch->cells = new WinLuaChannelCell[size];
+	for (size_t i = 0; i < size; i++)
+	{
+		ch->cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	ch->enqueuepos = 0;
+	ch->dequeuepos = 0;
+	semaphore_init(ch->slots, size, size);
+	semaphore_init(ch->items, 0, size);
+	return ch;
+}
+
+static void channel_retain(WinLuaChannel *ch)
+{
+	ch->refcount.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void message_clear(WinLuaMessage& msg);
+
+static void channel_release(WinLuaChannel *ch)
+{
+	if (ch->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		/* messages nobody received still hold their channels */
+		for (size_t i = 0; i <= ch->mask; i++)
+		{
+			message_clear(ch->cells[i].message);
+		}
+		semaphore_destroy(ch->slots);
+		semaphore_destroy(ch->items);
+		delete[] ch->cells;
+		delete ch;
+	}
+}
+
+static void message_clear(WinLuaMessage& msg)
+{
+	std::vector<WinLuaChannel*> channels;
+	channels.swap(msg.channels);
+	msg.data.clear();
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		channel_release(channels[i]);
+	}
+}
+
+/*
+Both operations are only called while holding a permit from the
+matching semaphore, so a cell is always available; a cell may
+still be in the middle of being released by another thread, in
+which case we retry.
+*/
+static void channel_enqueue(WinLuaChannel *ch, WinLuaMessage& msg)
+{
+	for (;;)
+	{
+		size_t pos = ch->enqueuepos.load(std::memory_order_relaxed);
+		WinLuaChannelCell *cell = &ch->cells[pos & ch->mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+
+		if (seq == pos && ch->enqueuepos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+		{
+			cell->message.swap(msg);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return;
+		}
+		if (seq != pos)
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+static void channel_dequeue(WinLuaChannel *ch, WinLuaMessage& msg)
+{
+	for (;;)
+	{
+		size_t pos = ch->dequeuepos.load(std::memory_order_relaxed);
+		WinLuaChannelCell *cell = &ch->cells[pos & ch->mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+
+		if (seq == pos + 1 && ch->dequeuepos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+		{
+			msg.swap(cell->message);
+			cell->sequence.store(pos + ch->mask + 1, std::memory_order_release);
+			return;
+		}
+		if (seq != pos + 1)
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+/* ------------------------------------------------------------
+Channels inside messages
+------------------------------------------------------------ */
+
+static void push_channel(lua_State *L, WinLuaChannel *ch);
+
+/*
+'ud' is the channel list of the message being encoded, which
+takes its own reference; the arguments of threads.start pass NULL
+and hold none, as the pool keeps the channel userdata themselves
+alive until it is joined. Decoding always takes a new reference,
+so a message keeps its own until it is dropped, even when decoding
+fails half way.
+*/
+static bool encode_channel(lua_State *L, int idx, std::string& out, void *ud)
+{
+	WinLuaChannel **pch = static_cast<WinLuaChannel**>(luaL_testudata(L, idx, WINLUA_CHANNEL_META));
+	if (pch == NULL)
+	{
+		return false;
+	}
+
+	if (ud != NULL)
+	{
+		std::vector<WinLuaChannel*> *channels = static_cast<std::vector<WinLuaChannel*>*>(ud);
+		channels->reserve(channels->size() + 1);
+		channel_retain(*pch);
+		channels->push_back(*pch);
+	}
+	out.append(reinterpret_cast<const char*>(pch), sizeof(*pch));
+	return true;
+}
+
+static const char *decode_channel(lua_State *L, const char *p, const char *end, void *)
+{
+	WinLuaChannel *ch;
+	if (static_cast<size_t>(end - p) < sizeof(ch))
+	{
+		luaL_error(L, "corrupt message");
+	}
+	memcpy(&ch, p, sizeof(ch));
+	channel_retain(ch);
+	push_channel(L, ch);
+	return p + sizeof(ch);
+}
+
+static const WinLuaSerializeUdata channel_codec = { encode_channel, decode_channel, NULL };
+
+/*
+Messages are encoded and decoded in protected calls, so an error
+(a function value, running out of memory) does not longjmp past
+the message: the caller releases it and raises the error again.
+Arguments: the message as light userdata, then the value to encode.
+*/
+static int encode_message(lua_State *L)
+{
+	WinLuaMessage *msg = static_cast<WinLuaMessage*>(lua_touserdata(L, 1));
+	WinLuaSerializeUdata codec = { encode_channel, decode_channel, &msg->channels };
+	winlua_serialize(L, 2, msg->data, &codec);
+	return 0;
+}
+
+static int decode_message(lua_State *L)
+{
+	WinLuaMessage *msg = static_cast<WinLuaMessage*>(lua_touserdata(L, 1));
+	winlua_deserialize(L, msg->data.data(), msg->data.data() + msg->data.size(), &channel_codec);
+	return 1;
+}
+
+/* ------------------------------------------------------------
+Channel userdata and methods
+------------------------------------------------------------ */
+
+static void push_channel(lua_State *L, WinLuaChannel *ch)
+{
+	WinLuaChannel **pch = static_cast<WinLuaChannel**>(lua_newuserdata(L, sizeof(WinLuaChannel*)));
+	*pch = ch;
+	luaL_setmetatable(L, WINLUA_CHANNEL_META);
+}
+
+static WinLuaChannel *check_channel(lua_State *L, int idx)
+{
+	return *static_cast<WinLuaChannel**>(luaL_checkudata(L, idx, WINLUA_CHANNEL_META));
+}
+
+static int channel__gc(lua_State *L)
+{
+	WinLuaChannel **pch = static_cast<WinLuaChannel**>(luaL_checkudata(L, 1, WINLUA_CHANNEL_META));
+	if (*pch != NULL)
+	{
+		channel_release(*pch);
+		*pch = NULL;
+	}
+	return 0;
+}
+
+static bool worker_closing(lua_State *L);
+
+/*
+Wait up to 'timeout' milliseconds for a permit of 'sem'. Waits in
+a worker are sliced so that collecting its pool, which joins the
+workers, makes them fail instead of hanging forever.
+Returns 1 with the permit, 0 on timeout and -1 when the pool is closing.
+*/
+static int channel_wait(lua_State *L, WinLuaSemaphore& sem, unsigned long timeout)
+{
+	if (semaphore_wait(sem, 0))
+	{
+		return 1;
+	}
+
+	for (;;)
+	{
+		unsigned long slice = (timeout < WINLUA_WAIT_SLICE) ? timeout : WINLUA_WAIT_SLICE;
+		if (slice == 0)
+		{
+			return 0;
+		}
+		if (semaphore_wait(sem, slice))
+		{
+			return 1;
+		}
+		if (worker_closing(L))
+		{
+			return -1;
+		}
+		if (timeout != WINLUA_WAIT_FOREVER)
+		{
+			timeout -= slice;
+		}
+	}
+}
+
+static int channel_send(lua_State *L)
+{
+	WinLuaChannel *ch = check_channel(L, 1);
+	luaL_checkany(L, 2);
+
+	int status;
+	bool sent = false;
+	{
+		WinLuaMessage msg;
+		lua_pushcfunction(L, encode_message);
+		lua_pushlightuserdata(L, &msg);
+		lua_pushvalue(L, 2);
+		status = lua_pcall(L, 2, 0, 0);
+		if (status == LUA_OK && channel_wait(L, ch->slots, WINLUA_WAIT_FOREVER) > 0)
+		{
+			channel_enqueue(ch, msg);
+			semaphore_post(ch->items);
+			sent = true;
+		}
+		message_clear(msg); /* the channels of a message that was not sent */
+	}
+	if (status != LUA_OK)
+	{
+		return lua_error(L);
+	}
+	if (!sent)
+	{
+		return luaL_error(L, "thread pool closed");
+	}
+	return 0;
+}
+
+static int channel_push_received(lua_State *L, WinLuaChannel *ch)
+{
+	int status;
+	{
+		WinLuaMessage msg;
+		channel_dequeue(ch, msg);
+		semaphore_post(ch->slots);
+
+		lua_pushcfunction(L, decode_message);
+		lua_pushlightuserdata(L, &msg);
+		status = lua_pcall(L, 1, 1, 0);
+		message_clear(msg); /* the values took their own references */
+	}
+	if (status != LUA_OK)
+	{
+		return lua_error(L);
+	}
+	return 1;
+}
+
+/*
+ch:receive([timeout]) -> value, or nil, "timeout" after 'timeout' milliseconds
+*/
+static int channel_receive(lua_State *L)
+{
+	WinLuaChannel *ch = check_channel(L, 1);
+	unsigned long timeout = lua_isnoneornil(L, 2) ? WINLUA_WAIT_FOREVER : static_cast<unsigned long>(luaL_checkinteger(L, 2));
+
+	int got = channel_wait(L, ch->items, timeout);
+	if (got < 0)
+	{
+		return luaL_error(L, "thread pool closed");
+	}
+	if (got == 0)
+	{
+		lua_pushnil(L);
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+	return channel_push_received(L, ch);
+}
+
+/*
+ch:try_receive() -> true, value | false
+*/
+static int channel_try_receive(lua_State *L)
+{
+	WinLuaChannel *ch = check_channel(L, 1);
+
+	if (!semaphore_wait(ch->items, 0))
+	{
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushboolean(L, 1);
+	return 1 + channel_push_received(L, ch);
+}
+
+static const luaL_Reg channel_methods[] = {
+	{"__gc", channel__gc},
+	{"send", channel_send},
+	{"receive", channel_receive},
+	{"try_receive", channel_try_receive},
+	{NULL, NULL}
+};
+
+/* ------------------------------------------------------------
+Worker threads
+------------------------------------------------------------ */
+
+struct WinLuaWorker
+{
+	int id;
+	bool pooled;
+	const std::string *code;
+	const std::string *args;
+	std::string error;
+	std::atomic<bool> closing; /* set when the pool is collected */
+};
+
+struct WinLuaThreadPool
+{
+	std::vector<std::thread> *threads;
+	std::vector<WinLuaWorker> *workers;
+	std::string *code;
+	std::string *args;
+};
+
+/* registry key of the worker running in a state */
+static const char worker_key = 0;
+
+static bool worker_closing(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &worker_key);
+	WinLuaWorker *worker = static_cast<WinLuaWorker*>(lua_touserdata(L, -1));
+	lua_pop(L, 1);
+	return worker != NULL && worker->closing.load(std::memory_order_acquire);
+}
+
+static int worker_main(lua_State *L)
+{
+	WinLuaWorker *worker = static_cast<WinLuaWorker*>(lua_touserdata(L, 1));
+	lua_pushvalue(L, 1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &worker_key);
+
+	/* load the module in the new state so channels received there have their metatable */
+	luaL_requiref(L, "threads", luaopen_threads, 0);
+	lua_pop(L, 1);
+
+	if (luaL_loadbufferx(L, worker->code->data(), worker->code->size(), "=worker", "bt") != LUA_OK)
+	{
+		return lua_error(L);
+	}
+
+	/* arguments: worker id followed by the values passed to threads.start */
+	lua_pushinteger(L, worker->id);
+	int nargs = 1;
+	const char *p = worker->args->data(), *end = p + worker->args->size();
+	while (p < end)
+	{
+		luaL_checkstack(L, 1, "too many arguments");
+		p = winlua_deserialize(L, p, end, &channel_codec);
+		nargs++;
+	}
+	lua_call(L, nargs, 0);
+	return 0;
+}
+
+static void worker_run(WinLuaWorker *worker)
+{
+	lua_State *L = winlua_newstate(worker->pooled);
+	if (L == NULL)
+	{
+		worker->error = "could not allocate Lua state";
+		return;
+	}
+	winlua_setup_env(L);
+
+	lua_pushcfunction(L, worker_main);
+	lua_pushlightuserdata(L, worker);
+	if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+	{
+		const char *msg = lua_tostring(L, -1);
+		worker->error = msg ? msg : "(error object is not a string)";
+	}
+	winlua_closestate(L);
+}
+
+static void threadpool_join(WinLuaThreadPool *pool)
+{
+	if (pool->threads == NULL)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < pool->threads->size(); i++)
+	{
+		(*pool->threads)[i].join();
+	}
+	delete pool->threads;
+	pool->threads = NULL;
+}
+
+static int threadpool__gc(lua_State *L)
+{
+	WinLuaThreadPool *pool = static_cast<WinLuaThreadPool*>(luaL_checkudata(L, 1, WINLUA_THREADPOOL_META));
+
+	/* workers blocked on a channel give up instead of keeping lua_close waiting */
+	for (size_t i = 0; pool->workers != NULL && i < pool->workers->size(); i++)
+	{
+		(*pool->workers)[i].closing.store(true, std::memory_order_release);
+	}
+	threadpool_join(pool);
+	delete pool->workers;
+	delete pool->code;
+	delete pool->args;
+	pool->workers = NULL;
+	pool->code = NULL;
+	pool->args = NULL;
+	return 0;
+}
+
+/*
+pool:join() -> true | nil, { [id] = error message, ... }
+*/
+static int threadpool_join_l(lua_State *L)
+{
+	WinLuaThreadPool *pool = static_cast<WinLuaThreadPool*>(luaL_checkudata(L, 1, WINLUA_THREADPOOL_META));
+	threadpool_join(pool);
+
+	bool failed = false;
+	for (size_t i = 0; pool->workers != NULL && i < pool->workers->size(); i++)
+	{
+		WinLuaWorker& worker = (*pool->workers)[i];
+		if (!worker.error.empty())
+		{
+			if (!failed)
+			{
+				lua_pushnil(L);
+				lua_newtable(L);
+				failed = true;
+			}
+			lua_pushlstring(L, worker.error.data(), worker.error.size());
+			lua_rawseti(L, -2, worker.id);
+		}
+	}
+
+	if (!failed)
+	{
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	return 2;
+}
+
+static const luaL_Reg threadpool_methods[] = {
+	{"__gc", threadpool__gc},
+	{"join", threadpool_join_l},
+	{NULL, NULL}
+};
+
+static int dump_writer(lua_State *, const void *p, size_t sz, void *ud)
+{
+	static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+	return 0;
+}
+
+/* ------------------------------------------------------------
+WinLua Threads functions
+------------------------------------------------------------ */
+
+static int threads_channel(lua_State *L)
+{
+	lua_Integer capacity = luaL_optinteger(L, 1, WINLUA_CHANNEL_DEFAULT_CAPACITY);
+	luaL_argcheck(L, capacity > 0 && capacity <= 0x40000000, 1, "capacity out of range");
+
+	push_channel(L, channel_create(static_cast<size_t>(capacity)));
+	return 1;
+}
+
+/*
+threads.start(n, code, ...) -> pool
+
+'code' is Lua source or a function whose only upvalue is _ENV;
+each worker runs it in its own state with (id, ...) as arguments.
+*/
+static int threads_start(lua_State *L)
+{
+	lua_Integer n = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, n > 0 && n <= 1024, 1, "thread count out of range");
+	int nargs = lua_gettop(L);
+
+	/* the pool owns everything allocated below, so errors cannot leak it */
+	WinLuaThreadPool *pool = static_cast<WinLuaThreadPool*>(lua_newuserdata(L, sizeof(WinLuaThreadPool)));
+	pool->threads = NULL;
+	pool->workers = NULL;
+	pool->code = NULL;
+	pool->args = NULL;
+	luaL_setmetatable(L, WINLUA_THREADPOOL_META);
+	int poolidx = lua_gettop(L);
+
+	pool->code = new std::string();
+	if (lua_type(L, 2) == LUA_TFUNCTION)
+	{
+		const char *upvalue = lua_getupvalue(L, 2, 1);
+		bool env = (upvalue == NULL || strcmp(upvalue, "_ENV") == 0);
+		if (upvalue != NULL) { lua_pop(L, 1); }
+		luaL_argcheck(L, env && lua_getupvalue(L, 2, 2) == NULL, 2, "function must not have upvalues");
+
+		lua_pushvalue(L, 2);
+		int failed = lua_dump(L, dump_writer, pool->code, 0);
+		lua_pop(L, 1);
+		luaL_argcheck(L, failed == 0, 2, "unable to dump given function");
+	}
+	else
+	{
+		size_t len;
+		const char *source = luaL_checklstring(L, 2, &len);
+		pool->code->assign(source, len);
+	}
+
+	/* the pool holds the arguments so the channels among them outlive the decoding */
+	pool->args = new std::string();
+	lua_createtable(L, (nargs > 2) ? nargs - 2 : 0, 0);
+	for (int j = 3; j <= nargs; j++)
+	{
+		winlua_serialize(L, j, *pool->args, &channel_codec);
+		lua_pushvalue(L, j);
+		lua_rawseti(L, -2, j - 2);
+	}
+	lua_setuservalue(L, poolidx);
+
+	pool->workers = new std::vector<WinLuaWorker>(static_cast<size_t>(n));
+	pool->threads = new std::vector<std::thread>();
+	pool->threads->reserve(static_cast<size_t>(n));
+	for (size_t i = 0; i < pool->workers->size(); i++)
+	{
+		WinLuaWorker& worker = (*pool->workers)[i];
+		worker.id = static_cast<int>(i + 1);
+		worker.pooled = winlua_state_pooled(L);
+		worker.code = pool->code;
+		worker.args = pool->args;
+		worker.closing.store(false, std::memory_order_relaxed);
+	}
+
+	for (size_t i = 0; i < pool->workers->size(); i++)
+	{
+		try
+		{
+			pool->threads->push_back(std::thread(worker_run, &(*pool->workers)[i]));
+		}
+		catch (...)
+		{
+			/* the workers that could not start are reported by pool:join() */
+			for (size_t j = i; j < pool->workers->size(); j++)
+			{
+				(*pool->workers)[j].error = "could not start worker thread";
+			}
+			break;
+		}
+	}
+	if (pool->threads->empty())
+	{
+		return luaL_error(L, "could not start worker threads");
+	}
+
+	lua_settop(L, poolidx);
+	return 1;
+}
+
+/* ------------------------------------------------------------
+WinLua Threads module
+------------------------------------------------------------ */
+
+static const luaL_Reg library_methods[] = {
+	{"channel", threads_channel},
+	{"start", threads_start},
+	{NULL, NULL}
+};
+
+static void create_meta(lua_State *L, const char *name, const luaL_Reg *methods)
+{
+	luaL_newmetatable(L, name);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, methods, 0);
+	lua_pop(L, 1);
+}
+
+int luaopen_threads(lua_State *L)
+{
+	create_meta(L, WINLUA_CHANNEL_META, channel_methods);
+	create_meta(L, WINLUA_THREADPOOL_META, threadpool_methods);
+
+	luaL_newlib(L, library_methods);
+	lua_pushinteger(L, static_cast<lua_Integer>(std::thread::hardware_concurrency()));
+	lua_setfield(L, -2, "cpucount");
+	return 1;
+}
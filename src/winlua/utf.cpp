@@ -0,0 +1,263 @@
+#include "winlua.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define WINLUA_UTF_SSE2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define WINLUA_TARGET_AVX2
+#else
+#define WINLUA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+/* ------------------------------------------------------------
+WinLua UTF-8 <-> UTF-16 Transcoder
+
+Both directions validate, size and convert in a single pass,
+writing straight into a buffer of the worst-case size: one UTF-16
+unit per UTF-8 byte, three UTF-8 bytes per UTF-16 unit. Runs of
+ASCII are converted 16 (SSE2) or 32 (AVX2, picked at runtime)
+characters at a time; everything else goes through a scalar
+decoder. Invalid sequences and lone surrogates are replaced with
+U+FFFD, like MultiByteToWideChar and WideCharToMultiByte do.
+------------------------------------------------------------ */
+#define UTF_REPLACEMENT 0xFFFD
+
+/* ------------------------------------------------------------
+ASCII fast paths; each returns the number of characters converted
+------------------------------------------------------------ */
+
+#ifdef WINLUA_UTF_SSE2
+
+static size_t ascii_to_utf16_sse2(const unsigned char *src, size_t len, uint16_t *dst)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		if (_mm_movemask_epi8(v) != 0) { break; }
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+	}
+	return i;
+}
+
+static size_t ascii_to_utf8_sse2(const uint16_t *src, size_t len, unsigned char *dst)
+{
+	const __m128i mask = _mm_set1_epi16(static_cast<short>(0xFF80));
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+		__m128i high = _mm_and_si128(_mm_or_si128(a, b), mask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xFFFF) { break; }
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b));
+	}
+	return i;
+}
+
+WINLUA_TARGET_AVX2 static size_t ascii_to_utf16_avx2(const unsigned char *src, size_t len, uint16_t *dst)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		if (_mm256_movemask_epi8(v) != 0) { break; }
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+	}
+	return i + ascii_to_utf16_sse2(src + i, len - i, dst + i);
+}
+
+WINLUA_TARGET_AVX2 static size_t ascii_to_utf8_avx2(const uint16_t *src, size_t len, unsigned char *dst)
+{
+	const __m256i mask = _mm256_set1_epi16(static_cast<short>(0xFF80));
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 16));
+		if (!_mm256_testz_si256(_mm256_or_si256(a, b), mask)) { break; }
+		/* packus works per 128-bit lane; restore the order of the 64-bit quarters */
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+	}
+	return i + ascii_to_utf8_sse2(src + i, len - i, dst + i);
+}
+
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 1);
+	bool osxsave = (regs[2] & (1 << 27)) != 0, avx = (regs[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+	{
+		return false;
+	}
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static const bool use_avx2 = cpu_has_avx2();
+
+static size_t ascii_to_utf16(const unsigned char *src, size_t len, uint16_t *dst)
+{
+	return use_avx2 ? ascii_to_utf16_avx2(src, len, dst) : ascii_to_utf16_sse2(src, len, dst);
+}
+
+static size_t ascii_to_utf8(const uint16_t *src, size_t len, unsigned char *dst)
+{
+	return use_avx2 ? ascii_to_utf8_avx2(src, len, dst) : ascii_to_utf8_sse2(src, len, dst);
+}
+
+#else
+
+static size_t ascii_to_utf16(const unsigned char *src, size_t len, uint16_t *dst)
+{
+	return 0;
+}
+
+static size_t ascii_to_utf8(const uint16_t *src, size_t len, unsigned char *dst)
+{
+	return 0;
+}
+
+#endif
+
+/* ------------------------------------------------------------
+Transcoders
+------------------------------------------------------------ */
+
+static inline bool is_continuation(unsigned char c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+size_t winlua_utf8_to_utf16(const char *input, size_t len, uint16_t *dst)
+{
+	const unsigned char *src = reinterpret_cast<const unsigned char*>(input);
+	size_t i = 0, o = 0;
+
+	while (i < len)
+	{
+		unsigned c = src[i];
+		if (c < 0x80)
+		{
+			size_t n = ascii_to_utf16(src + i, len - i, dst + o);
+			i += n; o += n;
+			/* the rest of a block that ended the vector loop */
+			while (i < len && src[i] < 0x80)
+			{
+				dst[o++] = src[i++];
+			}
+			continue;
+		}
+
+		/* lead byte: sequence length and the valid range of the second byte (Unicode table 3-7) */
+		size_t need;
+		unsigned lo = 0x80, hi = 0xBF, cp;
+		if (c >= 0xC2 && c <= 0xDF) { need = 1; cp = c & 0x1F; }
+		else if (c >= 0xE0 && c <= 0xEF)
+		{
+			need = 2; cp = c & 0x0F;
+			if (c == 0xE0) { lo = 0xA0; }
+			else if (c == 0xED) { hi = 0x9F; } /* no surrogates */
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			need = 3; cp = c & 0x07;
+			if (c == 0xF0) { lo = 0x90; }
+			else if (c == 0xF4) { hi = 0x8F; }
+		}
+		else
+		{
+			dst[o++] = UTF_REPLACEMENT;
+			i++;
+			continue;
+		}
+
+		/* consume the longest valid prefix; a broken sequence becomes one U+FFFD */
+		size_t k = 1;
+		for (; k <= need && i + k < len; k++)
+		{
+			unsigned cc = src[i + k];
+			if ((k == 1 && (cc < lo || cc > hi)) || (k > 1 && !is_continuation(static_cast<unsigned char>(cc))))
+			{
+				break;
+			}
+			cp = (cp << 6) | (cc & 0x3F);
+		}
+		i += k;
+
+		if (k <= need)
+		{
+			dst[o++] = UTF_REPLACEMENT;
+		}
+		else if (cp < 0x10000)
+		{
+			dst[o++] = static_cast<uint16_t>(cp);
+		}
+		else
+		{
+			cp -= 0x10000;
+			dst[o++] = static_cast<uint16_t>(0xD800 | (cp >> 10));
+			dst[o++] = static_cast<uint16_t>(0xDC00 | (cp & 0x3FF));
+		}
+	}
+	return o;
+}
+
+size_t winlua_utf16_to_utf8(const uint16_t *src, size_t len, char *output)
+{
+	unsigned char *dst = reinterpret_cast<unsigned char*>(output);
+	size_t i = 0, o = 0;
+
+	while (i < len)
+	{
+		unsigned c = src[i];
+		if (c < 0x80)
+		{
+			size_t n = ascii_to_utf8(src + i, len - i, dst + o);
+			i += n; o += n;
+			while (i < len && src[i] < 0x80)
+			{
+				dst[o++] = static_cast<unsigned char>(src[i++]);
+			}
+			continue;
+		}
+
+		i++;
+		if (c < 0x800)
+		{
+			dst[o++] = static_cast<unsigned char>(0xC0 | (c >> 6));
+			dst[o++] = static_cast<unsigned char>(0x80 | (c & 0x3F));
+			continue;
+		}
+		if (c >= 0xD800 && c <= 0xDFFF)
+		{
+			if (c <= 0xDBFF && i < len && src[i] >= 0xDC00 && src[i] <= 0xDFFF)
+			{
+				unsigned cp = 0x10000 + ((c - 0xD800) << 10) + (src[i++] - 0xDC00);
+				dst[o++] = static_cast<unsigned char>(0xF0 | (cp >> 18));
+				dst[o++] = static_cast<unsigned char>(0x80 | ((cp >> 12) & 0x3F));
+				dst[o++] = static_cast<unsigned char>(0x80 | ((cp >> 6) & 0x3F));
+				dst[o++] = static_cast<unsigned char>(0x80 | (cp & 0x3F));
+				continue;
+			}
+			c = UTF_REPLACEMENT; /* lone surrogate */
+		}
+		dst[o++] = static_cast<unsigned char>(0xE0 | (c >> 12));
+		dst[o++] = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+		dst[o++] = static_cast<unsigned char>(0x80 | (c & 0x3F));
+	}
+	return o;
+}
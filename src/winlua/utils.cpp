@@ -1,4 +1,5 @@
 #include "winlua.hpp"
+#include <string.h>
 #include <time.h>
 
 /* ------------------------------------------------------------
@@ -25,35 +26,23 @@ int table_field_integer(lua_State *L, int idx, const char *field, lua_Integer& r
 WinLua String Utility Functions
 ------------------------------------------------------------ */
 
+static_assert(sizeof(wchar_t) == sizeof(uint16_t), "wchar_t must hold UTF-16 units");
+
 const char *wstring_to_utf8(lua_State *L, wchar_t *inputs)
 {
-	int needed = WideCharToMultiByte(CP_UTF8, 0, inputs, -1, NULL, 0, NULL, NULL);
-	if (needed == 0)
-	{
-		lua_pushstring(L, "");
-	}
-	else
-	{
-		char *buff = static_cast<char*>(lua_newuserdata(L, sizeof(char) * (needed+1)));
-		WideCharToMultiByte(CP_UTF8, 0, inputs, -1, buff, (needed+1), NULL, NULL);
-		lua_pushstring(L, buff);
-		lua_remove(L, -2);
-	}
+	/* short strings are converted in the auxiliary buffer on the C stack */
+	size_t len = wcslen(inputs);
+	luaL_Buffer b;
+	char *buff = luaL_buffinitsize(L, &b, 3 * len);
+	luaL_pushresultsize(&b, winlua_utf16_to_utf8(reinterpret_cast<uint16_t*>(inputs), len, buff));
 	return lua_tostring (L, -1);
 }
 
 wchar_t *utf8_to_wstring(lua_State *L, const char *inputs)
 {
-	int needed = MultiByteToWideChar(CP_UTF8, 0, inputs, -1, NULL, 0);
-	wchar_t *buff = static_cast<wchar_t*>(lua_newuserdata(L, sizeof(wchar_t) * (needed+1)));
-	if (needed == 0)
-	{
-		buff[0] = L'\0';
-	}
-	else
-	{
-		MultiByteToWideChar(CP_UTF8, 0, inputs, -1, buff, (needed+1));
-	}
+	size_t len = strlen(inputs);
+	wchar_t *buff = static_cast<wchar_t*>(lua_newuserdata(L, sizeof(wchar_t) * (len+1)));
+	buff[winlua_utf8_to_utf16(inputs, len, reinterpret_cast<uint16_t*>(buff))] = L'\0';
 	return buff;
 }
 
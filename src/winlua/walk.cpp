@@ -0,0 +1,777 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* ------------------------------------------------------------
+WinLua Parallel Directory Walker
+
+fs.walk(root [, options]) lists a directory tree on a pool of
+worker threads and returns an iterator over batches of entries:
+
+	for batch in fs.walk("C:\\src", {depth = 3, exclude = ".git"}) do
+		for _, e in ipairs(batch) do print(e.path, e.type, e.size, e.mtime) end
+	end
+
+Every worker owns a deque of directories still to be listed. It
+pushes the subdirectories it finds onto its own deque and takes
+work from the back (depth first, so the directories it just saw
+are still cached); an idle worker steals from the front of the
+other deques, which holds the oldest and usually largest subtrees.
+Entries are handed to the Lua thread in batches through a bounded
+queue, so a slow consumer throttles the workers instead of letting
+the batches pile up.
+
+options:
+	depth    deepest level reported; children of root are level 1
+	follow   descend into symbolic links and junctions (each directory once)
+	include  name pattern or list of patterns for reported entries
+	exclude  name pattern or list of patterns to skip and not descend into
+	stat     fill in size and mtime (default true)
+	threads  number of workers (default: hardware threads)
+	batch    entries per batch (default 256)
+
+Entries are tables with path, type ("file", "directory", "link"
+or "other"), size and mtime (seconds since the epoch). Directories
+that cannot be listed show up as entries of type "error" with the
+system error code in 'error'. Patterns use * and ? and are matched
+against the entry name (case-insensitively on Windows).
+------------------------------------------------------------ */
+#define WINLUA_WALK_META "WinLuaWalk"
+#define WINLUA_WALK_BATCH 256
+#define WINLUA_WALK_QUEUED 64 /* batches waiting for the consumer */
+#define WINLUA_WALK_MAXTHREADS 64
+
+#ifdef _WIN32
+#define WALK_SEP '\\'
+#else
+#define WALK_SEP '/'
+#endif
+
+struct WalkEntry
+{
+	std::string path;
+	uint64_t size;
+	int64_t mtime;
+	int error;
+	char type; /* f, d, l, o or e */
+};
+
+struct WalkTask
+{
+	std::string path;
+	int depth; /* level of the directory itself; root is 0 */
+};
+
+struct WalkQueue
+{
+	std::mutex lock;
+	std::deque<WalkTask> tasks;
+};
+
+struct WinLuaWalk
+{
+	/* options */
+	std::vector<std::string> include, exclude;
+	int maxdepth; /* 0 for no limit */
+	bool follow, stat;
+	size_t batchsize;
+
+	/* work distribution */
+	std::vector<WalkQueue> queues;
+	std::atomic<long> pending; /* directories queued or being listed */
+	std::atomic<long> queued;
+	std::atomic<int> idle;
+	std::atomic<bool> stop;
+	std::mutex idle_lock;
+	std::condition_variable idle_cv;
+
+	/* results */
+	std::mutex result_lock;
+	std::condition_variable result_cv, space_cv;
+	std::deque<std::vector<WalkEntry> > results;
+	int active; /* workers still running, guarded by result_lock */
+	std::vector<WalkEntry> current; /* batch walk_next is converting, kept here in case a Lua error skips it */
+
+	/* directories already entered, only tracked when following links */
+	std::mutex visited_lock;
+	std::set<std::pair<uint64_t, uint64_t> > visited;
+
+	std::vector<std::thread> threads;
+
+	explicit WinLuaWalk(size_t nthreads) : queues(nthreads), pending(0), queued(0), idle(0), stop(false), active(0) {}
+};
+
+/* ------------------------------------------------------------
+Name patterns
+------------------------------------------------------------ */
+
+static inline unsigned char fold(unsigned char c)
+{
+#ifdef _WIN32
+	return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+#else
+	return c;
+#endif
+}
+
+/* '*' matches any run of characters, '?' a single one */
+static bool walk_match(const char *pattern, const char *name)
+{
+	const char *star = NULL, *resume = NULL;
+	while (*name)
+	{
+		if (*pattern == '*')
+		{
+			star = pattern++;
+			resume = name;
+		}
+		else if (*pattern == '?' || (*pattern && fold(*pattern) == fold(*name)))
+		{
+			pattern++; name++;
+		}
+		else if (star != NULL)
+		{
+			pattern = star + 1;
+			name = ++resume;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (*pattern == '*') { pattern++; }
+	return *pattern == '\0';
+}
+
+static bool walk_match_any(const std::vector<std::string>& patterns, const char *name)
+{
+	for (size_t i = 0; i < patterns.size(); i++)
+	{
+		if (walk_match(patterns[i].c_str(), name)) { return true; }
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------
+Workers
+------------------------------------------------------------ */
+
+struct WalkWorker
+{
+	WinLuaWalk *w;
+	size_t index;
+	std::vector<WalkEntry> batch;
+};
+
+static void walk_flush(WalkWorker& self)
+{
+	WinLuaWalk *w = self.w;
+	if (self.batch.empty()) { return; }
+
+	std::unique_lock<std::mutex> lock(w->result_lock);
+	while (w->results.size() >= WINLUA_WALK_QUEUED && !w->stop)
+	{
+		w->space_cv.wait(lock);
+	}
+	w->results.push_back(std::vector<WalkEntry>());
+	w->results.back().swap(self.batch);
+	lock.unlock();
+	w->result_cv.notify_one();
+	self.batch.reserve(w->batchsize);
+}
+
+static void walk_emit(WalkWorker& self, const std::string& path, char type, uint64_t size, int64_t mtime, int error)
+{
+	self.batch.push_back(WalkEntry());
+	WalkEntry& e = self.batch.back();
+	e.path = path;
+	e.type = type;
+	e.size = size;
+	e.mtime = mtime;
+	e.error = error;
+	if (self.batch.size() >= self.w->batchsize)
+	{
+		walk_flush(self);
+	}
+}
+
+static void walk_push(WalkWorker& self, const std::string& path, int depth)
+{
+	WinLuaWalk *w = self.w;
+	w->pending++;
+	{
+		std::lock_guard<std::mutex> lock(w->queues[self.index].lock);
+		WalkTask task;
+		task.path = path;
+		task.depth = depth;
+		w->queues[self.index].tasks.push_back(task);
+		w->queued++;
+	}
+	if (w->idle > 0)
+	{
+		/* taking the lock orders this push before an idle worker's check */
+		{ std::lock_guard<std::mutex> lock(w->idle_lock); }
+		w->idle_cv.notify_one();
+	}
+}
+
+static bool walk_take(WalkWorker& self, WalkTask& task)
+{
+	WinLuaWalk *w = self.w;
+	size_t n = w->queues.size();
+	for (size_t k = 0; k < n; k++)
+	{
+		WalkQueue& q = w->queues[(self.index + k) % n];
+		std::lock_guard<std::mutex> lock(q.lock);
+		if (q.tasks.empty()) { continue; }
+		if (k == 0)
+		{
+			task = q.tasks.back();
+			q.tasks.pop_back();
+		}
+		else
+		{
+			task = q.tasks.front();
+			q.tasks.pop_front();
+		}
+		w->queued--;
+		return true;
+	}
+	return false;
+}
+
+/* true when the directory was not entered before (always true without 'follow') */
+static bool walk_first_visit(WinLuaWalk *w, uint64_t volume, uint64_t id)
+{
+	std::lock_guard<std::mutex> lock(w->visited_lock);
+	return w->visited.insert(std::make_pair(volume, id)).second;
+}
+
+static std::string walk_join(const std::string& dir, const char *name)
+{
+	std::string path;
+	path.reserve(dir.size() + strlen(name) + 1);
+	path = dir;
+	if (!path.empty() && path[path.size() - 1] != '/' && path[path.size() - 1] != WALK_SEP)
+	{
+		path += WALK_SEP;
+	}
+	path += name;
+	return path;
+}
+
+/* report and, for directories, queue an entry of the directory being listed */
+static void walk_visit(WalkWorker& self, const WalkTask& task, const std::string& path, const char *name, char type, uint64_t size, int64_t mtime)
+{
+	WinLuaWalk *w = self.w;
+	int depth = task.depth + 1;
+
+	if (w->include.empty() || walk_match_any(w->include, name))
+	{
+		walk_emit(self, path, type, size, mtime, 0);
+	}
+	if (type == 'd' && (w->maxdepth == 0 || depth < w->maxdepth))
+	{
+		walk_push(self, path, depth);
+	}
+}
+
+#ifdef _WIN32
+
+static int64_t walk_filetime(const FILETIME& ft)
+{
+	uint64_t t = (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+	return static_cast<int64_t>(t / 10000000) - 11644473600LL;
+}
+
+static bool walk_directory_id(const std::vector<uint16_t>& pathW, uint64_t& volume, uint64_t& id)
+{
+	HANDLE file = CreateFileW(reinterpret_cast<LPCWSTR>(&pathW[0]), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return false; }
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ret = GetFileInformationByHandle(file, &info);
+	CloseHandle(file);
+	if (ret == 0) { return false; }
+	volume = info.dwVolumeSerialNumber;
+	id = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+	return true;
+}
+
+static void utf8_to_path(const std::string& path, const char *suffix, std::vector<uint16_t>& out)
+{
+	size_t len = path.size(), extra = strlen(suffix);
+	out.resize(len + extra + 1);
+	size_t n = winlua_utf8_to_utf16(path.data(), len, &out[0]);
+	n += winlua_utf8_to_utf16(suffix, extra, &out[n]);
+	out[n] = 0;
+}
+
+static void walk_directory(WalkWorker& self, const WalkTask& task)
+{
+	WinLuaWalk *w = self.w;
+	std::vector<uint16_t> specW;
+	utf8_to_path(task.path, "\\*", specW);
+
+	WIN32_FIND_DATAW data;
+	HANDLE handle = FindFirstFileExW(reinterpret_cast<LPCWSTR>(&specW[0]), FindExInfoBasic, &data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		DWORD err = GetLastError();
+		if (err != ERROR_FILE_NOT_FOUND) /* an empty drive root has no entries at all */
+		{
+			walk_emit(self, task.path, 'e', 0, 0, static_cast<int>(err));
+		}
+		return;
+	}
+
+	std::vector<char> name;
+	std::vector<uint16_t> childW;
+	do
+	{
+		const uint16_t *nameW = reinterpret_cast<const uint16_t*>(data.cFileName);
+		if (nameW[0] == '.' && (nameW[1] == 0 || (nameW[1] == '.' && nameW[2] == 0))) { continue; }
+
+		size_t len = 0;
+		while (nameW[len]) { len++; }
+		name.resize(3 * len + 1);
+		name[winlua_utf16_to_utf8(nameW, len, &name[0])] = '\0';
+		if (!w->exclude.empty() && walk_match_any(w->exclude, &name[0])) { continue; }
+
+		std::string path = walk_join(task.path, &name[0]);
+		DWORD attr = data.dwFileAttributes;
+		char type = (attr & FILE_ATTRIBUTE_DIRECTORY) ? 'd' : 'f';
+		if (attr & FILE_ATTRIBUTE_REPARSE_POINT)
+		{
+			/* symbolic links and junctions; only directory links can be descended */
+			type = (w->follow && (attr & FILE_ATTRIBUTE_DIRECTORY)) ? 'd' : 'l';
+		}
+		if (type == 'd' && w->follow)
+		{
+			uint64_t volume, id;
+			utf8_to_path(path, "", childW);
+			if (walk_directory_id(childW, volume, id) && !walk_first_visit(w, volume, id))
+			{
+				type = 'l'; /* already entered: report the link, do not descend again */
+			}
+		}
+
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		if (w->stat)
+		{
+			size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+			mtime = walk_filetime(data.ftLastWriteTime);
+		}
+		walk_visit(self, task, path, &name[0], type, size, mtime);
+	}
+	while (!w->stop && FindNextFileW(handle, &data));
+
+	FindClose(handle);
+}
+
+static void walk_root(WinLuaWalk *w, const std::string& root)
+{
+	if (w->follow)
+	{
+		std::vector<uint16_t> rootW;
+		utf8_to_path(root, "", rootW);
+		uint64_t volume, id;
+		if (walk_directory_id(rootW, volume, id)) { walk_first_visit(w, volume, id); }
+	}
+}
+
+#else
+
+static char walk_mode_type(mode_t mode)
+{
+	if (S_ISREG(mode)) { return 'f'; }
+	if (S_ISDIR(mode)) { return 'd'; }
+	if (S_ISLNK(mode)) { return 'l'; }
+	return 'o';
+}
+
+/* handle one name of the open directory 'fd'; 'hint' is the dirent type or 'u' */
+static void walk_name(WalkWorker& self, const WalkTask& task, int fd, const char *name, char hint)
+{
+	WinLuaWalk *w = self.w;
+	if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) { return; }
+	if (!w->exclude.empty() && walk_match_any(w->exclude, name)) { return; }
+
+	char type = hint;
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	bool follow = w->follow && (hint == 'l' || hint == 'u');
+	if (w->stat || hint == 'u' || follow || (w->follow && hint == 'd'))
+	{
+		struct stat st;
+		int ret = fstatat(fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+		if (ret != 0 && follow)
+		{
+			ret = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW); /* dangling link */
+		}
+		if (ret == 0)
+		{
+			type = walk_mode_type(st.st_mode);
+			size = w->stat ? static_cast<uint64_t>(st.st_size) : 0;
+			mtime = w->stat ? static_cast<int64_t>(st.st_mtime) : 0;
+			if (type == 'd' && w->follow && !walk_first_visit(w, st.st_dev, st.st_ino))
+			{
+				type = 'l'; /* already entered: report the link, do not descend again */
+			}
+		}
+		else if (type == 'u')
+		{
+			type = 'o';
+		}
+	}
+
+	walk_visit(self, task, walk_join(task.path, name), name, type, size, mtime);
+}
+
+static char walk_dirent_type(unsigned char d_type)
+{
+	switch (d_type)
+	{
+		case DT_REG: return 'f';
+		case DT_DIR: return 'd';
+		case DT_LNK: return 'l';
+		case DT_UNKNOWN: return 'u';
+		default: return 'o';
+	}
+}
+
+#ifdef __linux__
+/* the kernel's record layout for getdents64 */
+struct walk_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
+static void walk_directory(WalkWorker& self, const WalkTask& task)
+{
+	WinLuaWalk *w = self.w;
+	int fd = openat(AT_FDCWD, task.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		walk_emit(self, task.path, 'e', 0, 0, errno);
+		return;
+	}
+
+#ifdef __linux__
+	/* getdents64 returns many entries per call without readdir's per-stream allocation */
+	union { char bytes[32 * 1024]; uint64_t align; } buffer;
+	for (;;)
+	{
+		long n = syscall(SYS_getdents64, fd, buffer.bytes, sizeof(buffer.bytes));
+		if (n <= 0)
+		{
+			if (n < 0) { walk_emit(self, task.path, 'e', 0, 0, errno); }
+			break;
+		}
+		for (long offset = 0; offset < n && !w->stop;)
+		{
+			const walk_dirent64 *d = reinterpret_cast<const walk_dirent64*>(buffer.bytes + offset);
+			walk_name(self, task, fd, d->d_name, walk_dirent_type(d->d_type));
+			offset += d->d_reclen;
+		}
+		if (w->stop) { break; }
+	}
+	close(fd);
+#else
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL)
+	{
+		walk_emit(self, task.path, 'e', 0, 0, errno);
+		close(fd);
+		return;
+	}
+	struct dirent *d;
+	while (!w->stop && (d = readdir(dir)) != NULL)
+	{
+		walk_name(self, task, dirfd(dir), d->d_name, walk_dirent_type(d->d_type));
+	}
+	closedir(dir);
+#endif
+}
+
+static void walk_root(WinLuaWalk *w, const std::string& root)
+{
+	struct stat st;
+	if (w->follow && stat(root.c_str(), &st) == 0)
+	{
+		walk_first_visit(w, st.st_dev, st.st_ino);
+	}
+}
+
+#endif
+
+static void walk_worker(WinLuaWalk *w, size_t index)
+{
+	WalkWorker self;
+	self.w = w;
+	self.index = index;
+	self.batch.reserve(w->batchsize);
+
+	while (!w->stop)
+	{
+		WalkTask task;
+		if (walk_take(self, task))
+		{
+			walk_directory(self, task);
+			if (--w->pending == 0)
+			{
+				/* last directory: wake the idle workers so they can exit */
+				{ std::lock_guard<std::mutex> lock(w->idle_lock); }
+				w->idle_cv.notify_all();
+			}
+			continue;
+		}
+
+		/* nothing to take: hand over what we have, then sleep until there is work or the walk is done */
+		walk_flush(self);
+		std::unique_lock<std::mutex> lock(w->idle_lock);
+		w->idle++;
+		while (w->queued == 0 && w->pending != 0 && !w->stop)
+		{
+			w->idle_cv.wait(lock);
+		}
+		w->idle--;
+		if (w->pending == 0) { break; }
+	}
+
+	walk_flush(self);
+	std::lock_guard<std::mutex> lock(w->result_lock);
+	w->active--;
+	w->result_cv.notify_one();
+}
+
+static void walk_shutdown(WinLuaWalk *w)
+{
+	w->stop = true;
+	{ std::lock_guard<std::mutex> lock(w->idle_lock); }
+	w->idle_cv.notify_all();
+	{ std::lock_guard<std::mutex> lock(w->result_lock); }
+	w->space_cv.notify_all();
+	for (size_t i = 0; i < w->threads.size(); i++)
+	{
+		w->threads[i].join();
+	}
+	w->threads.clear();
+}
+
+/* ------------------------------------------------------------
+Walk userdata & iterator
+------------------------------------------------------------ */
+
+static int walk__gc(lua_State *L)
+{
+	WinLuaWalk **box = static_cast<WinLuaWalk**>(luaL_checkudata(L, 1, WINLUA_WALK_META));
+	if (*box != NULL)
+	{
+		walk_shutdown(*box);
+		delete *box;
+		*box = NULL;
+	}
+	return 0;
+}
+
+static const char *walk_type_name(char type)
+{
+	switch (type)
+	{
+		case 'f': return "file";
+		case 'd': return "directory";
+		case 'l': return "link";
+		case 'e': return "error";
+		default: return "other";
+	}
+}
+
+static int walk_next(lua_State *L)
+{
+	WinLuaWalk **box = static_cast<WinLuaWalk**>(luaL_checkudata(L, lua_upvalueindex(1), WINLUA_WALK_META));
+	WinLuaWalk *w = *box;
+	if (w == NULL) { return 0; }
+
+	std::vector<WalkEntry>& batch = w->current;
+	batch.clear();
+	{
+		std::unique_lock<std::mutex> lock(w->result_lock);
+		while (w->results.empty() && w->active > 0)
+		{
+			w->result_cv.wait(lock);
+		}
+		if (!w->results.empty())
+		{
+			batch.swap(w->results.front());
+			w->results.pop_front();
+		}
+	}
+	w->space_cv.notify_one();
+
+	if (batch.empty())
+	{
+		/* all workers are done; release them now rather than at collection */
+		walk_shutdown(w);
+		delete w;
+		*box = NULL;
+		return 0;
+	}
+
+	lua_createtable(L, static_cast<int>(batch.size()), 0);
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		const WalkEntry& e = batch[i];
+		lua_createtable(L, 0, 4);
+		lua_pushlstring(L, e.path.data(), e.path.size());
+		lua_setfield(L, -2, "path");
+		lua_pushstring(L, walk_type_name(e.type));
+		lua_setfield(L, -2, "type");
+		if (e.type == 'e')
+		{
+			lua_pushinteger(L, e.error);
+			lua_setfield(L, -2, "error");
+		}
+		else
+		{
+			lua_pushinteger(L, static_cast<lua_Integer>(e.size));
+			lua_setfield(L, -2, "size");
+			lua_pushinteger(L, static_cast<lua_Integer>(e.mtime));
+			lua_setfield(L, -2, "mtime");
+		}
+		lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+	}
+	batch.clear();
+	return 1;
+}
+
+static void get_patterns(lua_State *L, int idx, const char *field, std::vector<std::string>& patterns)
+{
+	int t = lua_getfield(L, idx, field);
+	if (t == LUA_TSTRING)
+	{
+		patterns.push_back(lua_tostring(L, -1));
+	}
+	else if (t == LUA_TTABLE)
+	{
+		for (lua_Integer i = 1; lua_rawgeti(L, -1, i) != LUA_TNIL; i++)
+		{
+			const char *pattern = lua_tostring(L, -1);
+			if (pattern == NULL)
+			{
+				luaL_error(L, "'%s' patterns must be strings", field);
+			}
+			patterns.push_back(pattern);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	else if (t != LUA_TNIL)
+	{
+		luaL_error(L, "'%s' must be a string or a list of strings", field);
+	}
+	lua_pop(L, 1);
+}
+
+int winlua_fs_walk(lua_State *L)
+{
+	const char *root = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2))
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+	bool hasopts = lua_istable(L, 2);
+
+	size_t nthreads = std::thread::hardware_concurrency();
+	lua_Integer threads = hasopts ? winlua_option_integer(L, 2, "threads", 0) : 0;
+	if (threads > 0) { nthreads = static_cast<size_t>(threads); }
+	if (nthreads < 1) { nthreads = 1; }
+	if (nthreads > WINLUA_WALK_MAXTHREADS) { nthreads = WINLUA_WALK_MAXTHREADS; }
+
+	/* the box goes on the stack first so a failed option check still frees the walker */
+	WinLuaWalk **box = static_cast<WinLuaWalk**>(lua_newuserdata(L, sizeof(WinLuaWalk*)));
+	*box = NULL;
+	if (luaL_newmetatable(L, WINLUA_WALK_META))
+	{
+		lua_pushcfunction(L, walk__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	WinLuaWalk *w = *box = new WinLuaWalk(nthreads);
+
+	w->maxdepth = 0;
+	w->follow = false;
+	w->stat = true;
+	w->batchsize = WINLUA_WALK_BATCH;
+	if (hasopts)
+	{
+		lua_Integer depth = winlua_option_integer(L, 2, "depth", 0);
+		luaL_argcheck(L, depth >= 0, 2, "'depth' must not be negative");
+		w->maxdepth = static_cast<int>(depth);
+		lua_Integer batch = winlua_option_integer(L, 2, "batch", WINLUA_WALK_BATCH);
+		luaL_argcheck(L, batch > 0, 2, "'batch' must be positive");
+		w->batchsize = static_cast<size_t>(batch);
+		w->follow = winlua_option_boolean(L, 2, "follow", false);
+		w->stat = winlua_option_boolean(L, 2, "stat", true);
+		get_patterns(L, 2, "include", w->include);
+		get_patterns(L, 2, "exclude", w->exclude);
+	}
+
+	walk_root(w, root);
+	WalkTask task;
+	task.path = root;
+	task.depth = 0;
+	w->queues[0].tasks.push_back(task);
+	w->pending = 1;
+	w->queued = 1;
+
+	w->active = static_cast<int>(nthreads);
+	for (size_t i = 0; i < nthreads; i++)
+	{
+		try
+		{
+			w->threads.push_back(std::thread(walk_worker, w, i));
+		}
+		catch (...)
+		{
+			/* run with the workers we have; the rest can be stolen from queue i */
+			std::lock_guard<std::mutex> lock(w->result_lock);
+			w->active -= static_cast<int>(nthreads - i);
+			break;
+		}
+	}
+	if (w->threads.empty())
+	{
+		return luaL_error(L, "could not start walker threads");
+	}
+
+	lua_pushcclosure(L, walk_next, 1);
+	return 1;
+}
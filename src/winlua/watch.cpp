@@ -0,0 +1,662 @@
+#include "winlua.hpp"
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+/* ------------------------------------------------------------
+WinLua File System Watcher
+
+fs.watch(path [, options]) watches a directory and returns a
+watcher whose next_batch method hands over the changes since the
+last call:
+
+	local w = fs.watch("C:\\inbox", {recursive = true})
+	while true do
+		local batch, dropped = w:next_batch(1000)
+		if batch then
+			for _, e in ipairs(batch) do print(e.action, e.path) end
+		end
+	end
+
+A background thread reads the changes (ReadDirectoryChangesW on
+Windows, inotify on Linux) into a fixed-size ring of pending
+events. A change to a path that already has an undelivered event
+is folded into it: repeated actions count once and "modified"
+after "added" stays "added". next_batch waits until the changes
+have been quiet for 'debounce' milliseconds (or a full batch is
+ready, or the oldest change has waited ten debounce periods) so a
+burst of writes arrives as one batch.
+
+Actions are "added", "removed", "modified", "renamed_from",
+"renamed_to" and "overflow". Paths are relative to the watched
+directory. An "overflow" event (with an empty path) means the
+system dropped changes and the directory should be rescanned;
+'dropped' counts the changes lost because the ring was full.
+
+options:
+	recursive  watch subdirectories too (default false)
+	debounce   quiet time in milliseconds before a batch is released (default 50)
+	batch      most events per batch (default 1024)
+	capacity   pending events kept before new ones are dropped (default 65536)
+
+w:next_batch([timeout]) -> events, dropped, or nil, "timeout" after
+'timeout' milliseconds (default: wait for changes). w:close() stops
+the watcher; it is also stopped when collected.
+------------------------------------------------------------ */
+#define WINLUA_WATCH_META "WinLuaWatch"
+#define WINLUA_WATCH_DEBOUNCE 50
+#define WINLUA_WATCH_BATCH 1024
+#define WINLUA_WATCH_CAPACITY 65536
+#define WINLUA_WATCH_MAXDELAY 10 /* in debounce periods */
+#define WINLUA_WATCH_BUFFER (64 * 1024)
+
+typedef std::chrono::steady_clock WatchClock;
+
+enum WatchAction
+{
+	WATCH_ADDED,
+	WATCH_REMOVED,
+	WATCH_MODIFIED,
+	WATCH_RENAMED_FROM,
+	WATCH_RENAMED_TO,
+	WATCH_OVERFLOW
+};
+
+static const char *const watch_actions[] = {"added", "removed", "modified", "renamed_from", "renamed_to", "overflow"};
+
+struct WatchEvent
+{
+	std::string path;
+	int action;
+};
+
+struct WinLuaWatch
+{
+	/* options */
+	bool recursive;
+	WatchClock::duration debounce;
+	size_t batchsize;
+
+	/* ring of pending events; event number 'first' is at ring[first % capacity] */
+	std::mutex lock;
+	std::condition_variable changed;
+	std::vector<WatchEvent> ring;
+	uint64_t first, next;
+	std::unordered_map<std::string, uint64_t> pending; /* path -> its undelivered event */
+	size_t dropped;
+	WatchClock::time_point oldest, latest;
+	bool running;
+	int error; /* set when the backend stopped on its own */
+	std::vector<WatchEvent> current; /* batch next_batch is converting, kept here in case a Lua error skips it */
+
+	std::thread thread;
+#ifdef _WIN32
+	HANDLE dir, stop;
+#else
+	int fd, wakeup[2];
+	std::unordered_map<int, std::string> dirs; /* inotify watch -> relative directory */
+#endif
+
+	explicit WinLuaWatch(size_t capacity) : ring(capacity), first(0), next(0), dropped(0), running(true), error(0) {}
+};
+
+/* ------------------------------------------------------------
+Event ring
+------------------------------------------------------------ */
+
+/* add one event; the caller holds the lock */
+static void watch_push(WinLuaWatch *w, const std::string& path, int action, WatchClock::time_point now)
+{
+	std::unordered_map<std::string, uint64_t>::iterator it = w->pending.find(path);
+	if (it != w->pending.end() && it->second >= w->first)
+	{
+		int prev = w->ring[it->second % w->ring.size()].action;
+		if (prev == action || (prev == WATCH_ADDED && action == WATCH_MODIFIED))
+		{
+			w->latest = now;
+			return;
+		}
+	}
+	if (w->next - w->first == w->ring.size())
+	{
+		w->dropped++;
+		return;
+	}
+
+	if (w->next == w->first) { w->oldest = now; }
+	w->latest = now;
+	WatchEvent& e = w->ring[w->next % w->ring.size()];
+	e.path = path;
+	e.action = action;
+	w->pending[path] = w->next++;
+}
+
+static void watch_fail(WinLuaWatch *w, int err)
+{
+	{
+		std::lock_guard<std::mutex> guard(w->lock);
+		w->error = err;
+		w->running = false;
+	}
+	w->changed.notify_all();
+}
+
+/* ------------------------------------------------------------
+Backends
+------------------------------------------------------------ */
+
+#ifdef _WIN32
+
+static void watch_thread(WinLuaWatch *w)
+{
+	std::vector<DWORD> buffer(WINLUA_WATCH_BUFFER / sizeof(DWORD));
+	std::vector<char> name;
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (ov.hEvent == NULL)
+	{
+		watch_fail(w, static_cast<int>(GetLastError()));
+		return;
+	}
+
+	const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+		FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_CREATION;
+	for (;;)
+	{
+		ResetEvent(ov.hEvent);
+		if (ReadDirectoryChangesW(w->dir, &buffer[0], WINLUA_WATCH_BUFFER, w->recursive ? TRUE : FALSE, filter, NULL, &ov, NULL) == 0)
+		{
+			watch_fail(w, static_cast<int>(GetLastError()));
+			break;
+		}
+		HANDLE handles[2] = {ov.hEvent, w->stop};
+		DWORD n = 0;
+		if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+		{
+			CancelIoEx(w->dir, &ov);
+			GetOverlappedResult(w->dir, &ov, &n, TRUE);
+			break;
+		}
+
+		WatchClock::time_point now = WatchClock::now();
+		if (GetOverlappedResult(w->dir, &ov, &n, FALSE) == 0)
+		{
+			DWORD err = GetLastError();
+			if (err != ERROR_NOTIFY_ENUM_DIR)
+			{
+				watch_fail(w, static_cast<int>(err));
+				break;
+			}
+			n = 0;
+		}
+		{
+			std::lock_guard<std::mutex> guard(w->lock);
+			if (n == 0)
+			{
+				/* the system buffer overflowed; what changed is unknown */
+				watch_push(w, std::string(), WATCH_OVERFLOW, now);
+			}
+			for (DWORD offset = 0; n > 0;)
+			{
+				const FILE_NOTIFY_INFORMATION *info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const char*>(&buffer[0]) + offset);
+				size_t units = info->FileNameLength / sizeof(WCHAR);
+				name.resize(3 * units + 1);
+				size_t len = winlua_utf16_to_utf8(reinterpret_cast<const uint16_t*>(info->FileName), units, &name[0]);
+				int action;
+				switch (info->Action)
+				{
+					case FILE_ACTION_ADDED: action = WATCH_ADDED; break;
+					case FILE_ACTION_REMOVED: action = WATCH_REMOVED; break;
+					case FILE_ACTION_RENAMED_OLD_NAME: action = WATCH_RENAMED_FROM; break;
+					case FILE_ACTION_RENAMED_NEW_NAME: action = WATCH_RENAMED_TO; break;
+					default: action = WATCH_MODIFIED; break;
+				}
+				watch_push(w, std::string(&name[0], len), action, now);
+				if (info->NextEntryOffset == 0) { break; }
+				offset += info->NextEntryOffset;
+			}
+		}
+		w->changed.notify_all();
+	}
+	CloseHandle(ov.hEvent);
+}
+
+static bool watch_start(WinLuaWatch *w, const char *path, int *err)
+{
+	std::vector<uint16_t> pathW(strlen(path) + 1);
+	pathW[winlua_utf8_to_utf16(path, strlen(path), &pathW[0])] = 0;
+	w->stop = NULL;
+	w->dir = CreateFileW(reinterpret_cast<LPCWSTR>(&pathW[0]), FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (w->dir == INVALID_HANDLE_VALUE)
+	{
+		*err = static_cast<int>(GetLastError());
+		return false;
+	}
+	w->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (w->stop == NULL)
+	{
+		*err = static_cast<int>(GetLastError());
+		CloseHandle(w->dir);
+		w->dir = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	return true;
+}
+
+static void watch_wake(WinLuaWatch *w)
+{
+	SetEvent(w->stop);
+}
+
+static void watch_release(WinLuaWatch *w)
+{
+	if (w->stop != NULL) { CloseHandle(w->stop); }
+	if (w->dir != INVALID_HANDLE_VALUE) { CloseHandle(w->dir); }
+	w->stop = NULL;
+	w->dir = INVALID_HANDLE_VALUE;
+}
+
+#elif defined(__linux__)
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+static std::string watch_join(const std::string& dir, const char *name)
+{
+	return dir.empty() ? std::string(name) : dir + '/' + name;
+}
+
+/*
+** watch 'rel' and, when recursive, its subdirectories. 'report' adds
+** an "added" event for everything found: entries created in a new
+** directory before its watch was in place would otherwise be missed.
+*/
+static void watch_add_tree(WinLuaWatch *w, const std::string& root, const std::string& rel, bool report, WatchClock::time_point now)
+{
+	std::string full = rel.empty() ? root : root + '/' + rel;
+	int wd = inotify_add_watch(w->fd, full.c_str(), WATCH_MASK);
+	if (wd < 0) { return; }
+	w->dirs[wd] = rel;
+	if (!w->recursive && !report) { return; }
+
+	DIR *d = opendir(full.c_str());
+	if (d == NULL) { return; }
+	std::vector<std::string> subdirs;
+	for (struct dirent *e = readdir(d); e != NULL; e = readdir(d))
+	{
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) { continue; }
+		std::string child = watch_join(rel, e->d_name);
+		if (report)
+		{
+			std::lock_guard<std::mutex> guard(w->lock);
+			watch_push(w, child, WATCH_ADDED, now);
+		}
+		if (w->recursive && e->d_type == DT_DIR)
+		{
+			subdirs.push_back(child);
+		}
+	}
+	closedir(d);
+	for (size_t i = 0; i < subdirs.size(); i++)
+	{
+		watch_add_tree(w, root, subdirs[i], report, now);
+	}
+}
+
+static void watch_thread(WinLuaWatch *w, std::string root)
+{
+	std::vector<char> buffer(WINLUA_WATCH_BUFFER);
+	std::vector<std::string> created; /* new directories to watch once the lock is released */
+	for (;;)
+	{
+		struct pollfd fds[2];
+		fds[0].fd = w->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = w->wakeup[0];
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR) { continue; }
+			watch_fail(w, errno);
+			return;
+		}
+		if (fds[1].revents != 0) { return; }
+
+		ssize_t n = read(w->fd, &buffer[0], buffer.size());
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR) { continue; }
+			watch_fail(w, errno);
+			return;
+		}
+
+		WatchClock::time_point now = WatchClock::now();
+		{
+			std::lock_guard<std::mutex> guard(w->lock);
+			for (ssize_t offset = 0; offset < n;)
+			{
+				const struct inotify_event *ev = reinterpret_cast<const struct inotify_event*>(&buffer[offset]);
+				offset += static_cast<ssize_t>(sizeof(struct inotify_event) + ev->len);
+				if (ev->mask & IN_Q_OVERFLOW)
+				{
+					watch_push(w, std::string(), WATCH_OVERFLOW, now);
+					continue;
+				}
+				std::unordered_map<int, std::string>::iterator dir = w->dirs.find(ev->wd);
+				if (dir == w->dirs.end()) { continue; }
+				if (ev->mask & IN_IGNORED)
+				{
+					w->dirs.erase(dir);
+					continue;
+				}
+				if (ev->len == 0) { continue; }
+
+				std::string path = watch_join(dir->second, ev->name);
+				int action;
+				if (ev->mask & IN_CREATE) { action = WATCH_ADDED; }
+				else if (ev->mask & IN_DELETE) { action = WATCH_REMOVED; }
+				else if (ev->mask & IN_MOVED_FROM) { action = WATCH_RENAMED_FROM; }
+				else if (ev->mask & IN_MOVED_TO) { action = WATCH_RENAMED_TO; }
+				else { action = WATCH_MODIFIED; }
+				watch_push(w, path, action, now);
+				if (w->recursive && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+				{
+					created.push_back(path);
+				}
+			}
+		}
+		for (size_t i = 0; i < created.size(); i++)
+		{
+			watch_add_tree(w, root, created[i], true, now);
+		}
+		created.clear();
+		w->changed.notify_all();
+	}
+}
+
+static bool watch_start(WinLuaWatch *w, const char *path, int *err)
+{
+	w->wakeup[0] = w->wakeup[1] = -1;
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd < 0 || pipe2(w->wakeup, O_CLOEXEC) != 0)
+	{
+		*err = errno;
+		return false;
+	}
+	/* the first watch reports errors; watch_add_tree gets the same descriptor back */
+	if (inotify_add_watch(w->fd, path, WATCH_MASK) < 0)
+	{
+		*err = errno;
+		return false;
+	}
+	watch_add_tree(w, path, std::string(), false, WatchClock::now());
+	return true;
+}
+
+static void watch_wake(WinLuaWatch *w)
+{
+	char c = 0;
+	ssize_t n = write(w->wakeup[1], &c, 1);
+	(void) n;
+}
+
+static void watch_release(WinLuaWatch *w)
+{
+	if (w->fd >= 0) { close(w->fd); }
+	if (w->wakeup[0] >= 0) { close(w->wakeup[0]); }
+	if (w->wakeup[1] >= 0) { close(w->wakeup[1]); }
+	w->fd = w->wakeup[0] = w->wakeup[1] = -1;
+}
+
+#else
+
+/* no backend on this system: fs.watch reports ENOSYS */
+static void watch_thread(WinLuaWatch *w, std::string root)
+{
+	(void) w;
+	(void) root;
+}
+
+static bool watch_start(WinLuaWatch *w, const char *path, int *err)
+{
+	(void) path;
+	w->fd = w->wakeup[0] = w->wakeup[1] = -1;
+	*err = ENOSYS;
+	return false;
+}
+
+static void watch_wake(WinLuaWatch *w)
+{
+	(void) w;
+}
+
+static void watch_release(WinLuaWatch *w)
+{
+	(void) w;
+}
+
+#endif
+
+static void watch_shutdown(WinLuaWatch *w)
+{
+	if (w->thread.joinable())
+	{
+		watch_wake(w);
+		w->thread.join();
+	}
+	watch_release(w);
+}
+
+/* ------------------------------------------------------------
+Watch userdata
+------------------------------------------------------------ */
+
+static WinLuaWatch **check_watch(lua_State *L)
+{
+	return static_cast<WinLuaWatch**>(luaL_checkudata(L, 1, WINLUA_WATCH_META));
+}
+
+static int watch__gc(lua_State *L)
+{
+	WinLuaWatch **box = check_watch(L);
+	if (*box != NULL)
+	{
+		watch_shutdown(*box);
+		delete *box;
+		*box = NULL;
+	}
+	return 0;
+}
+
+static int watch_next_batch(lua_State *L)
+{
+	WinLuaWatch *w = *check_watch(L);
+	luaL_argcheck(L, w != NULL, 1, "watcher is closed");
+	bool forever = lua_isnoneornil(L, 2);
+	lua_Integer timeout = forever ? 0 : luaL_checkinteger(L, 2);
+	WatchClock::time_point deadline = WatchClock::now() + std::chrono::milliseconds(timeout > 0 ? timeout : 0);
+
+	std::vector<WatchEvent>& batch = w->current;
+	size_t dropped;
+	int error;
+	{
+		std::unique_lock<std::mutex> guard(w->lock);
+		for (;;)
+		{
+			WatchClock::time_point now = WatchClock::now();
+			bool expired = !forever && now >= deadline;
+			size_t count = static_cast<size_t>(w->next - w->first);
+			if (count > 0)
+			{
+				WatchClock::time_point due = w->latest + w->debounce;
+				WatchClock::time_point overdue = w->oldest + w->debounce * WINLUA_WATCH_MAXDELAY;
+				if (due > overdue) { due = overdue; }
+				if (count >= w->batchsize || now >= due || expired || !w->running) { break; }
+				w->changed.wait_until(guard, (!forever && deadline < due) ? deadline : due);
+			}
+			else if (expired || !w->running || w->dropped > 0)
+			{
+				break;
+			}
+			else if (forever)
+			{
+				w->changed.wait(guard);
+			}
+			else
+			{
+				w->changed.wait_until(guard, deadline);
+			}
+		}
+
+		size_t count = static_cast<size_t>(w->next - w->first);
+		if (count > w->batchsize) { count = w->batchsize; }
+		batch.resize(count);
+		for (size_t i = 0; i < count; i++, w->first++)
+		{
+			WatchEvent& e = w->ring[w->first % w->ring.size()];
+			std::unordered_map<std::string, uint64_t>::iterator it = w->pending.find(e.path);
+			if (it != w->pending.end() && it->second == w->first)
+			{
+				w->pending.erase(it);
+			}
+			batch[i].path.swap(e.path);
+			batch[i].action = e.action;
+		}
+		if (w->next != w->first) { w->oldest = WatchClock::now(); }
+		dropped = w->dropped;
+		w->dropped = 0;
+		error = w->running ? 0 : w->error;
+	}
+
+	if (batch.empty() && dropped == 0)
+	{
+		lua_pushnil(L);
+		if (error != 0)
+		{
+			lua_pushfstring(L, "watcher stopped (%d)", error);
+			lua_pushinteger(L, error);
+			return 3;
+		}
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+
+	lua_createtable(L, static_cast<int>(batch.size()), 0);
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		lua_createtable(L, 0, 2);
+		lua_pushlstring(L, batch[i].path.data(), batch[i].path.size());
+		lua_setfield(L, -2, "path");
+		lua_pushstring(L, watch_actions[batch[i].action]);
+		lua_setfield(L, -2, "action");
+		lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+	}
+	batch.clear();
+	lua_pushinteger(L, static_cast<lua_Integer>(dropped));
+	return 2;
+}
+
+static int watch_close(lua_State *L)
+{
+	return watch__gc(L);
+}
+
+static int watch__tostring(lua_State *L)
+{
+	WinLuaWatch *w = *check_watch(L);
+	if (w == NULL)
+	{
+		lua_pushliteral(L, "watcher (closed)");
+	}
+	else
+	{
+		lua_pushfstring(L, "watcher: %p", w);
+	}
+	return 1;
+}
+
+static const luaL_Reg watch_methods[] = {
+	{"next_batch", watch_next_batch},
+	{"close", watch_close},
+	{"__gc", watch__gc},
+	{"__tostring", watch__tostring},
+	{NULL, NULL}
+};
+
+int winlua_fs_watch(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer debounce = WINLUA_WATCH_DEBOUNCE, batch = WINLUA_WATCH_BATCH, capacity = WINLUA_WATCH_CAPACITY;
+	bool recursive = false;
+	if (!lua_isnoneornil(L, 2))
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		debounce = winlua_option_integer(L, 2, "debounce", debounce);
+		batch = winlua_option_integer(L, 2, "batch", batch);
+		capacity = winlua_option_integer(L, 2, "capacity", capacity);
+		lua_getfield(L, 2, "recursive");
+		recursive = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 1);
+		luaL_argcheck(L, debounce >= 0, 2, "'debounce' must not be negative");
+		luaL_argcheck(L, batch > 0, 2, "'batch' must be positive");
+		luaL_argcheck(L, capacity > 0, 2, "'capacity' must be positive");
+	}
+
+	/* the box goes on the stack first so a failed start still frees the watcher */
+	WinLuaWatch **box = static_cast<WinLuaWatch**>(lua_newuserdata(L, sizeof(WinLuaWatch*)));
+	*box = NULL;
+	if (luaL_newmetatable(L, WINLUA_WATCH_META))
+	{
+		luaL_setfuncs(L, watch_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	WinLuaWatch *w = *box = new WinLuaWatch(static_cast<size_t>(capacity));
+	w->recursive = recursive;
+	w->debounce = std::chrono::milliseconds(debounce);
+	w->batchsize = static_cast<size_t>(batch);
+
+	int err = 0;
+	if (!watch_start(w, path, &err))
+	{
+		watch_release(w);
+		lua_pushnil(L);
+		lua_pushfstring(L, "could not watch '%s' (%d)", path, err);
+		lua_pushinteger(L, err);
+		return 3;
+	}
+	try
+	{
+#ifdef _WIN32
+		w->thread = std::thread(watch_thread, w);
+#else
+		w->thread = std::thread(watch_thread, w, std::string(path));
+#endif
+	}
+	catch (...)
+	{
+		watch_release(w);
+		return luaL_error(L, "could not start the watcher thread");
+	}
+	return 1;
+}
@@ -2,7 +2,11 @@
 #define WINLUA_HPP_INCLUDED
 
 #include <lua.hpp>
+#include <stdint.h>
+#include <stdio.h>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 /* ------------------------------------------------------------
 WinLua String Utility Functions
@@ -10,20 +14,229 @@ WinLua String Utility Functions
 const char *wstring_to_utf8(lua_State *L, wchar_t *inputs);
 wchar_t *utf8_to_wstring(lua_State *L, const char *inputs);
 
+/* one-pass transcoders; 'dst' must hold 'len' UTF-16 units or 3 * 'len' bytes respectively */
+size_t winlua_utf8_to_utf16(const char *src, size_t len, uint16_t *dst);
+size_t winlua_utf16_to_utf8(const uint16_t *src, size_t len, char *dst);
+
+/* ------------------------------------------------------------
+WinLua Scratch Arena
+
+Temporary buffers (wide strings, API output buffers) that are only
+needed while a C function runs come from a per-state bump arena
+instead of Lua userdata. Open one WinLuaScratch at the start of the
+function; its allocations are released when it goes out of scope,
+or, when a Lua error or yield skips the destructor, as soon as the
+next scope is opened further up the C stack. Helpers that run while
+a scope is open take it as a parameter instead of opening their own,
+and no scope may be open across a yield.
+------------------------------------------------------------ */
+struct WinLuaArena;
+
+class WinLuaScratch
+{
+public:
+	explicit WinLuaScratch(lua_State *L);
+	~WinLuaScratch();
+
+	void *alloc(size_t size);
+
+	/* NUL-terminated UTF-16 copy of a UTF-8 string */
+	uint16_t *utf16(const char *inputs);
+#ifdef _WIN32
+	wchar_t *wstring(const char *inputs) { return reinterpret_cast<wchar_t*>(utf16(inputs)); }
+#endif
+
+private:
+	lua_State *L;
+	WinLuaArena *arena;
+
+	WinLuaScratch(const WinLuaScratch&);
+	WinLuaScratch& operator=(const WinLuaScratch&);
+};
+
+/* ------------------------------------------------------------
+WinLua Parallel Loops
+------------------------------------------------------------ */
+typedef void (*WinLuaRangeFunction)(void *ud, size_t begin, size_t end);
+
+/* worker count winlua_parallel_for would use, including the caller */
+size_t winlua_parallel_threads(size_t count, size_t grain);
+/* call 'fn' on chunks of [0, count) from several threads; returns when all are done */
+void winlua_parallel_for(size_t count, size_t grain, WinLuaRangeFunction fn, void *ud);
+
+/* ------------------------------------------------------------
+WinLua Option Tables
+------------------------------------------------------------ */
+/* field of the options table at 'idx', or 'def' when it is nil; raises if it is not an integer */
+lua_Integer winlua_option_integer(lua_State *L, int idx, const char *field, lua_Integer def);
+/* likewise, any non-nil value counting by its truth */
+bool winlua_option_boolean(lua_State *L, int idx, const char *field, bool def);
+
+/* ------------------------------------------------------------
+WinLua Filesystem Functions (shared by fs and its stand-ins)
+------------------------------------------------------------ */
+int winlua_fs_walk(lua_State *L);
+int winlua_fs_attributes_many(lua_State *L);
+int winlua_fs_mmap(lua_State *L);
+int winlua_fs_hash(lua_State *L);
+int winlua_fs_hash_many(lua_State *L);
+int winlua_fs_hasher(lua_State *L);
+int winlua_fs_watch(lua_State *L);
+int winlua_fs_copy(lua_State *L);
+int winlua_fs_copy_tree(lua_State *L);
+int winlua_fs_glob(lua_State *L);
+int winlua_fs_snapshot(lua_State *L);
+int winlua_fs_diff(lua_State *L);
+
+/* ------------------------------------------------------------
+WinLua Process and Environment Functions (shared by os and the bench)
+------------------------------------------------------------ */
+int winlua_os_spawn(lua_State *L);
+int winlua_os_run_all(lua_State *L);
+int winlua_os_environ(lua_State *L);
+int winlua_os_environ_block(lua_State *L);
+
+/* the prepared block of an os.environ_block value at 'idx' (UTF-16 text on Windows, envp elsewhere), or NULL */
+const void *winlua_environ_block(lua_State *L, int idx);
+
+/* ------------------------------------------------------------
+WinLua Registry Functions (live keys and hive files)
+------------------------------------------------------------ */
+int winlua_registry_load_hive(lua_State *L);
+
+/* push value data as Lua sees it: strings as UTF-8, REG_MULTI_SZ as a list, DWORDs and QWORDs as integers, anything else as bytes; conversion buffers come from the caller's scope */
+void winlua_push_regvalue(lua_State *L, uint32_t type, const unsigned char *data, size_t len, WinLuaScratch& scratch);
+/* push the name of a value type ("REG_SZ", ...), or its number when it has none */
+void winlua_push_regtype(lua_State *L, uint32_t type);
+/* the type called 'name', or -1 */
+int winlua_regtype(const char *name);
+
+/* ------------------------------------------------------------
+WinLua Registry Backends
+
+key:read_tree reads keys through this interface, so live keys and
+hive files share one implementation. A handle is an HKEY or a cell
+offset; the reader closes the handles 'subkey' gives it, never the
+root. Calls may come from several threads at once. Each returns 0,
+a system error code, or WINLUA_REG_MORE_DATA when 'name' or 'data'
+is too small.
+------------------------------------------------------------ */
+typedef uintptr_t WinLuaRegHandle;
+
+#define WINLUA_REG_MORE_DATA (-1)
+
+struct WinLuaRegInfo
+{
+	uint32_t subkeys, values;
+	size_t max_subkey, max_value_name; /* UTF-16 units, without terminator; 0 when unknown */
+	size_t max_data; /* bytes */
+};
+
+class WinLuaRegBackend
+{
+public:
+	virtual ~WinLuaRegBackend() {}
+
+	virtual int info(WinLuaRegHandle key, WinLuaRegInfo *info) = 0;
+	/* name the 'index'th subkey ('len' units in and out) and open it; when it can be named but not opened, 'len' is set and the error returned */
+	virtual int subkey(WinLuaRegHandle key, uint32_t index, uint16_t *name, size_t *len, WinLuaRegHandle *sub) = 0;
+	/* the 'index'th value; 'namelen' in units and 'size' in bytes, in and out */
+	virtual int value(WinLuaRegHandle key, uint32_t index, uint16_t *name, size_t *namelen, uint32_t *type, unsigned char *data, size_t *size) = 0;
+	virtual void close(WinLuaRegHandle key) = 0;
+};
+
+/* key:read_tree([options]) for the key at index 1, read through 'backend' from 'root' */
+int winlua_registry_read_tree(lua_State *L, WinLuaRegBackend *backend, WinLuaRegHandle root);
+/* key:export(file, name [, options]) likewise */
+int winlua_registry_export(lua_State *L, WinLuaRegBackend *backend, WinLuaRegHandle root);
+
+/* ------------------------------------------------------------
+WinLua .reg Files
+
+The parser hands each line of a .reg file to a sink as a record;
+registry.cpp imports into the live registry with one.
+------------------------------------------------------------ */
+#define WINLUA_REG_KEY 0 /* [path] */
+#define WINLUA_REG_DELETE_KEY 1 /* [-path] */
+#define WINLUA_REG_VALUE 2 /* "name"=data */
+#define WINLUA_REG_DELETE_VALUE 3 /* "name"=- */
+
+struct WinLuaRegRecord
+{
+	int kind;
+	const char *key; /* full path of the current key, UTF-8 */
+	size_t keylen;
+	const char *name; /* UTF-8, "" for the default value */
+	size_t namelen;
+	uint32_t type;
+	const unsigned char *data; /* the bytes the registry stores, or NULL for a quoted string in 'text' */
+	size_t size;
+	const char *text; /* UTF-8, without the terminator */
+	size_t textlen;
+};
+
+/* 0 to go on, or a system error code that stops the import */
+typedef int (*WinLuaRegSink)(void *ud, const WinLuaRegRecord *record);
+
+int winlua_registry_parse_reg(lua_State *L);
+int winlua_registry_reg_writer(lua_State *L);
+/* feed the .reg file named at index 1 to 'sink'; pushes true, or nil, message, code */
+int winlua_registry_import(lua_State *L, WinLuaRegSink sink, void *ud);
+
+/* ------------------------------------------------------------
+WinLua File Hashes (for modules that keep digests)
+------------------------------------------------------------ */
+#define WINLUA_HASH_MAXDIGEST 32
+
+/* index of "crc32c", "xxh3" or "sha256", or -1 */
+int winlua_hash_algorithm(const char *name);
+const char *winlua_hash_name(int algo);
+size_t winlua_hash_size(int algo);
+/* digest of a whole file as big-endian bytes; returns 0 or the system error code */
+int winlua_hash_file(const char *path, size_t len, int algo, unsigned char *digest);
+
+#ifdef _WIN32
 /* ------------------------------------------------------------
 WinLua Time Utility Functions
 ------------------------------------------------------------ */
+/* seconds since 1970 as an integer; allocates nothing */
 void winlua_push_date(lua_State *L, FILETIME& ft);
+/* a new date table with year, month, day, hour, min, sec, msec and wday */
 void winlua_push_date(lua_State *L, SYSTEMTIME& st);
 
 int winlua_get_date(lua_State *L, int idx, SYSTEMTIME& st);
 
 int timet_to_systemtime(time_t &from, SYSTEMTIME& to);
 int timet_to_filetime(time_t &from, FILETIME& to);
+#endif
 
 /* ------------------------------------------------------------
 WinLua Module Utility Functions
 ------------------------------------------------------------ */
 void winlua_at_exit(lua_State *L, const char *id, lua_CFunction finalizer);
 
+/* ------------------------------------------------------------
+WinLua State Functions
+------------------------------------------------------------ */
+lua_State *winlua_newstate(bool pooled);
+void winlua_closestate(lua_State *L);
+bool winlua_state_pooled(lua_State *L);
+
+/* ------------------------------------------------------------
+WinLua Chunk Cache Functions
+------------------------------------------------------------ */
+int winlua_loadfile(lua_State *L, const char *filename);
+void winlua_install_cache_searcher(lua_State *L);
+
+/* ------------------------------------------------------------
+WinLua Bundle Functions
+------------------------------------------------------------ */
+#define WINLUA_BUNDLE_MAIN "main"
+
+bool winlua_bundle_open();
+void winlua_bundle_close();
+bool winlua_bundle_contains(const char *name);
+int winlua_bundle_load(lua_State *L, const char *name);
+void winlua_install_bundle_searcher(lua_State *L);
+
 #endif
\ No newline at end of file
@@ -6,11 +6,21 @@ int luaopen_winos(lua_State *L);
 int luaopen_fs(lua_State *L);
 int luaopen_shell(lua_State *L);
 int luaopen_registry(lua_State *L);
+int luaopen_bundle(lua_State *L);
+int luaopen_allocator(lua_State *L);
+int luaopen_threads(lua_State *L);
+int luaopen_serialize(lua_State *L);
+int luaopen_profiler(lua_State *L);
+int luaopen_async(lua_State *L);
 
 int luaopen_dispatch_typeinfo(lua_State *L);
 int luaopen_dispatch_thin(lua_State *L);
 
 int winlua_print(lua_State *L);
+void winlua_open_print(lua_State *L);
+void winlua_flush_output(lua_State *L);
+
+void winlua_setup_env(lua_State *L);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef WINLUA_SERIALIZE_HPP_INCLUDED
+#define WINLUA_SERIALIZE_HPP_INCLUDED
+
+#include "winlua.hpp"
+#include <string>
+
+/* ------------------------------------------------------------
+WinLua Serializer Functions
+------------------------------------------------------------ */
+
+/*
+Optional userdata support: 'encode' appends a representation of
+the userdata at 'idx' and returns false if it cannot be encoded;
+'decode' pushes the value back and returns the position after it.
+Both get 'ud' along.
+*/
+struct WinLuaSerializeUdata
+{
+	bool (*encode)(lua_State *L, int idx, std::string& out, void *ud);
+	const char *(*decode)(lua_State *L, const char *p, const char *end, void *ud);
+	void *ud;
+};
+
+void winlua_serialize(lua_State *L, int idx, std::string& out, const WinLuaSerializeUdata *udata = NULL);
+const char *winlua_deserialize(lua_State *L, const char *p, const char *end, const WinLuaSerializeUdata *udata = NULL);
+
+#endif
@@ -7,7 +7,8 @@ WinLua Operating System functions
 static int winlua_getenv(lua_State *L)
 {
 	const char *varname = luaL_checkstring(L, 1);
-	wchar_t *varnameW = utf8_to_wstring(L, varname);
+	WinLuaScratch scratch(L);
+	wchar_t *varnameW = scratch.wstring(varname);
 
 	DWORD needed = GetEnvironmentVariableW(varnameW, NULL, 0);
 	if (needed == 0)
@@ -28,7 +29,7 @@ static int winlua_getenv(lua_State *L)
 		}
 	}
 
-	wchar_t *buff = static_cast<wchar_t*>(lua_newuserdata(L, sizeof(wchar_t) * needed));
+	wchar_t *buff = static_cast<wchar_t*>(scratch.alloc(sizeof(wchar_t) * needed));
 	needed = GetEnvironmentVariableW(varnameW, buff, needed);
 	if (needed == 0)
 	{
@@ -40,7 +41,6 @@ static int winlua_getenv(lua_State *L)
 	}
 
 	wstring_to_utf8(L, buff);
-	lua_remove(L, -2); lua_remove(L, -2); // pop temporary buffer and name buffer
 	return 1;
 }
 
@@ -48,8 +48,9 @@ static int winlua_putenv(lua_State *L)
 {
 	const char *varname = luaL_checkstring(L, 1);
 	const char *varvalue = luaL_checkstring(L, 2);
-	wchar_t *varnameW = utf8_to_wstring(L, varname);
-	wchar_t *varvalueW = utf8_to_wstring(L, varvalue);
+	WinLuaScratch scratch(L);
+	wchar_t *varnameW = scratch.wstring(varname);
+	wchar_t *varvalueW = scratch.wstring(varvalue);
 
 	BOOL ret = SetEnvironmentVariableW(varnameW, varvalueW);
 	if (ret == 0)
@@ -61,7 +62,6 @@ static int winlua_putenv(lua_State *L)
 		return 3;
 	}
 
-	lua_pop(L, 2); // pop name and value buffer
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -69,7 +69,8 @@ static int winlua_putenv(lua_State *L)
 static int winlua_remove(lua_State *L)
 {
 	const char *filename = luaL_checkstring(L, 1);
-	wchar_t *filenameW = utf8_to_wstring(L, filename);
+	WinLuaScratch scratch(L);
+	wchar_t *filenameW = scratch.wstring(filename);
 
 	DWORD is_dir = GetFileAttributesW(filenameW);
 
@@ -114,9 +115,10 @@ static int winlua_remove(lua_State *L)
 static int winlua_rename(lua_State *L)
 {
 	const char *oldname = luaL_checkstring(L, 1);
-	wchar_t *oldnameW = utf8_to_wstring(L, oldname);
+	WinLuaScratch scratch(L);
+	wchar_t *oldnameW = scratch.wstring(oldname);
 	const char *newname = luaL_checkstring(L, 2);
-	wchar_t *newnameW = utf8_to_wstring(L, newname);
+	wchar_t *newnameW = scratch.wstring(newname);
 
 	BOOL ret = MoveFileW(oldnameW, newnameW);
 	if (ret == 0)
@@ -162,6 +164,10 @@ static const luaL_Reg library_methods[] = {
 	{"putenv", winlua_putenv},
 	{"remove", winlua_remove},
 	{"rename", winlua_rename},
+	{"spawn", winlua_os_spawn},
+	{"run_all", winlua_os_run_all},
+	{"environ", winlua_os_environ},
+	{"environ_block", winlua_os_environ_block},
 	// {"time", winlua_time},
 	{NULL, NULL}
 };